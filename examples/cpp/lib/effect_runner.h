@@ -56,13 +56,17 @@ public:
     void setMaxFrameRate(float fps);
     void setVerbose(bool verbose = true);
 
+    // Send 16 bits per color instead of 8. Only Fadecandy devices with 'highPrecision' keep them all.
+    void setHighPrecision(bool enable = true);
+
     bool hasLayout() const;
     const rapidjson::Document& getLayout() const;
     Effect* getEffect() const;
     bool isVerbose() const;
+    bool isHighPrecision() const;
     OPCClient& getClient();
 
-    // Access to most recent framebuffer information
+    // Access to most recent framebuffer information. Pixels are 8-bit RGB, or big-endian 16-bit in high precision mode.
     const Effect::PixelInfoVec& getPixelInfo() const;
     const uint8_t* getPixel(unsigned index) const;
     void getPixelColor(unsigned index, Vec3 &rgb) const;
@@ -111,12 +115,15 @@ private:
     float debugTimer;
     float speed;
     bool verbose;
+    bool highPrecision;
     struct timeval lastTime;
     float jitterStatsMin;
     float jitterStatsMax;
 
     void usage(const char *name);
     void debug();
+    void initFrameBuffer();
+    unsigned bytesPerPixel() const;
 };
 
 
@@ -138,6 +145,7 @@ inline EffectRunner::EffectRunner()
       debugTimer(0),
       speed(1.0),
       verbose(false),
+      highPrecision(false),
       jitterStatsMin(1),
       jitterStatsMax(0)
 {
@@ -159,6 +167,14 @@ inline void EffectRunner::setVerbose(bool verbose)
     this->verbose = verbose;
 }
 
+inline void EffectRunner::setHighPrecision(bool enable)
+{
+    highPrecision = enable;
+    if (hasLayout()) {
+        initFrameBuffer();
+    }
+}
+
 inline bool EffectRunner::setServer(const char *hostport)
 {
     return opc.resolve(hostport);
@@ -182,10 +198,7 @@ inline bool EffectRunner::setLayout(const char *filename)
         return false;
     }
 
-    // Set up an empty framebuffer, with OPC packet header
-    int frameBytes = layout.Size() * 3;
-    frameBuffer.resize(sizeof(OPCClient::Header) + frameBytes);
-    OPCClient::Header::view(frameBuffer).init(0, opc.SET_PIXEL_COLORS, frameBytes);
+    initFrameBuffer();
 
     // Init pixel info
     frameInfo.init(layout);
@@ -193,6 +206,20 @@ inline bool EffectRunner::setLayout(const char *filename)
     return true;
 }
 
+inline unsigned EffectRunner::bytesPerPixel() const
+{
+    return highPrecision ? 6 : 3;
+}
+
+inline void EffectRunner::initFrameBuffer()
+{
+    // Set up an empty framebuffer, with OPC packet header. Messages can't hold more than 64 kB.
+    int frameBytes = std::min<int>(layout.Size(), 0xFFFF / bytesPerPixel()) * bytesPerPixel();
+    frameBuffer.assign(sizeof(OPCClient::Header) + frameBytes, 0);
+    OPCClient::Header::view(frameBuffer).init(0,
+        highPrecision ? opc.SET_PIXEL_COLORS_16 : opc.SET_PIXEL_COLORS, frameBytes);
+}
+
 inline const rapidjson::Document& EffectRunner::getLayout() const
 {
     return layout;
@@ -225,6 +252,11 @@ inline bool EffectRunner::isVerbose() const
     return verbose;
 }
 
+inline bool EffectRunner::isHighPrecision() const
+{
+    return highPrecision;
+}
+
 inline float EffectRunner::getFrameRate() const
 {
     return filteredTimeDelta > 0.0f ? 1.0f / filteredTimeDelta : 0.0f;
@@ -297,8 +329,10 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
         if (opc.tryConnect()) {
 
             uint8_t *dest = OPCClient::Header::view(frameBuffer).data();
+            uint8_t *end = &frameBuffer[0] + frameBuffer.size();
 
-            for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
+            for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end();
+                 i != e && dest != end; ++i) {
                 Vec3 rgb(0, 0, 0);
                 const Effect::PixelInfo &p = *i;
 
@@ -307,8 +341,16 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
                     effect->postProcess(rgb, p);
                 }
 
-                for (unsigned i = 0; i < 3; i++) {
-                    *(dest++) = std::min<int>(255, std::max<int>(0, rgb[i] * 255 + 0.5));
+                if (highPrecision) {
+                    for (unsigned i = 0; i < 3; i++) {
+                        int value = std::min<int>(0xFFFF, std::max<int>(0, rgb[i] * 0xFFFF + 0.5));
+                        *(dest++) = value >> 8;
+                        *(dest++) = value;
+                    }
+                } else {
+                    for (unsigned i = 0; i < 3; i++) {
+                        *(dest++) = std::min<int>(255, std::max<int>(0, rgb[i] * 255 + 0.5));
+                    }
                 }
             }
 
@@ -361,14 +403,19 @@ inline const Effect::PixelInfoVec& EffectRunner::getPixelInfo() const
 
 inline const uint8_t* EffectRunner::getPixel(unsigned index) const
 {
-    return OPCClient::Header::view(frameBuffer).data() + index * 3;
+    return OPCClient::Header::view(frameBuffer).data() + index * bytesPerPixel();
 }
 
 inline void EffectRunner::getPixelColor(unsigned index, Vec3 &rgb) const
 {
     const uint8_t *byte = getPixel(index);
     for (unsigned i = 0; i < 3; i++) {
-        rgb[i] = *(byte++) / 255.0f;
+        if (highPrecision) {
+            rgb[i] = ((byte[0] << 8) | byte[1]) / 65535.0f;
+            byte += 2;
+        } else {
+            rgb[i] = *(byte++) / 255.0f;
+        }
     }
 }
 
@@ -440,6 +487,11 @@ inline bool EffectRunner::parseArgument(int &i, int &argc, char **argv)
         return true;
     }
 
+    if (!strcmp(argv[i], "-16")) {
+        setHighPrecision();
+        return true;
+    }
+
     if (!strcmp(argv[i], "-fps") && (i+1 < argc)) {
         float rate = atof(argv[++i]);
         if (rate <= 0) {
@@ -490,5 +542,5 @@ inline bool EffectRunner::validateArguments()
 
 inline void EffectRunner::argumentUsage()
 {
-    fprintf(stderr, "[-v] [-fps LIMIT] [-speed MULTIPLIER] [-layout FILE.json] [-server HOST[:port]]");
+    fprintf(stderr, "[-v] [-16] [-fps LIMIT] [-speed MULTIPLIER] [-layout FILE.json] [-server HOST[:port] | shm[:/NAME]]");
 }
@@ -34,17 +34,26 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <signal.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 
 class OPCClient {
 public:
     OPCClient();
     ~OPCClient();
 
+    // A hostport of "shm" or "shm:/name" uses the server's shared memory segment instead of TCP
     bool resolve(const char *hostport, int defaultPort = 7890);
     bool write(const uint8_t *data, ssize_t length);
     bool write(const std::vector<uint8_t> &data);
@@ -52,6 +61,17 @@ public:
     bool tryConnect();
     bool isConnected();
 
+    struct Header;
+
+    /*
+     * Build one message in place, then send it with commit(). Over shared
+     * memory this is a slot in the server's ring, so pixels can be drawn
+     * without any copying. Returns 0 if not connected, or if the ring is full
+     * and this message should be skipped.
+     */
+    Header *reserve();
+    bool commit();
+
     struct Header {
         uint8_t channel;
         uint8_t command;
@@ -82,12 +102,50 @@ public:
 
     // Commands
     static const uint8_t SET_PIXEL_COLORS = 0;
+    static const uint8_t SET_PIXEL_COLORS_16 = 2;      // Big-endian 16-bit R, G, B
+
+    // Shared memory segment layout, matching the server's "shm" input
+    struct ShmHeader {
+        static const uint32_t MAGIC = 0x4d534346;
+        static const uint32_t VERSION = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numSlots;
+        uint32_t slotBytes;
+        uint8_t reserved0[48];
+
+        // Written by the client
+        volatile uint32_t writeIndex;
+        volatile uint32_t doorbell;
+        volatile uint32_t dropped;
+        uint8_t reserved1[52];
+
+        // Written by the server
+        volatile uint32_t readIndex;
+        volatile uint32_t waiting;
+        uint8_t reserved2[56];
+
+        Header *slot(uint32_t index) {
+            return (Header*) ((uint8_t*) &this[1] + (index % numSlots) * slotBytes);
+        }
+    };
 
 private:
     int fd;
     struct sockaddr_in address;
     bool connectSocket();
     void closeSocket();
+
+    char *shmName;
+    int shmFd;
+    ShmHeader *shm;
+    size_t shmSize;
+    bool connectShm();
+    void closeShm();
+
+    // Message under construction for reserve() over TCP
+    std::vector<uint8_t> scratch;
 };
 
 
@@ -100,16 +158,22 @@ inline OPCClient::OPCClient()
 {
     fd = -1;
     memset(&address, 0, sizeof address);
+    shmName = 0;
+    shmFd = -1;
+    shm = 0;
+    shmSize = 0;
 }
 
 inline OPCClient::~OPCClient()
 {
     closeSocket();
+    closeShm();
+    free(shmName);
 }
 
 inline void OPCClient::closeSocket()
 {
-    if (isConnected()) {
+    if (fd > 0) {
         close(fd);
         fd = -1;
     }
@@ -118,6 +182,14 @@ inline void OPCClient::closeSocket()
 inline bool OPCClient::resolve(const char *hostport, int defaultPort)
 {
     fd = -1;
+    closeShm();
+    free(shmName);
+    shmName = 0;
+
+    if (!strncmp(hostport, "shm", 3) && (hostport[3] == '\0' || hostport[3] == ':')) {
+        shmName = strdup(hostport[3] && hostport[4] ? hostport + 4 : "/fcserver");
+        return true;
+    }
 
     char *host = strdup(hostport);
     char *colon = strchr(host, ':');
@@ -150,12 +222,12 @@ inline bool OPCClient::resolve(const char *hostport, int defaultPort)
 
 inline bool OPCClient::isConnected()
 {
-    return fd > 0;
+    return shmName ? shm != 0 : fd > 0;
 }
 
 inline bool OPCClient::tryConnect()
 {
-    return isConnected() || connectSocket();
+    return isConnected() || (shmName ? connectShm() : connectSocket());
 }
 
 inline bool OPCClient::write(const uint8_t *data, ssize_t length)
@@ -164,6 +236,25 @@ inline bool OPCClient::write(const uint8_t *data, ssize_t length)
         return false;
     }
 
+    if (shm) {
+        // Copy each complete message into its own slot
+        while (length >= (ssize_t) sizeof(Header)) {
+            const Header *message = (const Header*) data;
+            ssize_t size = sizeof(Header) + ((message->length[0] << 8) | message->length[1]);
+            Header *slot;
+
+            if (size > length || !(slot = reserve())) {
+                return false;
+            }
+            memcpy(slot, data, size);
+            commit();
+
+            length -= size;
+            data += size;
+        }
+        return length == 0;
+    }
+
     while (length > 0) {
         int result = send(fd, data, length, 0);
         if (result <= 0) {
@@ -203,3 +294,92 @@ inline bool OPCClient::connectSocket()
 
     return true;
 }
+
+inline OPCClient::Header *OPCClient::reserve()
+{
+    if (!tryConnect()) {
+        return 0;
+    }
+
+    if (!shm) {
+        scratch.resize(sizeof(Header) + 0xFFFF);
+        return &Header::view(scratch);
+    }
+
+    if (shm->writeIndex - shm->readIndex >= shm->numSlots) {
+        // Either the server is behind, or it restarted and nobody reads this segment any more
+        struct stat st;
+        if (fstat(shmFd, &st) < 0 || st.st_nlink == 0) {
+            closeShm();
+        } else {
+            shm->dropped++;
+        }
+        return 0;
+    }
+
+    return shm->slot(shm->writeIndex);
+}
+
+inline bool OPCClient::commit()
+{
+    if (!shm) {
+        const Header &message = Header::view(scratch);
+        return write(&scratch[0], sizeof(Header) + ((message.length[0] << 8) | message.length[1]));
+    }
+
+    // Publish the slot, then ring. The atomic add is a full barrier, so our
+    // check of the server's waiting flag can't pass the new writeIndex.
+    __sync_synchronize();
+    shm->writeIndex++;
+    __sync_fetch_and_add(&shm->doorbell, 1);
+
+    #ifdef __linux__
+        if (shm->waiting) {
+            syscall(SYS_futex, &shm->doorbell, FUTEX_WAKE, 1, 0, 0, 0);
+        }
+    #endif
+
+    return true;
+}
+
+inline bool OPCClient::connectShm()
+{
+    shmFd = shm_open(shmName, O_RDWR, 0);
+    if (shmFd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(shmFd, &st) == 0 && st.st_size >= (off_t) sizeof(ShmHeader)) {
+        mapping = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        closeShm();
+        return false;
+    }
+
+    shm = (ShmHeader*) mapping;
+    shmSize = st.st_size;
+
+    if (shm->magic != ShmHeader::MAGIC || shm->version != ShmHeader::VERSION ||
+        shm->numSlots == 0 || shm->slotBytes < sizeof(Header) + 0xFFFF ||
+        sizeof(ShmHeader) + (size_t) shm->numSlots * shm->slotBytes > shmSize) {
+        closeShm();
+        return false;
+    }
+
+    return true;
+}
+
+inline void OPCClient::closeShm()
+{
+    if (shm) {
+        munmap(shm, shmSize);
+        shm = 0;
+    }
+    if (shmFd >= 0) {
+        close(shmFd);
+        shmFd = -1;
+    }
+}
@@ -0,0 +1,257 @@
+// Latency benchmark for OPCClient transports:
+// Sends timestamped frames over TCP loopback and over shared memory, to a
+// receiver thread that consumes them the way fcserver does, and reports how
+// long each frame took to arrive.
+//
+// usage: opc_latency [-frames N] [-pixels N] [-interval MS]
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include <arpa/inet.h>
+#include "lib/opc_client.h"
+#include "lib/tinythread.h"
+
+struct Receiver
+{
+    unsigned frames;
+    volatile bool done;
+    std::vector<double> latencies;
+
+    // TCP
+    int listenFd;
+    int port;
+
+    // Shared memory
+    char shmName[64];
+    OPCClient::ShmHeader *shm;
+    size_t shmSize;
+};
+
+static uint64_t nanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void received(Receiver &r, const OPCClient::Header *message)
+{
+    uint64_t sent;
+    memcpy(&sent, message->data(), sizeof sent);
+    r.latencies.push_back((nanos() - sent) * 1e-3);
+}
+
+static void tcpReceiverThread(void *arg)
+{
+    Receiver &r = *(Receiver*) arg;
+    int fd = accept(r.listenFd, 0, 0);
+    std::vector<uint8_t> buffer(1 << 20);
+    size_t filled = 0;
+
+    while (r.latencies.size() < r.frames) {
+        ssize_t result = recv(fd, &buffer[filled], buffer.size() - filled, 0);
+        if (result <= 0) {
+            break;
+        }
+        filled += result;
+
+        // Consume every complete message, and keep any partial one for next time
+        size_t offset = 0;
+        while (filled - offset >= sizeof(OPCClient::Header)) {
+            const OPCClient::Header *message = (const OPCClient::Header*) &buffer[offset];
+            size_t size = sizeof *message + ((message->length[0] << 8) | message->length[1]);
+            if (filled - offset < size) {
+                break;
+            }
+            received(r, message);
+            offset += size;
+        }
+        memmove(&buffer[0], &buffer[offset], filled - offset);
+        filled -= offset;
+    }
+
+    close(fd);
+}
+
+static void shmReceiverThread(void *arg)
+{
+    Receiver &r = *(Receiver*) arg;
+    OPCClient::ShmHeader *shm = r.shm;
+
+    // Stop early if the sender finished without filling every frame
+    while (r.latencies.size() < r.frames && !(r.done && shm->readIndex == shm->writeIndex)) {
+        uint32_t doorbell = shm->doorbell;
+
+        while (shm->readIndex != shm->writeIndex) {
+            __sync_synchronize();
+            received(r, shm->slot(shm->readIndex));
+            __sync_synchronize();
+            shm->readIndex++;
+        }
+
+        shm->waiting = 1;
+        __sync_synchronize();
+        if (shm->readIndex == shm->writeIndex) {
+            #ifdef __linux__
+                struct timespec timeout = { 1, 0 };
+                syscall(SYS_futex, &shm->doorbell, FUTEX_WAIT, doorbell, &timeout, 0, 0);
+            #else
+                usleep(500);
+            #endif
+        }
+        shm->waiting = 0;
+    }
+}
+
+static bool startTcp(Receiver &r)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    r.listenFd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (bind(r.listenFd, (struct sockaddr*) &addr, sizeof addr) < 0 || listen(r.listenFd, 1) < 0 ||
+        getsockname(r.listenFd, (struct sockaddr*) &addr, &len) < 0) {
+        perror("TCP listen");
+        return false;
+    }
+    r.port = ntohs(addr.sin_port);
+    return true;
+}
+
+static bool startShm(Receiver &r)
+{
+    // Same layout fcserver creates for its "shm" input
+    const uint32_t numSlots = 8;
+    const uint32_t slotBytes = 65600;
+
+    snprintf(r.shmName, sizeof r.shmName, "/opc_latency_%d", (int) getpid());
+    r.shmSize = sizeof(OPCClient::ShmHeader) + numSlots * slotBytes;
+
+    int fd = shm_open(r.shmName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, r.shmSize) < 0) {
+        perror("shm_open");
+        return false;
+    }
+    void *mapping = mmap(0, r.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    r.shm = (OPCClient::ShmHeader*) mapping;
+    r.shm->version = OPCClient::ShmHeader::VERSION;
+    r.shm->numSlots = numSlots;
+    r.shm->slotBytes = slotBytes;
+    __sync_synchronize();
+    r.shm->magic = OPCClient::ShmHeader::MAGIC;
+    return true;
+}
+
+static void stopShm(Receiver &r)
+{
+    munmap(r.shm, r.shmSize);
+    shm_unlink(r.shmName);
+}
+
+static void report(const char *name, std::vector<double> &latencies)
+{
+    if (latencies.empty()) {
+        printf("%-8s no frames received\n", name);
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    printf("%-8s %6u frames   min %8.2f   median %8.2f   p99 %8.2f   max %8.2f  us\n",
+        name, (unsigned) n, latencies[0], latencies[n / 2],
+        latencies[std::min(n - 1, n * 99 / 100)], latencies[n - 1]);
+}
+
+static void run(const char *hostport, Receiver &r, tthread::thread &receiver,
+    unsigned pixels, unsigned intervalMs)
+{
+    unsigned length = std::max<unsigned>(pixels * 3, sizeof(uint64_t));
+
+    {
+        OPCClient opc;
+        if (!opc.resolve(hostport) || !opc.tryConnect()) {
+            fprintf(stderr, "Can't connect to %s\n", hostport);
+        } else {
+            for (unsigned i = 0; i < r.frames; i++) {
+                OPCClient::Header *message = opc.reserve();
+                if (message) {
+                    // Draw in place, then stamp the send time as late as possible
+                    message->init(0, opc.SET_PIXEL_COLORS, length);
+                    memset(message->data(), i, length);
+                    uint64_t now = nanos();
+                    memcpy(message->data(), &now, sizeof now);
+                    opc.commit();
+                }
+                usleep(intervalMs * 1000);
+            }
+        }
+
+        // Closing the client ends a TCP receiver
+        r.done = true;
+    }
+
+    receiver.join();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned frames = 2000;
+    unsigned pixels = 512;
+    unsigned intervalMs = 2;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-pixels") && i + 1 < argc) {
+            pixels = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-interval") && i + 1 < argc) {
+            intervalMs = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-frames N] [-pixels N] [-interval MS]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames == 0 || pixels == 0 || pixels > 0xFFFF / 3) {
+        fprintf(stderr, "Frames must be nonzero, and pixels between 1 and %d\n", 0xFFFF / 3);
+        return 1;
+    }
+
+    printf("%u frames of %u pixels, every %u ms\n", frames, pixels, intervalMs);
+
+    Receiver tcp;
+    tcp.frames = frames;
+    tcp.done = false;
+    if (startTcp(tcp)) {
+        char hostport[32];
+        snprintf(hostport, sizeof hostport, "127.0.0.1:%d", tcp.port);
+        tthread::thread receiver(tcpReceiverThread, &tcp);
+        run(hostport, tcp, receiver, pixels, intervalMs);
+        close(tcp.listenFd);
+        report("tcp", tcp.latencies);
+    }
+
+    Receiver shm;
+    shm.frames = frames;
+    shm.done = false;
+    if (startShm(shm)) {
+        char hostport[80];
+        snprintf(hostport, sizeof hostport, "shm:%s", shm.shmName);
+        tthread::thread receiver(shmReceiverThread, &shm);
+        run(hostport, shm, receiver, pixels, intervalMs);
+        stopShm(shm);
+        report("shm", shm.latencies);
+    }
+
+    return 0;
+}
@@ -55,42 +55,74 @@ extern uint32_t boot_token;
 
 #define FCP_INTERPOLATION   0
 #define FCP_DITHERING       0
+#define FCP_16BIT           0
 #define FCP_FN(name)        name##_I0_D0
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
 #undef FCP_DITHERING
+#undef FCP_16BIT
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   1
 #define FCP_DITHERING       0
+#define FCP_16BIT           0
 #define FCP_FN(name)        name##_I1_D0
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
 #undef FCP_DITHERING
+#undef FCP_16BIT
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   0
 #define FCP_DITHERING       1
+#define FCP_16BIT           0
 #define FCP_FN(name)        name##_I0_D1
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
 #undef FCP_DITHERING
+#undef FCP_16BIT
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   1
 #define FCP_DITHERING       1
+#define FCP_16BIT           0
 #define FCP_FN(name)        name##_I1_D1
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
 #undef FCP_DITHERING
+#undef FCP_16BIT
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   0
+#define FCP_DITHERING       0
+#define FCP_16BIT           1
+#define FCP_FN(name)        name##_W16_D0
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_DITHERING
+#undef FCP_16BIT
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   0
+#define FCP_DITHERING       1
+#define FCP_16BIT           1
+#define FCP_FN(name)        name##_W16_D1
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_DITHERING
+#undef FCP_16BIT
 #undef FCP_FN
 
 
@@ -156,7 +188,7 @@ extern "C" int main()
         watchdog_refresh();
 
         // Select a different drawing loop based on our firmware config flags
-        switch (buffers.flags & (CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING)) {
+        switch (buffers.flags & (CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING | CFLAG_16BIT_FRAMES)) {
             case 0:
             default:
                 updateDrawBuffer_I1_D1(calculateInterpCoefficient());
@@ -170,6 +202,14 @@ extern "C" int main()
             case CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING:
                 updateDrawBuffer_I0_D0(0x10000);
                 break;
+            case CFLAG_16BIT_FRAMES:
+            case CFLAG_16BIT_FRAMES | CFLAG_NO_INTERPOLATION:
+                updateDrawBuffer_W16_D1(0x10000);
+                break;
+            case CFLAG_16BIT_FRAMES | CFLAG_NO_DITHERING:
+            case CFLAG_16BIT_FRAMES | CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING:
+                updateDrawBuffer_W16_D0(0x10000);
+                break;
         }
 
         // Start sending the next frame over DMA
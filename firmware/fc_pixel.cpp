@@ -35,9 +35,16 @@ static uint32_t FCP_FN(updatePixel)(uint32_t icPrev, uint32_t icNext,
      * icPrev in range [0, 0x1010000]
      * icNext in range [0, 0x1010000]
      * icPrev + icNext = 0x1010000
+     *
+     * With FCP_16BIT, pixelNext holds the high byte of each color and pixelPrev
+     * the low byte. There is no interpolation.
      */
 
-#if FCP_INTERPOLATION
+#if FCP_16BIT
+    int iR = (pixelNext[0] << 8) | pixelPrev[0];
+    int iG = (pixelNext[1] << 8) | pixelPrev[1];
+    int iB = (pixelNext[2] << 8) | pixelPrev[2];
+#elif FCP_INTERPOLATION
     // Per-channel linear interpolation and conversion to 16-bit color.
     // Result range: [0, 0xFFFF] 
     int iR = (pixelPrev[0] * icPrev + pixelNext[0] * icNext) >> 16;
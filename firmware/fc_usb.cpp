@@ -33,6 +33,7 @@
 #define TYPE_FRAMEBUFFER    0x00
 #define TYPE_LUT            0x40
 #define TYPE_CONFIG         0x80
+#define TYPE_FRAMEBUFFER_LOW 0xC0
 
 
 void fcBuffers::finalizeFrame()
@@ -88,6 +89,24 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
             }
             break;
 
+        case TYPE_FRAMEBUFFER_LOW:
+
+            // Low bytes of a 16-bit frame, stored straight into the plane we're drawing.
+            // Like the high bytes, they wait while a frame is pending.
+            if (pendingFinalizeFrame) {
+                return false;
+            }
+            if (!(flags & CFLAG_16BIT_FRAMES)) {
+                usb_free(packet);
+                break;
+            }
+
+            fbPrev->store(index, packet);
+            if (final) {
+                pendingFinalizeFrame = true;
+            }
+            break;
+
         case TYPE_LUT:
             // LUT accesses are not synchronized
             lutNew.store(index, packet);
@@ -118,7 +137,14 @@ void fcBuffers::finalizeFramebuffer()
 {
     fcFramebuffer *recycle = fbPrev;
     fbNew->timestamp = millis();
-    fbPrev = fbNext;
+
+    if (flags & CFLAG_16BIT_FRAMES) {
+        // fbPrev keeps the low bytes, and the high bytes are double-buffered
+        recycle = fbNext;
+    } else {
+        fbPrev = fbNext;
+    }
+
     fbNext = fbNew;
     fbNew = recycle;
     perf_receivedKeyframeCounter++;
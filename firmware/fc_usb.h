@@ -98,6 +98,7 @@ struct fcColorLUT : public fcPacketBuffer<PACKETS_PER_LUT>
 #define CFLAG_NO_INTERPOLATION  (1 << 1)
 #define CFLAG_NO_ACTIVITY_LED   (1 << 2)
 #define CFLAG_LED_CONTROL       (1 << 3)
+#define CFLAG_16BIT_FRAMES      (1 << 5)
 
 /*
  * Data type for current color LUT
@@ -119,7 +120,14 @@ union fcLinearLUT
 
 struct fcBuffers
 {
-    fcFramebuffer *fbPrev;      // Frame we're interpolating from
+    /*
+     * With CFLAG_16BIT_FRAMES there's no memory for three 16-bit keyframes. Frames
+     * aren't interpolated, and fbPrev instead holds the low byte of each color in
+     * fbNext. The low bytes aren't double-buffered: they change while packets arrive,
+     * a difference of at most one 8-bit step until the frame's final packet.
+     */
+
+    fcFramebuffer *fbPrev;      // Frame we're interpolating from, or low bytes of fbNext
     fcFramebuffer *fbNext;      // Frame we're interpolating to
     fcFramebuffer *fbNew;       // Partial frame, getting ready to become fbNext
 
@@ -0,0 +1,743 @@
+/*
+ * Load generator and latency benchmark for fcserver
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Streams frames to a running fcserver over any mix of OPC TCP, WebSocket
+ * and Art-Net connections. Each connection sends its own OPC channel (or
+ * group of universes) to its own virtual device, and puts the time it sent
+ * each frame in the first 8 bytes of pixel data. The virtual devices, with
+ * "timestamps" enabled, measure how long each frame took to reach USB
+ * submission; fcbench reads their histograms over the WebSocket API before
+ * and after the run, and prints the results as JSON.
+ *
+ * The server needs a matching configuration, which -config prints:
+ *
+ *   fcbench -tcp 4 -ws 2 -udp 2 -config > bench.json
+ *   fcserver bench.json &
+ *   fcbench -tcp 4 -ws 2 -udp 2 -seconds 30
+ *
+ * fcbench and fcserver have to share a clock, so they must run on the same machine.
+ */
+
+#include "tinythread.h"
+#include "monotonic.h"
+#include "rapidjson/document.h"
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+
+
+enum Transport {
+    TRANSPORT_TCP,
+    TRANSPORT_WEBSOCKET,
+    TRANSPORT_UDP,
+    NUM_TRANSPORTS
+};
+
+static const char *kTransportNames[NUM_TRANSPORTS] = { "tcp", "websocket", "udp" };
+
+static const unsigned kMaxPixels = 512;
+static const unsigned kPixelsPerUniverse = 170;
+static const unsigned kUniversesPerStream = 4;
+
+struct Options {
+    const char *host;
+    unsigned port;
+    unsigned artnetPort;
+    unsigned connections[NUM_TRANSPORTS];
+    unsigned pixels;
+    double fps;
+    double seconds;
+};
+
+struct Stream {
+    const Options *options;
+    Transport transport;
+    unsigned index;             // Also the OPC channel minus one, and the virtual device's number
+    uint64_t endTime;
+
+    bool connected;
+    uint64_t frames;
+    uint64_t bytes;
+};
+
+// Totals from every virtual device that fcbench configured
+struct DeviceStats {
+    uint64_t frames;
+    std::vector<uint64_t> latencies;
+    std::vector<uint64_t> bounds;
+    uint64_t latencySum;
+    uint64_t maxLatency;
+};
+
+
+static unsigned streamChannel(unsigned index)
+{
+    return index + 1;
+}
+
+static unsigned streamUniverse(unsigned index)
+{
+    return index * kUniversesPerStream;
+}
+
+static void deviceSerial(unsigned index, char *buffer, size_t size)
+{
+    snprintf(buffer, size, "FCBENCH%03u", index);
+}
+
+static int connectTcp(const char *host, unsigned port, int type = SOCK_STREAM)
+{
+    char service[16];
+    snprintf(service, sizeof service, "%u", port);
+
+    struct addrinfo hints, *addr;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = type;
+    if (getaddrinfo(host, service, &hints, &addr)) {
+        return -1;
+    }
+
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr);
+
+    if (fd >= 0 && type == SOCK_STREAM) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*) &flag, sizeof flag);
+    }
+    return fd;
+}
+
+static bool sendAll(int fd, const uint8_t *data, size_t length)
+{
+    while (length) {
+        ssize_t result = send(fd, data, length, 0);
+        if (result <= 0) {
+            return false;
+        }
+        data += result;
+        length -= result;
+    }
+    return true;
+}
+
+static bool webSocketHandshake(int fd, const char *host, unsigned port)
+{
+    char request[512];
+    snprintf(request, sizeof request,
+        "GET / HTTP/1.1\r\n"
+        "Host: %s:%u\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: ZmNiZW5jaCBoYW5kc2hha2U=\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Protocol: fcserver\r\n"
+        "\r\n", host, port);
+
+    if (!sendAll(fd, (const uint8_t*) request, strlen(request))) {
+        return false;
+    }
+
+    // Read the response headers a byte at a time, so nothing after them is consumed
+    std::string response;
+    char c;
+    while (response.size() < 4096 && recv(fd, &c, 1, 0) == 1) {
+        response += c;
+        if (response.size() >= 4 && !response.compare(response.size() - 4, 4, "\r\n\r\n")) {
+            return response.compare(0, 12, "HTTP/1.1 101") == 0;
+        }
+    }
+    return false;
+}
+
+static bool webSocketSend(int fd, uint8_t opcode, const uint8_t *data, size_t length, std::vector<uint8_t> &buffer)
+{
+    // Client frames are always masked
+    static const uint8_t mask[4] = { 0x66, 0x63, 0x62, 0x6e };
+
+    buffer.clear();
+    buffer.push_back(0x80 | opcode);
+    if (length < 126) {
+        buffer.push_back(0x80 | uint8_t(length));
+    } else if (length <= 0xFFFF) {
+        buffer.push_back(0x80 | 126);
+        buffer.push_back(uint8_t(length >> 8));
+        buffer.push_back(uint8_t(length));
+    } else {
+        buffer.push_back(0x80 | 127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            buffer.push_back(uint8_t(uint64_t(length) >> shift));
+        }
+    }
+    buffer.insert(buffer.end(), mask, mask + 4);
+
+    size_t header = buffer.size();
+    buffer.resize(header + length);
+    for (size_t i = 0; i < length; i++) {
+        buffer[header + i] = data[i] ^ mask[i & 3];
+    }
+
+    return sendAll(fd, &buffer[0], buffer.size());
+}
+
+static bool recvAll(int fd, uint8_t *data, size_t length)
+{
+    while (length) {
+        ssize_t result = recv(fd, data, length, 0);
+        if (result <= 0) {
+            return false;
+        }
+        data += result;
+        length -= result;
+    }
+    return true;
+}
+
+static bool webSocketReceive(int fd, std::string &message)
+{
+    // One message, reassembled from its fragments. Server frames are never masked.
+    message.clear();
+
+    for (;;) {
+        uint8_t header[2];
+        if (!recvAll(fd, header, 2)) {
+            return false;
+        }
+
+        uint64_t length = header[1] & 0x7F;
+        unsigned extra = length == 126 ? 2 : length == 127 ? 8 : 0;
+        if (extra) {
+            uint8_t bytes[8];
+            if (!recvAll(fd, bytes, extra)) {
+                return false;
+            }
+            length = 0;
+            for (unsigned i = 0; i < extra; i++) {
+                length = (length << 8) | bytes[i];
+            }
+        }
+        if (length > (64 << 20)) {
+            return false;
+        }
+
+        size_t offset = message.size();
+        message.resize(offset + length);
+        if (length && !recvAll(fd, (uint8_t*) &message[offset], length)) {
+            return false;
+        }
+
+        if (header[0] & 0x80) {
+            return true;
+        }
+    }
+}
+
+static void fillFrame(uint8_t *pixels, unsigned length, uint64_t frame)
+{
+    // A moving gradient, so the server's color processing does real work
+    for (unsigned i = 0; i < length; i++) {
+        pixels[i] = uint8_t(i + frame);
+    }
+
+    uint64_t now = Monotonic::micros();
+    memcpy(pixels, &now, sizeof now);
+}
+
+static void streamThread(void *arg)
+{
+    Stream &s = *(Stream*) arg;
+    const Options &o = *s.options;
+    unsigned length = o.pixels * 3;
+
+    int fd = s.transport == TRANSPORT_UDP
+        ? connectTcp(o.host, o.artnetPort, SOCK_DGRAM)
+        : connectTcp(o.host, o.port);
+
+    if (fd < 0 || (s.transport == TRANSPORT_WEBSOCKET && !webSocketHandshake(fd, o.host, o.port))) {
+        fprintf(stderr, "Can't connect %s stream %u\n", kTransportNames[s.transport], s.index);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    s.connected = true;
+
+    std::vector<uint8_t> message(4 + length);
+    std::vector<uint8_t> scratch;
+    uint8_t *pixels = &message[4];
+    message[0] = streamChannel(s.index);
+    message[1] = 0;
+    message[2] = uint8_t(length >> 8);
+    message[3] = uint8_t(length);
+
+    uint64_t interval = o.fps > 0 ? uint64_t(1e6 / o.fps) : 0;
+    uint64_t nextFrame = Monotonic::micros();
+
+    while (Monotonic::micros() < s.endTime) {
+        if (interval) {
+            uint64_t now = Monotonic::micros();
+            if (now < nextFrame) {
+                usleep(nextFrame - now);
+            } else if (now > nextFrame + interval) {
+                // Fell behind. Keep the rate, rather than sending a burst to catch up.
+                nextFrame = now;
+            }
+            nextFrame += interval;
+        }
+
+        fillFrame(pixels, length, s.frames);
+        bool ok = true;
+
+        switch (s.transport) {
+
+            case TRANSPORT_TCP:
+                ok = sendAll(fd, &message[0], message.size());
+                s.bytes += message.size();
+                break;
+
+            case TRANSPORT_WEBSOCKET:
+                ok = webSocketSend(fd, 0x2, &message[0], message.size(), scratch);
+                s.bytes += message.size();
+                break;
+
+            case TRANSPORT_UDP:
+                // ArtDmx packets for each universe. The first one carries the timestamp.
+                // Datagrams are fire-and-forget, so a refused packet doesn't end the stream.
+                for (unsigned u = 0; u * kPixelsPerUniverse < o.pixels; u++) {
+                    unsigned count = std::min(o.pixels - u * kPixelsPerUniverse, kPixelsPerUniverse) * 3;
+                    unsigned universe = streamUniverse(s.index) + u;
+                    uint8_t packet[18 + 512];
+
+                    memcpy(packet, "Art-Net", 8);
+                    packet[8] = 0x00;                       // OpDmx, little-endian
+                    packet[9] = 0x50;
+                    packet[10] = 0;                         // Protocol version 14
+                    packet[11] = 14;
+                    packet[12] = uint8_t(s.frames % 255 + 1);
+                    packet[13] = 0;
+                    packet[14] = uint8_t(universe);
+                    packet[15] = uint8_t(universe >> 8);
+                    unsigned dmxLength = (count + 1) & ~1u;  // Always even
+                    packet[16] = uint8_t(dmxLength >> 8);   // Big-endian
+                    packet[17] = uint8_t(dmxLength);
+                    memset(packet + 18, 0, 512);
+                    memcpy(packet + 18, pixels + u * kPixelsPerUniverse * 3, count);
+
+                    if (send(fd, packet, 18 + dmxLength, 0) > 0) {
+                        s.bytes += 18 + dmxLength;
+                    }
+                }
+                break;
+
+            default:
+                ok = false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s stream %u disconnected\n", kTransportNames[s.transport], s.index);
+            break;
+        }
+        s.frames++;
+    }
+
+    close(fd);
+}
+
+static bool readDeviceStats(const Options &o, unsigned numStreams, DeviceStats &stats)
+{
+    stats.frames = 0;
+    stats.latencies.clear();
+    stats.bounds.clear();
+    stats.latencySum = 0;
+    stats.maxLatency = 0;
+
+    int fd = connectTcp(o.host, o.port);
+    if (fd >= 0) {
+        // Don't wait forever on something that isn't fcserver
+        struct timeval timeout = { 5, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*) &timeout, sizeof timeout);
+    }
+    if (fd < 0 || !webSocketHandshake(fd, o.host, o.port)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    static const char request[] = "{\"type\": \"list_connected_devices\"}";
+    std::vector<uint8_t> scratch;
+    std::string reply;
+    bool ok = webSocketSend(fd, 0x1, (const uint8_t*) request, strlen(request), scratch) &&
+        webSocketReceive(fd, reply);
+    close(fd);
+
+    rapidjson::Document doc;
+    if (!ok || doc.Parse<0>(reply.c_str()).HasParseError() || !doc.IsObject() || !doc["devices"].IsArray()) {
+        return false;
+    }
+
+    const rapidjson::Value &devices = doc["devices"];
+    for (unsigned i = 0; i < devices.Size(); i++) {
+        const rapidjson::Value &device = devices[i];
+        if (!device.IsObject() || !device["serial"].IsString() || !device["stats"].IsObject()) {
+            continue;
+        }
+
+        // Only the devices this run's streams are mapped to
+        bool ours = false;
+        for (unsigned index = 0; index < numStreams && !ours; index++) {
+            char serial[32];
+            deviceSerial(index, serial, sizeof serial);
+            ours = !strcmp(device["serial"].GetString(), serial);
+        }
+
+        const rapidjson::Value &s = device["stats"];
+        const rapidjson::Value &latencies = s["latencies"];
+        const rapidjson::Value &bounds = s["latency_bounds_us"];
+        if (!ours || !s["frames"].IsUint64() || !latencies.IsArray() || !bounds.IsArray() ||
+            latencies.Size() != bounds.Size() + 1) {
+            continue;
+        }
+
+        stats.frames += s["frames"].GetUint64();
+        if (stats.bounds.empty()) {
+            for (unsigned b = 0; b < bounds.Size(); b++) {
+                stats.bounds.push_back(bounds[b].GetUint64());
+            }
+            stats.latencies.resize(latencies.Size());
+        }
+        for (unsigned b = 0; b < latencies.Size() && b < stats.latencies.size(); b++) {
+            stats.latencies[b] += latencies[b].GetUint64();
+        }
+        if (s["latency_sum_us"].IsUint64()) {
+            stats.latencySum += s["latency_sum_us"].GetUint64();
+        }
+        if (s["max_latency_us"].IsUint64()) {
+            stats.maxLatency = std::max<uint64_t>(stats.maxLatency, s["max_latency_us"].GetUint64());
+        }
+    }
+
+    return true;
+}
+
+static double percentile(const std::vector<uint64_t> &counts, const std::vector<uint64_t> &bounds,
+    uint64_t total, uint64_t max, double fraction)
+{
+    /*
+     * Interpolate within the bucket holding the requested rank. Nothing is
+     * above the largest latency seen, which also caps the open-ended last bucket.
+     */
+    double rank = fraction * total;
+    double seen = 0;
+
+    for (unsigned i = 0; i < counts.size(); i++) {
+        if (counts[i] && seen + counts[i] >= rank) {
+            double lower = i ? bounds[i - 1] : 0;
+            double upper = i < bounds.size() ? std::min<double>(bounds[i], max) : max;
+            return std::max(lower, lower + (upper - lower) * (rank - seen) / counts[i]);
+        }
+        seen += counts[i];
+    }
+    return 0;
+}
+
+static void printConfig(const Options &o, unsigned numStreams)
+{
+    rapidjson::Document config;
+    config.SetObject();
+    rapidjson::Document::AllocatorType &alloc = config.GetAllocator();
+
+    rapidjson::Value listen(rapidjson::kArrayType);
+    listen.PushBack(o.host, alloc);
+    listen.PushBack(o.port, alloc);
+    config.AddMember("listen", listen, alloc);
+    config.AddMember("verbose", false, alloc);
+
+    rapidjson::Value devices(rapidjson::kArrayType);
+    rapidjson::Value dmxMap(rapidjson::kArrayType);
+    std::vector<std::string> serials(numStreams);
+
+    for (unsigned index = 0; index < numStreams; index++) {
+        char serial[32];
+        deviceSerial(index, serial, sizeof serial);
+        serials[index] = serial;
+
+        rapidjson::Value inst(rapidjson::kArrayType);
+        inst.PushBack(streamChannel(index), alloc);
+        inst.PushBack(0, alloc);
+        inst.PushBack(0, alloc);
+        inst.PushBack(o.pixels, alloc);
+        rapidjson::Value map(rapidjson::kArrayType);
+        map.PushBack(inst, alloc);
+
+        rapidjson::Value device(rapidjson::kObjectType);
+        device.AddMember("type", "virtual", alloc);
+        device.AddMember("serial", serials[index].c_str(), alloc);
+        device.AddMember("timestamps", true, alloc);
+        device.AddMember("map", map, alloc);
+        devices.PushBack(device, alloc);
+    }
+
+    // Art-Net streams come after the TCP and WebSocket ones
+    unsigned firstUdp = o.connections[TRANSPORT_TCP] + o.connections[TRANSPORT_WEBSOCKET];
+    for (unsigned index = firstUdp; index < numStreams; index++) {
+        for (unsigned u = 0; u * kPixelsPerUniverse < o.pixels; u++) {
+            rapidjson::Value inst(rapidjson::kArrayType);
+            inst.PushBack(streamUniverse(index) + u, alloc);
+            inst.PushBack(1, alloc);
+            inst.PushBack(streamChannel(index), alloc);
+            inst.PushBack(u * kPixelsPerUniverse, alloc);
+            inst.PushBack(std::min(o.pixels - u * kPixelsPerUniverse, kPixelsPerUniverse), alloc);
+            dmxMap.PushBack(inst, alloc);
+        }
+    }
+    if (!dmxMap.Empty()) {
+        rapidjson::Value dmxInput(rapidjson::kObjectType);
+        rapidjson::Value artnet(rapidjson::kArrayType);
+        artnet.PushBack(o.host, alloc);
+        artnet.PushBack(o.artnetPort, alloc);
+        dmxInput.AddMember("artnet", artnet, alloc);
+        dmxInput.AddMember("map", dmxMap, alloc);
+        config.AddMember("dmxInput", dmxInput, alloc);
+    }
+
+    config.AddMember("devices", devices, alloc);
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+    config.Accept(writer);
+    printf("%s\n", buffer.GetString());
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "\n"
+        "  -host HOST       Server address, default 127.0.0.1\n"
+        "  -port N          Server port for OPC and WebSockets, default 7890\n"
+        "  -artnet-port N   Server port for Art-Net, default 6454\n"
+        "  -tcp N           OPC connections over TCP, default 1\n"
+        "  -ws N            OPC connections over WebSockets, default 0\n"
+        "  -udp N           Art-Net senders, default 0\n"
+        "  -pixels N        Pixels per frame, up to %u, default 512\n"
+        "  -fps N           Frames per second on each connection, or 0 for as fast as possible. Default 60.\n"
+        "  -seconds N       Length of the run, default 10\n"
+        "  -config          Print a matching fcserver configuration, then exit\n",
+        name, kMaxPixels);
+}
+
+int main(int argc, char **argv)
+{
+    Options o;
+    o.host = "127.0.0.1";
+    o.port = 7890;
+    o.artnetPort = 6454;
+    o.connections[TRANSPORT_TCP] = 1;
+    o.connections[TRANSPORT_WEBSOCKET] = 0;
+    o.connections[TRANSPORT_UDP] = 0;
+    o.pixels = kMaxPixels;
+    o.fps = 60;
+    o.seconds = 10;
+    bool config = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(argv[i], "-host") && hasValue) {
+            o.host = argv[++i];
+        } else if (!strcmp(argv[i], "-port") && hasValue) {
+            o.port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-artnet-port") && hasValue) {
+            o.artnetPort = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-tcp") && hasValue) {
+            o.connections[TRANSPORT_TCP] = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-ws") && hasValue) {
+            o.connections[TRANSPORT_WEBSOCKET] = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-udp") && hasValue) {
+            o.connections[TRANSPORT_UDP] = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-pixels") && hasValue) {
+            o.pixels = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-fps") && hasValue) {
+            o.fps = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-seconds") && hasValue) {
+            o.seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-config")) {
+            config = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    unsigned numStreams = o.connections[TRANSPORT_TCP] + o.connections[TRANSPORT_WEBSOCKET] +
+        o.connections[TRANSPORT_UDP];
+
+    // Each stream has its own OPC channel, and Art-Net streams their own universes
+    if (numStreams == 0 || numStreams > 255 || o.pixels < 3 || o.pixels > kMaxPixels ||
+        o.fps < 0 || o.seconds <= 0) {
+        fprintf(stderr, "Need 1 to 255 connections, 3 to %u pixels, and a positive run time\n", kMaxPixels);
+        return 1;
+    }
+
+    if (config) {
+        printConfig(o, numStreams);
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    DeviceStats before, after;
+    bool haveStats = readDeviceStats(o, numStreams, before);
+    if (!haveStats) {
+        fprintf(stderr, "Can't read device stats over WebSockets. Latency won't be measured.\n");
+    }
+
+    std::vector<Stream> streams(numStreams);
+    std::vector<tthread::thread*> threads;
+    uint64_t startTime = Monotonic::micros();
+    uint64_t endTime = startTime + uint64_t(o.seconds * 1e6);
+
+    for (unsigned index = 0, t = 0; t < NUM_TRANSPORTS; t++) {
+        for (unsigned c = 0; c < o.connections[t]; c++, index++) {
+            Stream &s = streams[index];
+            s.options = &o;
+            s.transport = Transport(t);
+            s.index = index;
+            s.endTime = endTime;
+            s.connected = false;
+            s.frames = 0;
+            s.bytes = 0;
+            threads.push_back(new tthread::thread(streamThread, &s));
+        }
+    }
+
+    for (unsigned i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    double elapsed = (Monotonic::micros() - startTime) * 1e-6;
+
+    // Let the last frames reach the devices
+    usleep(200000);
+    haveStats = haveStats && readDeviceStats(o, numStreams, after);
+
+    /*
+     * Results
+     */
+
+    rapidjson::Document results;
+    results.SetObject();
+    rapidjson::Document::AllocatorType &alloc = results.GetAllocator();
+
+    rapidjson::Value options(rapidjson::kObjectType);
+    for (unsigned t = 0; t < NUM_TRANSPORTS; t++) {
+        options.AddMember(kTransportNames[t], o.connections[t], alloc);
+    }
+    options.AddMember("pixels", o.pixels, alloc);
+    options.AddMember("fps", o.fps, alloc);
+    options.AddMember("seconds", o.seconds, alloc);
+    results.AddMember("options", options, alloc);
+    results.AddMember("elapsed_seconds", elapsed, alloc);
+
+    uint64_t totalFrames = 0;
+    rapidjson::Value sent(rapidjson::kObjectType);
+    for (unsigned t = 0; t < NUM_TRANSPORTS; t++) {
+        uint64_t frames = 0, bytes = 0;
+        unsigned connected = 0;
+        for (unsigned i = 0; i < numStreams; i++) {
+            if (streams[i].transport == Transport(t)) {
+                frames += streams[i].frames;
+                bytes += streams[i].bytes;
+                connected += streams[i].connected;
+            }
+        }
+        totalFrames += frames;
+
+        if (o.connections[t]) {
+            rapidjson::Value item(rapidjson::kObjectType);
+            item.AddMember("connected", connected, alloc);
+            item.AddMember("frames", frames, alloc);
+            item.AddMember("bytes", bytes, alloc);
+            item.AddMember("fps", frames / elapsed, alloc);
+            sent.AddMember(kTransportNames[t], item, alloc);
+        }
+    }
+    sent.AddMember("frames", totalFrames, alloc);
+    sent.AddMember("fps", totalFrames / elapsed, alloc);
+    results.AddMember("sent", sent, alloc);
+
+    if (haveStats) {
+        uint64_t frames = after.frames - before.frames;
+        rapidjson::Value submitted(rapidjson::kObjectType);
+        submitted.AddMember("frames", frames, alloc);
+        submitted.AddMember("fps", frames / elapsed, alloc);
+        results.AddMember("submitted", submitted, alloc);
+
+        std::vector<uint64_t> counts(after.latencies.size());
+        uint64_t samples = 0;
+        for (unsigned i = 0; i < counts.size(); i++) {
+            counts[i] = after.latencies[i] - (i < before.latencies.size() ? before.latencies[i] : 0);
+            samples += counts[i];
+        }
+
+        rapidjson::Value latency(rapidjson::kObjectType);
+        latency.AddMember("samples", samples, alloc);
+        if (samples) {
+            latency.AddMember("mean", double(after.latencySum - before.latencySum) / samples, alloc);
+            latency.AddMember("p50", percentile(counts, after.bounds, samples, after.maxLatency, 0.50), alloc);
+            latency.AddMember("p90", percentile(counts, after.bounds, samples, after.maxLatency, 0.90), alloc);
+            latency.AddMember("p99", percentile(counts, after.bounds, samples, after.maxLatency, 0.99), alloc);
+            latency.AddMember("p999", percentile(counts, after.bounds, samples, after.maxLatency, 0.999), alloc);
+            latency.AddMember("max_since_start", after.maxLatency, alloc);
+        }
+        results.AddMember("latency_us", latency, alloc);
+    }
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+    results.Accept(writer);
+    printf("%s\n", buffer.GetString());
+
+    return 0;
+}
@@ -0,0 +1,733 @@
+/*
+ * Microbenchmarks for the per-pixel hot paths
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Times the code every pixel passes through, on this machine:
+ *
+ *   map8, map16    PixelMap::apply() into a Fadecandy framebuffer, for 8-bit and 16-bit messages
+ *   fcdevice       A whole FCDevice frame: mapping, USB packets, and transfer bookkeeping.
+ *                  Uses virtual devices, so nothing is sent.
+ *   lut            FCDevice::writeColorCorrection(), building the 257-entry LUT per color
+ *   apa102         APA102SPIDevice mapping and frame packing. The SPI write is a no-op without wiringPi.
+ *   fw_*           The firmware's updateDrawBuffer() and updatePixel() kernels, compiled for
+ *                  this machine, in each interpolation / dithering / 16-bit variant
+ *
+ * Results are per pixel: nanoseconds, and CPU cycles where a counter is
+ * available. On Linux that's the hardware cycle counter from perf_event_open(),
+ * which may need kernel.perf_event_paranoid lowered; otherwise x86 falls back
+ * to the timestamp counter, which ticks at a fixed rate rather than the core clock.
+ *
+ * Every benchmark runs for -seconds, so one can be profiled on its own:
+ *
+ *   perf record -g fcmicrobench -filter map8 -seconds 10
+ *
+ * usage: fcmicrobench [-pixels N] [-devices N] [-run N] [-swizzle rgb] [-reverse]
+ *                     [-seconds N] [-filter NAME]
+ */
+
+#include "pixelmap.h"
+#include "virtualfcdevice.h"
+#include "apa102spidevice.h"
+#include "monotonic.h"
+#include "opc.h"
+#include "rapidjson/document.h"
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+  #include <x86intrin.h>
+#endif
+
+#include "../../firmware/fc_defs.h"
+
+
+/*
+ * Just enough of the Teensy environment for the firmware's drawing code.
+ * The framebuffer and LUT types mirror fc_usb.h, without the USB driver.
+ */
+
+namespace Firmware {
+
+    #define ALWAYS_INLINE __attribute__ ((always_inline))
+
+    // Unsigned saturate, as the ARM USAT instruction
+    static inline uint32_t __USAT(int32_t value, unsigned bits)
+    {
+        int32_t max = (1 << bits) - 1;
+        return value < 0 ? 0 : value > max ? max : value;
+    }
+
+    // Dual signed 16-bit multiply with exchange, then add, as the ARM SMUADX instruction
+    static inline uint32_t __SMUADX(uint32_t a, uint32_t b)
+    {
+        return int32_t(int16_t(a)) * int16_t(b >> 16) + int32_t(int16_t(a >> 16)) * int16_t(b);
+    }
+
+    struct usb_packet_t {
+        uint16_t len;
+        uint16_t reserved;
+        uint8_t buf[64];
+    };
+
+    struct fcFramebuffer {
+        usb_packet_t *packets[PACKETS_PER_FRAME];
+
+        ALWAYS_INLINE const uint8_t* pixel(unsigned index)
+        {
+            return &packets[index / PIXELS_PER_PACKET]->buf[1 + (index % PIXELS_PER_PACKET) * 3];
+        }
+    };
+
+    union fcLinearLUT {
+        uint16_t entries[LUT_TOTAL_SIZE];
+        struct {
+            uint16_t r[LUT_CH_SIZE];
+            uint16_t g[LUT_CH_SIZE];
+            uint16_t b[LUT_CH_SIZE];
+        };
+    };
+
+    struct fcBuffers {
+        fcFramebuffer *fbPrev;
+        fcFramebuffer *fbNext;
+        fcLinearLUT lutCurrent;
+    };
+
+    struct OctoWS2811z {
+        uint32_t drawBuffer[LEDS_PER_STRIP * 6];
+
+        void* getDrawBuffer() {
+            return drawBuffer;
+        }
+    };
+
+    typedef int16_t residual_t;
+
+    static fcBuffers buffers;
+    static OctoWS2811z leds;
+    static residual_t residual[CHANNELS_TOTAL];
+
+    // Compiled several times with different config flags, as in fadecandy.cpp
+
+    #define FCP_INTERPOLATION   0
+    #define FCP_DITHERING       0
+    #define FCP_16BIT           0
+    #define FCP_FN(name)        name##_I0_D0
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    #define FCP_INTERPOLATION   1
+    #define FCP_DITHERING       0
+    #define FCP_16BIT           0
+    #define FCP_FN(name)        name##_I1_D0
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    #define FCP_INTERPOLATION   0
+    #define FCP_DITHERING       1
+    #define FCP_16BIT           0
+    #define FCP_FN(name)        name##_I0_D1
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    #define FCP_INTERPOLATION   1
+    #define FCP_DITHERING       1
+    #define FCP_16BIT           0
+    #define FCP_FN(name)        name##_I1_D1
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    #define FCP_INTERPOLATION   0
+    #define FCP_DITHERING       0
+    #define FCP_16BIT           1
+    #define FCP_FN(name)        name##_W16_D0
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    #define FCP_INTERPOLATION   0
+    #define FCP_DITHERING       1
+    #define FCP_16BIT           1
+    #define FCP_FN(name)        name##_W16_D1
+    #include "../../firmware/fc_pixel_lut.cpp"
+    #include "../../firmware/fc_pixel.cpp"
+    #include "../../firmware/fc_draw.cpp"
+    #undef FCP_INTERPOLATION
+    #undef FCP_DITHERING
+    #undef FCP_16BIT
+    #undef FCP_FN
+
+    static void setup()
+    {
+        static usb_packet_t packets[2][PACKETS_PER_FRAME];
+        static fcFramebuffer framebuffers[2];
+
+        for (unsigned f = 0; f < 2; f++) {
+            for (unsigned p = 0; p < PACKETS_PER_FRAME; p++) {
+                for (unsigned i = 0; i < sizeof packets[f][p].buf; i++) {
+                    packets[f][p].buf[i] = uint8_t(f * 97 + p * 31 + i * 7);
+                }
+                framebuffers[f].packets[p] = &packets[f][p];
+            }
+        }
+        buffers.fbPrev = &framebuffers[0];
+        buffers.fbNext = &framebuffers[1];
+
+        // A gamma curve, shifted right by one as in fcBuffers::finalizeLUT()
+        for (unsigned i = 0; i < LUT_TOTAL_SIZE; i++) {
+            unsigned entry = i % LUT_CH_SIZE;
+            double value = pow(std::min(1.0, entry / 256.0), 2.5) * 0xFFFF;
+            buffers.lutCurrent.entries[i] = uint16_t(value) >> 1;
+        }
+    }
+}
+
+
+struct Options {
+    unsigned pixels;        // Per device
+    unsigned devices;
+    unsigned run;           // Pixels per mapping instruction, or 0 for one instruction per device
+    const char *swizzle;
+    bool reverse;
+    double seconds;
+    const char *filter;
+};
+
+class CycleCounter
+{
+public:
+    CycleCounter();
+    ~CycleCounter();
+
+    // What read() counts, or 0 if there's no counter
+    const char *source() const { return mSource; }
+    uint64_t read();
+
+private:
+    int mFd;
+    const char *mSource;
+};
+
+class Benchmark
+{
+public:
+    virtual ~Benchmark() {}
+
+    // Pixels processed by each call to run()
+    virtual unsigned pixels() const = 0;
+    virtual void run() = 0;
+};
+
+
+CycleCounter::CycleCounter()
+    : mFd(-1), mSource(0)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    mFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (mFd >= 0) {
+        mSource = "cycles";
+        return;
+    }
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+    mSource = "tsc ticks";
+#endif
+}
+
+CycleCounter::~CycleCounter()
+{
+#ifdef __linux__
+    if (mFd >= 0) {
+        close(mFd);
+    }
+#endif
+}
+
+uint64_t CycleCounter::read()
+{
+#ifdef __linux__
+    if (mFd >= 0) {
+        uint64_t value = 0;
+        return ::read(mFd, &value, sizeof value) == sizeof value ? value : 0;
+    }
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void buildConfig(const Options &o, unsigned device, rapidjson::Document &config)
+{
+    /*
+     * A device configuration whose map takes this device's share of one big
+     * OPC message. With -run, the map is split into runs of that many pixels,
+     * each taken from a scattered place in the device's share.
+     */
+
+    rapidjson::Document::AllocatorType &alloc = config.GetAllocator();
+    config.SetObject();
+    config.AddMember("latency", 0, alloc);
+    config.AddMember("bandwidth", 0, alloc);
+
+    unsigned run = o.run ? o.run : o.pixels;
+    unsigned numRuns = (o.pixels + run - 1) / run;
+
+    // Visit the runs in a fixed pseudorandom order
+    std::vector<unsigned> order(numRuns);
+    uint32_t seed = 12345 + device;
+    for (unsigned i = 0; i < numRuns; i++) {
+        order[i] = i;
+    }
+    for (unsigned i = numRuns; i > 1; i--) {
+        seed = seed * 1103515245 + 12345;
+        std::swap(order[i - 1], order[(seed >> 8) % i]);
+    }
+
+    rapidjson::Value map(rapidjson::kArrayType);
+    for (unsigned i = 0; i < numRuns; i++) {
+        unsigned firstOut = i * run;
+        int count = std::min(run, o.pixels - firstOut);
+
+        rapidjson::Value inst(rapidjson::kArrayType);
+        inst.PushBack(0, alloc);
+        inst.PushBack(device * o.pixels + order[i] * run, alloc);
+        inst.PushBack(o.reverse ? firstOut + count - 1 : firstOut, alloc);
+        inst.PushBack(o.reverse ? -count : count, alloc);
+        inst.PushBack(o.swizzle, alloc);
+        map.PushBack(inst, alloc);
+    }
+    config.AddMember("map", map, alloc);
+}
+
+static OPC::Message *newMessage(const Options &o, uint8_t command)
+{
+    // Room for every device's share, plus a partial run scattered to the end
+    OPC::Message *msg = new OPC::Message;
+    unsigned length = (o.devices * o.pixels + o.run) * OPC::pixelBytes(command);
+
+    msg->channel = 0;
+    msg->command = command;
+    msg->setLength(length);
+    for (unsigned i = 0; i < length; i++) {
+        msg->data[i] = uint8_t(i * 13 + (i >> 8));
+    }
+    return msg;
+}
+
+
+class MapBenchmark : public Benchmark
+{
+public:
+    MapBenchmark(const Options &o, uint8_t command)
+        : mMsg(newMessage(o, command)), mMaps(o.devices), mPixels(o.devices * o.pixels),
+          mFramebuffers(o.devices * FRAMEBUFFER_BYTES * 2)
+    {
+        // Same layout as FCDevice, with a low byte plane for 16-bit frames
+        for (unsigned d = 0; d < o.devices; d++) {
+            rapidjson::Document config;
+            buildConfig(o, d, config);
+
+            uint8_t *fb = &mFramebuffers[d * FRAMEBUFFER_BYTES * 2];
+            PixelMap::Layout layout;
+            layout.base = fb + 1;
+            layout.lowBase = command == OPC::SetPixelColors16 ? fb + FRAMEBUFFER_BYTES + 1 : 0;
+            layout.numPixels = LEDS_TOTAL;
+            layout.pixelsPerBlock = PIXELS_PER_PACKET;
+            layout.blockStride = 64;
+            layout.pixelStride = 3;
+            layout.colorOffsets[0] = 0;
+            layout.colorOffsets[1] = 1;
+            layout.colorOffsets[2] = 2;
+            mMaps[d].load(&config["map"], layout, true);
+        }
+    }
+
+    ~MapBenchmark() {
+        delete mMsg;
+    }
+
+    unsigned pixels() const {
+        return mPixels;
+    }
+
+    void run() {
+        for (unsigned d = 0; d < mMaps.size(); d++) {
+            mMaps[d].apply(*mMsg);
+        }
+    }
+
+private:
+    static const unsigned FRAMEBUFFER_BYTES = PACKETS_PER_FRAME * 64;
+
+    OPC::Message *mMsg;
+    std::vector<PixelMap> mMaps;
+    unsigned mPixels;
+    std::vector<uint8_t> mFramebuffers;
+};
+
+
+class FCDeviceBenchmark : public Benchmark
+{
+public:
+    FCDeviceBenchmark(const Options &o)
+        : mMsg(newMessage(o, OPC::SetPixelColors)), mPixels(o.devices * o.pixels)
+    {
+        for (unsigned d = 0; d < o.devices; d++) {
+            char serial[32];
+            snprintf(serial, sizeof serial, "MICRO%03u", d);
+
+            rapidjson::Document config;
+            buildConfig(o, d, config);
+
+            VirtualFCDevice *device = new VirtualFCDevice(serial, true);
+            device->open();
+            device->loadConfiguration(config);
+            device->writeColorCorrection(rapidjson::Value());
+            mDevices.push_back(device);
+        }
+    }
+
+    ~FCDeviceBenchmark() {
+        for (unsigned d = 0; d < mDevices.size(); d++) {
+            delete mDevices[d];
+        }
+        delete mMsg;
+    }
+
+    unsigned pixels() const {
+        return mPixels;
+    }
+
+    void run() {
+        // With no simulated latency, each flush completes the transfers submitted so far
+        for (unsigned d = 0; d < mDevices.size(); d++) {
+            mDevices[d]->writeMessage(*mMsg);
+            mDevices[d]->flush();
+        }
+    }
+
+private:
+    OPC::Message *mMsg;
+    std::vector<VirtualFCDevice*> mDevices;
+    unsigned mPixels;
+};
+
+
+class LUTBenchmark : public Benchmark
+{
+public:
+    LUTBenchmark()
+        : mDevice("MICROLUT", true)
+    {
+        rapidjson::Document config;
+        config.SetObject();
+        config.AddMember("latency", 0, config.GetAllocator());
+        config.AddMember("bandwidth", 0, config.GetAllocator());
+        mDevice.open();
+        mDevice.loadConfiguration(config);
+
+        // A typical curve, with both the linear and the nonlinear section
+        const char *json = "{\"gamma\": 2.5, \"whitepoint\": [1.0, 0.9, 0.8], "
+            "\"linearSlope\": 1.0, \"linearCutoff\": 0.0039}";
+        mColor.Parse<0>(json);
+    }
+
+    // Entries in the LUT, rather than pixels
+    unsigned pixels() const {
+        return 3 * 257;
+    }
+
+    void run() {
+        mDevice.writeColorCorrection(mColor);
+        mDevice.flush();
+    }
+
+private:
+    VirtualFCDevice mDevice;
+    rapidjson::Document mColor;
+};
+
+
+class APA102Benchmark : public Benchmark
+{
+public:
+    APA102Benchmark(const Options &o)
+        : mMsg(newMessage(o, OPC::SetPixelColors)), mPixels(o.devices * o.pixels)
+    {
+        for (unsigned d = 0; d < o.devices; d++) {
+            rapidjson::Document config;
+            buildConfig(o, d, config);
+
+            APA102SPIDevice *device = new APA102SPIDevice(o.pixels, true);
+            device->loadConfiguration(config);
+            mDevices.push_back(device);
+        }
+    }
+
+    ~APA102Benchmark() {
+        for (unsigned d = 0; d < mDevices.size(); d++) {
+            delete mDevices[d];
+        }
+        delete mMsg;
+    }
+
+    unsigned pixels() const {
+        return mPixels;
+    }
+
+    void run() {
+        for (unsigned d = 0; d < mDevices.size(); d++) {
+            mDevices[d]->writeMessage(*mMsg);
+        }
+    }
+
+private:
+    OPC::Message *mMsg;
+    std::vector<APA102SPIDevice*> mDevices;
+    unsigned mPixels;
+};
+
+
+class FirmwareBenchmark : public Benchmark
+{
+public:
+    typedef void (*drawFn_t)(unsigned interpCoefficient);
+
+    FirmwareBenchmark(drawFn_t fn, unsigned interpCoefficient)
+        : mFn(fn), mCoefficient(interpCoefficient) {}
+
+    // Always a whole Fadecandy, since that's what the firmware draws
+    unsigned pixels() const {
+        return LEDS_TOTAL;
+    }
+
+    void run() {
+        mFn(mCoefficient);
+    }
+
+private:
+    drawFn_t mFn;
+    unsigned mCoefficient;
+};
+
+
+static void measure(const char *name, Benchmark &b, const Options &o, CycleCounter &counter)
+{
+    // Warm up caches and branch predictors
+    b.run();
+
+    uint64_t iterations = 0;
+    uint64_t batch = 1;
+    uint64_t limit = uint64_t(o.seconds * 1e6);
+    uint64_t startTime = Monotonic::micros();
+    uint64_t startCycles = counter.read();
+    uint64_t elapsed;
+
+    do {
+        for (uint64_t i = 0; i < batch; i++) {
+            b.run();
+        }
+        iterations += batch;
+        elapsed = Monotonic::micros() - startTime;
+
+        // Check the clock about once a millisecond
+        if (elapsed < 1000 * iterations / batch) {
+            batch *= 2;
+        }
+    } while (elapsed < limit);
+
+    uint64_t cycles = counter.read() - startCycles;
+    double pixels = double(iterations) * b.pixels();
+
+    printf("%-12s %8u %12llu %10.2f", name, b.pixels(), (unsigned long long) iterations,
+        elapsed * 1e3 / pixels);
+    if (counter.source()) {
+        printf(" %12.2f", cycles / pixels);
+    }
+    printf(" %10.1f\n", pixels / elapsed);
+}
+
+static bool selected(const Options &o, const char *name)
+{
+    return !o.filter || strstr(name, o.filter);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "\n"
+        "  -pixels N      Pixels per device, up to %u. Default %u.\n"
+        "  -devices N     Devices sharing one OPC message, default 1\n"
+        "  -run N         Split each device's map into scattered runs of N pixels. Default 0, one run.\n"
+        "  -swizzle STR   Color channels for each map instruction, from 'r', 'g', 'b', and 'l'. Default rgb.\n"
+        "  -reverse       Map each run in reverse order\n"
+        "  -seconds N     Time spent on each benchmark, default 0.5\n"
+        "  -filter NAME   Only run benchmarks whose name contains NAME\n",
+        name, LEDS_TOTAL, LEDS_TOTAL);
+}
+
+int main(int argc, char **argv)
+{
+    Options o;
+    o.pixels = LEDS_TOTAL;
+    o.devices = 1;
+    o.run = 0;
+    o.swizzle = "rgb";
+    o.reverse = false;
+    o.seconds = 0.5;
+    o.filter = 0;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(argv[i], "-pixels") && hasValue) {
+            o.pixels = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-devices") && hasValue) {
+            o.devices = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-run") && hasValue) {
+            o.run = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-swizzle") && hasValue) {
+            o.swizzle = argv[++i];
+        } else if (!strcmp(argv[i], "-reverse")) {
+            o.reverse = true;
+        } else if (!strcmp(argv[i], "-seconds") && hasValue) {
+            o.seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-filter") && hasValue) {
+            o.filter = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Every device's share has to fit in one OPC message, even at 16 bits per color
+    if (o.pixels == 0 || o.pixels > LEDS_TOTAL || o.devices == 0 ||
+        (uint64_t(o.devices) * o.pixels + o.run) * 6 > 0xFFFF ||
+        strlen(o.swizzle) != 3 || strspn(o.swizzle, "rgblRGBL") != 3 || o.seconds <= 0) {
+        fprintf(stderr, "Need 1 to %u pixels per device, at most %u pixels in all, and a swizzle like \"grb\"\n",
+            LEDS_TOTAL, 0xFFFF / 6);
+        return 1;
+    }
+
+    CycleCounter counter;
+    Firmware::setup();
+
+    printf("%u device(s) of %u pixels, run %u, swizzle %s%s\n\n", o.devices, o.pixels,
+        o.run ? o.run : o.pixels, o.swizzle, o.reverse ? ", reversed" : "");
+    printf("%-12s %8s %12s %10s", "benchmark", "pixels", "iterations", "ns/pixel");
+    if (counter.source()) {
+        printf(" %12s", counter.source());
+    }
+    printf(" %10s\n", "Mpixels/s");
+
+    if (selected(o, "map8")) {
+        MapBenchmark b(o, OPC::SetPixelColors);
+        measure("map8", b, o, counter);
+    }
+    if (selected(o, "map16")) {
+        MapBenchmark b(o, OPC::SetPixelColors16);
+        measure("map16", b, o, counter);
+    }
+    if (selected(o, "fcdevice")) {
+        FCDeviceBenchmark b(o);
+        measure("fcdevice", b, o, counter);
+    }
+    if (selected(o, "lut")) {
+        LUTBenchmark b;
+        measure("lut", b, o, counter);
+    }
+    if (selected(o, "apa102")) {
+        APA102Benchmark b(o);
+        measure("apa102", b, o, counter);
+    }
+
+    // Interpolating halfway, so neither keyframe can be skipped
+    static const struct {
+        const char *name;
+        FirmwareBenchmark::drawFn_t fn;
+        unsigned interpCoefficient;
+    } kernels[] = {
+        { "fw_I0_D0", Firmware::updateDrawBuffer_I0_D0, 0x10000 },
+        { "fw_I1_D0", Firmware::updateDrawBuffer_I1_D0, 0x8000 },
+        { "fw_I0_D1", Firmware::updateDrawBuffer_I0_D1, 0x10000 },
+        { "fw_I1_D1", Firmware::updateDrawBuffer_I1_D1, 0x8000 },
+        { "fw_W16_D0", Firmware::updateDrawBuffer_W16_D0, 0x10000 },
+        { "fw_W16_D1", Firmware::updateDrawBuffer_W16_D1, 0x10000 },
+    };
+
+    for (unsigned i = 0; i < sizeof kernels / sizeof kernels[0]; i++) {
+        if (selected(o, kernels[i].name)) {
+            FirmwareBenchmark b(kernels[i].fn, kernels[i].interpCoefficient);
+            measure(kernels[i].name, b, o, counter);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Compression ratio and decode speed for recorded shows
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Reads a show recorded by fcserver, compressed or not, and compresses it
+ * again the way the recorder does. Reports the compression ratio, then
+ * decodes the compressed show repeatedly and reports how much faster than
+ * realtime that is.
+ *
+ * usage: fcshowbench <show file> [-passes N]
+ */
+
+#include "showfile.h"
+#include "showcodec.h"
+#include "monotonic.h"
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+int main(int argc, char **argv)
+{
+    const char *path = 0;
+    unsigned passes = 10;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-passes") && i + 1 < argc) {
+            passes = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            path = 0;
+            break;
+        }
+    }
+    if (!path || passes == 0) {
+        fprintf(stderr, "usage: %s <show file> [-passes N]\n", argv[0]);
+        return 1;
+    }
+
+    ShowFile show;
+    if (!show.open(path, std::cerr)) {
+        return 2;
+    }
+
+    // Uncompressed records, exactly as the recorder buffers them
+    std::vector<uint8_t> raw;
+    for (uint64_t offset = show.seek(0); offset < show.end();) {
+        uint64_t micros;
+        OPC::Message *msg;
+        offset = show.read(offset, micros, msg);
+        if (msg) {
+            size_t pos = raw.size();
+            raw.resize(pos + ShowFile::recordBytes(msg->length()));
+            memcpy(&raw[pos], &micros, sizeof micros);
+            memcpy(&raw[pos + sizeof micros], msg, OPC::HEADER_BYTES + msg->length());
+        }
+    }
+
+    // Compress, starting over at each index entry like the recorder
+    std::vector<uint8_t> coded;
+    std::vector<size_t> keyframes;
+    uint64_t messages = 0;
+    uint64_t dataBytes = 0;
+    uint64_t nextIndex = 0;
+    ShowEncoder encoder;
+
+    uint64_t startTime = Monotonic::micros();
+    for (size_t pos = 0; pos < raw.size(); messages++) {
+        uint64_t micros;
+        memcpy(&micros, &raw[pos], sizeof micros);
+        const OPC::Message *msg = (const OPC::Message*) &raw[pos + sizeof micros];
+
+        if (micros >= nextIndex) {
+            keyframes.push_back(coded.size());
+            nextIndex = (micros / ShowFile::INDEX_INTERVAL + 1) * ShowFile::INDEX_INTERVAL;
+            encoder.reset();
+        }
+
+        encoder.encode(micros, *msg, coded);
+        dataBytes += msg->length();
+        pos += ShowFile::recordBytes(msg->length());
+    }
+    uint64_t encodeTime = Monotonic::micros() - startTime;
+
+    if (!messages) {
+        fprintf(stderr, "%s has no messages\n", path);
+        return 3;
+    }
+
+    // Decode, checking the first pass against the original
+    ShowDecoder decoder;
+    uint64_t decodeTime = 0;
+
+    for (unsigned pass = 0; pass < passes; pass++) {
+        size_t rawPos = 0;
+        size_t nextKeyframe = 0;
+        unsigned index = 0;
+        bool check = pass == 0;
+
+        startTime = Monotonic::micros();
+        for (size_t pos = 0; pos < coded.size();) {
+            if (nextKeyframe < keyframes.size() && keyframes[nextKeyframe] == pos) {
+                decoder.reset();
+                nextKeyframe++;
+            }
+
+            const ShowCodec::RecordHeader *header = (const ShowCodec::RecordHeader*) &coded[pos];
+            OPC::Message *msg = decoder.decode(&coded[pos]);
+
+            if (check) {
+                const OPC::Message *expected = (const OPC::Message*) &raw[rawPos + sizeof(uint64_t)];
+                if (!msg || memcmp(msg, expected, OPC::HEADER_BYTES + expected->length())) {
+                    fprintf(stderr, "Message %u didn't decode correctly\n", index);
+                    return 4;
+                }
+                rawPos += ShowFile::recordBytes(expected->length());
+                index++;
+            }
+            pos += ShowCodec::recordBytes(header->codedLength);
+        }
+        decodeTime += Monotonic::micros() - startTime;
+    }
+
+    double seconds = show.duration() * 1e-6;
+    double decodeSeconds = decodeTime * 1e-6 / passes;
+
+    printf("%s: %.1f seconds, %llu messages, %llu bytes of pixel data\n",
+        path, seconds, (unsigned long long) messages, (unsigned long long) dataBytes);
+    printf("uncompressed %10llu bytes\n", (unsigned long long) raw.size());
+    printf("compressed   %10llu bytes, ratio %.2f, %llu keyframe groups\n",
+        (unsigned long long) coded.size(), double(raw.size()) / coded.size(),
+        (unsigned long long) keyframes.size());
+    printf("encode %8.1f MB/s\n", dataBytes / double(encodeTime ? encodeTime : 1));
+    printf("decode %8.1f MB/s, %.0fx realtime\n",
+        dataBytes / (decodeSeconds * 1e6), decodeSeconds > 0 ? seconds / decodeSeconds : 0.0);
+
+    return 0;
+}
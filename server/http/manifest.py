@@ -21,7 +21,7 @@ manifest = [
     (None, '404.html', 'text/html'),
 ]
 
-import json, sys, os, zlib
+import json, sys, os, re, zlib, hashlib
 
 sys.stdout.write("""/*
  * HTTP Document data.
@@ -62,7 +62,15 @@ for path, filename, contentType in manifest:
     else:
         raw = open(filename, 'rb').read()
     data = zlib.compress(raw)
-    sys.stdout.write("{ %s, %s, %s, %d },\n" %
-        (quote(path), quote(data), quote(contentType), len(data)))
+
+    # Strong validator for conditional requests. Only files with a version in
+    # their name, like jquery-1.10.2.min.js, can be kept for a day without
+    # asking; anything else might change under the same name in an upgrade.
+    etag = '"%s"' % hashlib.sha1(raw).hexdigest()[:16]
+    versioned = path and re.search(r'-\d+(\.\d+)+[.-]', os.path.basename(path))
+    maxAge = 86400 if versioned else 0
+
+    sys.stdout.write("{ %s, %s, %s, %d, %s, %d },\n" %
+        (quote(path), quote(data), quote(contentType), len(data), quote(etag.encode('ascii')), maxAge))
 
 sys.stdout.write("};\n")
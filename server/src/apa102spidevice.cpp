@@ -23,17 +23,22 @@
  */
 
 #include "apa102spidevice.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
 #include "opc.h"
+#include "jsonmessagereader.h"
+#include "monotonic.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <stddef.h>
 
 const char* APA102SPIDevice::DEVICE_TYPE = "apa102spi";
 
+// Frames per second while interpolating. SPI is fast enough that this costs little.
+static const double kDefaultOutputRate = 400;
+
 APA102SPIDevice::APA102SPIDevice(uint32_t numLights, bool verbose)
     : SPIDevice(DEVICE_TYPE, verbose),
-      mConfigMap(0),
+      mPreparedConfig(0),
       mNumLights(numLights)
 {
     uint32_t bufferSize = sizeof(PixelFrame) * (numLights + 2); // Number of lights plus start and end frames
@@ -49,19 +54,61 @@ APA102SPIDevice::APA102SPIDevice(uint32_t numLights, bool verbose)
     // Initialize start and end frames
     mFrameBuffer[0].value = START_FRAME;
     mFrameBuffer[numLights + 1].value = END_FRAME;
+
+    // Mapping only ever writes color bytes, so the brightness bytes are set once here
+    for (uint32_t i = 0; i < numLights; i++) {
+        fbPixel(i)->l = 0xEF; // todo: fix so we actually pass brightness
+    }
 }
 
 APA102SPIDevice::~APA102SPIDevice()
 {
+    flush();
+
     free(mFrameBuffer);
     free(mFlushBuffer);
-
-    flush();
 }
 
 void APA102SPIDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    // With interpolation, mapping draws keyframes and the framebuffer holds blends of them
+    mInterpolator.setup((uint8_t*) fbPixel(0), mNumLights * sizeof(PixelFrame),
+        Interpolator::parseConfiguration(config, kDefaultOutputRate, mVerbose));
+
+    PixelMap::Layout layout;
+    mapLayout(layout);
+    mMap.load(findConfigMap(config), layout, mVerbose);
+    mConfig = &config;
+}
+
+void APA102SPIDevice::prepareConfiguration(const Value &config)
+{
+    PixelMap::Layout layout;
+    mapLayout(layout);
+    mPreparedMap.load(findConfigMap(config), layout, mVerbose);
+    mPreparedConfig = &config;
+}
+
+void APA102SPIDevice::commitConfiguration()
+{
+    if (mPreparedConfig) {
+        mMap.swap(mPreparedMap);
+        mConfig = mPreparedConfig;
+        mPreparedConfig = 0;
+    }
+}
+
+void APA102SPIDevice::mapLayout(PixelMap::Layout &layout)
+{
+    layout.base = mInterpolator.keyframe();
+    layout.lowBase = 0;
+    layout.numPixels = mNumLights;
+    layout.pixelsPerBlock = std::max<unsigned>(1, mNumLights);
+    layout.blockStride = 0;
+    layout.pixelStride = sizeof(PixelFrame);
+    layout.colorOffsets[0] = offsetof(PixelFrame, r);
+    layout.colorOffsets[1] = offsetof(PixelFrame, g);
+    layout.colorOffsets[2] = offsetof(PixelFrame, b);
 }
 
 std::string APA102SPIDevice::getName()
@@ -116,38 +163,42 @@ void APA102SPIDevice::writeMessage(Document &msg)
 void APA102SPIDevice::writeDevicePixels(Document &msg)
 {
     /*
-    * Write pixels without mapping, from a JSON integer
-    * array in msg["pixels"]. The pixel array is removed from
+    * Write pixels without mapping, from msg["pixels"]. This is normally a
+    * string of packed RGB bytes produced by JsonMessageReader, but a JSON
+    * integer array is accepted too. The pixel array is removed from
     * the reply to save network bandwidth.
     *
     * Pixel values are clamped to [0, 255], for convenience.
     */
 
-    const Value &pixels = msg["pixels"];
-    if (!pixels.IsArray()) {
+    std::vector<uint8_t> scratch;
+    unsigned length;
+    const uint8_t *rgb = JsonMessageReader::pixelBytes(msg["pixels"], scratch, length);
+
+    if (!rgb) {
         msg.AddMember("error", "Pixel array is missing", msg.GetAllocator());
     }
     else {
 
         // Truncate to the framebuffer size, and only deal in whole pixels.
-        uint32_t numPixels = pixels.Size() / 3;
+        uint32_t numPixels = length / 3;
         if (numPixels > mNumLights)
             numPixels = mNumLights;
 
-        for (uint32_t i = 0; i < numPixels; i++) {
-            PixelFrame *out = fbPixel(i);
+        PixelFrame *keyframe = (PixelFrame*) mInterpolator.keyframe();
 
-            const Value &r = pixels[i * 3 + 0];
-            const Value &g = pixels[i * 3 + 1];
-            const Value &b = pixels[i * 3 + 2];
+        for (uint32_t i = 0; i < numPixels; i++) {
+            PixelFrame *out = &keyframe[i];
 
-            out->r = std::max(0, std::min(255, r.IsInt() ? r.GetInt() : 0));
-            out->g = std::max(0, std::min(255, g.IsInt() ? g.GetInt() : 0));
-            out->b = std::max(0, std::min(255, b.IsInt() ? b.GetInt() : 0));
+            out->r = rgb[i * 3 + 0];
+            out->g = rgb[i * 3 + 1];
+            out->b = rgb[i * 3 + 2];
             out->l = 0xEF; // todo: fix so we actually pass brightness
         }
 
-        writeBuffer();
+        if (mInterpolator.push(Monotonic::micros())) {
+            writeBuffer();
+        }
     }
 }
 
@@ -160,8 +211,14 @@ void APA102SPIDevice::writeMessage(const OPC::Message &msg)
     switch (msg.command) {
 
         case OPC::SetPixelColors:
-            opcSetPixelColors(msg);
-            writeBuffer();
+        case OPC::SetPixelColors16:
+            // Only messages we map are new frames, which matters when interpolating
+            if (mMap.hasChannel(msg.channel)) {
+                opcSetPixelColors(msg);
+                if (mInterpolator.push(Monotonic::micros())) {
+                    writeBuffer();
+                }
+            }
             return;
 
         case OPC::SystemExclusive:
@@ -177,90 +234,39 @@ void APA102SPIDevice::writeMessage(const OPC::Message &msg)
 void APA102SPIDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run our device's compiled mapping, and store any relevant portions of 'msg'
+     * in the framebuffer. If there's no mapping, this device is inactive.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
-    }
+    mMap.apply(msg);
 }
 
-void APA102SPIDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+void APA102SPIDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
 {
-    /*
-    * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-    * into our framebuffer. This looks for any mapping instructions that we
-    * recognize:
-    *
-    *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
-    */
-
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            }
-            else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, mNumLights);
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                direction > 0 ? mNumLights - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            while (count--) {
-                PixelFrame *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-                outPtr->r = inPtr[0];
-                outPtr->g = inPtr[1];
-                outPtr->b = inPtr[2];
-                outPtr->l = 0xEF; // todo: fix so we actually pass brightness
-                inPtr += 3;
-            }
+    // Map every part we use, then write (or interpolate toward) a single frame
+    bool mapped = false;
 
-            return;
+    for (unsigned i = 0; i < count; i++) {
+        if (mMap.hasChannel(parts[i]->channel)) {
+            opcSetPixelColors(*parts[i]);
+            mapped = true;
         }
     }
 
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+    if (mapped && mInterpolator.push(Monotonic::micros())) {
+        writeBuffer();
+    }
+}
+
+uint64_t APA102SPIDevice::interpolationDeadline()
+{
+    return mInterpolator.deadline();
+}
+
+void APA102SPIDevice::interpolate(uint64_t now)
+{
+    if (mInterpolator.update(now)) {
+        writeBuffer();
     }
 }
 
@@ -268,4 +274,8 @@ void APA102SPIDevice::describe(rapidjson::Value &object, Allocator &alloc)
 {
     SPIDevice::describe(object, alloc);
     object.AddMember("numLights", mNumLights, alloc);
+
+    if (mInterpolator.enabled()) {
+        object.AddMember("outputRate", mInterpolator.rate(), alloc);
+    }
 }
@@ -25,6 +25,8 @@
 #pragma once
 #include "spidevice.h"
 #include "opc.h"
+#include "pixelmap.h"
+#include "interpolator.h"
 #include <set>
 
 
@@ -35,8 +37,11 @@ public:
     virtual ~APA102SPIDevice();
 
     virtual void loadConfiguration(const Value &config);
+    virtual void prepareConfiguration(const Value &config);
+    virtual void commitConfiguration();
     virtual void writeMessage(const OPC::Message &msg);
     virtual void writeMessage(Document &msg);
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
     virtual std::string getName();
     virtual void flush();
 
@@ -44,6 +49,9 @@ public:
 
     virtual void describe(rapidjson::Value &object, Allocator &alloc);
 
+    virtual uint64_t interpolationDeadline();
+    virtual void interpolate(uint64_t now);
+
 private:
     static const uint32_t START_FRAME = 0x00000000;
     static const uint32_t END_FRAME = 0xFFFFFFFF;
@@ -62,7 +70,13 @@ private:
         uint32_t value;
     };
 
-    const Value *mConfigMap;
+    PixelMap mMap;
+    Interpolator mInterpolator;
+
+    // Map compiled by prepareConfiguration(), and the entry it came from
+    PixelMap mPreparedMap;
+    const Value *mPreparedConfig;
+
     PixelFrame* mFrameBuffer;
     PixelFrame* mFlushBuffer;
     uint32_t mNumLights;
@@ -72,9 +86,9 @@ private:
         return &mFrameBuffer[num + 1];
     }
 
+    void mapLayout(PixelMap::Layout &layout);
     void writeBuffer();
     void writeDevicePixels(Document &msg);
 
     void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
 };
@@ -0,0 +1,67 @@
+/*
+ * Art-Net output device
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "artnetdevice.h"
+#include <string.h>
+
+const char* ArtNetDevice::DEVICE_TYPE = "artnet";
+
+ArtNetDevice::ArtNetDevice(bool verbose)
+    : NetDevice(DEVICE_TYPE, verbose)
+{}
+
+void ArtNetDevice::formatCommon(uint8_t *packet, uint16_t opcode)
+{
+    // ID string, little-endian OpCode, big-endian protocol version
+    memcpy(packet, "Art-Net", 8);
+    packet[8] = uint8_t(opcode);
+    packet[9] = uint8_t(opcode >> 8);
+    packet[10] = uint8_t(PROTOCOL_VERSION >> 8);
+    packet[11] = uint8_t(PROTOCOL_VERSION);
+}
+
+void ArtNetDevice::formatHeader(uint8_t *header, unsigned universe)
+{
+    // ArtDmx
+    formatCommon(header, OP_DMX);
+    header[12] = 0;                                     // Sequence
+    header[13] = 0;                                     // Physical
+    header[14] = uint8_t(universe);                     // SubUni
+    header[15] = uint8_t(universe >> 8);                // Net
+    header[16] = uint8_t(CHANNELS_PER_UNIVERSE >> 8);   // Length, big-endian
+    header[17] = uint8_t(CHANNELS_PER_UNIVERSE);
+}
+
+void ArtNetDevice::setSequence(uint8_t *header, uint8_t sequence)
+{
+    header[12] = sequence;
+}
+
+unsigned ArtNetDevice::formatSync(uint8_t *packet, uint8_t sequence)
+{
+    // ArtSync has no sequence number; Aux1 and Aux2 are zero.
+    formatCommon(packet, OP_SYNC);
+    packet[12] = 0;
+    packet[13] = 0;
+    return SYNC_LENGTH;
+}
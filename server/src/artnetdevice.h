@@ -0,0 +1,52 @@
+/*
+ * Art-Net output device
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "netdevice.h"
+
+
+class ArtNetDevice : public NetDevice
+{
+public:
+    ArtNetDevice(bool verbose);
+
+    static const char* DEVICE_TYPE;
+
+protected:
+    virtual unsigned defaultPort() { return 6454; }
+    virtual unsigned minUniverse() { return 0; }
+    virtual unsigned maxUniverse() { return 0x7FFF; }    // 15-bit Port-Address
+    virtual unsigned headerLength() { return HEADER_LENGTH; }
+    virtual void formatHeader(uint8_t *header, unsigned universe);
+    virtual void setSequence(uint8_t *header, uint8_t sequence);
+    virtual unsigned formatSync(uint8_t *packet, uint8_t sequence);
+
+private:
+    static const unsigned HEADER_LENGTH = 18;
+    static const unsigned SYNC_LENGTH = 14;
+    static const uint16_t OP_DMX = 0x5000;
+    static const uint16_t OP_SYNC = 0x5200;
+    static const uint16_t PROTOCOL_VERSION = 14;
+
+    static void formatCommon(uint8_t *packet, uint16_t opcode);
+};
@@ -0,0 +1,634 @@
+/*
+ * Compositor for layered Open Pixel Control sources
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "compositor.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+#ifndef _WIN32
+  #include <sys/select.h>
+#endif
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define COMPOSITOR_NEON
+#endif
+
+static const char *kBlendNames[] = { "normal", "add", "multiply", "max" };
+
+namespace {
+
+    /*
+     * Blend kernels. Opacity is 0 to 256, and every path computes exactly the
+     * same 16-bit fixed point result as the scalar loop that finishes off the
+     * last few bytes, 16 bytes at a time with SSE2 or NEON.
+     *
+     *   normal:    dst = (src * a + dst * (256 - a)) / 256
+     *   add:       dst = min(255, dst + src * a / 256)
+     *   multiply:  dst = dst * m / 255, with m = normal blend of src over white
+     *   max:       dst = max(dst, src * a / 256)
+     */
+
+    inline uint8_t div255(unsigned x)
+    {
+        x += 128;
+        return uint8_t((x + (x >> 8)) >> 8);
+    }
+
+#if defined(__SSE2__)
+    inline __m128i scale16(__m128i v, __m128i a)
+    {
+        return _mm_srli_epi16(_mm_mullo_epi16(v, a), 8);
+    }
+
+    inline __m128i div255x16(__m128i x)
+    {
+        x = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+#endif
+
+    void blendNormal(uint8_t *dst, const uint8_t *src, unsigned count, unsigned alpha)
+    {
+        unsigned i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i a = _mm_set1_epi16(alpha);
+        const __m128i na = _mm_set1_epi16(256 - alpha);
+        for (; i + 16 <= count; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+            __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a),
+                                                      _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), na)), 8);
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a),
+                                                      _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), na)), 8);
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+        }
+#elif defined(COMPOSITOR_NEON)
+        const uint16x8_t a = vdupq_n_u16(alpha);
+        const uint16x8_t na = vdupq_n_u16(256 - alpha);
+        for (; i + 16 <= count; i += 16) {
+            uint8x16_t s = vld1q_u8(src + i);
+            uint8x16_t d = vld1q_u8(dst + i);
+            uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(s)), a), vmovl_u8(vget_low_u8(d)), na);
+            uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(s)), a), vmovl_u8(vget_high_u8(d)), na);
+            vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+#endif
+        for (; i < count; i++) {
+            dst[i] = uint8_t((src[i] * alpha + dst[i] * (256 - alpha)) >> 8);
+        }
+    }
+
+    void blendAdd(uint8_t *dst, const uint8_t *src, unsigned count, unsigned alpha)
+    {
+        unsigned i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i a = _mm_set1_epi16(alpha);
+        for (; i + 16 <= count; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+            __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+            s = _mm_packus_epi16(scale16(_mm_unpacklo_epi8(s, zero), a), scale16(_mm_unpackhi_epi8(s, zero), a));
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_adds_epu8(d, s));
+        }
+#elif defined(COMPOSITOR_NEON)
+        const uint16x8_t a = vdupq_n_u16(alpha);
+        for (; i + 16 <= count; i += 16) {
+            uint8x16_t s = vld1q_u8(src + i);
+            uint8x16_t d = vld1q_u8(dst + i);
+            s = vcombine_u8(vshrn_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(s)), a), 8),
+                            vshrn_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(s)), a), 8));
+            vst1q_u8(dst + i, vqaddq_u8(d, s));
+        }
+#endif
+        for (; i < count; i++) {
+            unsigned v = dst[i] + ((src[i] * alpha) >> 8);
+            dst[i] = uint8_t(v > 255 ? 255 : v);
+        }
+    }
+
+    void blendMultiply(uint8_t *dst, const uint8_t *src, unsigned count, unsigned alpha)
+    {
+        const unsigned white = 255 * (256 - alpha);
+        unsigned i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i a = _mm_set1_epi16(alpha);
+        const __m128i w = _mm_set1_epi16(white);
+        for (; i + 16 <= count; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+            __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+            __m128i mlo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a), w), 8);
+            __m128i mhi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a), w), 8);
+            __m128i lo = div255x16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), mlo));
+            __m128i hi = div255x16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), mhi));
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+        }
+#elif defined(COMPOSITOR_NEON)
+        const uint16x8_t a = vdupq_n_u16(alpha);
+        const uint16x8_t w = vdupq_n_u16(white);
+        const uint16x8_t half = vdupq_n_u16(128);
+        for (; i + 16 <= count; i += 16) {
+            uint8x16_t s = vld1q_u8(src + i);
+            uint8x16_t d = vld1q_u8(dst + i);
+            uint16x8_t mlo = vshrq_n_u16(vmlaq_u16(w, vmovl_u8(vget_low_u8(s)), a), 8);
+            uint16x8_t mhi = vshrq_n_u16(vmlaq_u16(w, vmovl_u8(vget_high_u8(s)), a), 8);
+            uint16x8_t lo = vaddq_u16(vmulq_u16(vmovl_u8(vget_low_u8(d)), mlo), half);
+            uint16x8_t hi = vaddq_u16(vmulq_u16(vmovl_u8(vget_high_u8(d)), mhi), half);
+            lo = vaddq_u16(lo, vshrq_n_u16(lo, 8));
+            hi = vaddq_u16(hi, vshrq_n_u16(hi, 8));
+            vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+#endif
+        for (; i < count; i++) {
+            dst[i] = div255(dst[i] * ((src[i] * alpha + white) >> 8));
+        }
+    }
+
+    void blendMax(uint8_t *dst, const uint8_t *src, unsigned count, unsigned alpha)
+    {
+        unsigned i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i a = _mm_set1_epi16(alpha);
+        for (; i + 16 <= count; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+            __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+            s = _mm_packus_epi16(scale16(_mm_unpacklo_epi8(s, zero), a), scale16(_mm_unpackhi_epi8(s, zero), a));
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_max_epu8(d, s));
+        }
+#elif defined(COMPOSITOR_NEON)
+        const uint16x8_t a = vdupq_n_u16(alpha);
+        for (; i + 16 <= count; i += 16) {
+            uint8x16_t s = vld1q_u8(src + i);
+            uint8x16_t d = vld1q_u8(dst + i);
+            s = vcombine_u8(vshrn_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(s)), a), 8),
+                            vshrn_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(s)), a), 8));
+            vst1q_u8(dst + i, vmaxq_u8(d, s));
+        }
+#endif
+        for (; i < count; i++) {
+            uint8_t v = uint8_t((src[i] * alpha) >> 8);
+            dst[i] = std::max(dst[i], v);
+        }
+    }
+
+    void blend(Compositor::BlendMode mode, uint8_t *dst, const uint8_t *src, unsigned count, unsigned alpha)
+    {
+        switch (mode) {
+            case Compositor::BLEND_NORMAL:      blendNormal(dst, src, count, alpha); break;
+            case Compositor::BLEND_ADD:         blendAdd(dst, src, count, alpha); break;
+            case Compositor::BLEND_MULTIPLY:    blendMultiply(dst, src, count, alpha); break;
+            case Compositor::BLEND_MAX:         blendMax(dst, src, count, alpha); break;
+        }
+    }
+
+    // Orders an output's layers by priority, keeping configuration order for ties
+    struct LayerPriorityLess {
+        const std::vector<Compositor::LayerConfig> &layers;
+
+        LayerPriorityLess(const std::vector<Compositor::LayerConfig> &layers) : layers(layers) {}
+
+        bool operator() (unsigned a, unsigned b) const {
+            return layers[a].priority < layers[b].priority;
+        }
+    };
+}
+
+
+Compositor::Compositor(OPC::callback_t outputCallback, void *context)
+    : mOutputCallback(outputCallback), mUserContext(context), mThread(0),
+      mTickMicros(1000000 / DEFAULT_FPS), mLastComposite(0)
+{
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        mLayerIndex[c] = -1;
+        mSend[c] = 0;
+    }
+}
+
+bool Compositor::parseConfiguration(const Value &config, Config &result, std::ostream &error)
+{
+    result = Config();
+    result.tickMicros = 1000000 / DEFAULT_FPS;
+
+    if (config.IsNull()) {
+        return true;
+    }
+
+    if (!config.IsObject() || !config["layers"].IsArray()) {
+        error << "The optional 'compositor' configuration key must be an object with a 'layers' list.\n";
+        return false;
+    }
+
+    const Value &fps = config["fps"];
+    if (!fps.IsNull()) {
+        if (!fps.IsNumber() || fps.GetDouble() < 1 || fps.GetDouble() > 1000) {
+            error << "The compositor 'fps' must be a number from 1 to 1000.\n";
+            return false;
+        }
+        result.tickMicros = uint32_t(1e6 / fps.GetDouble() + 0.5);
+    }
+
+    const Value &layers = config["layers"];
+    bool isLayer[NUM_CHANNELS] = { false };
+    bool isOutput[NUM_CHANNELS] = { false };
+
+    for (unsigned i = 0, e = layers.Size(); i != e; i++) {
+        const Value &layer = layers[i];
+        if (!layer.IsObject()) {
+            error << "Each compositor layer must be an object.\n";
+            return false;
+        }
+
+        const Value &channel = layer["channel"];
+        const Value &output = layer["output"];
+        const Value &priority = layer["priority"];
+        const Value &opacity = layer["opacity"];
+        const Value &blend = layer["blend"];
+        const Value &timeout = layer["timeout"];
+
+        if (!channel.IsUint() || channel.GetUint() >= NUM_CHANNELS ||
+            !output.IsUint() || output.GetUint() >= NUM_CHANNELS) {
+            error << "Each compositor layer needs a 'channel' and an 'output', both OPC channels from 0 to 255.\n";
+            return false;
+        }
+
+        LayerConfig lc;
+        lc.channel = channel.GetUint();
+        lc.output = output.GetUint();
+        lc.priority = 0;
+        lc.alpha = 256;
+        lc.blend = BLEND_NORMAL;
+        lc.timeoutMicros = 0;
+
+        if (!priority.IsNull()) {
+            if (!priority.IsInt()) {
+                error << "Compositor layer 'priority' must be an integer.\n";
+                return false;
+            }
+            lc.priority = priority.GetInt();
+        }
+
+        if (!opacity.IsNull()) {
+            if (!opacity.IsNumber() || opacity.GetDouble() < 0 || opacity.GetDouble() > 1) {
+                error << "Compositor layer 'opacity' must be a number from 0 to 1.\n";
+                return false;
+            }
+            lc.alpha = unsigned(opacity.GetDouble() * 256.0 + 0.5);
+        }
+
+        if (!blend.IsNull()) {
+            unsigned mode;
+            for (mode = 0; mode < sizeof kBlendNames / sizeof kBlendNames[0]; mode++) {
+                if (blend.IsString() && !strcmp(blend.GetString(), kBlendNames[mode])) {
+                    break;
+                }
+            }
+            if (mode == sizeof kBlendNames / sizeof kBlendNames[0]) {
+                error << "Compositor layer 'blend' must be \"normal\", \"add\", \"multiply\" or \"max\".\n";
+                return false;
+            }
+            lc.blend = BlendMode(mode);
+        }
+
+        if (!timeout.IsNull()) {
+            if (!timeout.IsNumber() || timeout.GetDouble() < 0 || timeout.GetDouble() > 3600000) {
+                error << "Compositor layer 'timeout' must be a number of milliseconds.\n";
+                return false;
+            }
+            lc.timeoutMicros = uint32_t(timeout.GetDouble() * 1000.0 + 0.5);
+        }
+
+        if (isLayer[lc.channel]) {
+            error << "OPC channel " << unsigned(lc.channel) << " is used by more than one compositor layer.\n";
+            return false;
+        }
+        isLayer[lc.channel] = true;
+        isOutput[lc.output] = true;
+        result.layers.push_back(lc);
+    }
+
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        if (isLayer[c] && isOutput[c]) {
+            error << "OPC channel " << c << " can't be both a compositor layer and an output.\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Compositor::setConfiguration(const Config &config)
+{
+    /*
+     * Group the layers by output, bottom first. The new layer list is built
+     * before we take the lock; only the frames we keep are moved under it.
+     */
+
+    std::vector<Layer> layers(config.layers.size());
+    std::vector<Output> outputs;
+    int outputIndex[NUM_CHANNELS];
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        outputIndex[c] = -1;
+    }
+
+    for (unsigned i = 0; i < layers.size(); i++) {
+        const LayerConfig &lc = config.layers[i];
+        layers[i].config = lc;
+        layers[i].active = false;
+        layers[i].updated = 0;
+
+        if (outputIndex[lc.output] < 0) {
+            outputIndex[lc.output] = outputs.size();
+            outputs.push_back(Output());
+            outputs.back().channel = lc.output;
+            outputs.back().dirtyFrom = 0;
+            outputs.back().length = 0;
+        }
+        outputs[outputIndex[lc.output]].layers.push_back(i);
+    }
+
+    for (unsigned o = 0; o < outputs.size(); o++) {
+        std::vector<unsigned> &order = outputs[o].layers;
+        std::stable_sort(order.begin(), order.end(), LayerPriorityLess(config.layers));
+        for (unsigned k = 0; k < order.size(); k++) {
+            layers[order[k]].position = k;
+        }
+    }
+
+    mLock.lock();
+
+    for (unsigned i = 0; i < layers.size(); i++) {
+        int old = mLayerIndex[layers[i].config.channel];
+        if (old >= 0) {
+            layers[i].pixels.swap(mLayers[old].pixels);
+            layers[i].active = mLayers[old].active;
+            layers[i].updated = mLayers[old].updated;
+        }
+    }
+
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        mLayerIndex[c] = -1;
+    }
+    for (unsigned i = 0; i < layers.size(); i++) {
+        mLayerIndex[layers[i].config.channel] = i;
+    }
+
+    mLayers.swap(layers);
+    mOutputs.swap(outputs);
+    mTickMicros = config.tickMicros;
+
+    mLock.unlock();
+    mWake.signal();
+}
+
+bool Compositor::start()
+{
+    if (!mWake.init()) {
+        std::clog << "Can't create compositor wakeup event\n";
+        return false;
+    }
+
+    // Forget wakeups from before the descriptors existed. The thread starts with a tick anyway.
+    mWake.clear();
+
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+bool Compositor::update(const OPC::Message &msg)
+{
+    if (!OPC::pixelBytes(msg.command)) {
+        return false;
+    }
+
+    mLock.lock();
+
+    int index = mLayerIndex[msg.channel];
+    if (index < 0) {
+        mLock.unlock();
+        return false;
+    }
+
+    Layer &layer = mLayers[index];
+    if (msg.command == OPC::SetPixelColors16) {
+        // Layers blend in 8 bits
+        layer.pixels.resize(msg.length() / 2);
+        for (unsigned i = 0; i < layer.pixels.size(); i++) {
+            layer.pixels[i] = OPC::to8Bit((unsigned(msg.data[i * 2]) << 8) | msg.data[i * 2 + 1]);
+        }
+    } else {
+        layer.pixels.assign(msg.data, msg.data + msg.length());
+    }
+    layer.active = true;
+    layer.updated = Monotonic::micros();
+    markDirty(layer);
+
+    mLock.unlock();
+    mWake.signal();
+    return true;
+}
+
+void Compositor::markDirty(const Layer &layer)
+{
+    for (unsigned o = 0; o < mOutputs.size(); o++) {
+        Output &output = mOutputs[o];
+        if (output.channel == layer.config.output) {
+            output.dirtyFrom = std::min(output.dirtyFrom, layer.position);
+            return;
+        }
+    }
+}
+
+void Compositor::threadFunc(void *arg)
+{
+    Compositor *self = (Compositor*) arg;
+    std::vector<uint8_t> ready;
+
+    for (;;) {
+        uint64_t now = Monotonic::micros();
+
+        ready.clear();
+        self->mLock.lock();
+        int64_t wait = self->tick(now, ready);
+        self->mLock.unlock();
+
+        if (!ready.empty()) {
+            self->mBlendMicros.add(Monotonic::micros() - now);
+        }
+        for (unsigned i = 0; i < ready.size(); i++) {
+            self->mOutputCallback(*self->mSend[ready[i]], self->mUserContext);
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(self->mWake.fd(), &fds);
+
+        struct timeval timeout;
+        timeout.tv_sec = long(wait / 1000000);
+        timeout.tv_usec = long(wait % 1000000);
+
+        self->mLoop.wait();
+        int result = select(int(self->mWake.fd()) + 1, &fds, 0, 0, wait < 0 ? 0 : &timeout);
+        self->mLoop.resume();
+
+        if (result > 0) {
+            self->mWake.clear();
+        }
+    }
+}
+
+int64_t Compositor::tick(uint64_t now, std::vector<uint8_t> &ready)
+{
+    /*
+     * Caller holds mLock. Composites every changed output, unless the last
+     * output tick was too recent. Returns how many microseconds to wait
+     * before calling again, or -1 to wait for the next update.
+     */
+
+    int64_t wait = -1;
+
+    // Layers that stop sending reveal the layers below them
+    for (unsigned i = 0; i < mLayers.size(); i++) {
+        Layer &layer = mLayers[i];
+        if (layer.active && layer.config.timeoutMicros) {
+            int64_t remaining = int64_t(layer.updated + layer.config.timeoutMicros - now);
+            if (remaining <= 0) {
+                layer.active = false;
+                markDirty(layer);
+            } else if (wait < 0 || remaining < wait) {
+                wait = remaining;
+            }
+        }
+    }
+
+    bool dirty = false;
+    for (unsigned o = 0; o < mOutputs.size(); o++) {
+        dirty = dirty || mOutputs[o].dirtyFrom < mOutputs[o].layers.size();
+    }
+    if (!dirty) {
+        return wait;
+    }
+
+    int64_t untilTick = int64_t(mLastComposite + mTickMicros - now);
+    if (mLastComposite && untilTick > 0) {
+        return (wait < 0 || untilTick < wait) ? untilTick : wait;
+    }
+    mLastComposite = now;
+
+    for (unsigned o = 0; o < mOutputs.size(); o++) {
+        Output &output = mOutputs[o];
+        if (output.dirtyFrom >= output.layers.size()) {
+            continue;
+        }
+
+        composite(output);
+        if (!output.length) {
+            continue;
+        }
+
+        OPC::Message *&msg = mSend[output.channel];
+        if (!msg) {
+            msg = new OPC::Message;
+        }
+        msg->channel = output.channel;
+        msg->command = OPC::SetPixelColors;
+        msg->setLength(output.length);
+        memcpy(msg->data, &mLayers[output.layers.back()].composite[0], output.length);
+
+        mComposites[output.channel].add();
+        ready.push_back(output.channel);
+    }
+
+    return wait;
+}
+
+void Compositor::composite(Output &output)
+{
+    /*
+     * Each layer keeps the composite of itself over everything below it, so
+     * we start from the cached result just below the lowest changed layer.
+     * Outputs are as long as the longest frame any of their layers has sent;
+     * an expired layer still reserves its length, so it fades to what's below
+     * rather than leaving its last frame on the LEDs.
+     */
+
+    unsigned length = 0;
+    for (unsigned k = 0; k < output.layers.size(); k++) {
+        length = std::max<unsigned>(length, mLayers[output.layers[k]].pixels.size());
+    }
+    if (length != output.length) {
+        output.length = length;
+        output.dirtyFrom = 0;
+    }
+
+    for (unsigned k = output.dirtyFrom; k < output.layers.size(); k++) {
+        Layer &layer = mLayers[output.layers[k]];
+        layer.composite.resize(length);
+        if (!length) {
+            continue;
+        }
+
+        if (k == 0) {
+            memset(&layer.composite[0], 0, length);
+        } else {
+            memcpy(&layer.composite[0], &mLayers[output.layers[k - 1]].composite[0], length);
+        }
+
+        if (layer.active && layer.config.alpha && !layer.pixels.empty()) {
+            blend(layer.config.blend, &layer.composite[0], &layer.pixels[0],
+                std::min<unsigned>(length, layer.pixels.size()), layer.config.alpha);
+            mLayerBlends.add();
+        }
+    }
+
+    output.dirtyFrom = output.layers.size();
+}
+
+void Compositor::writeMetrics(MetricsWriter &metrics)
+{
+    if (!mThread) {
+        return;
+    }
+
+    for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+        uint64_t composites = mComposites[channel].value();
+        if (composites) {
+            MetricsWriter::Labels labels;
+            labels.add("channel", channel);
+            metrics.counter("fcserver_composites_total",
+                "Composited frames sent to devices, by output channel", labels, composites);
+        }
+    }
+
+    metrics.counter("fcserver_layer_blends_total",
+        "Layers blended into composited frames", MetricsWriter::Labels(), mLayerBlends.value());
+    metrics.counter("fcserver_composite_seconds_total",
+        "Time spent compositing layers", MetricsWriter::Labels(), mBlendMicros.value() * 1e-6);
+    metrics.loop("compositor", mLoop);
+}
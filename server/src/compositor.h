@@ -0,0 +1,137 @@
+/*
+ * Compositor for layered Open Pixel Control sources
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "wakeevent.h"
+#include "opc.h"
+#include "metrics.h"
+
+
+/*
+ * Blends several OPC channels, each fed by its own client, into one output
+ * channel that devices map as usual. Every layer has a priority, an opacity
+ * and a blend mode. An ambient generator can run on one layer while an alert
+ * source takes over from a higher one, and fades away when it stops sending.
+ *
+ * Layers are copied in as messages arrive, from any thread. A separate thread
+ * composites changed outputs at most once per output tick, and hands each
+ * result to the output callback. The composite below each layer is cached, so
+ * only layers at or above the lowest change are blended again.
+ */
+class Compositor
+{
+public:
+    typedef rapidjson::Value Value;
+
+    enum BlendMode {
+        BLEND_NORMAL,
+        BLEND_ADD,
+        BLEND_MULTIPLY,
+        BLEND_MAX
+    };
+
+    struct LayerConfig {
+        uint8_t channel;
+        uint8_t output;
+        int priority;
+        unsigned alpha;         // Opacity, 0 to 256
+        BlendMode blend;
+        uint32_t timeoutMicros; // Zero to keep the last frame forever
+    };
+
+    struct Config {
+        Config() : tickMicros(0) {}
+
+        uint32_t tickMicros;
+        std::vector<LayerConfig> layers;
+    };
+
+    Compositor(OPC::callback_t outputCallback, void *context);
+
+    // Validate a 'compositor' configuration value. Null means no layers.
+    static bool parseConfiguration(const Value &config, Config &result, std::ostream &error);
+
+    // Replace the layers. Frames already received on channels that are still layers are kept.
+    void setConfiguration(const Config &config);
+
+    bool start();
+
+    // Store the message if its channel is a layer. Returns false if it should be mapped as usual.
+    bool update(const OPC::Message &msg);
+
+    // Add our counters to a metrics scrape, from any thread
+    void writeMetrics(MetricsWriter &metrics);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+    static const uint32_t DEFAULT_FPS = 120;
+
+    struct Layer {
+        LayerConfig config;
+        unsigned position;              // Index within its output, bottom first
+        bool active;
+        uint64_t updated;
+        std::vector<uint8_t> pixels;    // Data from the last message
+        std::vector<uint8_t> composite; // Output after blending this layer over the ones below
+    };
+
+    struct Output {
+        uint8_t channel;
+        std::vector<unsigned> layers;   // Indices into mLayers, bottom first
+        unsigned dirtyFrom;             // Lowest layer that needs blending again
+        unsigned length;
+    };
+
+    OPC::callback_t mOutputCallback;
+    void *mUserContext;
+    tthread::thread *mThread;
+    WakeEvent mWake;
+
+    // Protects everything below, up to the counters
+    tthread::mutex mLock;
+    uint32_t mTickMicros;
+    std::vector<Layer> mLayers;
+    std::vector<Output> mOutputs;
+    int16_t mLayerIndex[NUM_CHANNELS];
+    uint64_t mLastComposite;
+
+    // Compositor thread only
+    OPC::Message *mSend[NUM_CHANNELS];
+
+    // Counters, written only by the compositor thread
+    MetricLoop mLoop;
+    MetricCounter mComposites[NUM_CHANNELS];
+    MetricCounter mLayerBlends;
+    MetricCounter mBlendMicros;
+
+    static void threadFunc(void *arg);
+    int64_t tick(uint64_t now, std::vector<uint8_t> &ready);
+    void composite(Output &output);
+    void markDirty(const Layer &layer);
+};
@@ -0,0 +1,169 @@
+/*
+ * Streaming ACN (ANSI E1.31) output device
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "e131device.h"
+#include <string.h>
+
+const char* E131Device::DEVICE_TYPE = "e131";
+
+// Layer vectors
+static const uint32_t kVectorRootData = 0x00000004;
+static const uint32_t kVectorRootExtended = 0x00000008;
+static const uint32_t kVectorFramingData = 0x00000002;
+static const uint32_t kVectorFramingSync = 0x00000001;
+static const uint8_t kVectorDMPSetProperty = 0x02;
+
+// Byte offsets within a data packet
+static const unsigned kSyncAddressOffset = 109;
+static const unsigned kSequenceOffset = 111;
+
+E131Device::E131Device(bool verbose)
+    : NetDevice(DEVICE_TYPE, verbose),
+      mPriority(100)
+{
+    memset(mCID, 0, sizeof mCID);
+}
+
+int E131Device::open(const Value &config)
+{
+    const Value &vpriority = config["priority"];
+
+    if (vpriority.IsUint() && vpriority.GetUint() <= 200) {
+        mPriority = vpriority.GetUint();
+    } else if (!vpriority.IsNull()) {
+        return -1;
+    }
+
+    int r = NetDevice::open(config);
+    if (r < 0) {
+        return r;
+    }
+
+    /*
+     * Receivers track sources by CID, so it should stay the same across server
+     * restarts. Derive a version 4 style UUID from the configured destination
+     * rather than picking a random one each time.
+     */
+
+    std::string key = getName();
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < CID_LENGTH; i++) {
+        for (unsigned j = 0; j < key.size(); j++) {
+            hash = (hash ^ uint8_t(key[j])) * 16777619u;
+        }
+        hash = (hash ^ i) * 16777619u;
+        mCID[i] = uint8_t(hash >> 24);
+    }
+    mCID[6] = (mCID[6] & 0x0F) | 0x40;
+    mCID[8] = (mCID[8] & 0x3F) | 0x80;
+
+    return 0;
+}
+
+bool E131Device::defaultDestination(sockaddr_in &addr, unsigned universe)
+{
+    // Each universe has its own multicast group, 239.255.<universe hi>.<universe lo>
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0xEFFF0000 | (universe & 0xFFFF));
+    return true;
+}
+
+void E131Device::put16(uint8_t *p, uint16_t value)
+{
+    p[0] = uint8_t(value >> 8);
+    p[1] = uint8_t(value);
+}
+
+void E131Device::put32(uint8_t *p, uint32_t value)
+{
+    put16(p, uint16_t(value >> 16));
+    put16(p + 2, uint16_t(value));
+}
+
+void E131Device::putFlagsAndLength(uint8_t *p, unsigned length)
+{
+    // Each PDU length counts from its own flags field to the end of the packet
+    put16(p, uint16_t(0x7000 | (length & 0x0FFF)));
+}
+
+void E131Device::formatRootLayer(uint8_t *packet, unsigned length, uint32_t vector)
+{
+    put16(packet, 0x0010);                          // Preamble size
+    put16(packet + 2, 0x0000);                      // Postamble size
+    memcpy(packet + 4, "ASC-E1.17\0\0\0", 12);      // ACN packet identifier
+    putFlagsAndLength(packet + 16, length - 16);
+    put32(packet + 18, vector);
+    memcpy(packet + 22, mCID, CID_LENGTH);
+}
+
+void E131Device::formatHeader(uint8_t *header, unsigned universe)
+{
+    const unsigned length = HEADER_LENGTH + CHANNELS_PER_UNIVERSE;
+
+    formatRootLayer(header, length, kVectorRootData);
+
+    // Framing layer
+    putFlagsAndLength(header + 38, length - 38);
+    put32(header + 40, kVectorFramingData);
+    memset(header + 44, 0, SOURCE_NAME_LENGTH);
+    strcpy((char*) header + 44, "Fadecandy fcserver");
+    header[108] = uint8_t(mPriority);
+    put16(header + kSyncAddressOffset, mSync ? mSyncUniverse : 0);
+    header[kSequenceOffset] = 0;
+    header[112] = 0;                                // Options
+    put16(header + 113, universe);
+
+    // DMP layer
+    putFlagsAndLength(header + 115, length - 115);
+    header[117] = kVectorDMPSetProperty;
+    header[118] = 0xa1;                             // Address type and data type
+    put16(header + 119, 0x0000);                    // First property address
+    put16(header + 121, 0x0001);                    // Address increment
+    put16(header + 123, CHANNELS_PER_UNIVERSE + 1); // Property value count, including the start code
+    header[125] = 0;                                // DMX start code
+}
+
+void E131Device::setSequence(uint8_t *header, uint8_t sequence)
+{
+    header[kSequenceOffset] = sequence;
+}
+
+unsigned E131Device::formatSync(uint8_t *packet, uint8_t sequence)
+{
+    formatRootLayer(packet, SYNC_LENGTH, kVectorRootExtended);
+
+    putFlagsAndLength(packet + 38, SYNC_LENGTH - 38);
+    put32(packet + 40, kVectorFramingSync);
+    packet[44] = sequence;
+    put16(packet + 45, mSyncUniverse);
+    put16(packet + 47, 0);                          // Reserved
+
+    return SYNC_LENGTH;
+}
+
+void E131Device::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    NetDevice::describe(object, alloc);
+    object.AddMember("priority", mPriority, alloc);
+}
@@ -0,0 +1,61 @@
+/*
+ * Streaming ACN (ANSI E1.31) output device
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "netdevice.h"
+
+
+class E131Device : public NetDevice
+{
+public:
+    E131Device(bool verbose);
+
+    virtual int open(const Value &config);
+    virtual void describe(rapidjson::Value &object, Allocator &alloc);
+
+    static const char* DEVICE_TYPE;
+
+protected:
+    virtual unsigned defaultPort() { return 5568; }
+    virtual unsigned minUniverse() { return 1; }
+    virtual unsigned maxUniverse() { return 63999; }
+    virtual bool defaultDestination(sockaddr_in &addr, unsigned universe);
+    virtual unsigned headerLength() { return HEADER_LENGTH; }
+    virtual void formatHeader(uint8_t *header, unsigned universe);
+    virtual void setSequence(uint8_t *header, uint8_t sequence);
+    virtual unsigned formatSync(uint8_t *packet, uint8_t sequence);
+
+private:
+    static const unsigned HEADER_LENGTH = 126;     // Root, framing, and DMP layers, plus the start code
+    static const unsigned SYNC_LENGTH = 49;
+    static const unsigned CID_LENGTH = 16;
+    static const unsigned SOURCE_NAME_LENGTH = 64;
+
+    uint8_t mCID[CID_LENGTH];
+    unsigned mPriority;
+
+    void formatRootLayer(uint8_t *packet, unsigned length, uint32_t vector);
+    static void put16(uint8_t *p, uint16_t value);
+    static void put32(uint8_t *p, uint32_t value);
+    static void putFlagsAndLength(uint8_t *p, unsigned length);
+};
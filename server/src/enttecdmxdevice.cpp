@@ -25,16 +25,14 @@
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "opc.h"
+#include "monotonic.h"
 #include <sstream>
 #include <iostream>
 
 
-EnttecDMXDevice::Transfer::Transfer(EnttecDMXDevice *device, void *buffer, int length)
-    : transfer(libusb_alloc_transfer(0)), finished(false)
-{
-    libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, (uint8_t*) buffer, length, EnttecDMXDevice::completeTransfer, this, 2000);
-}
+EnttecDMXDevice::Transfer::Transfer()
+    : transfer(libusb_alloc_transfer(0)), finished(false), orphaned(false)
+{}
 
 EnttecDMXDevice::Transfer::~Transfer()
 {
@@ -44,10 +42,16 @@ EnttecDMXDevice::Transfer::~Transfer()
 EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
     : USBDevice(device, "enttec", verbose),
       mFoundEnttecStrings(false),
-      mConfigMap(0)
+      mPreparedConfig(0),
+      mMinInterval(1000000 / DEFAULT_REFRESH_RATE),
+      mKeepaliveInterval(DEFAULT_KEEPALIVE_MS * 1000),
+      mLastSendTime(0),
+      mSendWaiting(false),
+      mForceSend(false)
 {
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
+    memset(&mStats, 0, sizeof mStats);
 
     // Initialize a minimal valid DMX packet
     memset(&mChannelBuffer, 0, sizeof mChannelBuffer);
@@ -55,18 +59,40 @@ EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
     mChannelBuffer.label = SEND_DMX_PACKET;
     mChannelBuffer.data[0] = START_CODE;
     setChannel(1, 0);
+
+    // Nothing has been sent yet
+    memset(&mLastSent, 0, sizeof mLastSent);
+
+    // If allocation fails, we make do with a smaller pool
+    for (unsigned i = 0; i < NUM_TRANSFERS; ++i) {
+        Transfer *fct = new Transfer();
+        if (fct->transfer) {
+            mFreeTransfers.push_back(fct);
+        } else {
+            delete fct;
+        }
+    }
 }
 
 EnttecDMXDevice::~EnttecDMXDevice()
 {
     /*
-     * If we have pending transfers, cancel them.
-     * The Transfer objects themselves will be freed once libusb completes them.
+     * If we have pending transfers, cancel them. Those Transfer objects are
+     * orphaned, and they'll be freed once libusb completes them.
      */
 
     for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
         Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
+        if (fct->finished) {
+            delete fct;
+        } else {
+            fct->orphaned = true;
+            libusb_cancel_transfer(fct->transfer);
+        }
+    }
+
+    for (std::vector<Transfer*>::iterator i = mFreeTransfers.begin(), e = mFreeTransfers.end(); i != e; ++i) {
+        delete *i;
     }
 }
 
@@ -156,7 +182,75 @@ bool EnttecDMXDevice::probeAfterOpening()
 
 void EnttecDMXDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    if (mPreparedConfig == &config) {
+        mMap.swap(mPreparedMap);
+        mPreparedConfig = 0;
+    } else {
+        compileMap(mMap, config);
+    }
+
+    /*
+     * Optional timing settings. The refresh rate is an upper limit on DMX packets
+     * per second; zero means no limit. The keepalive is how long, in seconds, we'll
+     * go without resending unchanged data; zero disables the keepalive.
+     */
+
+    const Value &vRefreshRate = config["refreshRate"];
+    const Value &vKeepalive = config["keepalive"];
+
+    if (vRefreshRate.IsNumber() && vRefreshRate.GetDouble() >= 0) {
+        double rate = vRefreshRate.GetDouble();
+        mMinInterval = rate > 0 ? uint64_t(1e6 / rate) : 0;
+    } else if (!vRefreshRate.IsNull() && mVerbose) {
+        std::clog << "Enttec 'refreshRate' must be a non-negative number.\n";
+    }
+
+    if (vKeepalive.IsNumber() && vKeepalive.GetDouble() >= 0) {
+        mKeepaliveInterval = uint64_t(vKeepalive.GetDouble() * 1e6);
+    } else if (!vKeepalive.IsNull() && mVerbose) {
+        std::clog << "Enttec 'keepalive' must be a non-negative number of seconds.\n";
+    }
+
+    /*
+     * Constant channels don't wait for OPC data. Send them now, and the keepalive
+     * keeps them refreshed, even if no OPC message ever reaches this device.
+     */
+
+    bool constants = false;
+    for (std::vector<MapEntry>::const_iterator i = mMap.begin(), e = mMap.end(); i != e; ++i) {
+        if (i->opcChannel < 0) {
+            setChannel(i->dmxChannel, i->value);
+            constants = true;
+        }
+    }
+    if (constants) {
+        updateDMXPacket();
+    }
+}
+
+void EnttecDMXDevice::prepareConfiguration(const Value &config)
+{
+    compileMap(mPreparedMap, config);
+    mPreparedConfig = &config;
+}
+
+void EnttecDMXDevice::compileMap(std::vector<MapEntry> &map, const Value &config)
+{
+    map.clear();
+
+    const Value *vmap = findConfigMap(config);
+    if (vmap) {
+        for (unsigned i = 0, e = vmap->Size(); i != e; i++) {
+            const Value &inst = (*vmap)[i];
+
+            if (!compileMapInstruction(map, inst) && mVerbose) {
+                rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+                rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+                inst.Accept(writer);
+                std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+            }
+        }
+    }
 }
 
 std::string EnttecDMXDevice::getName()
@@ -179,11 +273,10 @@ void EnttecDMXDevice::setChannel(unsigned n, uint8_t value)
     }
 }
 
-void EnttecDMXDevice::submitTransfer(Transfer *fct)
+bool EnttecDMXDevice::submitTransfer(Transfer *fct)
 {
     /*
-     * Submit a new USB transfer. The Transfer object is guaranteed to be freed eventually.
-     * On error, it's freed right away.
+     * Submit a pooled USB transfer. On error, it goes right back to the pool.
      */
 
     int r = libusb_submit_transfer(fct->transfer);
@@ -192,21 +285,29 @@ void EnttecDMXDevice::submitTransfer(Transfer *fct)
         if (mVerbose && r != LIBUSB_ERROR_PIPE) {
             std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
         }
-        delete fct;
-    } else {
-        mPending.insert(fct);
+        mTransferStats.errors++;
+        mFreeTransfers.push_back(fct);
+        return false;
     }
+
+    mTransferStats.submitted++;
+    mPending.insert(fct);
+    return true;
 }
 
 void EnttecDMXDevice::completeTransfer(struct libusb_transfer *transfer)
 {
     EnttecDMXDevice::Transfer *fct = static_cast<EnttecDMXDevice::Transfer*>(transfer->user_data);
-    fct->finished = true;
+    if (fct->orphaned) {
+        delete fct;
+    } else {
+        fct->finished = true;
+    }
 }
 
 void EnttecDMXDevice::flush()
 {
-    // Erase any finished transfers
+    // Return any finished transfers to the pool
 
     std::set<Transfer*>::iterator current = mPending.begin();
     while (current != mPending.end()) {
@@ -215,12 +316,55 @@ void EnttecDMXDevice::flush()
 
         Transfer *fct = *current;
         if (fct->finished) {
+            mTransferStats.completed++;
+            if (fct->transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                mTransferStats.errors++;
+            }
+            fct->finished = false;
             mPending.erase(current);
-            delete fct;
+            mFreeTransfers.push_back(fct);
         }
 
         current = next;
     }
+
+    // Send a packet we held back earlier, or a keepalive if it's been a while.
+
+    uint64_t now = Monotonic::micros();
+    uint64_t elapsed = now - mLastSendTime;
+
+    if (mSendWaiting) {
+        if (elapsed >= mMinInterval) {
+            writeDMXPacket();
+        }
+    } else if (mKeepaliveInterval && mLastSendTime && elapsed >= mKeepaliveInterval) {
+        mStats.keepalives++;
+        mForceSend = true;
+        writeDMXPacket();
+    }
+}
+
+uint64_t EnttecDMXDevice::flushDeadline()
+{
+    /*
+     * Wake up when the refresh rate limit next allows a packet, so a held-back
+     * update goes out on time. If it's waiting on a transfer instead, the
+     * transfer's completion wakes the main loop, so there's no deadline.
+     * After that, only the keepalive needs a wakeup.
+     */
+
+    if (mSendWaiting && mFreeTransfers.empty()) {
+        return 0;
+    }
+
+    uint64_t nextAllowed = mLastSendTime + mMinInterval;
+    if (mSendWaiting || nextAllowed > Monotonic::micros()) {
+        return nextAllowed;
+    }
+    if (mKeepaliveInterval && mLastSendTime) {
+        return mLastSendTime + mKeepaliveInterval;
+    }
+    return 0;
 }
 
 void EnttecDMXDevice::writeDMXPacket()
@@ -229,11 +373,43 @@ void EnttecDMXDevice::writeDMXPacket()
      * Asynchronously write an FTDI packet containing an Enttec packet containing
      * our set of DMX channels.
      *
-     * XXX: We should probably throttle this so that we don't send DMX messages
-     *      faster than the Enttec device can keep up!
+     * Every OPC channel mapped to this device updates the same channel buffer, and
+     * we only send it when it differs from the last packet we sent. If the refresh
+     * rate limit or the transfer pool won't let us send right now, we note that a
+     * packet is owed and flush() sends the latest channel data once it can.
+     * A keepalive sets mForceSend, so unchanged data goes out anyway.
      */
 
-    submitTransfer(new Transfer(this, &mChannelBuffer, mChannelBuffer.length + 5));
+    unsigned length = mChannelBuffer.length + 5;
+
+    if (!mForceSend && !memcmp(&mChannelBuffer, &mLastSent, length)) {
+        mStats.skippedUnchanged++;
+        mSendWaiting = false;
+        return;
+    }
+
+    uint64_t now = Monotonic::micros();
+
+    if (now - mLastSendTime < mMinInterval || mFreeTransfers.empty()) {
+        mSendWaiting = true;
+        return;
+    }
+
+    Transfer *fct = mFreeTransfers.back();
+    mFreeTransfers.pop_back();
+
+    memcpy(&fct->packet, &mChannelBuffer, length);
+    libusb_fill_bulk_transfer(fct->transfer, mHandle, OUT_ENDPOINT,
+        (uint8_t*) &fct->packet, length, EnttecDMXDevice::completeTransfer, fct, 2000);
+
+    if (submitTransfer(fct)) {
+        memcpy(&mLastSent, &mChannelBuffer, sizeof mLastSent);
+        mLastSendTime = now;
+        mSendWaiting = false;
+        mForceSend = false;
+        mStats.sent++;
+        mTransferStats.frames++;
+    }
 }
 
 void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
@@ -245,8 +421,11 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
     switch (msg.command) {
 
         case OPC::SetPixelColors:
-            opcSetPixelColors(msg);
-            writeDMXPacket();
+        case OPC::SetPixelColors16:
+            if (opcSetPixelColors(msg)) {
+                mStats.messages++;
+                updateDMXPacket();
+            }
             return;
 
         case OPC::SystemExclusive:
@@ -259,38 +438,85 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
     }
 }
 
-void EnttecDMXDevice::opcSetPixelColors(const OPC::Message &msg)
+void EnttecDMXDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    // Every part updates the same universe, so it's sent (or coalesced) once
+    bool updated = false;
+    for (unsigned i = 0; i < count; i++) {
+        if (opcSetPixelColors(*parts[i])) {
+            mStats.messages++;
+            updated = true;
+        }
+    }
+    if (updated) {
+        updateDMXPacket();
+    }
+}
+
+void EnttecDMXDevice::updateDMXPacket()
+{
+    // New channel data replaces any update that's still waiting to be sent
+    if (mSendWaiting) {
+        mStats.coalesced++;
+    }
+    writeDMXPacket();
+}
+
+bool EnttecDMXDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through our device's compiled mapping, and store any relevant portions
+     * of 'msg' in the channel buffer. If there's no mapping, this device is inactive.
+     * DMX channels are 8-bit, so 16-bit color is rounded.
+     *
+     * Returns true if any of our channels came from 'msg'.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
+    unsigned msgLength = msg.length();
+    bool wide = msg.command == OPC::SetPixelColors16;
+    bool used = false;
+
+    for (std::vector<MapEntry>::const_iterator i = mMap.begin(), e = mMap.end(); i != e; ++i) {
+        if (i->opcChannel < 0) {
+            setChannel(i->dmxChannel, i->value);
 
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
+        } else if (i->opcChannel == msg.channel && !wide && i->byteOffset + 3 <= msgLength) {
+            uint8_t value;
+            OPC::pickColorChannel(value, i->pixelColor, msg.data + i->byteOffset);
+            setChannel(i->dmxChannel, value);
+            used = true;
+
+        } else if (i->opcChannel == msg.channel && wide && i->byteOffset * 2 + 6 <= msgLength) {
+            const uint8_t *in = msg.data + i->byteOffset * 2;
+            uint8_t rgb[3], value;
+            for (unsigned c = 0; c < 3; c++) {
+                rgb[c] = OPC::to8Bit((unsigned(in[c * 2]) << 8) | in[c * 2 + 1]);
+            }
+            OPC::pickColorChannel(value, i->pixelColor, rgb);
+            setChannel(i->dmxChannel, value);
+            used = true;
+        }
     }
+
+    return used;
 }
 
-void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+bool EnttecDMXDevice::compileMapInstruction(std::vector<MapEntry> &map, const Value &inst)
 {
     /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
+     * Compile one JSON mapping instruction. This looks for any mapping
+     * instructions that we recognize:
      *
      *   [ OPC Channel, OPC Pixel, Pixel Color, DMX Channel ]
+     *   [ Value, DMX Channel ]
+     *
+     * Returns false if the instruction isn't understood.
      */
 
-    unsigned msgPixelCount = msg.length() / 3;
+    MapEntry entry;
 
     if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
+        // Map a single pixel color from an OPC channel to a DMX channel
 
         const Value &vChannel = inst[0u];
         const Value &vPixelIndex = inst[1];
@@ -298,22 +524,24 @@ void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &in
         const Value &vDMXChannel = inst[3];
 
         if (vChannel.IsUint() && vPixelIndex.IsUint() && vPixelColor.IsString() && vDMXChannel.IsUint()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned pixelIndex = vPixelIndex.GetUint();
-            const char *pixelColor = vPixelColor.GetString();
-            unsigned dmxChannel = vDMXChannel.GetUint();
+            uint8_t unused;
+            const uint8_t zero[3] = { 0, 0, 0 };
 
-            if (channel != msg.channel || pixelIndex >= msgPixelCount) {
-                return;
+            if (!OPC::pickColorChannel(unused, vPixelColor.GetString()[0], zero)) {
+                return false;
             }
-
-            const uint8_t *pixel = msg.data + (pixelIndex * 3);
-            uint8_t value;
-
-            if (OPC::pickColorChannel(value, pixelColor[0], pixel)) {
-                setChannel(dmxChannel, value);
-                return;
+            if (vChannel.GetUint() > 0xFF || vPixelIndex.GetUint() >= 0xFFFF / 3) {
+                // Valid, but it can never match an OPC message
+                return true;
             }
+
+            entry.opcChannel = vChannel.GetUint();
+            entry.byteOffset = vPixelIndex.GetUint() * 3;
+            entry.pixelColor = vPixelColor.GetString()[0];
+            entry.value = 0;
+            entry.dmxChannel = vDMXChannel.GetUint();
+            map.push_back(entry);
+            return true;
         }
     }
 
@@ -324,19 +552,33 @@ void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &in
         const Value &vDMXChannel = inst[1];
 
         if (vValue.IsUint() && vDMXChannel.IsUint()) {
-            unsigned value = vValue.GetUint();
-            unsigned dmxChannel = vDMXChannel.GetUint();
-
-            setChannel(dmxChannel, value);
-            return;
+            entry.opcChannel = -1;
+            entry.byteOffset = 0;
+            entry.pixelColor = 0;
+            entry.value = vValue.GetUint();
+            entry.dmxChannel = vDMXChannel.GetUint();
+            map.push_back(entry);
+            return true;
         }
     }
 
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
-    }
+    return false;
+}
+
+void EnttecDMXDevice::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    USBDevice::describe(object, alloc);
+
+    /*
+     * Counters that show how much USB traffic the change detection and
+     * refresh rate limit are saving.
+     */
+
+    rapidjson::Value stats(rapidjson::kObjectType);
+    stats.AddMember("messages", mStats.messages, alloc);
+    stats.AddMember("sent", mStats.sent, alloc);
+    stats.AddMember("skipped_unchanged", mStats.skippedUnchanged, alloc);
+    stats.AddMember("coalesced", mStats.coalesced, alloc);
+    stats.AddMember("keepalives", mStats.keepalives, alloc);
+    object.AddMember("stats", stats, alloc);
 }
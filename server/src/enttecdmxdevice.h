@@ -25,6 +25,7 @@
 #include "usbdevice.h"
 #include "opc.h"
 #include <set>
+#include <vector>
 
 
 class EnttecDMXDevice : public USBDevice
@@ -38,11 +39,16 @@ public:
     virtual int open();
     virtual bool probeAfterOpening();
     virtual void loadConfiguration(const Value &config);
+    virtual void prepareConfiguration(const Value &config);
     virtual void writeMessage(const OPC::Message &msg);
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
     virtual std::string getName();
     virtual void flush();
+    virtual uint64_t flushDeadline();
+    virtual void describe(rapidjson::Value &object, Allocator &alloc);
 
     void writeDMXPacket();
+    void updateDMXPacket();
     void setChannel(unsigned n, uint8_t value);
 
 private:
@@ -51,6 +57,11 @@ private:
     static const unsigned END_OF_MESSAGE = 0xe7;
     static const unsigned SEND_DMX_PACKET = 0x06;
     static const unsigned START_CODE = 0x00;
+    static const unsigned NUM_TRANSFERS = 4;
+
+    // Defaults for the refresh rate limit and the unchanged-data keepalive
+    static const unsigned DEFAULT_REFRESH_RATE = 44;
+    static const unsigned DEFAULT_KEEPALIVE_MS = 1000;
 
     struct Packet {
         uint8_t start;
@@ -59,22 +70,57 @@ private:
         uint8_t data[514];
     };
 
+    // Transfers are allocated once, and each owns a copy of the packet it's sending.
     struct Transfer {
-        Transfer(EnttecDMXDevice *device, void *buffer, int length);
+        Transfer();
         ~Transfer();
         libusb_transfer *transfer;
+        Packet packet;
         bool finished;
+        bool orphaned;
+    };
+
+    // Compiled mapping instruction
+    struct MapEntry {
+        int opcChannel;             // Negative for a constant value
+        unsigned byteOffset;        // Offset of the pixel within the OPC message
+        char pixelColor;
+        uint8_t value;              // Constant value, if opcChannel is negative
+        unsigned dmxChannel;
+    };
+
+    struct Stats {
+        uint64_t messages;          // OPC messages that updated our channels
+        uint64_t sent;              // DMX packets submitted
+        uint64_t skippedUnchanged;  // Sends avoided because channel data didn't change
+        uint64_t coalesced;         // Held-back updates replaced by newer data before they were sent
+        uint64_t keepalives;        // Sends of unchanged data, to keep the output refreshed
     };
 
     char mSerialBuffer[256];
     bool mFoundEnttecStrings;
-    const Value *mConfigMap;
+    std::vector<MapEntry> mMap;
     Packet mChannelBuffer;
+
+    // Map compiled by prepareConfiguration(), and the entry it came from
+    std::vector<MapEntry> mPreparedMap;
+    const Value *mPreparedConfig;
+
+    Packet mLastSent;
+    std::vector<Transfer*> mFreeTransfers;
     std::set<Transfer*> mPending;
 
-    void submitTransfer(Transfer *fct);
+    uint64_t mMinInterval;          // Microseconds between packets, from the refresh rate
+    uint64_t mKeepaliveInterval;    // Microseconds before we resend unchanged data
+    uint64_t mLastSendTime;
+    bool mSendWaiting;
+    bool mForceSend;                // Send even if the data is unchanged, for the keepalive
+    Stats mStats;
+
+    bool submitTransfer(Transfer *fct);
     static LIBUSB_CALL void completeTransfer(struct libusb_transfer *transfer);
 
-    void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    bool opcSetPixelColors(const OPC::Message &msg);
+    void compileMap(std::vector<MapEntry> &map, const Value &config);
+    bool compileMapInstruction(std::vector<MapEntry> &map, const Value &inst);
 };
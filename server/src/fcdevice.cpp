@@ -22,9 +22,8 @@
  */
 
 #include "fcdevice.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
 #include "opc.h"
+#include "jsonmessagereader.h"
 #include <math.h>
 #include <iostream>
 #include <sstream>
@@ -56,22 +55,25 @@ FCDevice::Transfer::~Transfer()
     #endif
 }
 
-FCDevice::FCDevice(libusb_device *device, bool verbose)
-    : USBDevice(device, "fadecandy", verbose),
-      mConfigMap(0), mNumFramesPending(0), mFrameWaitingForSubmit(false)
+FCDevice::FCDevice(libusb_device *device, bool verbose, const char *type)
+    : USBDevice(device, type, verbose),
+      mPreparedConfig(0), mNumFramesPending(0), mFrameWaitingForSubmit(false), mHighPrecision(false)
 {
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
+    memset(&mDD, 0, sizeof mDD);
 
     memset(&mFirmwareConfig, 0, sizeof mFirmwareConfig);
     mFirmwareConfig.control = TYPE_CONFIG;
 
-    // Framebuffer headers
+    // Framebuffer headers, for both planes
     memset(mFramebuffer, 0, sizeof mFramebuffer);
     for (unsigned i = 0; i < FRAMEBUFFER_PACKETS; ++i) {
         mFramebuffer[i].control = TYPE_FRAMEBUFFER | i;
+        mFramebuffer[FRAMEBUFFER_PACKETS + i].control = TYPE_FRAMEBUFFER_LOW | i;
     }
     mFramebuffer[FRAMEBUFFER_PACKETS - 1].control |= FINAL;
+    mFramebuffer[FRAMEBUFFER_PACKETS * 2 - 1].control |= FINAL;
 
     // Color LUT headers
     memset(mColorLUT, 0, sizeof mColorLUT);
@@ -134,12 +136,41 @@ int FCDevice::open()
 
 void FCDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    if (mPreparedConfig == &config) {
+        mMap.swap(mPreparedMap);
+        mPreparedConfig = 0;
+    } else {
+        PixelMap::Layout layout;
+        mapLayout(layout);
+        mMap.load(findConfigMap(config), layout, mVerbose);
+    }
 
     // Initial firmware configuration from our device options
     writeFirmwareConfiguration(config);
 }
 
+void FCDevice::prepareConfiguration(const Value &config)
+{
+    PixelMap::Layout layout;
+    mapLayout(layout);
+    mPreparedMap.load(findConfigMap(config), layout, mVerbose);
+    mPreparedConfig = &config;
+}
+
+void FCDevice::mapLayout(PixelMap::Layout &layout)
+{
+    // Keep the low byte plane up to date whenever the firmware could use it
+    layout.base = mFramebuffer[0].data;
+    layout.lowBase = mDD.bcdDevice >= FIRMWARE_VERSION_16BIT ? mFramebuffer[FRAMEBUFFER_PACKETS].data : 0;
+    layout.numPixels = NUM_PIXELS;
+    layout.pixelsPerBlock = PIXELS_PER_PACKET;
+    layout.blockStride = sizeof(Packet);
+    layout.pixelStride = 3;
+    layout.colorOffsets[0] = 0;
+    layout.colorOffsets[1] = 1;
+    layout.colorOffsets[2] = 2;
+}
+
 void FCDevice::writeFirmwareConfiguration(const Value &config)
 {
     /*
@@ -155,6 +186,7 @@ void FCDevice::writeFirmwareConfiguration(const Value &config)
     const Value &led = config["led"];
     const Value &dither = config["dither"];
     const Value &interpolate = config["interpolate"];
+    const Value &highPrecision = config["highPrecision"];
 
     if (!(led.IsTrue() || led.IsFalse() || led.IsNull())) {
         std::clog << "LED configuration must be true (always on), false (always off), or null (default).\n";
@@ -164,7 +196,8 @@ void FCDevice::writeFirmwareConfiguration(const Value &config)
         (led.IsNull() ? 0 : CFLAG_NO_ACTIVITY_LED)             |
         (led.IsTrue() ? CFLAG_LED_CONTROL : 0)                 |
         (dither.IsFalse() ? CFLAG_NO_DITHERING : 0)            |
-        (interpolate.IsFalse() ? CFLAG_NO_INTERPOLATION : 0)   ;
+        (interpolate.IsFalse() ? CFLAG_NO_INTERPOLATION : 0)   |
+        (highPrecision.IsTrue() ? CFLAG_16BIT_FRAMES : 0)      ;
 
     writeFirmwareConfiguration();
 }
@@ -182,10 +215,15 @@ bool FCDevice::submitTransfer(Transfer *fct)
         if (mVerbose && r != LIBUSB_ERROR_PIPE) {
             std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
         }
+        mTransferStats.errors++;
         delete fct;
         return false;
 
     } else {
+        mTransferStats.submitted++;
+        if (fct->type == FRAME) {
+            mTransferStats.frames++;
+        }
         mPending.insert(fct);
         return true;
     }
@@ -208,6 +246,11 @@ void FCDevice::flush()
 
         Transfer *fct = *current;
         if (fct->finished) {
+            mTransferStats.completed++;
+            if (fct->transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                mTransferStats.errors++;
+            }
+
             switch (fct->type) {
 
                 case FRAME:
@@ -371,11 +414,18 @@ void FCDevice::writeFramebuffer()
 
     if (mNumFramesPending >= MAX_FRAMES_PENDING) {
         // Too many outstanding frames. Wait to submit until a previous frame completes.
+        // A frame that was already waiting is replaced by this one.
+        if (mFrameWaitingForSubmit) {
+            mTransferStats.droppedFrames++;
+        }
         mFrameWaitingForSubmit = true;
         return;
     }
 
-    if (submitTransfer(new Transfer(this, &mFramebuffer, sizeof mFramebuffer, FRAME))) {
+    // In 16-bit mode the low byte plane follows, and its last packet finishes the frame
+    unsigned length = (mHighPrecision ? 2 : 1) * FRAMEBUFFER_PACKETS * sizeof(Packet);
+
+    if (submitTransfer(new Transfer(this, &mFramebuffer, length, FRAME))) {
         mFrameWaitingForSubmit = false;
         mNumFramesPending++;
     }
@@ -417,37 +467,40 @@ void FCDevice::writeMessage(Document &msg)
 void FCDevice::writeDevicePixels(Document &msg)
 {
     /*
-     * Write pixels without mapping, from a JSON integer
-     * array in msg["pixels"]. The pixel array is removed from
+     * Write pixels without mapping, from msg["pixels"]. This is normally a
+     * string of packed RGB bytes produced by JsonMessageReader, but a JSON
+     * integer array is accepted too. The pixel array is removed from
      * the reply to save network bandwidth.
      *
      * Pixel values are clamped to [0, 255], for convenience.
      */
 
-    const Value &pixels = msg["pixels"];
-    if (!pixels.IsArray()) {
+    std::vector<uint8_t> scratch;
+    unsigned length;
+    const uint8_t *rgb = JsonMessageReader::pixelBytes(msg["pixels"], scratch, length);
+
+    if (!rgb) {
         msg.AddMember("error", "Pixel array is missing", msg.GetAllocator());
     } else {
+        writeDevicePixels(rgb, length / 3);
+    }
+}
 
-        // Truncate to the framebuffer size, and only deal in whole pixels.
-        int numPixels = pixels.Size() / 3;
-        if (numPixels > NUM_PIXELS)
-            numPixels = NUM_PIXELS;
-
-        for (int i = 0; i < numPixels; i++) {
-            uint8_t *out = fbPixel(i);
-
-            const Value &r = pixels[i*3 + 0];
-            const Value &g = pixels[i*3 + 1];
-            const Value &b = pixels[i*3 + 2];
-
-            out[0] = std::max(0, std::min(255, r.IsInt() ? r.GetInt() : 0));
-            out[1] = std::max(0, std::min(255, g.IsInt() ? g.GetInt() : 0));
-            out[2] = std::max(0, std::min(255, b.IsInt() ? b.GetInt() : 0));
-        }
-
-        writeFramebuffer();
+void FCDevice::writeDevicePixels(const uint8_t *rgb, unsigned numPixels)
+{
+    // Truncate to the framebuffer size, and copy one USB packet's worth of pixels at a time.
+    if (numPixels > NUM_PIXELS)
+        numPixels = NUM_PIXELS;
+
+    for (unsigned i = 0; i < numPixels; i += PIXELS_PER_PACKET) {
+        unsigned count = numPixels - i;
+        if (count > PIXELS_PER_PACKET)
+            count = PIXELS_PER_PACKET;
+        memcpy(fbPixel(i), rgb + i * 3, count * 3);
+        memcpy(fbPixelLow(i), rgb + i * 3, count * 3);
     }
+
+    writeFramebuffer();
 }
 
 void FCDevice::writeMessage(const OPC::Message &msg)
@@ -459,6 +512,7 @@ void FCDevice::writeMessage(const OPC::Message &msg)
     switch (msg.command) {
 
         case OPC::SetPixelColors:
+        case OPC::SetPixelColors16:
             opcSetPixelColors(msg);
             writeFramebuffer();
             return;
@@ -473,6 +527,15 @@ void FCDevice::writeMessage(const OPC::Message &msg)
     }
 }
 
+void FCDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    // Map every part into the framebuffer, then send it once
+    for (unsigned i = 0; i < count; i++) {
+        opcSetPixelColors(*parts[i]);
+    }
+    writeFramebuffer();
+}
+
 void FCDevice::opcSysEx(const OPC::Message &msg)
 {
     if (msg.length() < 4) {
@@ -482,10 +545,7 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
         return;
     }
 
-    unsigned id = (unsigned(msg.data[0]) << 24) |
-                  (unsigned(msg.data[1]) << 16) |
-                  (unsigned(msg.data[2]) << 8)  |
-                   unsigned(msg.data[3])        ;
+    unsigned id = OPC::sysExId(msg);
 
     switch (id) {
 
@@ -495,6 +555,9 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
         case OPC::FCSetFirmwareConfiguration:
             return opcSetFirmwareConfiguration(msg);
 
+        case OPC::FCSetDevicePixels:
+            return opcSetDevicePixels(msg);
+
     }
 
     // Quietly ignore unhandled SysEx messages.
@@ -503,151 +566,11 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
 void FCDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run our device's compiled mapping, and store any relevant portions of 'msg'
+     * in the framebuffer. If there's no mapping, this device is inactive.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
-    }
-}
-
-void FCDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
-{
-    /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
-     *
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Color channels ]
-     */
-
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            while (count--) {
-                uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-                outPtr[0] = inPtr[0];
-                outPtr[1] = inPtr[1];
-                outPtr[2] = inPtr[2];
-                inPtr += 3;
-            }
-
-            return;
-        }
-    }
-
-    if (inst.IsArray() && inst.Size() == 5) {
-        // Map a range from an OPC channel to our framebuffer, with color channel swizzling
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-        const Value &vColorChannels = inst[4];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()
-            && vColorChannels.IsString() && vColorChannels.GetStringLength() == 3) {
-
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-            const char *colorChannels = vColorChannels.GetString();
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            bool success = true;
-            while (count--) {
-                uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-
-                for (int channel = 0; channel < 3; channel++) {
-                    if (!OPC::pickColorChannel(outPtr[channel], colorChannels[channel], inPtr)) {
-                        success = false;
-                        break;
-                    }
-                }
-
-                inPtr += 3;
-            }
-
-            if (success) {
-                return;
-            }
-        }
-    }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
-    }
+    mMap.apply(msg);
 }
 
 void FCDevice::opcSetGlobalColorCorrection(const OPC::Message &msg)
@@ -689,8 +612,46 @@ void FCDevice::opcSetFirmwareConfiguration(const OPC::Message &msg)
     writeFirmwareConfiguration();
 }
 
+void FCDevice::opcSetDevicePixels(const OPC::Message &msg)
+{
+    /*
+     * Raw pixels addressed to one device by serial number, bypassing the mapping.
+     * The payload is a NUL-terminated serial string followed by packed RGB bytes.
+     */
+
+    const char *serial = (const char*) msg.data + 4;
+    const char *end = (const char*) memchr(serial, '\0', msg.length() - 4);
+
+    if (!end || strcmp(serial, mSerialString)) {
+        // Malformed, or meant for a different device
+        return;
+    }
+
+    const uint8_t *rgb = (const uint8_t*) end + 1;
+    writeDevicePixels(rgb, (msg.data + msg.length() - rgb) / 3);
+}
+
 void FCDevice::writeFirmwareConfiguration()
 {
+    /*
+     * 16-bit frames need firmware that understands the low byte plane. Older
+     * firmware would never see the end of a frame, so it keeps 8-bit frames.
+     */
+
+    if ((mFirmwareConfig.data[0] & CFLAG_16BIT_FRAMES) && mDD.bcdDevice < FIRMWARE_VERSION_16BIT) {
+        if (mVerbose) {
+            std::clog << "16-bit frames need firmware version 1.09 or later. Using 8-bit frames.\n";
+        }
+        mFirmwareConfig.data[0] &= ~CFLAG_16BIT_FRAMES;
+    }
+
+    mHighPrecision = (mFirmwareConfig.data[0] & CFLAG_16BIT_FRAMES) != 0;
+    if (mHighPrecision) {
+        mFramebuffer[FRAMEBUFFER_PACKETS - 1].control &= ~FINAL;
+    } else {
+        mFramebuffer[FRAMEBUFFER_PACKETS - 1].control |= FINAL;
+    }
+
     // Write mFirmwareConfig to the device
     submitTransfer(new Transfer(this, &mFirmwareConfig, sizeof mFirmwareConfig));
 }
@@ -710,4 +671,5 @@ void FCDevice::describe(rapidjson::Value &object, Allocator &alloc)
     USBDevice::describe(object, alloc);
     object.AddMember("version", mVersionString, alloc);
     object.AddMember("bcd_version", mDD.bcdDevice, alloc);
+    object.AddMember("high_precision", mHighPrecision, alloc);
 }
@@ -24,21 +24,24 @@
 #pragma once
 #include "usbdevice.h"
 #include "opc.h"
+#include "pixelmap.h"
 #include <set>
 
 
 class FCDevice : public USBDevice
 {
 public:
-    FCDevice(libusb_device *device, bool verbose);
+    FCDevice(libusb_device *device, bool verbose, const char *type = "fadecandy");
     virtual ~FCDevice();
 
     static bool probe(libusb_device *device);
 
     virtual int open();
     virtual void loadConfiguration(const Value &config);
+    virtual void prepareConfiguration(const Value &config);
     virtual void writeMessage(const OPC::Message &msg);
     virtual void writeMessage(Document &msg);
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
     virtual void writeColorCorrection(const Value &color);
     virtual std::string getName();
     virtual void flush();
@@ -49,12 +52,15 @@ public:
     // Send current buffer contents
     void writeFramebuffer();
 
-    // Framebuffer accessor
+    // Framebuffer accessors, for the high byte of each color and for the low byte
     uint8_t *fbPixel(unsigned num) {
         return &mFramebuffer[num / PIXELS_PER_PACKET].data[3 * (num % PIXELS_PER_PACKET)];
     }
+    uint8_t *fbPixelLow(unsigned num) {
+        return fbPixel(num) + FRAMEBUFFER_PACKETS * sizeof(Packet);
+    }
  
-private:
+protected:
     static const unsigned PIXELS_PER_PACKET = 21;
     static const unsigned LUT_ENTRIES_PER_PACKET = 31;
     static const unsigned FRAMEBUFFER_PACKETS = 25;
@@ -62,16 +68,19 @@ private:
     static const unsigned LUT_ENTRIES = 257;
     static const unsigned OUT_ENDPOINT = 1;
     static const unsigned MAX_FRAMES_PENDING = 2;
+    static const unsigned FIRMWARE_VERSION_16BIT = 0x0109;
 
     static const uint8_t TYPE_FRAMEBUFFER = 0x00;
     static const uint8_t TYPE_LUT = 0x40;
     static const uint8_t TYPE_CONFIG = 0x80;
+    static const uint8_t TYPE_FRAMEBUFFER_LOW = 0xC0;
     static const uint8_t FINAL = 0x20;
 
     static const uint8_t CFLAG_NO_DITHERING     = (1 << 0);
     static const uint8_t CFLAG_NO_INTERPOLATION = (1 << 1);
     static const uint8_t CFLAG_NO_ACTIVITY_LED  = (1 << 2);
     static const uint8_t CFLAG_LED_CONTROL      = (1 << 3);
+    static const uint8_t CFLAG_16BIT_FRAMES     = (1 << 5);
 
     struct Packet {
         uint8_t control;
@@ -94,28 +103,42 @@ private:
         bool finished;
     };
 
-    const Value *mConfigMap;
+    PixelMap mMap;
     std::set<Transfer*> mPending;
+
+    // Map compiled by prepareConfiguration(), and the entry it came from
+    PixelMap mPreparedMap;
+    const Value *mPreparedConfig;
+
     int mNumFramesPending;
     bool mFrameWaitingForSubmit;
+    bool mHighPrecision;
 
     char mSerialBuffer[256];
     char mVersionString[10];
 
     libusb_device_descriptor mDD;
-    Packet mFramebuffer[FRAMEBUFFER_PACKETS];
+
+    /*
+     * High bytes of each color, then a second plane of low bytes. Firmware
+     * with 16-bit frames enabled gets both planes, older firmware only the first.
+     */
+    Packet mFramebuffer[FRAMEBUFFER_PACKETS * 2];
     Packet mColorLUT[LUT_PACKETS];
     Packet mFirmwareConfig;
 
-    bool submitTransfer(Transfer *fct);
+    // Queue a transfer to the device. Simulated devices override this.
+    virtual bool submitTransfer(Transfer *fct);
+    void mapLayout(PixelMap::Layout &layout);
     void writeFirmwareConfiguration();
     void writeFirmwareConfiguration(const Value &json);
     void writeDevicePixels(Document &msg);
+    void writeDevicePixels(const uint8_t *rgb, unsigned numPixels);
     static LIBUSB_CALL void completeTransfer(libusb_transfer *transfer);
 
     void opcSetPixelColors(const OPC::Message &msg);
     void opcSysEx(const OPC::Message &msg);
     void opcSetGlobalColorCorrection(const OPC::Message &msg);
     void opcSetFirmwareConfiguration(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    void opcSetDevicePixels(const OPC::Message &msg);
 };
@@ -25,26 +25,50 @@
 #include "usbdevice.h"
 #include "apa102spidevice.h"
 #include "fcdevice.h"
+#include "virtualfcdevice.h"
 #include "version.h"
 #include "enttecdmxdevice.h"
+#include "artnetdevice.h"
+#include "e131device.h"
+#include "monotonic.h"
+#include "rapidjson/filestream.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 #include <ctype.h>
+#include <stdio.h>
 #include <iostream>
+#include <algorithm>
 
 #ifdef FCSERVER_HAS_WIRINGPI
 #include <wiringPi.h>
 #endif
 
-FCServer::FCServer(rapidjson::Document &config)
-    : mConfig(config),
+FCServer::FCServer(rapidjson::Document &config, const char *configPath)
+    : mConfig(&config),
+      mReloadedConfig(0),
+      mConfigPath(configPath),
+      mReloadRequested(0),
       mListen(config["listen"]),
       mRelay(config["relay"]),
-      mColor(config["color"]),
-      mDevices(config["devices"]),
+      mDmxInput(config["dmxInput"]),
+      mShm(config["shm"]),
+      mRecord(config["record"]),
+      mPlaybackConfig(config["playback"]),
+      mColor(&config["color"]),
+      mDevices(&config["devices"]),
       mVerbose(config["verbose"].IsTrue()),
       mPollForDevicesOnce(false),
-      mTcpNetServer(cbOpcMessage, cbJsonMessage, this, mVerbose),
+      mNumVirtualDevices(0),
+      mTcpNetServer(cbOpcMessage, cbJsonMessage, cbMetrics, this, mVerbose),
+      mUdpNetServer(cbOpcMessage, this, mVerbose),
+      mShmServer(cbOpcMessage, this, mVerbose),
       mUSBHotplugThread(0),
-      mUSB(0)
+      mUSB(0),
+      mMapMessages(0),
+      mMapMicros(0),
+      mCompositor(cbOpcMessage, this),
+      mRecorder(mVerbose),
+      mPlayback(cbOpcMessage, this, mVerbose)
 {
     /*
      * Validate the listen [host, port] list.
@@ -95,9 +119,65 @@ FCServer::FCServer(rapidjson::Document &config)
      * Minimal validation on 'devices'
      */
 
-    if (!mDevices.IsArray()) {
+    if (!mDevices->IsArray()) {
         mError << "The required 'devices' configuration key must be an array.\n";
     }
+
+    /*
+     * The optional Art-Net / sACN input map is compiled up front, so mistakes show up as config errors.
+     */
+
+    if (!mDmxInput.IsNull()) {
+        mUdpNetServer.loadConfiguration(mDmxInput, mError);
+    }
+
+    /*
+     * Optional shared memory input for renderers on this machine
+     */
+
+    if (!mShm.IsNull()) {
+        mShmServer.loadConfiguration(mShm, mError);
+    }
+
+    /*
+     * Optional scheduling for frames with presentation timestamps
+     */
+
+    JitterBuffer::Settings jitterSettings;
+    if (JitterBuffer::parseSettings(config["jitterBuffer"], jitterSettings, mError)) {
+        mJitterBuffer.setSettings(jitterSettings);
+    }
+
+    /*
+     * Optional compositing of several sources onto shared channels
+     */
+
+    Compositor::Config compositorConfig;
+    if (Compositor::parseConfiguration(config["compositor"], compositorConfig, mError)) {
+        mCompositor.setConfiguration(compositorConfig);
+    }
+
+    /*
+     * Optional show recording and playback
+     */
+
+    if (!mRecord.IsNull()) {
+        mRecorder.loadConfiguration(mRecord, mError);
+    }
+    if (!mPlaybackConfig.IsNull()) {
+        if (mRecord.IsObject() && mPlaybackConfig.IsObject() && mRecord["file"].IsString() &&
+            mPlaybackConfig["file"].IsString() &&
+            !strcmp(mRecord["file"].GetString(), mPlaybackConfig["file"].GetString())) {
+            mError << "A show can't be played back from the same file it's being recorded to.\n";
+        } else {
+            mPlayback.loadConfiguration(mPlaybackConfig, mError);
+        }
+    }
+}
+
+FCServer::~FCServer()
+{
+    delete mReloadedConfig;
 }
 
 bool FCServer::start(libusb_context *usb)
@@ -106,7 +186,8 @@ bool FCServer::start(libusb_context *usb)
     const Value &port = mListen[1];
     const char *hostStr = host.IsString() ? host.GetString() : NULL;
 
-    bool started = mTcpNetServer.start(hostStr, port.GetUint()) && startUSB(usb) && startSPI();
+    bool started = mTcpNetServer.start(hostStr, port.GetUint()) && startUSB(usb) && startVirtual() && startSPI() && startNet()
+        && mCompositor.start();
 
     if (started && !mRelay.IsNull()) {
         const Value &relayHost = mRelay[0u];
@@ -115,6 +196,22 @@ bool FCServer::start(libusb_context *usb)
         mTcpNetServer.startRelay(relayHostStr, relayPort.GetUint());
     }
 
+    if (started && !mDmxInput.IsNull()) {
+        started = mUdpNetServer.start();
+    }
+
+    if (started && !mShm.IsNull()) {
+        started = mShmServer.start();
+    }
+
+    if (started && !mRecord.IsNull()) {
+        started = mRecorder.start();
+    }
+
+    if (started && !mPlaybackConfig.IsNull()) {
+        started = mPlayback.start();
+    }
+
     return started;
 }
 
@@ -122,6 +219,11 @@ bool FCServer::startUSB(libusb_context *usb)
 {
     mUSB = usb;
 
+    if (!mUSB) {
+        // No USB support on this machine. Virtual and network devices still work.
+        return true;
+    }
+
     // Enumerate all attached devices, and get notified of hotplug events
     libusb_hotplug_register_callback(mUSB,
         libusb_hotplug_event(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
@@ -143,32 +245,160 @@ bool FCServer::startUSB(libusb_context *usb)
 void FCServer::cbOpcMessage(OPC::Message &msg, void *context)
 {
     /*
-     * Broadcast the OPC message to all configured devices.
+     * Broadcast the OPC message to all configured devices. Timed frames wait
+     * in the jitter buffer instead, unless they're already due. A multi-channel
+     * frame is mapped all at once, under this one lock.
      */
 
     FCServer *self = static_cast<FCServer*>(context);
     self->mEventMutex.lock();
 
-    for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
+    if (JitterBuffer::isTimedFrame(msg)) {
+        self->mJitterBuffer.push(msg, Monotonic::micros());
+        self->presentTimedFrames();
+        self->mEventMutex.unlock();
+        return;
+    }
+
+    if (OPC::isMultiChannelFrame(msg)) {
+        self->mapFrame(msg);
+    } else {
+        self->mapMessage(msg);
+    }
+    self->mEventMutex.unlock();
+
+    // also forward the message to clients connected on the relay socket
+    self->mTcpNetServer.relayMessage(msg);
+}
+
+void FCServer::mapMessage(OPC::Message &msg)
+{
+    // Caller holds mEventMutex. Layers are only seen by devices once they've been composited.
+    if (mCompositor.update(msg)) {
+        return;
+    }
+
+    // Record exactly what the devices see, so playback reproduces the output
+    mRecorder.record(msg);
+
+    uint64_t startTime = Monotonic::micros();
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
         USBDevice *dev = *i;
         dev->writeMessage(msg);
     }
 
-    for (std::vector<SPIDevice*>::iterator i = self->mSPIDevices.begin(), e = self->mSPIDevices.end(); i != e; ++i) {
+    for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
         SPIDevice *dev = *i;
         dev->writeMessage(msg);
     }
 
-    self->mEventMutex.unlock();
+    for (std::vector<NetDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+        NetDevice *dev = *i;
+        dev->writeMessage(msg);
+    }
 
-    // also forward the message to clients connected on the relay socket
-    self->mTcpNetServer.relayMessage(msg);
+    mMapMessages++;
+    mMapMicros += Monotonic::micros() - startTime;
+}
+
+void FCServer::mapFrame(const OPC::Message &msg)
+{
+    /*
+     * A Multi-Channel Pixel Colors message is a SysEx ID followed by Set Pixel
+     * Colors messages, packed end to end. Caller holds mEventMutex. Parts go to
+     * the compositor and the recorder just as separate messages would, and the
+     * rest go to each device together, so it maps them all and sends one frame.
+     */
+
+    unsigned length = msg.length();
+    unsigned offset = 4;
+
+    mFrameParts.clear();
+
+    while (offset + OPC::HEADER_BYTES <= length) {
+        const OPC::Message *part = (const OPC::Message*) &msg.data[offset];
+        unsigned size = OPC::HEADER_BYTES + part->length();
+
+        if (offset + size > length) {
+            if (mVerbose) {
+                std::clog << "Multi-channel frame has a truncated part on channel " << unsigned(part->channel) << "\n";
+            }
+            break;
+        }
+        offset += size;
+
+        if (!OPC::pixelBytes(part->command) || mCompositor.update(*part)) {
+            continue;
+        }
+
+        mRecorder.record(*part);
+        mFrameParts.push_back(part);
+    }
+
+    if (mFrameParts.empty()) {
+        return;
+    }
+
+    uint64_t startTime = Monotonic::micros();
+    const OPC::Message *const *parts = &mFrameParts[0];
+    unsigned count = mFrameParts.size();
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        dev->writeFrame(parts, count);
+    }
+
+    for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+        SPIDevice *dev = *i;
+        dev->writeFrame(parts, count);
+    }
+
+    for (std::vector<NetDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+        NetDevice *dev = *i;
+        dev->writeFrame(parts, count);
+    }
+
+    mMapMessages++;
+    mMapMicros += Monotonic::micros() - startTime;
+}
+
+void FCServer::interpolate()
+{
+    // Caller holds mEventMutex. Devices that aren't interpolating, or aren't due yet, do nothing.
+    uint64_t now = Monotonic::micros();
+
+    for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+        SPIDevice *dev = *i;
+        dev->interpolate(now);
+    }
+
+    for (std::vector<NetDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+        NetDevice *dev = *i;
+        dev->interpolate(now);
+    }
+}
+
+void FCServer::presentTimedFrames()
+{
+    /*
+     * Send every timed frame that's due. Caller holds mEventMutex. The frames
+     * belong to the jitter buffer, so they're relayed before we let go of the
+     * lock; relaying never waits on anything that needs mEventMutex.
+     */
+
+    OPC::Message *msg;
+    while ((msg = mJitterBuffer.pop(Monotonic::micros()))) {
+        mapMessage(*msg);
+        mTcpNetServer.relayMessage(*msg);
+    }
 }
 
 int FCServer::cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
 {
     FCServer *self = static_cast<FCServer*>(user_data);
 
+    self->mDeviceListMutex.lock();
     self->mEventMutex.lock();
 
     if (event & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
@@ -179,6 +409,7 @@ int FCServer::cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotpl
     }
 
     self->mEventMutex.unlock();
+    self->mDeviceListMutex.unlock();
     return false;
 }
 
@@ -232,12 +463,13 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         return;
     }
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        if (dev->matchConfiguration(mDevices[i])) {
+    const Value &devices = *mDevices;
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        if (dev->matchConfiguration(devices[i])) {
             // Found a matching configuration for this device. We're keeping it!
 
-            dev->loadConfiguration(mDevices[i]);
-            dev->writeColorCorrection(mColor);
+            dev->loadConfiguration(devices[i]);
+            dev->writeColorCorrection(*mColor);
             mUSBDevices.push_back(dev);
 
             if (mVerbose) {
@@ -280,14 +512,83 @@ void FCServer::usbDeviceLeft(std::vector<USBDevice*>::iterator iter)
     jsonConnectedDevicesChanged();
 }
 
+bool FCServer::startVirtual()
+{
+    /*
+     * Virtual devices are simulated Fadecandy boards. Each configuration entry
+     * creates one, attached for as long as the server runs.
+     */
+
+    const Value &devices = *mDevices;
+    mDeviceListMutex.lock();
+
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        const Value &vtype = devices[i]["type"];
+
+        if (vtype.IsString() && !strcmp(vtype.GetString(), VirtualFCDevice::DEVICE_TYPE)) {
+            openVirtualDevice(devices[i], *mColor);
+        }
+    }
+
+    mDeviceListMutex.unlock();
+    return true;
+}
+
+void FCServer::openVirtualDevice(const Value &config, const Value &color)
+{
+    const Value &vserial = config["serial"];
+
+    std::ostringstream serial;
+    if (vserial.IsString()) {
+        serial << vserial.GetString();
+    } else {
+        serial << "VIRTUAL" << mNumVirtualDevices;
+    }
+    mNumVirtualDevices++;
+
+    USBDevice *dev = new VirtualFCDevice(serial.str().c_str(), mVerbose);
+    dev->open();
+    dev->loadConfiguration(config);
+    dev->writeColorCorrection(color);
+
+    mEventMutex.lock();
+    mUSBDevices.push_back(dev);
+    mEventMutex.unlock();
+
+    if (mVerbose) {
+        std::clog << "USB device " << dev->getName() << " attached.\n";
+    }
+    jsonConnectedDevicesChanged();
+}
+
 bool FCServer::startSPI()
 {
 #ifdef FCSERVER_HAS_WIRINGPI
     wiringPiSetup();
 #endif
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        const Value &device = mDevices[i];
+    std::vector<SPIDevice*> list, reusable;
+    mDeviceListMutex.lock();
+    openSPIDevices(*mDevices, *mColor, list, reusable);
+
+    mEventMutex.lock();
+    mSPIDevices.insert(mSPIDevices.end(), list.begin(), list.end());
+    mEventMutex.unlock();
+    mDeviceListMutex.unlock();
+
+    if (!list.empty()) {
+        jsonConnectedDevicesChanged();
+    }
+    return true;
+}
+
+void FCServer::openSPIDevices(const Value &devices, const Value &color, std::vector<SPIDevice*> &list,
+    std::vector<SPIDevice*> &reusable)
+{
+    // Devices from 'reusable' are kept if their entry only changed its map. The rest are left there.
+
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        const Value &device = devices[i];
 
         const Value &vtype = device["type"];
         const Value &vport = device["port"];
@@ -305,13 +606,20 @@ bool FCServer::startSPI()
             continue;
         }
 
-        openAPA102SPIDevice(vport.GetUint(), vnumLights.GetUint());
-    }
+        SPIDevice *dev = reuseDevice(reusable, device);
+        if (dev) {
+            list.push_back(dev);
+            continue;
+        }
 
-    return true;
+        dev = openAPA102SPIDevice(vport.GetUint(), vnumLights.GetUint(), devices, color);
+        if (dev) {
+            list.push_back(dev);
+        }
+    }
 }
 
-void FCServer::openAPA102SPIDevice(uint32_t port, int numLights)
+SPIDevice *FCServer::openAPA102SPIDevice(uint32_t port, int numLights, const Value &devices, const Value &color)
 {
     APA102SPIDevice* dev = new APA102SPIDevice(numLights, mVerbose);
 
@@ -321,55 +629,463 @@ void FCServer::openAPA102SPIDevice(uint32_t port, int numLights)
             std::clog << "Error opening " << dev->getName() << "\n";
         }
         delete dev;
-        return;
+        return 0;
     }
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        if (dev->matchConfiguration(mDevices[i])) {
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        if (dev->matchConfiguration(devices[i])) {
             // Found a matching configuration for this device. We're keeping it!
 
-            dev->loadConfiguration(mDevices[i]);
-            dev->writeColorCorrection(mColor);
-            mSPIDevices.push_back(dev);
+            dev->loadConfiguration(devices[i]);
+            dev->writeColorCorrection(color);
 
             if (mVerbose) {
                 std::clog << "SPI device " << dev->getName() << " attached.\n";
             }
-            jsonConnectedDevicesChanged();
-            return;
+            return dev;
+        }
+    }
+
+    delete dev;
+    return 0;
+}
+
+bool FCServer::startNet()
+{
+    std::vector<NetDevice*> list, reusable;
+    mDeviceListMutex.lock();
+    openNetDevices(*mDevices, *mColor, list, reusable);
+
+    mEventMutex.lock();
+    mNetDevices.insert(mNetDevices.end(), list.begin(), list.end());
+    mEventMutex.unlock();
+    mDeviceListMutex.unlock();
+
+    if (!list.empty()) {
+        jsonConnectedDevicesChanged();
+    }
+    return true;
+}
+
+void FCServer::openNetDevices(const Value &devices, const Value &color, std::vector<NetDevice*> &list,
+    std::vector<NetDevice*> &reusable)
+{
+    /*
+     * Network output devices don't come and go like USB devices do. Every
+     * configuration entry with a network device type creates one device,
+     * or keeps one from 'reusable' if only its map changed.
+     */
+
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        const Value &device = devices[i];
+        const Value &vtype = device["type"];
+        NetDevice *dev = 0;
+
+        if (!vtype.IsString()) {
+            continue;
+        }
+
+        if ((dev = reuseDevice(reusable, device))) {
+            // Still open, with its new map prepared
+
+        } else if (!strcmp(vtype.GetString(), ArtNetDevice::DEVICE_TYPE)) {
+            dev = openNetDevice(new ArtNetDevice(mVerbose), device, color);
+
+        } else if (!strcmp(vtype.GetString(), E131Device::DEVICE_TYPE)) {
+            dev = openNetDevice(new E131Device(mVerbose), device, color);
+        }
+
+        if (dev) {
+            list.push_back(dev);
+        }
+    }
+}
+
+NetDevice *FCServer::openNetDevice(NetDevice *dev, const Value &config, const Value &color)
+{
+    int r = dev->open(config);
+    if (r < 0) {
+        if (mVerbose) {
+            std::clog << "Error opening " << dev->getName() << "\n";
         }
+        delete dev;
+        return 0;
+    }
+
+    dev->loadConfiguration(config);
+    dev->writeColorCorrection(color);
+
+    if (mVerbose) {
+        std::clog << "Network device " << dev->getName() << " attached.\n";
     }
+    return dev;
+}
+
+std::string FCServer::jsonString(const Value &value)
+{
+    rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+    rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+    value.Accept(writer);
+    return std::string(buffer.GetString(), buffer.Size());
+}
+
+bool FCServer::jsonEqual(const Value &a, const Value &b)
+{
+    if (a.GetType() != b.GetType()) {
+        return false;
+    }
+
+    switch (a.GetType()) {
+
+        case rapidjson::kNumberType:
+            if (a.IsInt64() && b.IsInt64()) {
+                return a.GetInt64() == b.GetInt64();
+            }
+            return a.GetDouble() == b.GetDouble();
+
+        case rapidjson::kStringType:
+            return a.GetStringLength() == b.GetStringLength() &&
+                !memcmp(a.GetString(), b.GetString(), a.GetStringLength());
+
+        case rapidjson::kArrayType:
+            if (a.Size() != b.Size()) {
+                return false;
+            }
+            for (unsigned i = 0; i < a.Size(); ++i) {
+                if (!jsonEqual(a[i], b[i])) {
+                    return false;
+                }
+            }
+            return true;
+
+        case rapidjson::kObjectType: {
+            unsigned count = 0;
+            for (Value::ConstMemberIterator i = a.MemberBegin(); i != a.MemberEnd(); ++i, ++count) {
+                const char *name = i->name.GetString();
+                if (!b.HasMember(name) || !jsonEqual(i->value, b[name])) {
+                    return false;
+                }
+            }
+            return count == unsigned(b.MemberEnd() - b.MemberBegin());
+        }
+
+        default:
+            // Null, true, and false are completely described by their type
+            return true;
+    }
+}
+
+bool FCServer::jsonEqualExceptMap(const Value &a, const Value &b)
+{
+    // Two device entries that describe the same output, perhaps with different maps
+    if (!a.IsObject() || !b.IsObject()) {
+        return false;
+    }
+
+    unsigned count = 0;
+    for (Value::ConstMemberIterator i = a.MemberBegin(); i != a.MemberEnd(); ++i) {
+        const char *name = i->name.GetString();
+        if (!strcmp(name, "map")) {
+            continue;
+        }
+        if (!b.HasMember(name) || !jsonEqual(i->value, b[name])) {
+            return false;
+        }
+        count++;
+    }
+
+    return count + (b.HasMember("map") ? 1 : 0) == unsigned(b.MemberEnd() - b.MemberBegin());
+}
+
+template <class T> T *FCServer::reuseDevice(std::vector<T*> &reusable, const Value &config)
+{
+    // Take a device out of 'reusable' if it can switch to 'config' by changing only its map
+    for (typename std::vector<T*>::iterator i = reusable.begin(); i != reusable.end(); ++i) {
+        T *dev = *i;
+        const Value *loaded = dev->getConfiguration();
+
+        if (loaded && jsonEqualExceptMap(*loaded, config)) {
+            reusable.erase(i);
+            dev->prepareConfiguration(config);
+            return dev;
+        }
+    }
+    return 0;
+}
+
+bool FCServer::reloadConfiguration(Document *config, std::ostream &error)
+{
+    /*
+     * Swap in a new configuration without restarting. Takes ownership of 'config'.
+     *
+     * Everything that can be slow happens before we take mEventMutex: validation,
+     * compiling new maps, and opening any SPI and network outputs that changed,
+     * including their address lookups. SPI and network devices whose entries only
+     * changed their maps stay open, as do USB devices (real or virtual) that still
+     * match an entry. Under mEventMutex, devices only swap in what was prepared, so
+     * all of this lands between two frames, and no client connection is touched.
+     * mDeviceListMutex keeps devices from coming or going until we're done.
+     */
+
+    static const char *kRestartKeys[] = { "listen", "relay", "dmxInput", "shm", "record", "playback" };
+    std::ostringstream errors;
+    JitterBuffer::Settings jitterSettings;
+    Compositor::Config compositorConfig;
+
+    mDeviceListMutex.lock();
+
+    if (!config->IsObject()) {
+        errors << "The configuration must be a JSON object.\n";
+    } else {
+        if (!(*config)["devices"].IsArray()) {
+            errors << "The required 'devices' configuration key must be an array.\n";
+        }
+        for (unsigned i = 0; i < sizeof kRestartKeys / sizeof kRestartKeys[0]; i++) {
+            const char *key = kRestartKeys[i];
+            if (!jsonEqual((*config)[key], (*mConfig)[key])) {
+                errors << "Changing '" << key << "' requires restarting the server.\n";
+            }
+        }
+        if ((*config)["verbose"].IsTrue() != mVerbose) {
+            errors << "Changing 'verbose' requires restarting the server.\n";
+        }
+        JitterBuffer::parseSettings((*config)["jitterBuffer"], jitterSettings, errors);
+        Compositor::parseConfiguration((*config)["compositor"], compositorConfig, errors);
+    }
+
+    if (!errors.str().empty()) {
+        mDeviceListMutex.unlock();
+        error << errors.str();
+        delete config;
+        return false;
+    }
+
+    const Value &devices = (*config)["devices"];
+    const Value &color = (*config)["color"];
+
+    // Afterwards, the 'old' lists hold only the devices we're replacing
+    std::vector<SPIDevice*> spiDevices, oldSPIDevices(mSPIDevices);
+    std::vector<NetDevice*> netDevices, oldNetDevices(mNetDevices);
+    openSPIDevices(devices, color, spiDevices, oldSPIDevices);
+    openNetDevices(devices, color, netDevices, oldNetDevices);
+
+    // Match USB devices to entries, and compile their maps.
+    // Many hardware devices can share one entry, but each virtual device has its own.
+    std::vector<bool> used(devices.Size(), false);
+    std::vector<unsigned> usbMatches;
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(); i != mUSBDevices.end(); ++i) {
+        USBDevice *dev = *i;
+        bool isVirtual = !strcmp(dev->getTypeString(), VirtualFCDevice::DEVICE_TYPE);
+        unsigned match;
+        for (match = 0; match < devices.Size(); ++match) {
+            if (!(isVirtual && used[match]) && dev->matchConfiguration(devices[match])) {
+                break;
+            }
+        }
+
+        if (match < devices.Size()) {
+            dev->prepareConfiguration(devices[match]);
+            used[match] = true;
+        }
+        usbMatches.push_back(match);
+    }
+
+    mEventMutex.lock();
+
+    mSPIDevices.swap(spiDevices);
+    mNetDevices.swap(netDevices);
+    mJitterBuffer.setSettings(jitterSettings);
+    mCompositor.setConfiguration(compositorConfig);
+
+    for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+        (*i)->commitConfiguration();
+        (*i)->writeColorCorrection(color);
+    }
+    for (std::vector<NetDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+        (*i)->commitConfiguration();
+        (*i)->writeColorCorrection(color);
+    }
+
+    // Keep every USB device that still matches a configuration entry
+    std::vector<unsigned>::iterator match = usbMatches.begin();
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(); i != mUSBDevices.end(); ++match) {
+        USBDevice *dev = *i;
+
+        if (*match < devices.Size()) {
+            dev->loadConfiguration(devices[*match]);
+            dev->writeColorCorrection(color);
+            ++i;
+        } else {
+            if (mVerbose) {
+                std::clog << "USB device " << dev->getName() << " has no matching configuration. Not using it.\n";
+            }
+            i = mUSBDevices.erase(i);
+            delete dev;
+        }
+    }
+
+    // New virtual devices
+    for (unsigned i = 0; i < devices.Size(); ++i) {
+        const Value &vtype = devices[i]["type"];
+        if (!used[i] && vtype.IsString() && !strcmp(vtype.GetString(), VirtualFCDevice::DEVICE_TYPE)) {
+            openVirtualDevice(devices[i], color);
+        }
+    }
+
+    // Attached hardware we turned away before may match the new configuration
+    mPollForDevicesOnce = true;
+
+    delete mReloadedConfig;
+    mReloadedConfig = config;
+    mConfig = config;
+    mDevices = &devices;
+    mColor = &color;
+
+    // Replaced SPI devices blank their LEDs on the way out, on a port a new device may share
+    for (std::vector<SPIDevice*>::iterator i = oldSPIDevices.begin(); i != oldSPIDevices.end(); ++i) {
+        delete *i;
+    }
+
+    mEventMutex.unlock();
+
+    // Free the network outputs we replaced, now that no frame can be using them
+    for (std::vector<NetDevice*>::iterator i = oldNetDevices.begin(); i != oldNetDevices.end(); ++i) {
+        delete *i;
+    }
+
+    mDeviceListMutex.unlock();
+
+    jsonConnectedDevicesChanged();
+    return true;
+}
+
+bool FCServer::reloadConfigurationFile()
+{
+    if (!mConfigPath) {
+        std::clog << "Not reloading; the server is using its built-in default configuration.\n";
+        return false;
+    }
+
+    FILE *configFile = fopen(mConfigPath, "r");
+    if (!configFile) {
+        perror("Error opening config file");
+        return false;
+    }
+
+    Document *config = new Document();
+    rapidjson::FileStream istr(configFile);
+    config->ParseStream<0>(istr);
+    fclose(configFile);
+
+    if (config->HasParseError()) {
+        std::clog << "Not reloading " << mConfigPath << ". Parse error at character "
+                  << config->GetErrorOffset() << ": " << config->GetParseError() << "\n";
+        delete config;
+        return false;
+    }
+
+    std::ostringstream errors;
+    if (!reloadConfiguration(config, errors)) {
+        std::clog << "Not reloading " << mConfigPath << ". Configuration errors:\n" << errors.str();
+        return false;
+    }
+
+    std::clog << "Reloaded configuration from " << mConfigPath << "\n";
+    return true;
 }
 
 void FCServer::mainLoop()
 {
     for (;;) {
+        if (mReloadRequested) {
+            mReloadRequested = 0;
+            reloadConfigurationFile();
+        }
+
         struct timeval timeout;
         timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
+        timeout.tv_usec = mainLoopTimeout();
+
+        mMainLoop.wait();
 
-        int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
-        if (err) {
-            std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
-            // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
+        if (!mUSB) {
+            // No USB. Virtual devices still need flush() called on time.
+            tthread::this_thread::sleep_for(tthread::chrono::microseconds(timeout.tv_usec));
+            mMainLoop.resume();
+
+        } else {
+            int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
+            mMainLoop.resume();
+            if (err) {
+                std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
+                // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
+            }
         }
 
         // We may have been asked for a one-shot poll, to retry connecting devices that failed.
-        if (mPollForDevicesOnce) {
+        if (mPollForDevicesOnce && mUSB) {
             mPollForDevicesOnce = false;
             usbHotplugPoll();
         }
 
-        // Flush completed transfers
+        // Flush completed transfers, present timed frames that are due, and interpolate between frames
         mEventMutex.lock();
         for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
             USBDevice *dev = *i;
             dev->flush();
         }
+        presentTimedFrames();
+        interpolate();
         mEventMutex.unlock();
     }
 }
 
+long FCServer::mainLoopTimeout()
+{
+    /*
+     * How long can we wait for USB events? Normally we poll at 10 Hz, but devices
+     * that have timed work to do in flush() can ask us to wake up sooner, and so
+     * can the jitter buffer when it's holding frames, and so can any SPI or network
+     * device that's interpolating.
+     */
+
+    const long maxTimeout = 100000;
+    uint64_t now = Monotonic::micros();
+    uint64_t wakeup = now + maxTimeout;
+
+    mEventMutex.lock();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        uint64_t deadline = (*i)->flushDeadline();
+        if (deadline && deadline < wakeup) {
+            wakeup = std::max(deadline, now);
+        }
+    }
+
+    for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+        uint64_t deadline = (*i)->interpolationDeadline();
+        if (deadline && deadline < wakeup) {
+            wakeup = std::max(deadline, now);
+        }
+    }
+
+    for (std::vector<NetDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+        uint64_t deadline = (*i)->interpolationDeadline();
+        if (deadline && deadline < wakeup) {
+            wakeup = std::max(deadline, now);
+        }
+    }
+
+    uint64_t presentation = mJitterBuffer.wakeupTime(now);
+    if (presentation && presentation < wakeup) {
+        wakeup = std::max(presentation, now);
+    }
+    mEventMutex.unlock();
+
+    return long(wakeup - now);
+}
+
 bool FCServer::usbHotplugPoll()
 {
     /*
@@ -393,7 +1109,8 @@ bool FCServer::usbHotplugPoll()
         return false;
     }
 
-    // Take the lock after get_device_list completes
+    // Take the locks after get_device_list completes
+    mDeviceListMutex.lock();
     mEventMutex.lock();
 
     // Look for devices that were added
@@ -416,7 +1133,7 @@ bool FCServer::usbHotplugPoll()
     for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
         USBDevice *dev = *i;
         libusb_device *usbdev = dev->getDevice();
-        bool isRemoved = true;
+        bool isRemoved = usbdev != 0;
 
         for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
             if (list[listItem] == usbdev) {
@@ -430,6 +1147,7 @@ bool FCServer::usbHotplugPoll()
     }
 
     mEventMutex.unlock();
+    mDeviceListMutex.unlock();
     libusb_free_device_list(list, true);
     return true;
 }
@@ -457,6 +1175,13 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
     }
     const char *type = vtype.GetString();
 
+    // Reloading takes the event lock itself, once the slow parts are done
+    if (!strcmp(type, "set_config")) {
+        self->jsonSetConfig(message);
+        self->mTcpNetServer.jsonReply(wsi, message);
+        return;
+    }
+
     // Hold the event lock while dispatching
     self->mEventMutex.lock();
 
@@ -464,6 +1189,10 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
         self->jsonListConnectedDevices(message);
     } else if (!strcmp(type, "server_info")) {
         self->jsonServerInfo(message);
+    } else if (!strcmp(type, "list_relay_clients")) {
+        self->jsonListRelayClients(message);
+    } else if (!strcmp(type, "playback")) {
+        self->mPlayback.control(message);
     } else if (message.HasMember("device")) {
         self->jsonDeviceMessage(message);
     } else {
@@ -480,6 +1209,42 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
     self->mTcpNetServer.jsonReply(wsi, message);
 }
 
+void FCServer::cbMetrics(MetricsWriter &metrics, void *context)
+{
+    /*
+     * The metrics endpoint was scraped. Network servers have already added their
+     * own counters; we add the main loop's, and each device's. Device counters
+     * are only written with the event lock held, so we take it just long enough
+     * to read them.
+     */
+
+    FCServer *self = (FCServer*) context;
+
+    self->mUdpNetServer.writeMetrics(metrics);
+    self->mShmServer.writeMetrics(metrics);
+    self->mCompositor.writeMetrics(metrics);
+    self->mRecorder.writeMetrics(metrics);
+    self->mPlayback.writeMetrics(metrics);
+    metrics.loop("usb", self->mMainLoop);
+
+    self->mEventMutex.lock();
+
+    metrics.counter("fcserver_map_messages_total",
+        "OPC messages mapped onto devices", MetricsWriter::Labels(), self->mMapMessages);
+    metrics.counter("fcserver_map_seconds_total",
+        "Time spent mapping OPC messages onto devices", MetricsWriter::Labels(), self->mMapMicros * 1e-6);
+    self->mJitterBuffer.writeMetrics(metrics);
+
+    for (unsigned i = 0; i != self->mUSBDevices.size(); i++) {
+        self->mUSBDevices[i]->writeMetrics(metrics);
+    }
+    for (unsigned i = 0; i != self->mNetDevices.size(); i++) {
+        self->mNetDevices[i]->writeMetrics(metrics);
+    }
+
+    self->mEventMutex.unlock();
+}
+
 void FCServer::jsonDeviceMessage(rapidjson::Document &message)
 {
     /*
@@ -511,6 +1276,16 @@ void FCServer::jsonDeviceMessage(rapidjson::Document &message)
                     break;
             }
         }
+        for (unsigned i = 0; i != mNetDevices.size(); i++) {
+            NetDevice *netDev = mNetDevices[i];
+
+            if (netDev->matchConfiguration(device)) {
+                matched = true;
+                netDev->writeMessage(message);
+                if (message.HasMember("error"))
+                    break;
+            }
+        }
     }
 
     if (!matched) {
@@ -532,10 +1307,21 @@ void FCServer::jsonListConnectedDevices(rapidjson::Document &message)
     for (unsigned i = 0; i != mSPIDevices.size(); i++) {
         SPIDevice *spiDev = mSPIDevices[i];
         list.PushBack(rapidjson::kObjectType, message.GetAllocator());
-        mSPIDevices[i]->describe(list[i], message.GetAllocator());
+        spiDev->describe(list[list.Size() - 1], message.GetAllocator());
+    }
+
+    for (unsigned i = 0; i != mNetDevices.size(); i++) {
+        NetDevice *netDev = mNetDevices[i];
+        list.PushBack(rapidjson::kObjectType, message.GetAllocator());
+        netDev->describe(list[list.Size() - 1], message.GetAllocator());
     }
 }
 
+void FCServer::jsonListRelayClients(rapidjson::Document &message)
+{
+    mTcpNetServer.describeRelayClients(message, message.GetAllocator());
+}
+
 void FCServer::jsonServerInfo(rapidjson::Document &message)
 {
     // Server version
@@ -543,7 +1329,35 @@ void FCServer::jsonServerInfo(rapidjson::Document &message)
 
     // Server configuration
     message.AddMember("config", rapidjson::kObjectType, message.GetAllocator());
-    message.DeepCopy(message["config"], mConfig);
+    message.DeepCopy(message["config"], *mConfig);
+}
+
+void FCServer::jsonSetConfig(rapidjson::Document &message)
+{
+    /*
+     * Replace the server configuration, as if the config file changed and was reloaded.
+     * The new configuration is re-parsed from text, so it owns all of its strings
+     * rather than pointing into the receive buffer.
+     */
+
+    const Value &config = message["config"];
+    if (!config.IsObject()) {
+        message.AddMember("error", "Missing 'config' object", message.GetAllocator());
+        return;
+    }
+
+    Document *newConfig = new Document();
+    newConfig->Parse<0>(jsonString(config).c_str());
+
+    std::ostringstream errors;
+    if (!reloadConfiguration(newConfig, errors)) {
+        std::string text = errors.str();
+        Value error(text.c_str(), text.size(), message.GetAllocator());
+        message.AddMember("error", error, message.GetAllocator());
+    }
+
+    // Don't echo the whole configuration back
+    message.RemoveMember("config");
 }
 
 void FCServer::jsonConnectedDevicesChanged()
@@ -25,10 +25,19 @@
 #include "rapidjson/document.h"
 #include "opc.h"
 #include "tcpnetserver.h"
+#include "udpnetserver.h"
+#include "shmserver.h"
 #include "usbdevice.h"
 #include "spidevice.h"
+#include "netdevice.h"
+#include "jitterbuffer.h"
+#include "compositor.h"
+#include "recorder.h"
+#include "playback.h"
 #include <sstream>
+#include <string>
 #include <vector>
+#include <signal.h>
 #include <libusb.h>
 #include "tinythread.h"
 
@@ -39,7 +48,9 @@ public:
     typedef rapidjson::Value Value;
     typedef rapidjson::Document Document;
 
-    FCServer(rapidjson::Document &config);
+    // The config must outlive the server. If it came from a file, name it so the file can be reloaded.
+    FCServer(rapidjson::Document &config, const char *configPath = 0);
+    ~FCServer();
 
     const char *errorText() const { return mError.str().c_str(); }
     bool hasError() const { return !mError.str().empty(); }
@@ -47,19 +58,45 @@ public:
     bool start(libusb_context *usb);
     void mainLoop();
 
+    // Ask mainLoop() to reload the config file. Safe to call from a signal handler.
+    void requestReload() { mReloadRequested = 1; }
+
 private:
     std::ostringstream mError;
 
-    const Document& mConfig;
+    // The current configuration. After a reload, we own it; the original belongs to our caller.
+    const Document *mConfig;
+    Document *mReloadedConfig;
+    const char *mConfigPath;
+    volatile sig_atomic_t mReloadRequested;
+
+    // These can't change without a restart, so they always refer to the original configuration
     const Value& mListen;
     const Value& mRelay;
-    const Value& mColor;
-    const Value& mDevices;
+    const Value& mDmxInput;
+    const Value& mShm;
+    const Value& mRecord;
+    const Value& mPlaybackConfig;
+
+    // These are swapped along with mConfig
+    const Value *mColor;
+    const Value *mDevices;
+
     bool mVerbose;
     bool mPollForDevicesOnce;
+    unsigned mNumVirtualDevices;
 
     TcpNetServer mTcpNetServer;
+    UdpNetServer mUdpNetServer;
+    ShmServer mShmServer;
     tthread::recursive_mutex mEventMutex;
+
+    /*
+     * Held while devices are added or removed, and for the whole of a reload,
+     * always before mEventMutex. A reload can then match devices and compile
+     * their maps without holding up frames, knowing no device goes away meanwhile.
+     */
+    tthread::mutex mDeviceListMutex;
     tthread::thread *mUSBHotplugThread;
 
     std::vector<USBDevice*> mUSBDevices;
@@ -67,8 +104,34 @@ private:
 
     std::vector<SPIDevice*> mSPIDevices;
 
+    std::vector<NetDevice*> mNetDevices;
+
+    // Time spent mapping OPC messages onto devices, protected by mEventMutex
+    uint64_t mMapMessages;
+    uint64_t mMapMicros;
+
+    // Parts of the multi-channel frame being mapped, protected by mEventMutex
+    std::vector<const OPC::Message*> mFrameParts;
+    MetricLoop mMainLoop;
+
+    // Timed frames waiting for their presentation time, protected by mEventMutex
+    JitterBuffer mJitterBuffer;
+
+    // Blends layer channels into output channels, which come back through cbOpcMessage
+    Compositor mCompositor;
+
+    // Optional show recording of everything the devices are sent, and playback of a recorded show
+    Recorder mRecorder;
+    Playback mPlayback;
+
     static void cbOpcMessage(OPC::Message &msg, void *context);
     static void cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, void *context);
+    static void cbMetrics(MetricsWriter &metrics, void *context);
+
+    void mapMessage(OPC::Message &msg);
+    void mapFrame(const OPC::Message &msg);
+    void presentTimedFrames();
+    void interpolate();
 
     static LIBUSB_CALL int cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
 
@@ -77,11 +140,30 @@ private:
     void usbDeviceLeft(libusb_device *device);
     void usbDeviceLeft(std::vector<USBDevice*>::iterator iter);
     bool usbHotplugPoll();
+    long mainLoopTimeout();
 
     static void usbHotplugThreadFunc(void *arg);
 
+    bool startVirtual();
+    void openVirtualDevice(const Value &config, const Value &color);
+
     bool startSPI();
-    void openAPA102SPIDevice(uint32_t port, int numLights);
+    void openSPIDevices(const Value &devices, const Value &color, std::vector<SPIDevice*> &list,
+        std::vector<SPIDevice*> &reusable);
+    SPIDevice *openAPA102SPIDevice(uint32_t port, int numLights, const Value &devices, const Value &color);
+
+    bool startNet();
+    void openNetDevices(const Value &devices, const Value &color, std::vector<NetDevice*> &list,
+        std::vector<NetDevice*> &reusable);
+    NetDevice *openNetDevice(NetDevice *dev, const Value &config, const Value &color);
+
+    // Live configuration changes
+    bool reloadConfiguration(Document *config, std::ostream &error);
+    bool reloadConfigurationFile();
+    static std::string jsonString(const Value &value);
+    static bool jsonEqual(const Value &a, const Value &b);
+    static bool jsonEqualExceptMap(const Value &a, const Value &b);
+    template <class T> static T *reuseDevice(std::vector<T*> &reusable, const Value &config);
 
     // JSON event broadcasters
     void jsonConnectedDevicesChanged();
@@ -89,5 +171,7 @@ private:
     // JSON message handlers
     void jsonListConnectedDevices(rapidjson::Document &message);
     void jsonServerInfo(rapidjson::Document &message);
+    void jsonListRelayClients(rapidjson::Document &message);
     void jsonDeviceMessage(rapidjson::Document &message);
+    void jsonSetConfig(rapidjson::Document &message);
 };
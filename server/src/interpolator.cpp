@@ -0,0 +1,179 @@
+/*
+ * Host-side interpolation between keyframes, for SPI and network outputs
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "interpolator.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+static const double kMaxRate = 1000;
+
+
+Interpolator::Interpolator()
+    : mOutput(0), mSize(0), mPeriod(0),
+      mPrevTime(0), mNextTime(0), mNextUpdate(0), mCoefficient(0x10000)
+{}
+
+double Interpolator::parseConfiguration(const Value &config, double defaultRate, bool verbose)
+{
+    /*
+     * Optional keys in a device configuration:
+     *
+     *   "interpolate":  true to smooth between frames. Off by default.
+     *   "outputRate":   Frames per second sent to the device while interpolating
+     */
+
+    const Value &vinterpolate = config["interpolate"];
+    const Value &vrate = config["outputRate"];
+
+    if (!vinterpolate.IsBool() && !vinterpolate.IsNull() && verbose) {
+        std::clog << "Device 'interpolate' must be true or false.\n";
+    }
+
+    double rate = defaultRate;
+    if (vrate.IsNumber() && vrate.GetDouble() >= 1 && vrate.GetDouble() <= kMaxRate) {
+        rate = vrate.GetDouble();
+    } else if (!vrate.IsNull() && verbose) {
+        std::clog << "Device 'outputRate' must be a number of frames per second, from 1 to " << kMaxRate << ".\n";
+    }
+
+    return vinterpolate.IsTrue() ? rate : 0;
+}
+
+void Interpolator::setup(uint8_t *output, unsigned size, double rate)
+{
+    mOutput = output;
+    mSize = size;
+    mPeriod = rate > 0 && size ? std::max<uint64_t>(1, uint64_t(1e6 / rate)) : 0;
+
+    mKeyframe.assign(output, output + (mPeriod ? size : 0));
+    mPrev = mKeyframe;
+    mNext = mKeyframe;
+
+    mPrevTime = 0;
+    mNextTime = 0;
+    mNextUpdate = 0;
+    mCoefficient = 0x10000;
+}
+
+bool Interpolator::push(uint64_t now)
+{
+    if (!mPeriod) {
+        return true;
+    }
+
+    if (mNextTime == 0 || now - mNextTime > MAX_INTERVAL_US) {
+        // The first keyframe after a pause is shown right away
+        memcpy(&mPrev[0], &mKeyframe[0], mSize);
+        memcpy(&mNext[0], &mKeyframe[0], mSize);
+        memcpy(mOutput, &mKeyframe[0], mSize);
+        mPrevTime = now;
+        mNextTime = now;
+        mCoefficient = 0x10000;
+        mNextUpdate = now + mPeriod;
+        return true;
+    }
+
+    /*
+     * The new blend starts from whatever is on the output now. Usually the last
+     * blend already finished on the old 'next' keyframe, which we can reuse. If
+     * it hadn't, we start from the partial blend instead, so the output doesn't
+     * jump ahead to the old keyframe. Either way, nothing changes yet.
+     */
+    if (mCoefficient == 0x10000) {
+        mPrev.swap(mNext);
+    } else {
+        memcpy(&mPrev[0], mOutput, mSize);
+    }
+    memcpy(&mNext[0], &mKeyframe[0], mSize);
+    mPrevTime = mNextTime;
+    mNextTime = now;
+    mCoefficient = 0;
+
+    if (!mNextUpdate) {
+        mNextUpdate = now + mPeriod;
+    }
+    return false;
+}
+
+bool Interpolator::update(uint64_t now)
+{
+    if (!mNextUpdate || now < mNextUpdate) {
+        return false;
+    }
+
+    // Keep a steady rate, without a burst of updates to catch up after a stall
+    mNextUpdate += mPeriod;
+    if (mNextUpdate <= now) {
+        mNextUpdate = now + mPeriod;
+    }
+
+    uint32_t c = coefficient(now);
+    if (c == 0x10000 && now - mNextTime > MAX_INTERVAL_US) {
+        // No keyframes lately. Sleep until the next one.
+        mNextUpdate = 0;
+    }
+
+    if (c == mCoefficient) {
+        return false;
+    }
+
+    mCoefficient = c;
+    blend(c);
+    return true;
+}
+
+uint32_t Interpolator::coefficient(uint64_t now) const
+{
+    /*
+     * How far between mPrev and mNext we are, from 0 to 0x10000. This is
+     * calculateInterpCoefficient() from the firmware, in microseconds.
+     */
+
+    uint64_t diff = mNextTime - mPrevTime;
+    uint64_t elapsed = now - mNextTime;
+
+    if (diff == 0) {
+        return 0x10000;
+    }
+    return uint32_t((std::min(elapsed, diff) << 16) / diff);
+}
+
+void Interpolator::blend(uint32_t coefficient)
+{
+    const uint8_t *prev = &mPrev[0];
+    const uint8_t *next = &mNext[0];
+    uint8_t *out = mOutput;
+
+    if (coefficient == 0) {
+        memcpy(out, prev, mSize);
+    } else if (coefficient == 0x10000) {
+        memcpy(out, next, mSize);
+    } else {
+        uint32_t icPrev = 0x10000 - coefficient;
+        uint32_t icNext = coefficient;
+        for (unsigned i = 0; i < mSize; i++) {
+            out[i] = uint8_t((prev[i] * icPrev + next[i] * icNext + 0x8000) >> 16);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * Host-side interpolation between keyframes, for SPI and network outputs
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "rapidjson/document.h"
+
+
+/*
+ * Smooths an output buffer between keyframes, the way Fadecandy firmware does,
+ * for SPI and network outputs that would otherwise show each frame as a step.
+ *
+ * The device's map draws into keyframe() instead of the output buffer. Each
+ * completed keyframe goes to push(). From then on, update() blends the
+ * previous and newest keyframes into the output, a little further each time
+ * it's called, at the configured output rate. As in the firmware, blending
+ * takes exactly as long as the time between the last two keyframes, so
+ * output runs one keyframe behind the input.
+ *
+ * Not thread-safe. FCServer calls devices with its event lock held.
+ */
+class Interpolator
+{
+public:
+    typedef rapidjson::Value Value;
+
+    Interpolator();
+
+    /*
+     * Read the "interpolate" and "outputRate" keys from a device configuration.
+     * Returns the output rate in Hz, or 0 if interpolation is off.
+     */
+    static double parseConfiguration(const Value &config, double defaultRate, bool verbose);
+
+    /*
+     * Interpolate into 'output', a buffer of 'size' bytes that stays put for
+     * as long as we do. Its current contents become the first keyframe. A rate
+     * of zero disables interpolation, and keyframe() is the output itself.
+     */
+    void setup(uint8_t *output, unsigned size, double rate);
+
+    bool enabled() const { return mPeriod != 0; }
+    double rate() const { return mPeriod ? 1e6 / mPeriod : 0; }
+
+    // Where the next keyframe is drawn. Contents persist from one keyframe to the next.
+    uint8_t *keyframe() { return mPeriod ? &mKeyframe[0] : mOutput; }
+
+    // The keyframe is complete. Returns true if the output changed, and should be sent now.
+    bool push(uint64_t now);
+
+    // When update() should be called next, or 0 while idle
+    uint64_t deadline() const { return mNextUpdate; }
+
+    // Blend for the current time, if an update is due. Returns true if the output changed.
+    bool update(uint64_t now);
+
+private:
+    // Keyframes further apart than this aren't interpolated, and stop updates once blending is done
+    static const uint64_t MAX_INTERVAL_US = 1000000;
+
+    uint8_t *mOutput;
+    unsigned mSize;
+    uint64_t mPeriod;
+
+    std::vector<uint8_t> mKeyframe;
+    std::vector<uint8_t> mPrev;
+    std::vector<uint8_t> mNext;
+
+    uint64_t mPrevTime;
+    uint64_t mNextTime;
+    uint64_t mNextUpdate;
+    uint32_t mCoefficient;      // Last blend written to the output, from 0 (mPrev) to 0x10000 (mNext)
+
+    uint32_t coefficient(uint64_t now) const;
+    void blend(uint32_t coefficient);
+};
@@ -0,0 +1,240 @@
+/*
+ * Jitter buffer for Open Pixel Control frames with presentation timestamps
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "jitterbuffer.h"
+#include <string.h>
+
+
+JitterBuffer::JitterBuffer()
+    : mLastArrival(0)
+{
+    memset(mChannels, 0, sizeof mChannels);
+}
+
+JitterBuffer::~JitterBuffer()
+{
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        if (mChannels[c]) {
+            for (unsigned i = 0; i < MAX_FRAMES; i++) {
+                delete mChannels[c]->frames[i].msg;
+            }
+            delete mChannels[c];
+        }
+    }
+}
+
+bool JitterBuffer::parseSettings(const Value &config, Settings &settings, std::ostream &error)
+{
+    settings = Settings();
+    if (config.IsNull()) {
+        return true;
+    }
+
+    if (!config.IsObject() || !config["delay"].IsNumber() ||
+        config["delay"].GetDouble() < 0 || config["delay"].GetDouble() > 1000 ||
+        !(config["dropLate"].IsNull() || config["dropLate"].IsBool())) {
+        error << "The optional 'jitterBuffer' configuration key must be an object with a 'delay' "
+                 "of up to 1000 milliseconds, and an optional 'dropLate' flag.\n";
+        return false;
+    }
+
+    settings.enabled = true;
+    settings.delayMicros = uint32_t(config["delay"].GetDouble() * 1000.0 + 0.5);
+    settings.dropLate = config["dropLate"].IsTrue();
+    return true;
+}
+
+bool JitterBuffer::isTimedFrame(const OPC::Message &msg)
+{
+    return msg.length() >= HEADER_BYTES && OPC::sysExId(msg) == OPC::FCTimedPixelColors;
+}
+
+JitterBuffer::Channel *JitterBuffer::channel(unsigned number)
+{
+    Channel *ch = mChannels[number];
+    if (!ch) {
+        ch = new Channel;
+        memset(ch, 0, sizeof *ch);
+        mChannels[number] = ch;
+    }
+    return ch;
+}
+
+void JitterBuffer::push(const OPC::Message &msg, uint64_t now)
+{
+    Channel *ch = channel(msg.channel);
+    ch->received++;
+    mLastArrival = now;
+
+    uint64_t timestamp = 0;
+    for (unsigned i = 4; i < HEADER_BYTES; i++) {
+        timestamp = (timestamp << 8) | msg.data[i];
+    }
+
+    uint64_t due = now;
+
+    if (mSettings.enabled) {
+        // Our clock minus the sender's, for this frame. Network delay only makes it larger.
+        int64_t sample = int64_t(now - timestamp);
+
+        if (!ch->synced || sample > ch->offset + RESYNC_US) {
+            ch->synced = true;
+            ch->offset = sample;
+        } else {
+            ch->offset += int64_t((now - ch->lastArrival) * DRIFT_PPM / 1000000);
+            if (sample < ch->offset) {
+                ch->offset = sample;
+            }
+        }
+        ch->lastArrival = now;
+
+        due = timestamp + uint64_t(ch->offset) + mSettings.delayMicros;
+
+        if (int64_t(due - now) < 0) {
+            // More jitter than the delay can absorb
+            ch->late++;
+            if (mSettings.dropLate) {
+                ch->droppedLate++;
+                return;
+            }
+            due = now;
+        }
+    }
+
+    if (ch->count) {
+        // Never reorder frames on a channel
+        uint64_t tail = ch->frames[(ch->head + ch->count - 1) % MAX_FRAMES].due;
+        if (int64_t(due - tail) < 0) {
+            due = tail;
+        }
+    }
+
+    if (ch->count == MAX_FRAMES) {
+        // The delay holds more frames than we have room for. Lose the oldest.
+        ch->head = (ch->head + 1) % MAX_FRAMES;
+        ch->count--;
+        ch->droppedOverflow++;
+    }
+
+    Frame &frame = ch->frames[(ch->head + ch->count) % MAX_FRAMES];
+    if (!frame.msg) {
+        frame.msg = new OPC::Message;
+    }
+
+    unsigned length = msg.length() - HEADER_BYTES;
+    frame.due = due;
+    frame.msg->channel = msg.channel;
+    frame.msg->command = OPC::SetPixelColors;
+    frame.msg->setLength(length);
+    memcpy(frame.msg->data, msg.data + HEADER_BYTES, length);
+    ch->count++;
+}
+
+OPC::Message *JitterBuffer::pop(uint64_t now)
+{
+    // Oldest due frame across all channels
+    Channel *next = 0;
+    uint64_t nextDue = 0;
+
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        Channel *ch = mChannels[c];
+        if (ch && ch->count) {
+            uint64_t due = ch->frames[ch->head].due;
+            if (int64_t(due - now) <= 0 && (!next || int64_t(due - nextDue) < 0)) {
+                next = ch;
+                nextDue = due;
+            }
+        }
+    }
+
+    if (!next) {
+        return 0;
+    }
+
+    Frame &frame = next->frames[next->head];
+    next->head = (next->head + 1) % MAX_FRAMES;
+    next->count--;
+    next->presented++;
+    return frame.msg;
+}
+
+uint64_t JitterBuffer::wakeupTime(uint64_t now) const
+{
+    uint64_t wakeup = 0;
+
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        const Channel *ch = mChannels[c];
+        if (ch && ch->count) {
+            uint64_t due = ch->frames[ch->head].due;
+            if (!wakeup || int64_t(due - wakeup) < 0) {
+                wakeup = due;
+            }
+        }
+    }
+
+    /*
+     * A frame can arrive while the main loop sleeps. If timed frames are
+     * streaming in, don't sleep longer than one tick, so new frames are
+     * presented at most a tick late even when the buffer is empty.
+     */
+
+    if (mLastArrival && now - mLastArrival < IDLE_US) {
+        uint64_t tick = now + TICK_US;
+        if (!wakeup || int64_t(tick - wakeup) < 0) {
+            wakeup = tick;
+        }
+    }
+
+    return wakeup;
+}
+
+void JitterBuffer::writeMetrics(MetricsWriter &metrics) const
+{
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        const Channel *ch = mChannels[c];
+        if (!ch) {
+            continue;
+        }
+
+        MetricsWriter::Labels labels;
+        labels.add("channel", c);
+
+        metrics.counter("fcserver_timed_frames_total",
+            "Timed Pixel Colors messages received, by channel", labels, ch->received);
+        metrics.counter("fcserver_timed_frames_presented_total",
+            "Timed frames sent on to devices, by channel", labels, ch->presented);
+        metrics.counter("fcserver_timed_frames_late_total",
+            "Timed frames that arrived after their presentation time, by channel", labels, ch->late);
+        metrics.gauge("fcserver_timed_frames_queued",
+            "Timed frames waiting for their presentation time, by channel", labels, ch->count);
+
+        MetricsWriter::Labels late(labels), overflow(labels);
+        late.add("reason", "late");
+        overflow.add("reason", "overflow");
+        metrics.counter("fcserver_timed_frames_dropped_total",
+            "Timed frames discarded, by channel and reason", late, ch->droppedLate);
+        metrics.counter("fcserver_timed_frames_dropped_total",
+            "Timed frames discarded, by channel and reason", overflow, ch->droppedOverflow);
+    }
+}
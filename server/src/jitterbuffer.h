@@ -0,0 +1,118 @@
+/*
+ * Jitter buffer for Open Pixel Control frames with presentation timestamps
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include "rapidjson/document.h"
+#include "opc.h"
+#include "metrics.h"
+
+
+/*
+ * Holds Timed Pixel Colors messages in a short queue per OPC channel, and
+ * releases each one as an ordinary Set Pixel Colors message at its
+ * presentation time. Not thread-safe; FCServer calls it with its event lock held.
+ *
+ * Timestamps come from whatever clock the sender likes. For each channel we
+ * track the smallest difference between our clock and the sender's, which is
+ * the fastest any frame has reached us. A frame is presented that long after
+ * its timestamp, plus the configured delay, so network jitter smaller than
+ * the delay never reaches the LEDs.
+ */
+class JitterBuffer
+{
+public:
+    typedef rapidjson::Value Value;
+
+    struct Settings {
+        Settings() : enabled(false), delayMicros(0), dropLate(false) {}
+
+        bool enabled;
+        uint32_t delayMicros;
+        bool dropLate;
+    };
+
+    JitterBuffer();
+    ~JitterBuffer();
+
+    // Validate a 'jitterBuffer' configuration value. Null disables buffering.
+    static bool parseSettings(const Value &config, Settings &settings, std::ostream &error);
+    void setSettings(const Settings &settings) { mSettings = settings; }
+
+    static bool isTimedFrame(const OPC::Message &msg);
+
+    // Queue a Timed Pixel Colors message. Without buffering, it's due right away.
+    void push(const OPC::Message &msg, uint64_t now);
+
+    // The next frame due by 'now', or 0. It stays valid until the next push().
+    OPC::Message *pop(uint64_t now);
+
+    // When pop() should be called next, or 0 if nothing is pending
+    uint64_t wakeupTime(uint64_t now) const;
+
+    void writeMetrics(MetricsWriter &metrics) const;
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+    static const unsigned MAX_FRAMES = 32;
+    static const unsigned HEADER_BYTES = 12;        // SysEx ID and timestamp
+
+    // While timed frames keep arriving, poll this often in case one is due before our next wakeup
+    static const uint64_t TICK_US = 1000;
+    static const uint64_t IDLE_US = 1000000;
+
+    // A sender whose clock jumps ahead of our estimate by this much has probably restarted
+    static const int64_t RESYNC_US = 1000000;
+
+    // How quickly the estimate follows a sender whose clock runs slower than ours
+    static const uint64_t DRIFT_PPM = 1000;
+
+    struct Frame {
+        uint64_t due;
+        OPC::Message *msg;
+    };
+
+    struct Channel {
+        bool synced;
+        int64_t offset;
+        uint64_t lastArrival;
+
+        unsigned head;
+        unsigned count;
+        Frame frames[MAX_FRAMES];
+
+        uint64_t received;
+        uint64_t presented;
+        uint64_t late;
+        uint64_t droppedLate;
+        uint64_t droppedOverflow;
+    };
+
+    Settings mSettings;
+    Channel *mChannels[NUM_CHANNELS];
+    uint64_t mLastArrival;
+
+    Channel *channel(unsigned number);
+};
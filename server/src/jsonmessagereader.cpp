@@ -0,0 +1,230 @@
+/*
+ * Streaming JSON reader for incoming WebSocket messages.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "jsonmessagereader.h"
+#include <algorithm>
+#include <string.h>
+
+
+JsonMessageReader::JsonMessageReader(Document &doc)
+    : mDoc(doc), mPacking(false), mSkipDepth(0)
+{}
+
+bool JsonMessageReader::parseInsitu(Document &doc, char *text, const char *&error, size_t &errorOffset)
+{
+    JsonMessageReader handler(doc);
+    rapidjson::GenericReader<rapidjson::UTF8<>, Document::AllocatorType> reader;
+    rapidjson::InsituStringStream stream(text);
+
+    if (!reader.Parse<rapidjson::kParseInsituFlag>(stream, handler)) {
+        doc.SetNull();
+        error = reader.GetParseError();
+        errorOffset = reader.GetErrorOffset();
+        return false;
+    }
+
+    return true;
+}
+
+const uint8_t *JsonMessageReader::pixelBytes(const Value &pixels, std::vector<uint8_t> &scratch, unsigned &length)
+{
+    if (pixels.IsString()) {
+        length = pixels.GetStringLength();
+        return (const uint8_t*) pixels.GetString();
+    }
+
+    if (!pixels.IsArray()) {
+        return 0;
+    }
+
+    length = pixels.Size();
+    scratch.resize(length);
+    for (unsigned i = 0; i < length; i++) {
+        const Value &v = pixels[i];
+        scratch[i] = clampComponent(v.IsInt() ? v.GetInt() : 0);
+    }
+    return length ? &scratch[0] : (const uint8_t*) "";
+}
+
+uint8_t JsonMessageReader::clampComponent(int value)
+{
+    return std::max(0, std::min(255, value));
+}
+
+void JsonMessageReader::pack(uint8_t value)
+{
+    // Nested containers count as a single (zero) element, like any other non-integer
+    if (mSkipDepth == 0) {
+        mPixels.push_back(value);
+    }
+}
+
+JsonMessageReader::Value *JsonMessageReader::add(Value &value)
+{
+    if (mStack.empty()) {
+        static_cast<Value&>(mDoc) = value;
+        return &mDoc;
+    }
+
+    Frame &parent = mStack.back();
+    Document::AllocatorType &alloc = mDoc.GetAllocator();
+
+    if (parent.value->IsArray()) {
+        parent.value->PushBack(value, alloc);
+        return &(*parent.value)[parent.value->Size() - 1];
+    }
+
+    parent.value->AddMember(mKey, value, alloc);
+    parent.expectingKey = true;
+    return &(parent.value->MemberEnd() - 1)->value;
+}
+
+void JsonMessageReader::Null()
+{
+    if (mPacking) return pack(0);
+    Value v;
+    add(v);
+}
+
+void JsonMessageReader::Bool(bool b)
+{
+    if (mPacking) return pack(0);
+    Value v(b);
+    add(v);
+}
+
+void JsonMessageReader::Int(int i)
+{
+    if (mPacking) return pack(clampComponent(i));
+    Value v(i);
+    add(v);
+}
+
+void JsonMessageReader::Uint(unsigned u)
+{
+    if (mPacking) return pack(u <= 0x7FFFFFFF ? clampComponent(u) : 0);
+    Value v(u);
+    add(v);
+}
+
+void JsonMessageReader::Int64(int64_t i)
+{
+    if (mPacking) return pack(0);
+    Value v(i);
+    add(v);
+}
+
+void JsonMessageReader::Uint64(uint64_t u)
+{
+    if (mPacking) return pack(0);
+    Value v(u);
+    add(v);
+}
+
+void JsonMessageReader::Double(double d)
+{
+    if (mPacking) return pack(0);
+    Value v(d);
+    add(v);
+}
+
+void JsonMessageReader::String(const char *str, SizeType length, bool copy)
+{
+    if (mPacking) return pack(0);
+
+    Value v;
+    if (copy) {
+        v.SetString(str, length, mDoc.GetAllocator());
+    } else {
+        v.SetString(str, length);
+    }
+
+    if (!mStack.empty() && mStack.back().expectingKey) {
+        mKey = v;
+        mStack.back().expectingKey = false;
+        return;
+    }
+
+    add(v);
+}
+
+void JsonMessageReader::StartObject()
+{
+    if (mPacking) {
+        pack(0);
+        mSkipDepth++;
+        return;
+    }
+
+    Value v(rapidjson::kObjectType);
+    Frame f = { add(v), true };
+    mStack.push_back(f);
+}
+
+void JsonMessageReader::EndObject(SizeType memberCount)
+{
+    if (mPacking) {
+        mSkipDepth--;
+        return;
+    }
+    mStack.pop_back();
+}
+
+void JsonMessageReader::StartArray()
+{
+    if (mPacking) {
+        pack(0);
+        mSkipDepth++;
+        return;
+    }
+
+    if (mStack.size() == 1 && mStack.back().expectingKey == false && mStack.back().value->IsObject() &&
+        !strcmp(mKey.GetString(), "pixels")) {
+        // Top-level pixel array; pack it instead of building a DOM
+        mPacking = true;
+        mPixels.clear();
+        return;
+    }
+
+    Value v(rapidjson::kArrayType);
+    Frame f = { add(v), false };
+    mStack.push_back(f);
+}
+
+void JsonMessageReader::EndArray(SizeType elementCount)
+{
+    if (mPacking && mSkipDepth) {
+        mSkipDepth--;
+        return;
+    }
+
+    if (mPacking) {
+        mPacking = false;
+        Value v;
+        v.SetString(mPixels.empty() ? "" : (const char*) &mPixels[0], mPixels.size(), mDoc.GetAllocator());
+        add(v);
+        return;
+    }
+
+    mStack.pop_back();
+}
@@ -0,0 +1,89 @@
+/*
+ * Streaming JSON reader for incoming WebSocket messages.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+#include <stdint.h>
+#include <vector>
+
+
+class JsonMessageReader
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::Document Document;
+    typedef rapidjson::SizeType SizeType;
+
+    /*
+     * Parse a JSON message in-place, building a Document much like
+     * Document::ParseInsitu() would. The exception is a top-level "pixels"
+     * array: its elements are packed straight into a string of bytes as they
+     * stream past, clamped to [0, 255], rather than allocating a Value for
+     * every color component. Returns false on a parse error.
+     */
+    static bool parseInsitu(Document &doc, char *text, const char *&error, size_t &errorOffset);
+
+    /*
+     * Locate the packed pixel bytes in a message parsed by parseInsitu(). As a
+     * fallback for Documents built any other way, an integer array is packed
+     * into 'scratch'. Returns 0 if there are no pixels.
+     */
+    static const uint8_t *pixelBytes(const Value &pixels, std::vector<uint8_t> &scratch, unsigned &length);
+
+    // SAX handler interface, for rapidjson::GenericReader
+    void Null();
+    void Bool(bool b);
+    void Int(int i);
+    void Uint(unsigned u);
+    void Int64(int64_t i);
+    void Uint64(uint64_t u);
+    void Double(double d);
+    void String(const char *str, SizeType length, bool copy);
+    void StartObject();
+    void EndObject(SizeType memberCount);
+    void StartArray();
+    void EndArray(SizeType elementCount);
+
+private:
+    struct Frame {
+        Value *value;
+        bool expectingKey;
+    };
+
+    JsonMessageReader(Document &doc);
+
+    Document &mDoc;
+    std::vector<Frame> mStack;
+    Value mKey;
+
+    // Packing state for the top-level "pixels" array
+    bool mPacking;
+    unsigned mSkipDepth;
+    std::vector<uint8_t> mPixels;
+
+    static uint8_t clampComponent(int value);
+    void pack(uint8_t value);
+    Value *add(Value &value);
+};
@@ -27,6 +27,7 @@
 #include "fcserver.h"
 #include "version.h"
 #include <cstdio>
+#include <csignal>
 #include <iostream>
 
 const char *kDefaultConfig =
@@ -50,14 +51,28 @@ const char *kDefaultConfig =
 
 const char *kSystemConfigPath = "/etc/fcserver/config.json";
 
+static FCServer *gServer;
+
+#ifdef SIGHUP
+static void onHangup(int)
+{
+    // Reload the config file, without dropping devices or connections
+    if (gServer) {
+        gServer->requestReload();
+    }
+}
+#endif
+
 int main(int argc, char **argv)
 {
     rapidjson::Document config;
+    const char *configPath = 0;
 
     libusb_context *usb;
     if (libusb_init(&usb)) {
-        std::clog << "Error initializing USB library!\n";
-        return 7;
+        // Keep going; virtual and network devices don't need USB
+        std::clog << "Error initializing USB library! Continuing without USB devices.\n";
+        usb = 0;
     }
 
     if (argc == 2 && argv[1][0] != '-') {
@@ -71,6 +86,7 @@ int main(int argc, char **argv)
 
         rapidjson::FileStream istr(configFile);
         config.ParseStream<0>(istr);
+        configPath = argv[1];
 
     } else if (argc == 1) {
         // Load default configuration
@@ -80,6 +96,7 @@ int main(int argc, char **argv)
             std::clog << "Using system config at " << kSystemConfigPath << "\n";
             rapidjson::FileStream istr(configFile);
             config.ParseStream<0>(istr);
+            configPath = kSystemConfigPath;
 
         } else {
             std::clog << "No system config file found, using default\n";
@@ -122,7 +139,7 @@ int main(int argc, char **argv)
         return 3;
     }
 
-    FCServer server(config);
+    FCServer server(config, configPath);
     if (server.hasError()) {
         fprintf(stderr, "Configuration errors:\n%s", server.errorText());
         return 5;
@@ -131,6 +148,11 @@ int main(int argc, char **argv)
         return 9;
     }
 
+    gServer = &server;
+#ifdef SIGHUP
+    signal(SIGHUP, onHangup);
+#endif
+
     server.mainLoop();
 
     // If mainLoop() exits, it was an error
@@ -0,0 +1,163 @@
+/*
+ * Counters and Prometheus text exposition for the /metrics HTTP endpoint.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "metrics.h"
+#include <stdio.h>
+
+
+MetricsWriter::Labels &MetricsWriter::Labels::add(const char *name, const char *value)
+{
+    if (!mText.empty()) {
+        mText += ',';
+    }
+    mText += name;
+    mText += "=\"";
+
+    // Label values escape backslash, double-quote, and line feed
+    for (const char *p = value; *p; p++) {
+        switch (*p) {
+            case '\\':  mText += "\\\\"; break;
+            case '"':   mText += "\\\""; break;
+            case '\n':  mText += "\\n"; break;
+            default:    mText += *p; break;
+        }
+    }
+
+    mText += '"';
+    return *this;
+}
+
+MetricsWriter::Labels &MetricsWriter::Labels::add(const char *name, unsigned value)
+{
+    char buffer[16];
+    snprintf(buffer, sizeof buffer, "%u", value);
+    return add(name, buffer);
+}
+
+void MetricsWriter::counter(const char *name, const char *help, const Labels &labels, uint64_t value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%llu", (unsigned long long) value);
+    sample(name, help, "counter", labels, buffer);
+}
+
+void MetricsWriter::counter(const char *name, const char *help, const Labels &labels, double value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%.9g", value);
+    sample(name, help, "counter", labels, buffer);
+}
+
+void MetricsWriter::gauge(const char *name, const char *help, const Labels &labels, double value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%.9g", value);
+    sample(name, help, "gauge", labels, buffer);
+}
+
+void MetricsWriter::histogram(const char *name, const char *help, const Labels &labels,
+    const double *bounds, const uint64_t *counts, unsigned numBounds, double sum)
+{
+    char buffer[32];
+    uint64_t total = 0;
+
+    for (unsigned i = 0; i <= numBounds; i++) {
+        total += counts[i];
+
+        Labels bucket = labels;
+        if (i < numBounds) {
+            snprintf(buffer, sizeof buffer, "%.9g", bounds[i]);
+            bucket.add("le", buffer);
+        } else {
+            bucket.add("le", "+Inf");
+        }
+
+        snprintf(buffer, sizeof buffer, "%llu", (unsigned long long) total);
+        sample(name, help, "histogram", bucket, buffer, "_bucket");
+    }
+
+    snprintf(buffer, sizeof buffer, "%.9g", sum);
+    sample(name, help, "histogram", labels, buffer, "_sum");
+    snprintf(buffer, sizeof buffer, "%llu", (unsigned long long) total);
+    sample(name, help, "histogram", labels, buffer, "_count");
+}
+
+void MetricsWriter::loop(const char *thread, const MetricLoop &loop)
+{
+    Labels labels;
+    labels.add("thread", thread);
+
+    counter("fcserver_thread_loops_total",
+        "Event loop iterations, by thread", labels, loop.iterations.value());
+    counter("fcserver_thread_busy_seconds_total",
+        "Time each event loop spent working rather than waiting", labels, loop.busyMicros.value() * 1e-6);
+}
+
+void MetricsWriter::sample(const char *name, const char *help, const char *type,
+    const Labels &labels, const char *value, const char *suffix)
+{
+    std::map<std::string, unsigned>::iterator i = mFamilyIndex.find(name);
+    Family *family;
+
+    if (i == mFamilyIndex.end()) {
+        mFamilyIndex[name] = mFamilies.size();
+        mFamilies.push_back(Family());
+        family = &mFamilies.back();
+        family->name = name;
+        family->help = help;
+        family->type = type;
+    } else {
+        family = &mFamilies[i->second];
+    }
+
+    family->samples += name;
+    family->samples += suffix;
+    if (!labels.str().empty()) {
+        family->samples += '{';
+        family->samples += labels.str();
+        family->samples += '}';
+    }
+    family->samples += ' ';
+    family->samples += value;
+    family->samples += '\n';
+}
+
+std::string MetricsWriter::text() const
+{
+    std::string text;
+
+    for (std::vector<Family>::const_iterator i = mFamilies.begin(); i != mFamilies.end(); ++i) {
+        text += "# HELP ";
+        text += i->name;
+        text += ' ';
+        text += i->help;
+        text += "\n# TYPE ";
+        text += i->name;
+        text += ' ';
+        text += i->type;
+        text += '\n';
+        text += i->samples;
+    }
+
+    return text;
+}
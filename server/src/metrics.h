@@ -0,0 +1,134 @@
+/*
+ * Counters and Prometheus text exposition for the /metrics HTTP endpoint.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "monotonic.h"
+
+
+/*
+ * A counter with a single writer: one thread, or threads that only write it
+ * under the same lock. Any thread may read it at any time, without locks. Each
+ * thread keeps its own counters, and they're only added up when the metrics
+ * endpoint is scraped.
+ *
+ * Updates are a plain increment, with no locked instruction. On 64-bit targets
+ * an aligned 64-bit load or store is a single access, so readers always see a
+ * whole value. On 32-bit targets it takes two, and a scrape that races with a
+ * carry into the high word can see a value that's off by up to 2^32 once.
+ */
+class MetricCounter
+{
+public:
+    MetricCounter() : mValue(0) {}
+
+    // Writer only
+    void add(uint64_t n = 1) { mValue = mValue + n; }
+
+    uint64_t value() const { return mValue; }
+
+private:
+    volatile uint64_t mValue;
+};
+
+
+/*
+ * Iterations of an event loop, and the time it spent working between waits.
+ * The loop's thread calls wait() just before blocking and resume() right after.
+ */
+class MetricLoop
+{
+public:
+    MetricLoop() : mResumed(0) {}
+
+    void resume()
+    {
+        mResumed = Monotonic::micros();
+        iterations.add();
+    }
+
+    void wait()
+    {
+        if (mResumed) {
+            busyMicros.add(Monotonic::micros() - mResumed);
+        }
+    }
+
+    MetricCounter iterations;
+    MetricCounter busyMicros;
+
+private:
+    uint64_t mResumed;
+};
+
+
+/*
+ * Collects samples in any order, and writes them grouped into metric
+ * families as Prometheus text format version 0.0.4.
+ */
+class MetricsWriter
+{
+public:
+    // A label set, written as Prometheus text: name="value",...
+    class Labels {
+    public:
+        Labels &add(const char *name, const char *value);
+        Labels &add(const char *name, unsigned value);
+        const std::string &str() const { return mText; }
+
+    private:
+        std::string mText;
+    };
+
+    // Counters only go up; gauges can go either way. Counter names should end in _total.
+    void counter(const char *name, const char *help, const Labels &labels, uint64_t value);
+    void counter(const char *name, const char *help, const Labels &labels, double value);
+    void gauge(const char *name, const char *help, const Labels &labels, double value);
+
+    // Histogram from per-bucket (not cumulative) counts. There's one more count than bounds,
+    // for observations above the last bound.
+    void histogram(const char *name, const char *help, const Labels &labels,
+        const double *bounds, const uint64_t *counts, unsigned numBounds, double sum);
+
+    // Per-thread loop metrics, labelled with the thread's name
+    void loop(const char *thread, const MetricLoop &loop);
+
+    std::string text() const;
+
+private:
+    struct Family {
+        std::string name;
+        const char *help;
+        const char *type;
+        std::string samples;
+    };
+
+    std::vector<Family> mFamilies;
+    std::map<std::string, unsigned> mFamilyIndex;
+
+    void sample(const char *name, const char *help, const char *type, const Labels &labels,
+        const char *value, const char *suffix = "");
+};
@@ -0,0 +1,61 @@
+/*
+ * Portable monotonic clock, for timing that mustn't jump when the wall clock does.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#if defined(_WIN32)
+  #include <windows.h>
+#elif defined(__APPLE__)
+  #include <mach/mach_time.h>
+#else
+  #include <time.h>
+#endif
+
+namespace Monotonic {
+
+    // Microseconds since some arbitrary point in the past
+    inline uint64_t micros()
+    {
+        #if defined(_WIN32)
+            LARGE_INTEGER count, frequency;
+            QueryPerformanceCounter(&count);
+            QueryPerformanceFrequency(&frequency);
+            return uint64_t(count.QuadPart / frequency.QuadPart) * 1000000 +
+                uint64_t(count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+
+        #elif defined(__APPLE__)
+            static mach_timebase_info_data_t timebase;
+            if (!timebase.denom) {
+                mach_timebase_info(&timebase);
+            }
+            return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+
+        #else
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+        #endif
+    }
+
+}
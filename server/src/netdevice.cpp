@@ -0,0 +1,550 @@
+/*
+ * Abstract base class for DMX-over-IP output devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "netdevice.h"
+#include "monotonic.h"
+#include <sstream>
+#include <iostream>
+#include <string.h>
+
+#ifndef _WIN32
+  #include <netdb.h>
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <errno.h>
+#endif
+
+#ifdef _WIN32
+  static const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+  static const int kInvalidSocket = -1;
+#endif
+
+
+NetDevice::NetDevice(const char *type, bool verbose)
+    : mTypeString(type),
+      mVerbose(verbose),
+      mPort(0),
+      mFirstUniverse(0),
+      mNumUniverses(0),
+      mSync(false),
+      mSyncUniverse(0),
+      mSocket(kInvalidSocket),
+      mConfig(0),
+      mPreparedConfig(0),
+      mSequence(0),
+      mSyncLength(0)
+{
+    gettimeofday(&mTimestamp, NULL);
+    memset(&mStats, 0, sizeof mStats);
+    memset(&mSyncDestination, 0, sizeof mSyncDestination);
+}
+
+NetDevice::~NetDevice()
+{
+    closeSocket();
+}
+
+void NetDevice::closeSocket()
+{
+    if (mSocket != kInvalidSocket) {
+        #ifdef _WIN32
+            closesocket(mSocket);
+        #else
+            ::close(mSocket);
+        #endif
+        mSocket = kInvalidSocket;
+    }
+}
+
+int NetDevice::open(const Value &config)
+{
+    /*
+     * Read the addressing parts of the configuration, and open a non-blocking
+     * UDP socket. All destination addresses are resolved here, so sending a
+     * frame never has to wait on DNS.
+     */
+
+    const Value &vhost = config["host"];
+    const Value &vport = config["port"];
+    const Value &vuniverse = config["universe"];
+    const Value &vuniverses = config["universes"];
+    const Value &vsync = config["sync"];
+    const Value &vsyncUniverse = config["syncUniverse"];
+
+    if (vhost.IsString()) {
+        mHost = vhost.GetString();
+    } else if (!vhost.IsNull()) {
+        if (mVerbose) {
+            std::clog << "Network device 'host' must be a string.\n";
+        }
+        return -1;
+    }
+
+    mPort = vport.IsUint() ? vport.GetUint() : defaultPort();
+    mFirstUniverse = vuniverse.IsUint() ? vuniverse.GetUint() : minUniverse();
+    mNumUniverses = vuniverses.IsUint() ? vuniverses.GetUint() : 1;
+    mSync = vsync.IsTrue();
+    mSyncUniverse = vsyncUniverse.IsUint() ? vsyncUniverse.GetUint() : mFirstUniverse;
+
+    if (mPort == 0 || mPort > 0xFFFF) {
+        if (mVerbose) {
+            std::clog << "Network device 'port' must be a UDP port number.\n";
+        }
+        return -1;
+    }
+
+    if (mNumUniverses == 0 || mFirstUniverse < minUniverse() ||
+        mFirstUniverse > maxUniverse() || mNumUniverses - 1 > maxUniverse() - mFirstUniverse ||
+        mSyncUniverse < minUniverse() || mSyncUniverse > maxUniverse()) {
+        if (mVerbose) {
+            std::clog << "Network device universes must be between " << minUniverse()
+                      << " and " << maxUniverse() << ".\n";
+        }
+        return -1;
+    }
+
+    mDestinations.resize(mNumUniverses);
+    for (unsigned i = 0; i < mNumUniverses; i++) {
+        if (!destinationFor(mDestinations[i], mFirstUniverse + i)) {
+            return -1;
+        }
+    }
+    if (mSync && !destinationFor(mSyncDestination, mSyncUniverse)) {
+        return -1;
+    }
+
+    mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (mSocket == kInvalidSocket) {
+        if (mVerbose) {
+            std::clog << "Can't create UDP socket for " << getName() << "\n";
+        }
+        return -1;
+    }
+
+    // Art-Net nodes are often addressed by subnet broadcast
+    int enable = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_BROADCAST, (const char*) &enable, sizeof enable);
+
+    // Never stall the OPC event path; a full socket buffer just drops the frame
+    #ifdef _WIN32
+        u_long nonBlocking = 1;
+        ioctlsocket(mSocket, FIONBIO, &nonBlocking);
+    #else
+        fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+
+    return 0;
+}
+
+bool NetDevice::defaultDestination(sockaddr_in &addr, unsigned universe)
+{
+    // By default, there's no way to find a node without being told its address
+    return false;
+}
+
+bool NetDevice::destinationFor(sockaddr_in &addr, unsigned universe)
+{
+    if (!mHost.empty()) {
+        return resolveHost(addr, mHost.c_str());
+    }
+
+    if (defaultDestination(addr, universe)) {
+        addr.sin_port = htons(mPort);
+        return true;
+    }
+
+    if (mVerbose) {
+        std::clog << "Network device of type '" << mTypeString << "' requires a 'host'.\n";
+    }
+    return false;
+}
+
+bool NetDevice::resolveHost(sockaddr_in &addr, const char *host)
+{
+    struct addrinfo hints;
+    struct addrinfo *result = 0;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int err = getaddrinfo(host, 0, &hints, &result);
+    if (err || !result) {
+        if (mVerbose) {
+            std::clog << "Can't resolve network device host '" << host << "': " << gai_strerror(err) << "\n";
+        }
+        return false;
+    }
+
+    memcpy(&addr, result->ai_addr, sizeof addr);
+    addr.sin_port = htons(mPort);
+    freeaddrinfo(result);
+    return true;
+}
+
+bool NetDevice::matchConfiguration(const Value &config)
+{
+    if (!config.IsObject()) {
+        return false;
+    }
+
+    const Value &vtype = config["type"];
+    const Value &vhost = config["host"];
+    const Value &vuniverse = config["universe"];
+
+    if (!vtype.IsNull() && (!vtype.IsString() || strcmp(vtype.GetString(), mTypeString))) {
+        return false;
+    }
+
+    if (vhost.IsString() && mHost != vhost.GetString()) {
+        return false;
+    }
+
+    if (!vuniverse.IsNull() && (!vuniverse.IsUint() || vuniverse.GetUint() != mFirstUniverse)) {
+        return false;
+    }
+
+    return true;
+}
+
+const NetDevice::Value *NetDevice::findConfigMap(const Value &config)
+{
+    const Value &vmap = config["map"];
+
+    if (vmap.IsArray()) {
+        // The map is optional, but if it exists it needs to be an array.
+        return &vmap;
+    }
+
+    if (!vmap.IsNull() && mVerbose) {
+        std::clog << "Device configuration 'map' must be an array.\n";
+    }
+
+    return 0;
+}
+
+void NetDevice::loadConfiguration(const Value &config)
+{
+    /*
+     * Each universe becomes one datagram: a protocol header followed by 512 DMX
+     * channels. Headers are formatted once, here, and only their sequence numbers
+     * change from frame to frame. The map addresses the channel data as RGB pixels,
+     * 170 to a universe, with the last two channels of each universe left unused.
+     */
+
+    unsigned hlen = headerLength();
+
+    mHeaders.assign(mNumUniverses * hlen, 0);
+    mChannels.assign(mNumUniverses * CHANNELS_PER_UNIVERSE, 0);
+
+    for (unsigned i = 0; i < mNumUniverses; i++) {
+        formatHeader(&mHeaders[i * hlen], mFirstUniverse + i);
+    }
+
+    mSyncLength = mSync ? formatSync(mSyncPacket, mSequence) : 0;
+
+    /*
+     * DMX can't refresh much faster than 44 Hz, so that's the default output
+     * rate while interpolating. With interpolation on, the map draws keyframes
+     * and mChannels holds blends of them.
+     */
+
+    mInterpolator.setup(&mChannels[0], mChannels.size(),
+        Interpolator::parseConfiguration(config, 44, mVerbose));
+
+    PixelMap::Layout layout;
+    mapLayout(layout);
+    mMap.load(findConfigMap(config), layout, mVerbose);
+    mConfig = &config;
+
+    // Scatter-gather lists point straight at the buffers above, which don't move again
+    unsigned numPackets = mNumUniverses + (mSyncLength ? 1 : 0);
+    mBuffers.resize(numPackets * 2);
+
+    for (unsigned i = 0; i < numPackets; i++) {
+        uint8_t *header, *data;
+        unsigned headerLen, dataLen;
+
+        if (i < mNumUniverses) {
+            header = &mHeaders[i * hlen];
+            headerLen = hlen;
+            data = &mChannels[i * CHANNELS_PER_UNIVERSE];
+            dataLen = CHANNELS_PER_UNIVERSE;
+        } else {
+            header = mSyncPacket;
+            headerLen = mSyncLength;
+            data = mSyncPacket + mSyncLength;
+            dataLen = 0;
+        }
+
+        #ifdef _WIN32
+            mBuffers[2*i].buf = (char*) header;
+            mBuffers[2*i].len = headerLen;
+            mBuffers[2*i+1].buf = (char*) data;
+            mBuffers[2*i+1].len = dataLen;
+        #else
+            mBuffers[2*i].iov_base = header;
+            mBuffers[2*i].iov_len = headerLen;
+            mBuffers[2*i+1].iov_base = data;
+            mBuffers[2*i+1].iov_len = dataLen;
+        #endif
+    }
+
+    #ifdef NETDEVICE_HAS_SENDMMSG
+        mMessages.resize(numPackets);
+        memset(&mMessages[0], 0, numPackets * sizeof mMessages[0]);
+
+        for (unsigned i = 0; i < numPackets; i++) {
+            msghdr &hdr = mMessages[i].msg_hdr;
+            hdr.msg_name = i < mNumUniverses ? &mDestinations[i] : &mSyncDestination;
+            hdr.msg_namelen = sizeof(sockaddr_in);
+            hdr.msg_iov = &mBuffers[2*i];
+            hdr.msg_iovlen = 2;
+        }
+    #endif
+}
+
+void NetDevice::prepareConfiguration(const Value &config)
+{
+    PixelMap::Layout layout;
+    mapLayout(layout);
+    mPreparedMap.load(findConfigMap(config), layout, mVerbose);
+    mPreparedConfig = &config;
+}
+
+void NetDevice::commitConfiguration()
+{
+    if (mPreparedConfig) {
+        mMap.swap(mPreparedMap);
+        mConfig = mPreparedConfig;
+        mPreparedConfig = 0;
+    }
+}
+
+void NetDevice::mapLayout(PixelMap::Layout &layout)
+{
+    layout.base = mInterpolator.keyframe();
+    layout.lowBase = 0;
+    layout.numPixels = mNumUniverses * PIXELS_PER_UNIVERSE;
+    layout.pixelsPerBlock = PIXELS_PER_UNIVERSE;
+    layout.blockStride = CHANNELS_PER_UNIVERSE;
+    layout.pixelStride = 3;
+    layout.colorOffsets[0] = 0;
+    layout.colorOffsets[1] = 1;
+    layout.colorOffsets[2] = 2;
+}
+
+void NetDevice::writeMessage(const OPC::Message &msg)
+{
+    /*
+     * Dispatch an incoming OPC command. Every SetPixelColors or SetPixelColors16
+     * message that touches this device's map sends a complete frame, one datagram
+     * per universe, or with interpolation, starts blending toward a new keyframe.
+     * DMX channels are 8-bit, so 16-bit color is rounded.
+     */
+
+    if (OPC::pixelBytes(msg.command) && mMap.hasChannel(msg.channel)) {
+        mMap.apply(msg);
+        if (mInterpolator.push(Monotonic::micros())) {
+            writeUniverses();
+        }
+    }
+}
+
+void NetDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    // Map every part we use, then send one datagram per universe for the whole frame
+    bool mapped = false;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (mMap.hasChannel(parts[i]->channel)) {
+            mMap.apply(*parts[i]);
+            mapped = true;
+        }
+    }
+
+    if (mapped && mInterpolator.push(Monotonic::micros())) {
+        writeUniverses();
+    }
+}
+
+void NetDevice::interpolate(uint64_t now)
+{
+    if (mInterpolator.update(now)) {
+        writeUniverses();
+    }
+}
+
+void NetDevice::writeUniverses()
+{
+    if (mSocket == kInvalidSocket || mNumUniverses == 0) {
+        return;
+    }
+
+    // Art-Net reserves sequence zero to mean "not sequenced"
+    mSequence = mSequence == 0xFF ? 1 : mSequence + 1;
+
+    unsigned hlen = headerLength();
+    for (unsigned i = 0; i < mNumUniverses; i++) {
+        setSequence(&mHeaders[i * hlen], mSequence);
+    }
+    if (mSyncLength) {
+        formatSync(mSyncPacket, mSequence);
+    }
+
+    mStats.frames++;
+    sendPackets(mNumUniverses + (mSyncLength ? 1 : 0));
+}
+
+void NetDevice::sendPackets(unsigned count)
+{
+    unsigned sent = 0;
+    uint64_t errors = 0;
+
+    while (sent < count) {
+        #if defined(NETDEVICE_HAS_SENDMMSG)
+            // Batched; if a datagram is refused, count it and carry on with the next
+            int r = sendmmsg(mSocket, &mMessages[sent], count - sent, 0);
+            if (r <= 0) {
+                errors++;
+                sent++;
+            } else {
+                mStats.packets += r;
+                sent += r;
+            }
+
+        #else
+            const sockaddr_in *dest = sent < mNumUniverses ? &mDestinations[sent] : &mSyncDestination;
+
+            #ifdef _WIN32
+                DWORD bytes;
+                int r = WSASendTo(mSocket, &mBuffers[2*sent], 2, &bytes, 0,
+                    (const sockaddr*) dest, sizeof *dest, NULL, NULL);
+                bool ok = r == 0;
+            #else
+                msghdr hdr;
+                memset(&hdr, 0, sizeof hdr);
+                hdr.msg_name = (void*) dest;
+                hdr.msg_namelen = sizeof *dest;
+                hdr.msg_iov = &mBuffers[2*sent];
+                hdr.msg_iovlen = 2;
+                bool ok = sendmsg(mSocket, &hdr, 0) >= 0;
+            #endif
+
+            if (ok) {
+                mStats.packets++;
+            } else {
+                errors++;
+            }
+            sent++;
+        #endif
+    }
+
+    if (errors) {
+        if (mVerbose && mStats.errors == 0) {
+            // Only the first failure; a missing node would otherwise flood the log at frame rate
+            std::clog << "Error sending to " << getName() << "\n";
+        }
+        mStats.errors += errors;
+    }
+}
+
+void NetDevice::writeColorCorrection(const Value &color)
+{
+    // Optional. By default, ignore color correction messages.
+}
+
+void NetDevice::writeMessage(Document &msg)
+{
+    const char *type = msg["type"].GetString();
+
+    if (!strcmp(type, "device_color_correction")) {
+        // Single-device color correction
+        writeColorCorrection(msg["color"]);
+        return;
+    }
+
+    msg.AddMember("error", "Unknown device-specific message type", msg.GetAllocator());
+}
+
+std::string NetDevice::getName()
+{
+    std::ostringstream s;
+    s << mTypeString << " universe " << mFirstUniverse;
+    if (mNumUniverses > 1) {
+        s << "-" << (mFirstUniverse + mNumUniverses - 1);
+    }
+    s << " at " << (mHost.empty() ? "multicast" : mHost.c_str()) << ":" << mPort;
+    return s.str();
+}
+
+void NetDevice::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    object.AddMember("type", mTypeString, alloc);
+
+    if (mHost.empty()) {
+        object.AddMember("host", rapidjson::kNullType, alloc);
+    } else {
+        object.AddMember("host", mHost.c_str(), alloc);
+    }
+
+    object.AddMember("port", mPort, alloc);
+    object.AddMember("universe", mFirstUniverse, alloc);
+    object.AddMember("universes", mNumUniverses, alloc);
+    object.AddMember("sync", mSync, alloc);
+
+    if (mInterpolator.enabled()) {
+        object.AddMember("outputRate", mInterpolator.rate(), alloc);
+    }
+
+    /*
+     * The connection timestamp lets a particular connection instance be identified
+     * reliably, even if the same device connects and disconnects.
+     *
+     * We encode the timestamp as 64-bit millisecond count, so we don't have to worry about
+     * the portability of string/float conversions. This also matches a common JS format.
+     */
+
+    uint64_t timestamp = (uint64_t)mTimestamp.tv_sec * 1000 + mTimestamp.tv_usec / 1000;
+    object.AddMember("timestamp", timestamp, alloc);
+
+    Value stats(rapidjson::kObjectType);
+    stats.AddMember("frames", mStats.frames, alloc);
+    stats.AddMember("packets", mStats.packets, alloc);
+    stats.AddMember("errors", mStats.errors, alloc);
+    object.AddMember("stats", stats, alloc);
+}
+
+void NetDevice::writeMetrics(MetricsWriter &metrics)
+{
+    MetricsWriter::Labels labels;
+    labels.add("type", mTypeString).add("host", mHost.c_str()).add("universe", mFirstUniverse);
+
+    metrics.counter("fcserver_device_frames_total",
+        "Frames sent to each device", labels, mStats.frames);
+    metrics.counter("fcserver_device_packets_total",
+        "UDP packets sent to each network device", labels, mStats.packets);
+    metrics.counter("fcserver_device_errors_total",
+        "Transfers or packets that failed, by device", labels, mStats.errors);
+}
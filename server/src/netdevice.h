@@ -0,0 +1,182 @@
+/*
+ * Abstract base class for DMX-over-IP output devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "rapidjson/document.h"
+#include "opc.h"
+#include "pixelmap.h"
+#include "metrics.h"
+#include "interpolator.h"
+#include <libusb.h> // Also brings in gettimeofday() in a portable way
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+#else
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/uio.h>
+  #include <netinet/in.h>
+#endif
+
+#ifdef __linux__
+  // Linux can hand the kernel a whole frame's worth of datagrams in one system call
+  #define NETDEVICE_HAS_SENDMMSG
+#endif
+
+
+class NetDevice
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::Document Document;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    NetDevice(const char *type, bool verbose);
+    virtual ~NetDevice();
+
+    // Must be opened before any other methods are called. Negative on error.
+    virtual int open(const Value &config);
+
+    // Check a configuration. Does it describe this device?
+    virtual bool matchConfiguration(const Value &config);
+
+    // Load a matching configuration
+    virtual void loadConfiguration(const Value &config);
+
+    /*
+     * A live reload keeps any device whose entry changed only in its map.
+     * prepareConfiguration() compiles the new map without the event lock, and
+     * commitConfiguration() swaps it in once the lock is held.
+     */
+    virtual void prepareConfiguration(const Value &config);
+    virtual void commitConfiguration();
+
+    // The configuration entry in use, or 0 before one is loaded
+    const Value *getConfiguration() { return mConfig; }
+
+    // Handle an incoming OPC message
+    virtual void writeMessage(const OPC::Message &msg);
+
+    // Handle the Set Pixel Colors messages that make up one multi-channel frame
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
+
+    // Handle a device-specific JSON message
+    virtual void writeMessage(Document &msg);
+
+    // Write color LUT from parsed JSON
+    virtual void writeColorCorrection(const Value &color);
+
+    // Describe this device by adding keys to a JSON object
+    virtual void describe(Value &object, Allocator &alloc);
+
+    // Add this device's counters to a metrics scrape
+    virtual void writeMetrics(MetricsWriter &metrics);
+
+    // Timed output between frames. When interpolate() should be called next, or 0 if there's nothing to do.
+    uint64_t interpolationDeadline() { return mInterpolator.deadline(); }
+    void interpolate(uint64_t now);
+
+    virtual std::string getName();
+
+    const char *getTypeString() { return mTypeString; }
+
+protected:
+    static const unsigned CHANNELS_PER_UNIVERSE = 512;
+    static const unsigned PIXELS_PER_UNIVERSE = 170;
+    static const unsigned MAX_HEADER_LENGTH = 128;
+    static const unsigned MAX_SYNC_LENGTH = 64;
+
+    // Protocol details, implemented by each subclass
+    virtual unsigned defaultPort() = 0;
+    virtual unsigned minUniverse() = 0;
+    virtual unsigned maxUniverse() = 0;
+    virtual bool defaultDestination(sockaddr_in &addr, unsigned universe);
+    virtual unsigned headerLength() = 0;
+    virtual void formatHeader(uint8_t *header, unsigned universe) = 0;
+    virtual void setSequence(uint8_t *header, uint8_t sequence) = 0;
+    virtual unsigned formatSync(uint8_t *packet, uint8_t sequence) = 0;
+
+    struct timeval mTimestamp;
+    const char *mTypeString;
+    bool mVerbose;
+    std::string mHost;
+    unsigned mPort;
+    unsigned mFirstUniverse;
+    unsigned mNumUniverses;
+    bool mSync;
+    unsigned mSyncUniverse;
+
+private:
+    struct Stats {
+        uint64_t frames;
+        uint64_t packets;
+        uint64_t errors;
+    };
+
+#ifdef _WIN32
+    typedef SOCKET socket_t;
+    typedef WSABUF buffer_t;
+#else
+    typedef int socket_t;
+    typedef iovec buffer_t;
+#endif
+
+    socket_t mSocket;
+    PixelMap mMap;
+    Interpolator mInterpolator;
+    const Value *mConfig;
+
+    // Map compiled by prepareConfiguration(), and the entry it came from
+    PixelMap mPreparedMap;
+    const Value *mPreparedConfig;
+
+    uint8_t mSequence;
+    Stats mStats;
+
+    // One header and one universe of channel data per packet, plus the optional sync packet
+    std::vector<uint8_t> mHeaders;
+    std::vector<uint8_t> mChannels;
+    std::vector<sockaddr_in> mDestinations;
+    uint8_t mSyncPacket[MAX_SYNC_LENGTH];
+    unsigned mSyncLength;
+    sockaddr_in mSyncDestination;
+
+    // Scatter-gather lists, built once by loadConfiguration(). Two buffers per universe.
+    std::vector<buffer_t> mBuffers;
+#ifdef NETDEVICE_HAS_SENDMMSG
+    std::vector<mmsghdr> mMessages;
+#endif
+
+    // Utilities
+    const Value *findConfigMap(const Value &config);
+    void mapLayout(PixelMap::Layout &layout);
+    bool resolveHost(sockaddr_in &addr, const char *host);
+    bool destinationFor(sockaddr_in &addr, unsigned universe);
+    void closeSocket();
+    void writeUniverses();
+    void sendPackets(unsigned count);
+};
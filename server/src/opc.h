@@ -28,13 +28,17 @@ namespace OPC {
 
     enum Command {
         SetPixelColors = 0x00,
+        SetPixelColors16 = 0x02,    // Big-endian 16-bit R, G, B per pixel
         SystemExclusive = 0xFF,
     };
 
     // SysEx system and command IDs
     enum SysEx {
         FCSetGlobalColorCorrection = 0x00010001,
-        FCSetFirmwareConfiguration = 0x00010002
+        FCSetFirmwareConfiguration = 0x00010002,
+        FCSetDevicePixels = 0x00010003,
+        FCTimedPixelColors = 0x00010004,
+        FCMultiChannelPixelColors = 0x00010005
     };
 
     struct Message
@@ -57,8 +61,42 @@ namespace OPC {
 
     static const unsigned HEADER_BYTES = 4;
 
+    // The big-endian System and SysEx ID of a System Exclusive message, or 0 for anything else
+    inline unsigned sysExId(const Message &msg)
+    {
+        if (msg.command != SystemExclusive || msg.length() < 4) {
+            return 0;
+        }
+        return (unsigned(msg.data[0]) << 24) |
+               (unsigned(msg.data[1]) << 16) |
+               (unsigned(msg.data[2]) << 8)  |
+                unsigned(msg.data[3])        ;
+    }
+
+    // A Multi-Channel Pixel Colors message, carrying a whole frame
+    inline bool isMultiChannelFrame(const Message &msg)
+    {
+        return sysExId(msg) == FCMultiChannelPixelColors;
+    }
+
     typedef void (*callback_t)(Message &msg, void *context);
 
+    // Bytes per pixel in a message carrying pixels, or zero for other commands
+    inline unsigned pixelBytes(uint8_t command)
+    {
+        switch (command) {
+            case SetPixelColors:    return 3;
+            case SetPixelColors16:  return 6;
+            default:                return 0;
+        }
+    }
+
+    // Nearest 8-bit value to a 16-bit intensity, the inverse of multiplying by 257
+    inline uint8_t to8Bit(unsigned value16)
+    {
+        return uint8_t((value16 * 0xFF + 0x807F) >> 16);
+    }
+
     // Common idiom for choosing color channels based on a character string
     inline bool pickColorChannel(uint8_t &output, char selector, const uint8_t *rgb)
     {
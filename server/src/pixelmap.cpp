@@ -0,0 +1,323 @@
+/*
+ * Compiled pixel mapping, shared by all framebuffer-style output drivers.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pixelmap.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+
+// Largest pixel index that can appear in an OPC message
+static const unsigned kMaxOPCPixels = 0xFFFF / 3;
+
+bool PixelMap::spanChannelLess(const Span &a, const Span &b)
+{
+    return a.channel < b.channel;
+}
+
+PixelMap::PixelMap()
+{
+    clear();
+}
+
+void PixelMap::clear()
+{
+    mSpans.clear();
+    memset(mChannelIndex, 0, sizeof mChannelIndex);
+    mLowOffset = 0;
+}
+
+void PixelMap::swap(PixelMap &other)
+{
+    mSpans.swap(other.mSpans);
+    std::swap_ranges(mChannelIndex, mChannelIndex + NUM_CHANNELS + 1, other.mChannelIndex);
+    std::swap(mLowOffset, other.mLowOffset);
+}
+
+void PixelMap::load(const Value *map, const Layout &layout, bool verbose)
+{
+    /*
+     * Compile every instruction in a JSON map into a flat list of spans, then
+     * group them by OPC channel. Sorting is stable, so instructions that overlap
+     * still take effect in the order they were written.
+     */
+
+    std::vector<Span> spans;
+
+    if (map) {
+        for (unsigned i = 0, e = map->Size(); i != e; i++) {
+            const Value &inst = (*map)[i];
+
+            if (!compileInstruction(spans, inst, layout) && verbose) {
+                rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+                rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+                inst.Accept(writer);
+                std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+            }
+        }
+    }
+
+    std::stable_sort(spans.begin(), spans.end(), spanChannelLess);
+
+    unsigned s = 0;
+    for (unsigned channel = 0; channel <= NUM_CHANNELS; channel++) {
+        while (s < spans.size() && spans[s].channel < channel) {
+            s++;
+        }
+        mChannelIndex[channel] = s;
+    }
+
+    mSpans.swap(spans);
+    mLowOffset = layout.lowBase ? layout.lowBase - layout.base : 0;
+}
+
+bool PixelMap::parseColorChannels(uint8_t source[3], const char *str)
+{
+    for (unsigned i = 0; i < 3; i++) {
+        switch (str[i]) {
+            case 'r': case 'R':     source[i] = 0; break;
+            case 'g': case 'G':     source[i] = 1; break;
+            case 'b': case 'B':     source[i] = 2; break;
+            case 'l': case 'L':     source[i] = SOURCE_LUMINOSITY; break;
+            default:                return false;
+        }
+    }
+    return true;
+}
+
+bool PixelMap::compileInstruction(std::vector<Span> &spans, const Value &inst, const Layout &layout)
+{
+    /*
+     * Compile one JSON mapping instruction. This looks for any mapping
+     * instructions that we recognize:
+     *
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count, Color channels ]
+     *
+     * Returns false if the instruction isn't understood.
+     */
+
+    if (!inst.IsArray() || (inst.Size() != 4 && inst.Size() != 5)) {
+        return false;
+    }
+
+    const Value &vChannel = inst[0u];
+    const Value &vFirstOPC = inst[1];
+    const Value &vFirstOut = inst[2];
+    const Value &vCount = inst[3];
+
+    if (!(vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt())) {
+        return false;
+    }
+
+    uint8_t source[3] = { 0, 1, 2 };
+    if (inst.Size() == 5) {
+        const Value &vColorChannels = inst[4];
+        if (!vColorChannels.IsString() || vColorChannels.GetStringLength() != 3 ||
+            !parseColorChannels(source, vColorChannels.GetString())) {
+            return false;
+        }
+    }
+
+    unsigned channel = vChannel.GetUint();
+    unsigned firstOPC = vFirstOPC.GetUint();
+    unsigned firstOut = vFirstOut.GetUint();
+    unsigned count;
+    int direction;
+    if (vCount.GetInt() >= 0) {
+        count = vCount.GetInt();
+        direction = 1;
+    } else {
+        count = -vCount.GetInt();
+        direction = -1;
+    }
+
+    if (channel >= NUM_CHANNELS || firstOPC >= kMaxOPCPixels || layout.numPixels == 0) {
+        // Well-formed, but it can never match any message or output pixel
+        return true;
+    }
+
+    // Clamping, overflow-safe
+    count = std::min<unsigned>(count, kMaxOPCPixels - firstOPC);
+    if (direction > 0) {
+        if (firstOut >= layout.numPixels) {
+            return true;
+        }
+        count = std::min<unsigned>(count, layout.numPixels - firstOut);
+    } else {
+        if (firstOut >= layout.numPixels) {
+            // Skip the part of a reversed run that starts past the end of the framebuffer
+            unsigned skip = firstOut - (layout.numPixels - 1);
+            if (skip >= count) {
+                return true;
+            }
+            firstOPC += skip;
+            count -= skip;
+            firstOut = layout.numPixels - 1;
+        }
+        count = std::min<unsigned>(count, firstOut + 1);
+    }
+
+    Span span;
+    span.channel = channel;
+    span.outStride = direction * int(layout.pixelStride);
+    memcpy(span.source, source, sizeof span.source);
+    memcpy(span.dest, layout.colorOffsets, sizeof span.dest);
+
+    if (direction > 0 && layout.pixelStride == 3 &&
+        source[0] == 0 && source[1] == 1 && source[2] == 2 &&
+        span.dest[0] == 0 && span.dest[1] == 1 && span.dest[2] == 2) {
+        span.type = SPAN_COPY;
+    } else if (source[0] == SOURCE_LUMINOSITY || source[1] == SOURCE_LUMINOSITY ||
+               source[2] == SOURCE_LUMINOSITY) {
+        span.type = SPAN_LUMINOSITY;
+    } else {
+        span.type = SPAN_SHUFFLE;
+    }
+
+    // Split the run wherever it crosses a block boundary
+    unsigned outIndex = firstOut;
+    while (count) {
+        unsigned block = outIndex / layout.pixelsPerBlock;
+        unsigned blockPos = outIndex % layout.pixelsPerBlock;
+        unsigned n = direction > 0 ? layout.pixelsPerBlock - blockPos : blockPos + 1;
+        n = std::min<unsigned>(n, count);
+
+        span.firstOPC = firstOPC;
+        span.count = n;
+        span.out = layout.base + block * layout.blockStride + blockPos * layout.pixelStride;
+        spans.push_back(span);
+
+        firstOPC += n;
+        count -= n;
+        outIndex += direction * int(n);
+    }
+
+    return true;
+}
+
+void PixelMap::apply(const OPC::Message &msg) const
+{
+    unsigned pixelBytes = OPC::pixelBytes(msg.command);
+    if (!pixelBytes) {
+        return;
+    }
+
+    unsigned msgPixelCount = msg.length() / pixelBytes;
+    const Span *span = mSpans.empty() ? 0 : &mSpans[0] + mChannelIndex[msg.channel];
+    const Span *end = mSpans.empty() ? 0 : &mSpans[0] + mChannelIndex[msg.channel + 1];
+
+    for (; span != end; ++span) {
+        if (span->firstOPC >= msgPixelCount) {
+            continue;
+        }
+
+        unsigned count = std::min<unsigned>(span->count, msgPixelCount - span->firstOPC);
+        const uint8_t *in = msg.data + span->firstOPC * pixelBytes;
+
+        if (pixelBytes == 6) {
+            store16(*span, in, count, mLowOffset);
+        } else {
+            // 8-bit color expands to 16 bits by repeating the byte
+            store8(*span, in, count, span->out);
+            if (mLowOffset) {
+                store8(*span, in, count, span->out + mLowOffset);
+            }
+        }
+    }
+}
+
+void PixelMap::store8(const Span &span, const uint8_t *in, unsigned count, uint8_t *out)
+{
+    int stride = span.outStride;
+
+    switch (span.type) {
+
+        case SPAN_COPY:
+            memcpy(out, in, count * 3);
+            break;
+
+        case SPAN_SHUFFLE: {
+            const unsigned s0 = span.source[0], s1 = span.source[1], s2 = span.source[2];
+            const unsigned d0 = span.dest[0], d1 = span.dest[1], d2 = span.dest[2];
+            while (count--) {
+                uint8_t r = in[s0], g = in[s1], b = in[s2];
+                out[d0] = r;
+                out[d1] = g;
+                out[d2] = b;
+                in += 3;
+                out += stride;
+            }
+            break;
+        }
+
+        case SPAN_LUMINOSITY: {
+            while (count--) {
+                uint8_t rgbl[4] = { in[0], in[1], in[2],
+                    uint8_t((unsigned(in[0]) + unsigned(in[1]) + unsigned(in[2])) / 3) };
+                out[span.dest[0]] = rgbl[span.source[0]];
+                out[span.dest[1]] = rgbl[span.source[1]];
+                out[span.dest[2]] = rgbl[span.source[2]];
+                in += 3;
+                out += stride;
+            }
+            break;
+        }
+    }
+}
+
+void PixelMap::store16(const Span &span, const uint8_t *in, unsigned count, ptrdiff_t lowOffset)
+{
+    /*
+     * Big-endian 16-bit input. Every span type takes the same path here; the
+     * byte swizzling that makes SPAN_COPY fast doesn't apply.
+     */
+
+    uint8_t *out = span.out;
+    int stride = span.outStride;
+
+    while (count--) {
+        unsigned rgbl[4];
+        rgbl[0] = (unsigned(in[0]) << 8) | in[1];
+        rgbl[1] = (unsigned(in[2]) << 8) | in[3];
+        rgbl[2] = (unsigned(in[4]) << 8) | in[5];
+        rgbl[3] = (rgbl[0] + rgbl[1] + rgbl[2]) / 3;
+
+        for (unsigned c = 0; c < 3; c++) {
+            unsigned value = rgbl[span.source[c]];
+            uint8_t *p = out + span.dest[c];
+
+            if (lowOffset) {
+                p[0] = uint8_t(value >> 8);
+                p[lowOffset] = uint8_t(value);
+            } else {
+                p[0] = OPC::to8Bit(value);
+            }
+        }
+
+        in += 6;
+        out += stride;
+    }
+}
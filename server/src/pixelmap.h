@@ -0,0 +1,118 @@
+/*
+ * Compiled pixel mapping, shared by all framebuffer-style output drivers.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "opc.h"
+#include <vector>
+#include <stddef.h>
+
+
+class PixelMap
+{
+public:
+    typedef rapidjson::Value Value;
+
+    /*
+     * Describes where each output pixel lives in a driver's framebuffer.
+     *
+     * Pixels are grouped into blocks (one USB packet, for example) of 'pixelsPerBlock'
+     * pixels each, with 'blockStride' bytes from the start of one block to the next.
+     * Within a block, pixels are 'pixelStride' bytes apart, and the red, green, and
+     * blue output bytes sit at the given offsets from the start of each pixel.
+     *
+     * A framebuffer that keeps 16-bit color sets 'lowBase' to a second plane with
+     * the same layout, holding the low byte of each color. Otherwise it's zero,
+     * and 16-bit input is rounded to 8 bits.
+     */
+    struct Layout {
+        uint8_t *base;
+        uint8_t *lowBase;
+        unsigned numPixels;
+        unsigned pixelsPerBlock;
+        unsigned blockStride;
+        unsigned pixelStride;
+        uint8_t colorOffsets[3];
+    };
+
+    PixelMap();
+
+    // Compile a JSON 'map' array for the given framebuffer. A null map is an empty map.
+    void load(const Value *map, const Layout &layout, bool verbose);
+    void clear();
+
+    // Exchange compiled maps. A map can be compiled anywhere, then swapped in quickly under a lock.
+    void swap(PixelMap &other);
+
+    bool isEmpty() const { return mSpans.empty(); }
+
+    // Does any instruction in this map read from the given OPC channel?
+    bool hasChannel(unsigned channel) const {
+        return channel < NUM_CHANNELS && mChannelIndex[channel] != mChannelIndex[channel + 1];
+    }
+
+    // Store any relevant portions of a SetPixelColors or SetPixelColors16 message in the framebuffer
+    void apply(const OPC::Message &msg) const;
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+
+    // Special 'source' value, meaning the average of all three input colors
+    static const uint8_t SOURCE_LUMINOSITY = 3;
+
+    enum SpanType {
+        SPAN_COPY,          // Forward, packed RGB, identity swizzle: a plain memcpy()
+        SPAN_SHUFFLE,       // Any stride or direction, choosing from the input R, G, B
+        SPAN_LUMINOSITY,    // Like SPAN_SHUFFLE, but at least one output uses luminosity
+    };
+
+    /*
+     * A compiled instruction covers a run of pixels that doesn't cross a block
+     * boundary, so its output address can be computed ahead of time.
+     */
+    struct Span {
+        uint8_t channel;
+        uint8_t type;
+        uint8_t source[3];      // For each output color: 0-2 = input R/G/B, or SOURCE_LUMINOSITY
+        uint8_t dest[3];        // Byte offset of each output color within a pixel
+        int outStride;          // Bytes between successive output pixels; negative for reversed runs
+        unsigned firstOPC;
+        unsigned count;
+        uint8_t *out;
+    };
+
+    std::vector<Span> mSpans;
+
+    // Spans for OPC channel N are mSpans[mChannelIndex[N]] through mSpans[mChannelIndex[N+1] - 1]
+    unsigned mChannelIndex[NUM_CHANNELS + 1];
+
+    // Distance from each output byte to its low byte, or zero without a low plane
+    ptrdiff_t mLowOffset;
+
+    bool compileInstruction(std::vector<Span> &spans, const Value &inst, const Layout &layout);
+    static bool parseColorChannels(uint8_t source[3], const char *str);
+    static bool spanChannelLess(const Span &a, const Span &b);
+
+    static void store8(const Span &span, const uint8_t *in, unsigned count, uint8_t *out);
+    static void store16(const Span &span, const uint8_t *in, unsigned count, ptrdiff_t lowOffset);
+};
@@ -0,0 +1,230 @@
+/*
+ * Plays a recorded show back into the server, as if its clients were connected
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "playback.h"
+#include "monotonic.h"
+#include <iostream>
+
+#ifdef _WIN32
+  #include <winsock2.h>
+#else
+  #include <sys/select.h>
+#endif
+
+
+Playback::Playback(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose), mThread(0),
+      mPath(0), mRepeat(true), mRate(1.0), mSeekTo(-1), mAnchorShow(0), mAnchorWall(0)
+{}
+
+bool Playback::loadConfiguration(const Value &config, std::ostream &error)
+{
+    if (!config.IsObject() || !config["file"].IsString()) {
+        error << "The optional 'playback' configuration key must be an object with a 'file' name.\n";
+        return false;
+    }
+
+    const Value &rate = config["rate"];
+    const Value &repeat = config["loop"];
+
+    if (rate.IsNumber() && rate.GetDouble() >= 0) {
+        mRate = rate.GetDouble();
+    } else if (!rate.IsNull()) {
+        error << "The playback 'rate' must be a non-negative number.\n";
+        return false;
+    }
+
+    if (repeat.IsBool()) {
+        mRepeat = repeat.IsTrue();
+    } else if (!repeat.IsNull()) {
+        error << "The playback 'loop' option must be true or false.\n";
+        return false;
+    }
+
+    mPath = config["file"].GetString();
+    if (!mShow.open(mPath, error)) {
+        return false;
+    }
+
+    if (mVerbose) {
+        std::clog << "Playing show " << mPath << ", " << mShow.duration() * 1e-6 << " seconds long\n";
+    }
+    return true;
+}
+
+bool Playback::start()
+{
+    if (!mWake.init()) {
+        std::clog << "Can't create wakeup event for show playback\n";
+        return false;
+    }
+    mWake.clear();
+
+    anchor(0, Monotonic::micros());
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+uint64_t Playback::position(uint64_t now) const
+{
+    // Caller holds mLock
+    uint64_t show = mAnchorShow + uint64_t((now - mAnchorWall) * mRate);
+    return std::min(show, mShow.duration());
+}
+
+void Playback::anchor(uint64_t show, uint64_t now)
+{
+    // Caller holds mLock
+    mAnchorShow = show;
+    mAnchorWall = now;
+}
+
+void Playback::threadFunc(void *arg)
+{
+    Playback *self = (Playback*) arg;
+    ShowFile &show = self->mShow;
+    uint64_t offset = show.seek(0);
+
+    for (;;) {
+        uint64_t now = Monotonic::micros();
+        OPC::Message *msg = 0;
+        int64_t wait = -1;
+
+        self->mLock.lock();
+
+        if (self->mSeekTo >= 0) {
+            offset = show.seek(self->mSeekTo);
+            self->anchor(self->mSeekTo, now);
+            self->mSeekTo = -1;
+        }
+
+        if (offset >= show.end() && self->mRepeat && show.end() > show.begin() && self->mRate > 0) {
+            offset = show.seek(0);
+            self->anchor(0, now);
+        }
+
+        if (offset < show.end() && self->mRate > 0) {
+            uint64_t micros = show.timestamp(offset);
+
+            // Due when the show clock reaches this record. Compressed records are only decoded once.
+            int64_t due = micros > self->mAnchorShow ? int64_t((micros - self->mAnchorShow) / self->mRate) : 0;
+            wait = due - int64_t(now - self->mAnchorWall);
+
+            if (wait <= 0) {
+                offset = show.read(offset, micros, msg);
+                wait = 0;
+            }
+        }
+
+        self->mLock.unlock();
+
+        if (msg) {
+            self->mOpcCallback(*msg, self->mUserContext);
+            self->mMessages.add();
+            continue;
+        }
+        if (wait == 0) {
+            // A compressed record that couldn't be decoded; move on to the next one
+            continue;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(self->mWake.fd(), &fds);
+
+        struct timeval timeout;
+        timeout.tv_sec = long(wait / 1000000);
+        timeout.tv_usec = long(wait % 1000000);
+
+        self->mLoop.wait();
+        int result = select(int(self->mWake.fd()) + 1, &fds, 0, 0, wait < 0 ? 0 : &timeout);
+        self->mLoop.resume();
+
+        if (result > 0) {
+            self->mWake.clear();
+        }
+    }
+}
+
+void Playback::control(rapidjson::Document &message)
+{
+    if (!mThread) {
+        message.AddMember("error", "No show is configured for playback", message.GetAllocator());
+        return;
+    }
+
+    const Value &seekTo = message["position"];
+    const Value &newRate = message["rate"];
+
+    if (!(seekTo.IsNull() || (seekTo.IsNumber() && seekTo.GetDouble() >= 0)) ||
+        !(newRate.IsNull() || (newRate.IsNumber() && newRate.GetDouble() >= 0))) {
+        message.AddMember("error", "Position and rate must be non-negative numbers", message.GetAllocator());
+        return;
+    }
+
+    uint64_t now = Monotonic::micros();
+    mLock.lock();
+
+    if (newRate.IsNumber()) {
+        anchor(position(now), now);
+        mRate = newRate.GetDouble();
+    }
+    if (seekTo.IsNumber()) {
+        mSeekTo = int64_t(seekTo.GetDouble() * 1e6);
+        anchor(mSeekTo, now);
+    }
+
+    double currentPosition = position(now) * 1e-6;
+    double currentRate = mRate;
+    mLock.unlock();
+    mWake.signal();
+
+    message.RemoveMember("position");
+    message.RemoveMember("rate");
+    message.AddMember("file", mPath, message.GetAllocator());
+    message.AddMember("position", currentPosition, message.GetAllocator());
+    message.AddMember("duration", mShow.duration() * 1e-6, message.GetAllocator());
+    message.AddMember("rate", currentRate, message.GetAllocator());
+}
+
+void Playback::writeMetrics(MetricsWriter &metrics)
+{
+    if (!mThread) {
+        return;
+    }
+
+    mLock.lock();
+    double seconds = position(Monotonic::micros()) * 1e-6;
+    mLock.unlock();
+
+    MetricsWriter::Labels labels;
+    labels.add("file", mPath);
+
+    metrics.counter("fcserver_playback_messages_total",
+        "OPC messages played back from the show file", labels, mMessages.value());
+    metrics.gauge("fcserver_playback_position_seconds",
+        "Current position in the show being played back", labels, seconds);
+
+    metrics.loop("playback", mLoop);
+}
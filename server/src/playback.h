@@ -0,0 +1,83 @@
+/*
+ * Plays a recorded show back into the server, as if its clients were connected
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "wakeevent.h"
+#include "showfile.h"
+#include "opc.h"
+#include "metrics.h"
+
+
+/*
+ * Messages are handed to the OPC callback straight from the mapped show
+ * file, at the times they were recorded divided by the playback rate. Seeking
+ * uses the show's time index, so it's quick anywhere in a long recording.
+ */
+class Playback
+{
+public:
+    typedef rapidjson::Value Value;
+
+    Playback(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Validate the 'playback' configuration and open the show. Problems are written to 'error'.
+    bool loadConfiguration(const Value &config, std::ostream &error);
+
+    bool start();
+
+    // Handle a "playback" JSON message: optional "position" in seconds and "rate". Replies with the current state.
+    void control(rapidjson::Document &message);
+
+    // Add our counters to a metrics scrape, from any thread
+    void writeMetrics(MetricsWriter &metrics);
+
+private:
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    tthread::thread *mThread;
+    WakeEvent mWake;
+    ShowFile mShow;
+    const char *mPath;
+    bool mRepeat;
+
+    // Protects everything below, up to the counters
+    tthread::mutex mLock;
+    double mRate;               // Zero while paused
+    int64_t mSeekTo;            // Requested position in microseconds, or -1
+    uint64_t mAnchorShow;       // Show time that was playing at mAnchorWall
+    uint64_t mAnchorWall;
+
+    // Counters, written only by the playback thread
+    MetricLoop mLoop;
+    MetricCounter mMessages;
+
+    static void threadFunc(void *arg);
+    uint64_t position(uint64_t now) const;
+    void anchor(uint64_t show, uint64_t now);
+};
@@ -0,0 +1,216 @@
+/*
+ * Records Open Pixel Control messages to a show file, without blocking ingest
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "recorder.h"
+#include "monotonic.h"
+#include <iostream>
+#include <string.h>
+
+
+Recorder::Recorder(bool verbose)
+    : mVerbose(verbose), mPath(0), mBufferBytes(DEFAULT_BUFFER_BYTES), mCompress(false), mThread(0), mStartMicros(0),
+      mFile(0), mIndexFile(0), mOffset(0), mNextIndex(0), mWriteError(false)
+{}
+
+bool Recorder::loadConfiguration(const Value &config, std::ostream &error)
+{
+    if (!config.IsObject() || !config["file"].IsString()) {
+        error << "The optional 'record' configuration key must be an object with a 'file' name.\n";
+        return false;
+    }
+
+    const Value &bufferBytes = config["bufferBytes"];
+    if (bufferBytes.IsUint() && bufferBytes.GetUint() >= MIN_BUFFER_BYTES) {
+        mBufferBytes = bufferBytes.GetUint();
+    } else if (!bufferBytes.IsNull()) {
+        error << "The recorder's 'bufferBytes' must be at least " << MIN_BUFFER_BYTES << ".\n";
+        return false;
+    }
+
+    const Value &compress = config["compress"];
+    if (compress.IsBool()) {
+        mCompress = compress.IsTrue();
+    } else if (!compress.IsNull()) {
+        error << "The recorder's 'compress' option must be true or false.\n";
+        return false;
+    }
+
+    mPath = config["file"].GetString();
+    return true;
+}
+
+bool Recorder::start()
+{
+    mFile = fopen(mPath, "wb");
+    mIndexFile = fopen(ShowFile::indexPath(mPath).c_str(), "wb");
+    if (!mFile || !mIndexFile) {
+        std::clog << "Can't create show file " << mPath << "\n";
+        return false;
+    }
+
+    ShowFile::FileHeader header = { ShowFile::MAGIC, ShowFile::VERSION,
+        mCompress ? ShowFile::FLAG_COMPRESSED : 0, 0 };
+    ShowFile::FileHeader indexHeader = { ShowFile::INDEX_MAGIC, ShowFile::VERSION, 0, 0 };
+    if (fwrite(&header, sizeof header, 1, mFile) != 1 || fflush(mFile) ||
+        fwrite(&indexHeader, sizeof indexHeader, 1, mIndexFile) != 1 || fflush(mIndexFile)) {
+        std::clog << "Can't write show file " << mPath << "\n";
+        return false;
+    }
+    mOffset = sizeof header;
+
+    // Both halves are allocated up front, so recording never allocates memory
+    mPending.reserve(mBufferBytes / 2);
+    mWriting.reserve(mBufferBytes / 2);
+    if (mCompress) {
+        mCoded.reserve(mBufferBytes / 2);
+    }
+
+    if (mVerbose) {
+        std::clog << "Recording show to " << mPath << "\n";
+    }
+
+    mStartMicros = Monotonic::micros();
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+void Recorder::record(const OPC::Message &msg)
+{
+    if (!mThread) {
+        return;
+    }
+
+    unsigned length = msg.length();
+    unsigned size = ShowFile::recordBytes(length);
+
+    mLock.lock();
+
+    if (mPending.size() + size > mBufferBytes / 2) {
+        mDropped.add();
+        mLock.unlock();
+        return;
+    }
+
+    // Timestamps are taken under the lock, so records are always in order
+    uint64_t micros = Monotonic::micros() - mStartMicros;
+
+    size_t offset = mPending.size();
+    mPending.resize(offset + size);
+    memcpy(&mPending[offset], &micros, sizeof micros);
+    memcpy(&mPending[offset + sizeof micros], &msg, OPC::HEADER_BYTES + length);
+
+    mLock.unlock();
+    mCond.notify_one();
+}
+
+void Recorder::threadFunc(void *arg)
+{
+    Recorder *self = (Recorder*) arg;
+
+    for (;;) {
+        self->mLock.lock();
+        while (self->mPending.empty()) {
+            self->mLoop.wait();
+            self->mCond.wait(self->mLock);
+            self->mLoop.resume();
+        }
+        self->mPending.swap(self->mWriting);
+        self->mLock.unlock();
+
+        self->writeBuffer();
+        self->mWriting.clear();
+    }
+}
+
+void Recorder::writeBuffer()
+{
+    /*
+     * Records go to disk first, then index entries for them. Whatever
+     * point a crash interrupts this, the index never points past the show.
+     */
+
+    if (mWriteError) {
+        return;
+    }
+
+    size_t size = mWriting.size();
+    unsigned messages = 0;
+    mNewIndex.clear();
+    mCoded.clear();
+
+    for (size_t pos = 0; pos < size; messages++) {
+        uint64_t micros;
+        memcpy(&micros, &mWriting[pos], sizeof micros);
+        const OPC::Message *msg = (const OPC::Message*) &mWriting[pos + sizeof micros];
+
+        if (micros >= mNextIndex) {
+            ShowFile::IndexEntry entry = { micros, mOffset + (mCompress ? mCoded.size() : pos) };
+            mNewIndex.push_back(entry);
+            mNextIndex = (micros / ShowFile::INDEX_INTERVAL + 1) * ShowFile::INDEX_INTERVAL;
+
+            // Every channel starts over with a keyframe, so playback can begin here
+            mEncoder.reset();
+        }
+
+        if (mCompress) {
+            mEncoder.encode(micros, *msg, mCoded);
+        }
+        pos += ShowFile::recordBytes(msg->length());
+    }
+
+    const std::vector<uint8_t> &data = mCompress ? mCoded : mWriting;
+    if (fwrite(&data[0], 1, data.size(), mFile) != data.size() || fflush(mFile)) {
+        std::clog << "Error writing show file " << mPath << ". Recording stopped.\n";
+        mWriteError = true;
+        return;
+    }
+
+    if (!mNewIndex.empty()) {
+        fwrite(&mNewIndex[0], sizeof mNewIndex[0], mNewIndex.size(), mIndexFile);
+        fflush(mIndexFile);
+    }
+
+    mOffset += data.size();
+    mMessages.add(messages);
+    mBytes.add(data.size());
+}
+
+void Recorder::writeMetrics(MetricsWriter &metrics)
+{
+    if (!mThread) {
+        return;
+    }
+
+    MetricsWriter::Labels labels;
+    labels.add("file", mPath);
+
+    metrics.counter("fcserver_record_messages_total",
+        "OPC messages written to the show file", labels, mMessages.value());
+    metrics.counter("fcserver_record_bytes_total",
+        "Bytes written to the show file", labels, mBytes.value());
+    metrics.counter("fcserver_record_dropped_total",
+        "OPC messages not recorded because the show file couldn't keep up", labels, mDropped.value());
+
+    metrics.loop("recorder", mLoop);
+}
@@ -0,0 +1,98 @@
+/*
+ * Records Open Pixel Control messages to a show file, without blocking ingest
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "opc.h"
+#include "showfile.h"
+#include "metrics.h"
+
+
+/*
+ * Messages are copied into a bounded buffer from any thread, and a separate
+ * thread writes them out along with the show's sparse time index. If the disk
+ * can't keep up, whole messages are dropped and counted; ingest never waits
+ * for the disk.
+ */
+class Recorder
+{
+public:
+    typedef rapidjson::Value Value;
+
+    Recorder(bool verbose = false);
+
+    // Validate the 'record' configuration. Problems are written to 'error'.
+    bool loadConfiguration(const Value &config, std::ostream &error);
+
+    // Create the show file, replacing any earlier recording, and start the writer thread
+    bool start();
+
+    // Append one message, from any thread. Does nothing before start().
+    void record(const OPC::Message &msg);
+
+    // Add our counters to a metrics scrape, from any thread
+    void writeMetrics(MetricsWriter &metrics);
+
+private:
+    static const unsigned DEFAULT_BUFFER_BYTES = 16 << 20;
+    static const unsigned MIN_BUFFER_BYTES = 256 << 10;
+
+    bool mVerbose;
+    const char *mPath;
+    unsigned mBufferBytes;
+    bool mCompress;
+    tthread::thread *mThread;
+    uint64_t mStartMicros;
+
+    // Protects mPending, which fills up to half the buffer while the other half is written
+    tthread::mutex mLock;
+    tthread::condition_variable mCond;
+    std::vector<uint8_t> mPending;
+    MetricCounter mDropped;
+
+    // Writer thread only
+    FILE *mFile;
+    FILE *mIndexFile;
+    std::vector<uint8_t> mWriting;
+    std::vector<uint8_t> mCoded;
+    std::vector<ShowFile::IndexEntry> mNewIndex;
+    ShowEncoder mEncoder;
+    uint64_t mOffset;
+    uint64_t mNextIndex;
+    bool mWriteError;
+
+    // Counters, written only by the writer thread
+    MetricLoop mLoop;
+    MetricCounter mMessages;
+    MetricCounter mBytes;
+
+    static void threadFunc(void *arg);
+    void writeBuffer();
+};
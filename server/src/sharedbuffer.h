@@ -0,0 +1,86 @@
+/*
+ * Reference counted, immutable message buffer for sending one message to many clients.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include "libwebsockets.h"
+
+
+/*
+ * The buffer has libwebsockets' pre- and post-padding built in, so it can be
+ * handed to libwebsocket_write() as-is. libwebsocket_write() does scribble its
+ * frame header into the pre-padding, but every server-to-client frame of the
+ * same length gets the same header, so sequential writes of one buffer to many
+ * clients on a single thread are safe.
+ *
+ * References may be taken and dropped from any thread.
+ */
+
+class SharedBuffer
+{
+public:
+    // Allocate a new buffer with a reference count of one. Returns NULL if out of memory.
+    static SharedBuffer *create(unsigned length)
+    {
+        void *mem = malloc(sizeof(SharedBuffer) + LWS_SEND_BUFFER_PRE_PADDING +
+            length + LWS_SEND_BUFFER_POST_PADDING);
+        if (!mem) {
+            return 0;
+        }
+        SharedBuffer *buffer = static_cast<SharedBuffer*>(mem);
+        buffer->mRefCount = 1;
+        buffer->mLength = length;
+        return buffer;
+    }
+
+    void ref()
+    {
+        __sync_fetch_and_add(&mRefCount, 1);
+    }
+
+    void unref()
+    {
+        if (__sync_sub_and_fetch(&mRefCount, 1) == 0) {
+            free(this);
+        }
+    }
+
+    uint8_t *data()
+    {
+        return reinterpret_cast<uint8_t*>(this + 1) + LWS_SEND_BUFFER_PRE_PADDING;
+    }
+
+    unsigned length() const
+    {
+        return mLength;
+    }
+
+private:
+    volatile int mRefCount;
+    unsigned mLength;
+
+    // Only created by create(), and only freed by unref()
+    SharedBuffer();
+    ~SharedBuffer();
+};
@@ -0,0 +1,212 @@
+/*
+ * Shared memory input, for Open Pixel Control clients on the same machine
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "shmserver.h"
+#include <iostream>
+#include <string.h>
+
+#ifndef _WIN32
+  #include <sys/types.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#ifdef __linux__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <time.h>
+#endif
+
+
+ShmServer::ShmServer(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose), mThread(0),
+      mName(0), mHeader(0), mMessage(0)
+{}
+
+bool ShmServer::loadConfiguration(const Value &config, std::ostream &error)
+{
+    // POSIX shared memory names are a single path component with a leading slash
+    if (!config.IsString() || config.GetString()[0] != '/' ||
+        strchr(config.GetString() + 1, '/') || config.GetStringLength() < 2 ||
+        config.GetStringLength() > 200) {
+        error << "The optional 'shm' configuration key must be a segment name like \"/fcserver\".\n";
+        return false;
+    }
+
+    mName = config.GetString();
+    return true;
+}
+
+bool ShmServer::start()
+{
+#ifdef _WIN32
+    std::clog << "Shared memory input is not supported on this platform\n";
+    return false;
+#else
+    size_t size = sizeof(Header) + size_t(NUM_SLOTS) * SLOT_BYTES;
+
+    /*
+     * Always start with a fresh segment. A client still holding a segment from
+     * an earlier server sees that it has been unlinked, and reopens by name.
+     * The mode is set explicitly so that renderers running as other users can
+     * connect, just as they could over the loopback interface.
+     */
+
+    shm_unlink(mName);
+    int fd = shm_open(mName, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        std::clog << "Can't create shared memory segment " << mName << "\n";
+        return false;
+    }
+    fchmod(fd, 0666);
+
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        shm_unlink(mName);
+        std::clog << "Can't map shared memory segment " << mName << "\n";
+        return false;
+    }
+
+    // The new segment is zero-filled. Publish the layout last, so clients never see half of it.
+    mHeader = (Header*) mapping;
+    mHeader->version = VERSION;
+    mHeader->numSlots = NUM_SLOTS;
+    mHeader->slotBytes = SLOT_BYTES;
+    __sync_synchronize();
+    mHeader->magic = MAGIC;
+
+    if (mVerbose) {
+        std::clog << "Listening for shared memory clients on " << mName << "\n";
+    }
+
+    mMessage = new OPC::Message;
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+#endif
+}
+
+void ShmServer::threadFunc(void *arg)
+{
+    ShmServer *self = (ShmServer*) arg;
+    Header *header = self->mHeader;
+
+    for (;;) {
+        // Sample the doorbell first; any message committed after this makes the wait return at once
+        uint32_t doorbell = header->doorbell;
+
+        self->mLoop.resume();
+        self->receive();
+        self->mLoop.wait();
+
+        header->waiting = 1;
+        __sync_synchronize();
+        if (header->writeIndex == header->readIndex) {
+            self->waitForDoorbell(doorbell);
+        }
+        header->waiting = 0;
+    }
+}
+
+void ShmServer::receive()
+{
+    uint32_t readIndex = mHeader->readIndex;
+    uint32_t writeIndex = mHeader->writeIndex;
+
+    // Only read slots after the index that published them
+    __sync_synchronize();
+
+    if (writeIndex - readIndex > NUM_SLOTS) {
+        // The client is confused or misbehaving. Skip whatever it claims to have written.
+        mHeader->readIndex = writeIndex;
+        return;
+    }
+
+    while (readIndex != writeIndex) {
+        /*
+         * The client can still write to the slot, so everything downstream gets a
+         * private copy. The header is copied first, and the length in the copy
+         * decides how much data follows; no one reads the shared length again.
+         */
+
+        const OPC::Message &shared = slot(readIndex);
+        OPC::Message &msg = *mMessage;
+        memcpy(&msg, &shared, OPC::HEADER_BYTES);
+        memcpy(msg.data, shared.data, msg.length());
+
+        // The slot can go back to the client while we work on the copy
+        __sync_synchronize();
+        mHeader->readIndex = ++readIndex;
+
+        mReceivedMessages[msg.channel].add();
+        mReceivedBytes[msg.channel].add(OPC::HEADER_BYTES + msg.length());
+        mOpcCallback(msg, mUserContext);
+    }
+}
+
+void ShmServer::waitForDoorbell(uint32_t doorbell)
+{
+#ifdef __linux__
+    // Shared futex, since the doorbell lives in memory mapped by another process
+    struct timespec timeout = { 1, 0 };
+    syscall(SYS_futex, &mHeader->doorbell, FUTEX_WAIT, doorbell, &timeout, 0, 0);
+#elif !defined(_WIN32)
+    // Without a cross-process futex, poll at a rate well above any LED frame rate
+    (void) doorbell;
+    usleep(500);
+#endif
+}
+
+void ShmServer::writeMetrics(MetricsWriter &metrics)
+{
+    if (!mThread) {
+        return;
+    }
+
+    for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+        uint64_t messages = mReceivedMessages[channel].value();
+        if (messages) {
+            MetricsWriter::Labels labels;
+            labels.add("transport", "shm").add("channel", channel);
+            metrics.counter("fcserver_opc_messages_total",
+                "OPC messages received, by transport and channel", labels, messages);
+            metrics.counter("fcserver_opc_bytes_total",
+                "OPC bytes received including headers, by transport and channel",
+                labels, mReceivedBytes[channel].value());
+        }
+    }
+
+    MetricsWriter::Labels labels;
+    labels.add("segment", mName);
+    metrics.counter("fcserver_shm_dropped_total",
+        "OPC messages a shared memory client discarded because the ring was full",
+        labels, uint64_t(mHeader->dropped));
+
+    metrics.loop("shm", mLoop);
+}
@@ -0,0 +1,110 @@
+/*
+ * Shared memory input, for Open Pixel Control clients on the same machine
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "opc.h"
+#include "metrics.h"
+
+
+class ShmServer {
+public:
+    typedef rapidjson::Value Value;
+
+    ShmServer(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Validate the 'shm' segment name. Problems are written to 'error'.
+    bool loadConfiguration(const Value &config, std::ostream &error);
+
+    // Create the segment and start receiving on a separate thread
+    bool start();
+
+    // Add our counters to a metrics scrape, from any thread
+    void writeMetrics(MetricsWriter &metrics);
+
+    /*
+     * Segment layout. One client at a time writes OPC messages into a ring of
+     * slots, each large enough for any message. The server copies each one out
+     * before using it, since the client could change a slot at any time.
+     *
+     * Indices are free-running message counts. The client fills the slot at
+     * writeIndex, then increments writeIndex and the doorbell. The server sets
+     * 'waiting' before it sleeps on the doorbell; clients only need to wake it
+     * while that flag is set. Fields written by each side live on separate
+     * cache lines.
+     *
+     * examples/cpp/lib/opc_client.h has a matching client.
+     */
+
+    static const uint32_t MAGIC = 0x4d534346;   // "FCSM"
+    static const uint32_t VERSION = 1;
+    static const uint32_t NUM_SLOTS = 8;
+    static const uint32_t SLOT_BYTES = 65600;   // sizeof(OPC::Message), rounded up to a cache line
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t numSlots;
+        uint32_t slotBytes;
+        uint8_t reserved0[48];
+
+        // Written by the client
+        volatile uint32_t writeIndex;
+        volatile uint32_t doorbell;
+        volatile uint32_t dropped;
+        uint8_t reserved1[52];
+
+        // Written by the server
+        volatile uint32_t readIndex;
+        volatile uint32_t waiting;
+        uint8_t reserved2[56];
+    };
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    tthread::thread *mThread;
+
+    const char *mName;
+    Header *mHeader;
+    OPC::Message *mMessage;     // Private copy of the slot being dispatched
+
+    // Counters, written only by the receive thread
+    MetricLoop mLoop;
+    MetricCounter mReceivedMessages[NUM_CHANNELS];
+    MetricCounter mReceivedBytes[NUM_CHANNELS];
+
+    static void threadFunc(void *arg);
+    void receive();
+    void waitForDoorbell(uint32_t doorbell);
+
+    OPC::Message &slot(uint32_t index) {
+        return *(OPC::Message*) ((uint8_t*)&mHeader[1] + (index % NUM_SLOTS) * SLOT_BYTES);
+    }
+};
@@ -0,0 +1,320 @@
+/*
+ * Compact encoding for recorded shows
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "showcodec.h"
+#include <string.h>
+
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint8_t *writeLength(uint8_t *op, unsigned length)
+{
+    // Lengths of 15 or more continue in extra bytes, each adding up to 255
+    for (length -= 15; length >= 255; length -= 255) {
+        *(op++) = 255;
+    }
+    *(op++) = length;
+    return op;
+}
+
+static inline bool readLength(const uint8_t *&ip, const uint8_t *ipEnd, unsigned &length)
+{
+    uint8_t b;
+    do {
+        if (ip == ipEnd) {
+            return false;
+        }
+        b = *(ip++);
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+unsigned ShowCodec::pack(const uint8_t *src, unsigned length, uint8_t *dst, unsigned capacity)
+{
+    /*
+     * Each sequence is a token byte holding a literal count and a match
+     * length, the literals, and a 16-bit offset back to the match. The last
+     * sequence is only literals. Candidate matches come from a hash of the
+     * next four bytes. Searching speeds up through data that isn't matching,
+     * so incompressible frames cost little more than a copy.
+     */
+
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof table);
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + length;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + capacity;
+
+    if (length > MIN_MATCH + LAST_LITERALS) {
+        // Matches end early enough to leave a few literals for the last sequence
+        const uint8_t *matchLimit = end - LAST_LITERALS;
+        const uint8_t *searchLimit = matchLimit - MIN_MATCH;
+
+        while (ip < searchLimit) {
+            uint32_t sequence = read32(ip);
+            unsigned hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            const uint8_t *ref = src + table[hash];
+            table[hash] = uint16_t(ip - src);
+
+            if (ref >= ip || read32(ref) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const uint8_t *matchEnd = ip + MIN_MATCH;
+            while (matchEnd < matchLimit && *matchEnd == ref[matchEnd - ip]) {
+                matchEnd++;
+            }
+
+            unsigned literals = unsigned(ip - anchor);
+            unsigned match = unsigned(matchEnd - ip) - MIN_MATCH;
+
+            // Token, literals, offset, and the worst case for both extended lengths
+            if (op + 1 + literals + literals / 255 + 2 + match / 255 + 2 > opEnd) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+            *token = uint8_t((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+            if (literals >= 15) {
+                op = writeLength(op, literals);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            unsigned offset = unsigned(ip - ref);
+            *(op++) = uint8_t(offset);
+            *(op++) = uint8_t(offset >> 8);
+            if (match >= 15) {
+                op = writeLength(op, match);
+            }
+
+            ip = anchor = matchEnd;
+        }
+    }
+
+    unsigned literals = unsigned(end - anchor);
+    if (op + 1 + literals + literals / 255 + 1 > opEnd) {
+        return 0;
+    }
+
+    *(op++) = uint8_t((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = writeLength(op, literals);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return unsigned(op - dst);
+}
+
+bool ShowCodec::unpack(const uint8_t *src, unsigned packedLength, uint8_t *dst, unsigned length)
+{
+    // Every length and offset is checked, so a damaged show can't write outside 'dst'
+
+    const uint8_t *ip = src;
+    const uint8_t *ipEnd = src + packedLength;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + length;
+
+    while (ip < ipEnd) {
+        uint8_t token = *(ip++);
+
+        unsigned literals = token >> 4;
+        if (literals == 15 && !readLength(ip, ipEnd, literals)) {
+            return false;
+        }
+        if (literals > unsigned(ipEnd - ip) || literals > unsigned(opEnd - op)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return false;
+        }
+        unsigned offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        unsigned match = token & 15;
+        if (match == 15 && !readLength(ip, ipEnd, match)) {
+            return false;
+        }
+        match += MIN_MATCH;
+
+        if (offset == 0 || offset > unsigned(op - dst) || match > unsigned(opEnd - op)) {
+            return false;
+        }
+
+        const uint8_t *ref = op - offset;
+        if (offset == 1) {
+            memset(op, *ref, match);
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            // Overlapping copy, repeating the last 'offset' bytes
+            for (unsigned i = 0; i < match; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match;
+    }
+
+    return op == opEnd;
+}
+
+void ShowCodec::xorBytes(uint8_t *dst, const uint8_t *a, const uint8_t *b, unsigned length)
+{
+    unsigned i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof x);
+        memcpy(&y, b + i, sizeof y);
+        x ^= y;
+        memcpy(dst + i, &x, sizeof x);
+    }
+    for (; i < length; i++) {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+void ShowEncoder::reset()
+{
+    for (unsigned i = 0; i < NUM_CHANNELS; i++) {
+        mPrevious[i].clear();
+    }
+}
+
+void ShowEncoder::encode(uint64_t micros, const OPC::Message &msg, std::vector<uint8_t> &out)
+{
+    unsigned length = msg.length();
+    std::vector<uint8_t> &previous = mPrevious[msg.channel];
+    const OPC::Message *prevMsg = previous.empty() ? 0 : (const OPC::Message*) &previous[0];
+    bool delta = prevMsg && prevMsg->command == msg.command && prevMsg->length() == length;
+
+    const uint8_t *residual = msg.data;
+    if (delta && length) {
+        mResidual.resize(length);
+        ShowCodec::xorBytes(&mResidual[0], msg.data, prevMsg->data, length);
+        residual = &mResidual[0];
+    }
+
+    // Room for the message stored as is, which packing has to beat
+    size_t offset = out.size();
+    out.resize(offset + ShowCodec::recordBytes(length));
+    ShowCodec::RecordHeader *header = (ShowCodec::RecordHeader*) &out[offset];
+    uint8_t *payload = (uint8_t*) &header[1];
+
+    unsigned packed = length ? ShowCodec::pack(residual, length, payload, length - 1) : 0;
+    if (!packed) {
+        memcpy(payload, residual, length);
+    }
+
+    header->micros = micros;
+    header->channel = msg.channel;
+    header->command = msg.command;
+    header->flags = (delta ? ShowCodec::FLAG_DELTA : 0) | (packed ? ShowCodec::FLAG_PACKED : 0);
+    header->reserved = 0;
+    header->length = length;
+    header->codedLength = packed ? packed : length;
+
+    unsigned size = ShowCodec::recordBytes(header->codedLength);
+    memset(payload + header->codedLength, 0, size - sizeof *header - header->codedLength);
+    out.resize(offset + size);
+
+    previous.assign((const uint8_t*) &msg, (const uint8_t*) &msg + OPC::HEADER_BYTES + length);
+}
+
+void ShowDecoder::reset()
+{
+    for (unsigned i = 0; i < NUM_CHANNELS; i++) {
+        mFrames[i].clear();
+    }
+}
+
+OPC::Message *ShowDecoder::decode(const uint8_t *record)
+{
+    const ShowCodec::RecordHeader *header = (const ShowCodec::RecordHeader*) record;
+    const uint8_t *payload = (const uint8_t*) &header[1];
+    std::vector<uint8_t> &frame = mFrames[header->channel];
+    unsigned length = header->length;
+    bool delta = header->flags & ShowCodec::FLAG_DELTA;
+    bool packed = header->flags & ShowCodec::FLAG_PACKED;
+
+    if (delta) {
+        const OPC::Message *prevMsg = frame.empty() ? 0 : (const OPC::Message*) &frame[0];
+        if (!prevMsg || prevMsg->command != header->command || prevMsg->length() != length) {
+            return 0;
+        }
+    } else {
+        frame.resize(OPC::HEADER_BYTES + length);
+    }
+
+    OPC::Message *msg = (OPC::Message*) &frame[0];
+    bool ok = true;
+
+    if (!packed) {
+        if (header->codedLength != length) {
+            ok = false;
+        } else if (delta) {
+            ShowCodec::xorBytes(msg->data, msg->data, payload, length);
+        } else {
+            memcpy(msg->data, payload, length);
+        }
+    } else if (delta) {
+        mResidual.resize(length);
+        ok = ShowCodec::unpack(payload, header->codedLength, &mResidual[0], length);
+        if (ok) {
+            ShowCodec::xorBytes(msg->data, msg->data, &mResidual[0], length);
+        }
+    } else {
+        ok = ShowCodec::unpack(payload, header->codedLength, msg->data, length);
+    }
+
+    if (!ok) {
+        // Damaged. Wait for this channel's next keyframe.
+        frame.clear();
+        return 0;
+    }
+
+    msg->channel = header->channel;
+    msg->command = header->command;
+    msg->setLength(length);
+    return msg;
+}
@@ -0,0 +1,114 @@
+/*
+ * Compact encoding for recorded shows
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "opc.h"
+
+
+/*
+ * Compressed show records. Each message is XORed with the previous message
+ * on its channel, so pixels that didn't change become zeroes, and the result
+ * is packed with a small LZ77 coder in the style of LZ4. Runs of zeroes
+ * become a few bytes, and decoding is little more than memcpy() and
+ * memset(). A message that can't be delta coded against the last one on its
+ * channel, because its command or length changed or the encoder was reset,
+ * is a keyframe that decodes on its own.
+ */
+class ShowCodec
+{
+public:
+    static const uint8_t FLAG_DELTA = 1 << 0;       // XORed with the previous message on this channel
+    static const uint8_t FLAG_PACKED = 1 << 1;      // LZ packed; otherwise stored as is
+
+    struct RecordHeader {
+        uint64_t micros;
+        uint8_t channel;
+        uint8_t command;
+        uint8_t flags;
+        uint8_t reserved;
+        uint16_t length;            // Decoded data length
+        uint16_t codedLength;       // Bytes following this header, not counting padding
+    };
+
+    // Bytes in a compressed record, padded like uncompressed records to a multiple of 8
+    static unsigned recordBytes(unsigned codedLength) {
+        return (sizeof(RecordHeader) + codedLength + 7) & ~7u;
+    }
+
+    /*
+     * Pack 'length' bytes. Returns the packed length, or zero if it wouldn't
+     * fit in 'capacity' bytes. unpack() returns false unless the packed data
+     * decodes to exactly 'length' bytes.
+     */
+    static unsigned pack(const uint8_t *src, unsigned length, uint8_t *dst, unsigned capacity);
+    static bool unpack(const uint8_t *src, unsigned packedLength, uint8_t *dst, unsigned length);
+
+    static void xorBytes(uint8_t *dst, const uint8_t *a, const uint8_t *b, unsigned length);
+
+private:
+    static const unsigned HASH_BITS = 11;
+    static const unsigned MIN_MATCH = 4;
+    static const unsigned LAST_LITERALS = 5;
+};
+
+
+class ShowEncoder
+{
+public:
+    // Start over with a keyframe on every channel
+    void reset();
+
+    // Append a compressed record for one message to 'out'
+    void encode(uint64_t micros, const OPC::Message &msg, std::vector<uint8_t> &out);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+
+    std::vector<uint8_t> mPrevious[NUM_CHANNELS];   // Last message on each channel, empty after reset()
+    std::vector<uint8_t> mResidual;
+};
+
+
+class ShowDecoder
+{
+public:
+    // Forget every channel. Delta records are skipped until their channel has a keyframe.
+    void reset();
+
+    /*
+     * Decode the record whose header is at 'record'. The caller checks that
+     * the whole record is readable. Returns zero if it can't be decoded yet.
+     * The decoded message is also the reference for the channel's next delta,
+     * so it must not be modified.
+     */
+    OPC::Message *decode(const uint8_t *record);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+
+    std::vector<uint8_t> mFrames[NUM_CHANNELS];     // Last decoded message on each channel
+    std::vector<uint8_t> mResidual;
+};
@@ -0,0 +1,203 @@
+/*
+ * Recorded shows: timestamped Open Pixel Control messages in an append-only file
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "showfile.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+  #include <sys/types.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+
+static bool indexEntryLess(uint64_t micros, const ShowFile::IndexEntry &entry)
+{
+    return micros < entry.micros;
+}
+
+ShowFile::ShowFile()
+    : mData(0), mSize(0), mEnd(0), mDuration(0), mCompressed(false)
+{}
+
+ShowFile::~ShowFile()
+{
+    close();
+}
+
+bool ShowFile::open(const char *path, std::ostream &error)
+{
+    close();
+
+#ifdef _WIN32
+    error << "Show playback is not supported on this platform\n";
+    return false;
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        error << "Can't open show file " << path << "\n";
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(FileHeader)) {
+        // Private and writable, so messages can be handed out as non-const without touching the file
+        mapping = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (mapping == MAP_FAILED) {
+        error << "Can't map show file " << path << "\n";
+        return false;
+    }
+
+    mData = (uint8_t*) mapping;
+    mSize = st.st_size;
+
+    const FileHeader *header = (const FileHeader*) mData;
+    if (header->magic != MAGIC || header->version != VERSION) {
+        error << path << " is not a show file\n";
+        close();
+        return false;
+    }
+    mCompressed = (header->flags & FLAG_COMPRESSED) != 0;
+
+    loadIndex(path);
+    scan();
+    return true;
+#endif
+}
+
+void ShowFile::close()
+{
+#ifndef _WIN32
+    if (mData) {
+        munmap(mData, mSize);
+    }
+#endif
+    mData = 0;
+    mSize = 0;
+    mEnd = 0;
+    mDuration = 0;
+    mCompressed = false;
+    mIndex.clear();
+    mDecoder.reset();
+}
+
+void ShowFile::loadIndex(const char *path)
+{
+    /*
+     * Trust each entry only if it points at a complete record with the same
+     * timestamp, after the previous entry. A missing or damaged sidecar just
+     * means that more of the show gets scanned.
+     */
+
+    FILE *f = fopen(indexPath(path).c_str(), "rb");
+    if (!f) {
+        return;
+    }
+
+    FileHeader header;
+    IndexEntry entry;
+
+    if (fread(&header, sizeof header, 1, f) == 1 && header.magic == INDEX_MAGIC && header.version == VERSION) {
+        while (fread(&entry, sizeof entry, 1, f) == 1) {
+            if (entry.offset < begin() || entry.offset > mSize - recordBytes(0) ||
+                (!mIndex.empty() && entry.offset <= mIndex.back().offset)) {
+                break;
+            }
+
+            uint64_t micros;
+            if (skip(entry.offset, micros) > mSize || micros != entry.micros) {
+                break;
+            }
+
+            mIndex.push_back(entry);
+        }
+    }
+
+    fclose(f);
+}
+
+void ShowFile::scan()
+{
+    /*
+     * Walk the records after the last index entry, indexing them too, to find
+     * the end of the show. A record that's incomplete or out of order means
+     * the recording was cut short there.
+     */
+
+    uint64_t offset = mIndex.empty() ? begin() : mIndex.back().offset;
+    uint64_t last = mIndex.empty() ? 0 : mIndex.back().micros;
+    uint64_t nextIndex = mIndex.empty() ? 0 : (last / INDEX_INTERVAL + 1) * INDEX_INTERVAL;
+
+    while (offset + recordBytes(0) <= mSize) {
+        uint64_t micros;
+        uint64_t next = skip(offset, micros);
+
+        if (next > mSize || micros < last) {
+            break;
+        }
+        if (micros >= nextIndex) {
+            IndexEntry entry = { micros, offset };
+            mIndex.push_back(entry);
+            nextIndex = (micros / INDEX_INTERVAL + 1) * INDEX_INTERVAL;
+        }
+
+        last = micros;
+        offset = next;
+    }
+
+    mEnd = offset;
+    mDuration = last;
+}
+
+uint64_t ShowFile::seek(uint64_t micros)
+{
+    // Binary search for the last index entry at or before 'micros', then at most an interval of records
+    std::vector<IndexEntry>::const_iterator i = std::upper_bound(mIndex.begin(), mIndex.end(), micros, indexEntryLess);
+    uint64_t offset = i == mIndex.begin() ? begin() : (i - 1)->offset;
+
+    // Compressed records on the way are decoded, so every channel is up to date at the new position
+    mDecoder.reset();
+
+    while (offset < mEnd) {
+        uint64_t recordMicros;
+        uint64_t next = skip(offset, recordMicros);
+        if (recordMicros >= micros) {
+            break;
+        }
+        if (mCompressed) {
+            mDecoder.decode(mData + offset);
+        }
+        offset = next;
+    }
+
+    return offset;
+}
@@ -0,0 +1,143 @@
+/*
+ * Recorded shows: timestamped Open Pixel Control messages in an append-only file
+ *
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "opc.h"
+#include "showcodec.h"
+
+
+/*
+ * A show file starts with a FileHeader, followed by one record per message:
+ * the time in microseconds since recording started, then the OPC message
+ * exactly as it arrived, padded to a multiple of 8 bytes. Records are only
+ * ever appended, so a recording that was cut short is still readable up to
+ * its last complete record.
+ *
+ * A sidecar file, the show's name plus ".index", holds a sparse time index:
+ * one entry for the first record in each second of the show. The recorder
+ * appends an entry only after the records it points to are written. Without
+ * the sidecar, or past its last entry, the index is rebuilt by scanning.
+ *
+ * A compressed show, with FLAG_COMPRESSED in its header, has ShowCodec
+ * records instead. The recorder starts every channel over with a keyframe at
+ * each index entry, so decoding can begin at any of them.
+ *
+ * ShowFile reads a show by mapping it into memory. Messages are handed out
+ * in place, without copying, or from the decoder's buffers for a compressed
+ * show.
+ */
+class ShowFile
+{
+public:
+    static const uint32_t MAGIC = 0x48534346;           // "FCSH"
+    static const uint32_t INDEX_MAGIC = 0x49534346;     // "FCSI"
+    static const uint32_t VERSION = 1;
+    static const uint64_t INDEX_INTERVAL = 1000000;
+    static const uint32_t FLAG_COMPRESSED = 1 << 0;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+
+    struct IndexEntry {
+        uint64_t micros;
+        uint64_t offset;
+    };
+
+    // Bytes in the record for an OPC message with the given data length
+    static unsigned recordBytes(unsigned length) {
+        return (sizeof(uint64_t) + OPC::HEADER_BYTES + length + 7) & ~7u;
+    }
+
+    static std::string indexPath(const char *path) {
+        return std::string(path) + ".index";
+    }
+
+    ShowFile();
+    ~ShowFile();
+
+    // Map a show into memory and load its index. Problems are written to 'error'.
+    bool open(const char *path, std::ostream &error);
+    void close();
+
+    // Offsets of the first record, and just past the last
+    uint64_t begin() const { return sizeof(FileHeader); }
+    uint64_t end() const { return mEnd; }
+
+    // Timestamp of the last record
+    uint64_t duration() const { return mDuration; }
+
+    bool compressed() const { return mCompressed; }
+
+    // Offset of the first record at or after the given time, or end(). Reading starts over from here.
+    uint64_t seek(uint64_t micros);
+
+    // Timestamp of the record at 'offset', which must be before end()
+    uint64_t timestamp(uint64_t offset) const { return *(const uint64_t*) (mData + offset); }
+
+    /*
+     * The record at 'offset', which must be before end(). Returns the offset
+     * of the next record. Compressed records have to be read in order after a
+     * seek(); 'msg' is zero for one that can't be decoded.
+     */
+    uint64_t read(uint64_t offset, uint64_t &micros, OPC::Message *&msg) {
+        if (mCompressed) {
+            msg = mDecoder.decode(mData + offset);
+            return skip(offset, micros);
+        }
+        uint8_t *record = mData + offset;
+        micros = *(uint64_t*) record;
+        msg = (OPC::Message*) (record + sizeof(uint64_t));
+        return offset + recordBytes(msg->length());
+    }
+
+private:
+    uint8_t *mData;
+    uint64_t mSize;
+    uint64_t mEnd;
+    uint64_t mDuration;
+    bool mCompressed;
+    std::vector<IndexEntry> mIndex;
+    ShowDecoder mDecoder;
+
+    // Timestamp of a record, and the offset of the next one, without decoding anything
+    uint64_t skip(uint64_t offset, uint64_t &micros) const {
+        const uint8_t *record = mData + offset;
+        micros = *(const uint64_t*) record;
+        if (mCompressed) {
+            return offset + ShowCodec::recordBytes(((const ShowCodec::RecordHeader*) record)->codedLength);
+        }
+        return offset + recordBytes(((const OPC::Message*) (record + sizeof(uint64_t)))->length());
+    }
+
+    void loadIndex(const char *path);
+    void scan();
+};
@@ -28,6 +28,7 @@
 #ifdef FCSERVER_HAS_WIRINGPI
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
+#include <unistd.h>
 #endif
 
 #ifndef SPI_FREQUENCY_MHZ
@@ -39,14 +40,21 @@
 SPIDevice::SPIDevice(const char *type, bool verbose)
     : mTypeString(type),
       mVerbose(verbose),
-      mPort(0)
+      mPort(0),
+      mFd(-1),
+      mConfig(0)
 {
     gettimeofday(&mTimestamp, NULL);
 }
 
 SPIDevice::~SPIDevice()
 {
-
+#ifdef FCSERVER_HAS_WIRINGPI
+    // wiringPi opens a new descriptor on every setup, and never closes them
+    if (mFd >= 0) {
+        close(mFd);
+    }
+#endif
 }
 
 int SPIDevice::open(uint32_t port)
@@ -54,7 +62,8 @@ int SPIDevice::open(uint32_t port)
     mPort = port;
 
 #ifdef FCSERVER_HAS_WIRINGPI
-    return wiringPiSPISetup(mPort, SPI_FREQUENCY);
+    mFd = wiringPiSPISetup(mPort, SPI_FREQUENCY);
+    return mFd;
 #else
     return -1;
 #endif
@@ -72,6 +81,23 @@ void SPIDevice::writeColorCorrection(const Value &color)
     // Optional. By default, ignore color correction messages.
 }
 
+void SPIDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    // Optional. By default, each part is handled as a separate message.
+    for (unsigned i = 0; i < count; i++) {
+        writeMessage(*parts[i]);
+    }
+}
+
+uint64_t SPIDevice::interpolationDeadline()
+{
+    // Optional. By default, every frame is written as it arrives.
+    return 0;
+}
+
+void SPIDevice::interpolate(uint64_t now)
+{}
+
 bool SPIDevice::matchConfiguration(const Value &config)
 {
     if (!config.IsObject()) {
@@ -50,9 +50,23 @@ public:
     // Load a matching configuration
     virtual void loadConfiguration(const Value &config) = 0;
 
+    /*
+     * A live reload keeps any device whose entry changed only in its map.
+     * prepareConfiguration() compiles the new map without the event lock, and
+     * commitConfiguration() swaps it in once the lock is held.
+     */
+    virtual void prepareConfiguration(const Value &config) = 0;
+    virtual void commitConfiguration() = 0;
+
+    // The configuration entry in use, or 0 before one is loaded
+    const Value *getConfiguration() { return mConfig; }
+
     // Handle an incoming OPC message
     virtual void writeMessage(const OPC::Message &msg) = 0;
 
+    // Handle the Set Pixel Colors messages that make up one multi-channel frame
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
+
     // Handle a device-specific JSON message
     virtual void writeMessage(Document &msg);
 
@@ -62,6 +76,10 @@ public:
     // Describe this device by adding keys to a JSON object
     virtual void describe(Value &object, Allocator &alloc);
 
+    // Timed output between frames. When interpolate() should be called next, or 0 if there's nothing to do.
+    virtual uint64_t interpolationDeadline();
+    virtual void interpolate(uint64_t now);
+
     virtual std::string getName() = 0;
 
     const char *getTypeString() { return mTypeString; }
@@ -71,6 +89,8 @@ protected:
     const char *mTypeString;
     bool mVerbose;
     uint32_t mPort;
+    int mFd;
+    const Value *mConfig;
 
     // Utilities
     const Value *findConfigMap(const Value &config);
@@ -27,17 +27,24 @@
 
 #include "tcpnetserver.h"
 #include "version.h"
+#include "monotonic.h"
+#include "jsonmessagereader.h"
 #include "libwebsockets.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include <iostream>
 #include <algorithm>
+#include <stdlib.h>
+#include <errno.h>
 
 
+const unsigned TcpNetServer::kIntervalBoundsMs[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+
 TcpNetServer::TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
-    void *context, bool verbose)
-    : mOpcCallback(opcCallback), mJsonCallback(jsonCallback),
-      mUserContext(context), mThread(0), mVerbose(verbose)
+    metricsCallback_t metricsCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mJsonCallback(jsonCallback), mMetricsCallback(metricsCallback),
+      mUserContext(context), mThread(0), mVerbose(verbose), mNextClientId(0),
+      mRelayThread(0), mRelayOutboxDropped(0), mNextRelayClientId(0), mRelayClientCount(0)
 {}
 
 bool TcpNetServer::start(const char *host, int port)
@@ -66,6 +73,14 @@ bool TcpNetServer::start(const char *host, int port)
     info.protocols = protocols;
     info.user = this;
 
+    // Other threads wake our poll() when they have broadcasts queued
+    if (!mWake.init()) {
+        lwsl_err("Can't create wakeup event\n");
+        return false;
+    }
+    pollfd wake = { mWake.fd(), POLLIN, 0 };
+    mPollFds.push_back(wake);
+
     // Quieter during create_context, since it's kind of chatty.
     lws_set_log_level(llNormal, NULL);
 
@@ -99,7 +114,7 @@ bool TcpNetServer::startRelay(const char *host, int port)
         {
             "fcserver-relay",       // Name
             lwsRelayCallback,       // Callback
-            sizeof(Client),         // Protocol-specific data size
+            sizeof(RelayClient),    // Protocol-specific data size
             sizeof(OPC::Message),   // Max frame size / rx buffer
         },
 
@@ -115,6 +130,14 @@ bool TcpNetServer::startRelay(const char *host, int port)
     info.protocols = protocols;
     info.user = this;
 
+    // relayMessage() wakes our poll() when it has queued a frame
+    if (!mRelayWake.init()) {
+        lwsl_err("Can't create wakeup event for relay\n");
+        return false;
+    }
+    pollfd wake = { mRelayWake.fd(), POLLIN, 0 };
+    mRelayPollFds.push_back(wake);
+
     // Quieter during create_context, since it's kind of chatty.
     lws_set_log_level(llNormal, NULL);
 
@@ -133,7 +156,7 @@ bool TcpNetServer::startRelay(const char *host, int port)
 
     // Note that we pass ownership of all libwebsockets state to this new thread.
     // We shouldn't access it on the other threads afterwards.
-    mRelayThread = new tthread::thread(threadFunc, context);
+    mRelayThread = new tthread::thread(relayThreadFunc, context);
 
     return true;
 }
@@ -144,22 +167,129 @@ void TcpNetServer::threadFunc(void *arg)
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
 
     /*
-     * Mostly we're just handling incoming events from libwebsocket's poll(),
-     * but we do have some non-latency-critical broadcast events to flush out
-     * periodically.
-     *
-     * These would be faster if we could wake up libwebsocket's poll() from another
-     * thread, but there isn't an easy way to do that now, and we don't really care
-     * that much. During normal operation we'll be receiving lots of data over the
-     * network anyway.
+     * Mostly we're just handling incoming events from poll(), but other threads
+     * also queue broadcast events for us. Those threads signal mWake, which is
+     * part of our poll set, so broadcasts go out as soon as they're queued.
+     * Broadcasts held back by a subscriber's rate limit decide how long we sleep.
+     */
+    int timeoutMs = SERVICE_TIMEOUT_MS;
+    while (servicePoll(context, self->mPollFds, self->mWake, self->mLoop, timeoutMs)) {
+        timeoutMs = self->flushBroadcastList(context);
+    }
+
+    libwebsocket_context_destroy(context);
+}
+
+void TcpNetServer::relayThreadFunc(void *arg)
+{
+    struct libwebsocket_context *context = (libwebsocket_context*) arg;
+    TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
+
+    /*
+     * The relay thread owns its own libwebsockets context. Frames arrive from
+     * other threads via mRelayOutbox, and we move them onto each client's queue
+     * here, where it's safe to ask libwebsockets for writable callbacks. We sleep
+     * until a frame arrives, or until a frame held back by a rate limit is due.
      */
-    while (libwebsocket_service(context, 100) >= 0) {
-        self->flushBroadcastList();
+    int timeoutMs = SERVICE_TIMEOUT_MS;
+    while (servicePoll(context, self->mRelayPollFds, self->mRelayWake, self->mRelayLoop, timeoutMs)) {
+        timeoutMs = self->flushRelayOutbox(context);
     }
 
     libwebsocket_context_destroy(context);
 }
 
+void TcpNetServer::pollSetUpdate(std::vector<pollfd> &fds, enum libwebsocket_callback_reasons reason,
+    void *in, size_t len)
+{
+    /*
+     * We run our own poll() loop so that it can include a wakeup event, which
+     * means libwebsockets tells us about its descriptors through these callbacks.
+     * The descriptor is in 'in', and poll events are in 'len'.
+     */
+
+    int fd = (int)(long) in;
+    std::vector<pollfd>::iterator i;
+
+    switch (reason) {
+        case LWS_CALLBACK_ADD_POLL_FD: {
+            pollfd p = { fd, (short) len, 0 };
+            fds.push_back(p);
+            return;
+        }
+
+        case LWS_CALLBACK_DEL_POLL_FD:
+        case LWS_CALLBACK_SET_MODE_POLL_FD:
+        case LWS_CALLBACK_CLEAR_MODE_POLL_FD:
+            break;
+
+        default:
+            return;
+    }
+
+    for (i = fds.begin(); i != fds.end() && i->fd != fd; ++i);
+    if (i == fds.end()) {
+        return;
+    }
+
+    if (reason == LWS_CALLBACK_DEL_POLL_FD) {
+        *i = fds.back();
+        fds.pop_back();
+    } else if (reason == LWS_CALLBACK_SET_MODE_POLL_FD) {
+        i->events |= (short) len;
+    } else {
+        i->events &= ~(short) len;
+    }
+}
+
+bool TcpNetServer::servicePoll(libwebsocket_context *context, std::vector<pollfd> &fds, WakeEvent &wake,
+    MetricLoop &loop, int timeoutMs)
+{
+    /*
+     * Wait for socket activity, a wakeup from another thread, or the timeout.
+     * The wakeup event is always fds[0]. Returns false if the server should stop.
+     */
+
+    loop.wait();
+#ifdef _WIN32
+    int n = WSAPoll(&fds[0], fds.size(), timeoutMs);
+#else
+    int n = poll(&fds[0], fds.size(), timeoutMs);
+#endif
+    loop.resume();
+
+    if (n < 0 && errno != EINTR) {
+        lwsl_err("poll() failed\n");
+        return false;
+    }
+
+    if (n > 0) {
+        if (fds[0].revents) {
+            fds[0].revents = 0;
+            wake.clear();
+        }
+
+        /*
+         * Servicing a descriptor can add or remove others. Removal moves the last
+         * descriptor into the vacated slot, so walk backwards over a copy of each
+         * entry, and clear its revents first so nothing is serviced twice.
+         */
+        for (size_t i = fds.size() - 1; i > 0; i--) {
+            if (i >= fds.size() || !fds[i].revents) {
+                continue;
+            }
+            pollfd p = fds[i];
+            fds[i].revents = 0;
+            if (libwebsocket_service_fd(context, &p) < 0) {
+                return false;
+            }
+        }
+    }
+
+    // Once-per-second timeout housekeeping
+    return libwebsocket_service_fd(context, NULL) >= 0;
+}
+
 int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
     enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
 {
@@ -176,6 +306,8 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
     Client *client = (Client*) user;
 
+    pollSetUpdate(self->mPollFds, reason, in, len);
+
     switch (reason) {
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_CLOSED_HTTP:
@@ -184,13 +316,29 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
                 free(client->opcBuffer);
                 client->opcBuffer = NULL;
             }
-            self->mClients.erase(wsi);
+            if (client && client->httpBuffer) {
+                free(client->httpBuffer);
+                client->httpBuffer = NULL;
+            }
+            if (client) {
+                self->broadcastClientClosed(*client);
+                self->mIngestClients.erase(client);
+            }
             break;
 
         case LWS_CALLBACK_ESTABLISHED:
-            self->mClients.insert(wsi);
+            client->wsi = wsi;
+            client->queueHead = 0;
+            client->queueCount = 0;
+            self->mClients.insert(client);
+
+            // Everyone hears about device changes unless they unsubscribe
+            self->subscribe(*client, "connected_devices_changed", 0);
             break;
 
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return self->broadcastWrite(context, wsi, *client);
+
         case LWS_CALLBACK_HTTP:
             return self->httpBegin(context, wsi, *client, (const char*) in);
 
@@ -202,8 +350,14 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
             return self->httpWrite(context, wsi, *client);
 
         case LWS_CALLBACK_SOCKET_READ:
-            // Low-level socket read. We may trap these for OPC protocol handling.
-            if (client->state != CLIENT_STATE_HTTP) {
+            // Low-level socket read. We trap these for OPC and plain HTTP.
+            if (!client->ingest.id) {
+                self->ingestClientOpened(context, wsi, *client);
+            }
+            if (client->state == CLIENT_STATE_HTTP) {
+                return self->httpRead(context, wsi, *client, (uint8_t*)in, len);
+            }
+            if (client->state != CLIENT_STATE_WEBSOCKETS) {
                 return self->opcRead(context, wsi, *client, (uint8_t*)in, len);
             }
             break;
@@ -223,36 +377,43 @@ int TcpNetServer::lwsRelayCallback(libwebsocket_context *context, libwebsocket *
     enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
 {
     /*
-     * Protocol callback for libwebsockets.
-     *
-     * Until we have a reason to support a non-default WebSockets protocol, this handles
-     * everything: plain HTTP, Open Pixel Control, and WebSockets.
-     *
-     * For HTTP, this serves simple static HTML documents which are included at compile-time
-     * from the 'http' directory. Our web UI interacts with the server via the public WebSockets API.
+     * Protocol callback for the relay socket. Relay clients are WebSockets
+     * connections that only receive; each one gets a copy of every OPC message
+     * that passes the filter in its URL.
      */
 
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
-    Client *client = (Client*) user;
+    RelayClient *client = (RelayClient*) user;
+
+    pollSetUpdate(self->mRelayPollFds, reason, in, len);
 
     switch (reason) {
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_CLOSED_HTTP:
         case LWS_CALLBACK_DEL_POLL_FD:
-            if (client && client->opcBuffer) {
-                free(client->opcBuffer);
-                client->opcBuffer = NULL;
+            if (client) {
+                self->relayClientClosed(*client);
             }
-            if (self->mRelayClients.erase(wsi) > 0) {
-                lwsl_notice("Relay client disconnected!\n");
+            break;
+
+        case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION: {
+            // Last chance to see the request headers
+            char uri[256];
+            if (client && lws_hdr_copy(wsi, uri, sizeof uri, WSI_TOKEN_GET_URI) > 0) {
+                relayParseFilter(client->filter, uri);
+            } else if (client) {
+                relayParseFilter(client->filter, "");
             }
             break;
+        }
 
         case LWS_CALLBACK_ESTABLISHED:
-            lwsl_notice("Relay client connected!\n");
-            self->mRelayClients.insert(wsi);
+            self->relayClientOpened(context, wsi, *client);
             break;
 
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return self->relayWrite(context, wsi, *client);
+
         default:
             break;
     }
@@ -294,7 +455,9 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
         return -1;
     }
 
-    if (opcb->bufferLength) {
+    bool copied = opcb->bufferLength != 0;
+    if (copied) {
+        client.ingest.reassemblyCopies++;
         memcpy(opcb->bufferLength + opcb->buffer, in, len);
         buffer = opcb->buffer;
         bufferLength = opcb->bufferLength + len;
@@ -325,17 +488,11 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
         }
 
         if (buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T' && buffer[3] == ' ') {
-            // Detected HTTP. Convert this to an HTTP client, and let libwebsockets handle
-            // all data received so far. We can jettison the OPC buffer at this point.
+            // Detected HTTP. We read requests until we see one for a WebSocket.
 
-            free(client.opcBuffer);
-            client.opcBuffer = 0;
             client.state = CLIENT_STATE_HTTP;
-
-            if (libwebsocket_read(context, wsi, buffer, bufferLength) < 0) {
-                return -1;
-            }
-            return 1;
+            opcb->bufferLength = 0;
+            return httpRead(context, wsi, client, buffer, bufferLength);
         }
 
         // Not HTTP. Handle this as an OPC socket.
@@ -360,7 +517,7 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
         }
 
         // Complete packet.
-        mOpcCallback(*msg, mUserContext);
+        opcDispatch(client, TRANSPORT_OPC, *msg);
 
         buffer += msgLength;
         bufferLength -= msgLength;
@@ -368,6 +525,9 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
 
     // If we have any residual data, save it for later.
     if (bufferLength && buffer != opcb->buffer) {
+        if (!copied) {
+            client.ingest.reassemblyCopies++;
+        }
         memmove(opcb->buffer, buffer, bufferLength);
     }
     opcb->bufferLength = bufferLength;
@@ -376,6 +536,180 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
     return 1;
 }
 
+void TcpNetServer::opcDispatch(Client &client, Transport transport, OPC::Message &msg)
+{
+    unsigned length = OPC::HEADER_BYTES + msg.length();
+    IngestStats &stats = client.ingest;
+
+    mReceivedMessages[transport][msg.channel].add();
+    mReceivedBytes[transport][msg.channel].add(length);
+    stats.messages++;
+    stats.bytes += length;
+
+    /*
+     * A client may send several channels per frame, so we time frames on the
+     * first channel it used. Bursty or stalling sources show up as a wide
+     * spread in the interval histogram.
+     */
+
+    if (stats.frameChannel < 0) {
+        stats.frameChannel = msg.channel;
+    }
+    if (msg.channel == stats.frameChannel) {
+        uint64_t now = Monotonic::micros();
+        if (stats.lastFrame) {
+            uint64_t interval = now - stats.lastFrame;
+            unsigned bucket = 0;
+            while (bucket < NUM_INTERVAL_BUCKETS && interval > kIntervalBoundsMs[bucket] * 1000ULL) {
+                bucket++;
+            }
+            stats.intervals[bucket]++;
+            stats.intervalSum += interval;
+            stats.intervalMax = std::max(stats.intervalMax, interval);
+        }
+        stats.lastFrame = now;
+    }
+
+    mOpcCallback(msg, mUserContext);
+}
+
+void TcpNetServer::ingestClientOpened(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    // A new connection sent its first data. Every connection gets an ID, but only OPC and WebSockets clients are listed.
+
+    IngestStats &stats = client.ingest;
+    stats.id = ++mNextClientId;
+    stats.connected = Monotonic::micros();
+    stats.frameChannel = -1;
+
+    char name[64];
+    libwebsockets_get_peer_addresses(context, wsi, libwebsocket_get_socket_fd(wsi),
+        name, sizeof name, stats.address, sizeof stats.address);
+
+    mIngestClients.insert(&client);
+}
+
+int TcpNetServer::httpRead(libwebsocket_context *context, libwebsocket *wsi,
+    Client &client, uint8_t *in, size_t len)
+{
+    /*
+     * Plain HTTP. libwebsockets closes the connection after every response, so
+     * we parse GET requests here and keep connections open between them. Only a
+     * WebSocket upgrade request goes to libwebsockets, with everything we buffered.
+     *
+     * Requests are collected in the protocol-detection buffer. If 'in' came from
+     * that buffer, it's already in place.
+     */
+
+    OPCBuffer *opcb = client.opcBuffer;
+
+    if (in != opcb->buffer + opcb->bufferLength) {
+        if (len + opcb->bufferLength > sizeof opcb->buffer) {
+            return -1;
+        }
+        memmove(opcb->buffer + opcb->bufferLength, in, len);
+    }
+    opcb->bufferLength += len;
+
+    // Pipelined requests wait until the current response is finished
+    if (client.httpBody) {
+        return 1;
+    }
+
+    return httpRequest(context, wsi, client) < 0 ? -1 : 1;
+}
+
+int TcpNetServer::httpRequest(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    /*
+     * Start responding to the next complete request in our buffer, if there is one.
+     */
+
+    OPCBuffer *opcb = client.opcBuffer;
+    const char *data = (const char*) opcb->buffer;
+    std::string buffered(data, opcb->bufferLength);
+
+    size_t end = buffered.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        // Still waiting for the end of the headers
+        return 0;
+    }
+    std::string request = buffered.substr(0, end + 2);
+
+    std::string value;
+    if (httpHeader(request, "Upgrade", value)) {
+        // Detected WebSockets. Let libwebsockets handle all data received so far.
+        // We can jettison the OPC buffer at this point.
+
+        client.state = CLIENT_STATE_WEBSOCKETS;
+        client.httpKeepAlive = false;
+        client.opcBuffer = 0;
+        int r = libwebsocket_read(context, wsi, opcb->buffer, opcb->bufferLength);
+        free(opcb);
+        return r < 0 ? -1 : 0;
+    }
+
+    // Remove the request from our buffer
+    opcb->bufferLength -= end + 4;
+    memmove(opcb->buffer, opcb->buffer + end + 4, opcb->bufferLength);
+
+    // Request line is "GET <path> HTTP/1.x"
+    size_t pathEnd = request.find(' ', 4);
+    size_t lineEnd = request.find("\r\n");
+    if (request.compare(0, 4, "GET ") || pathEnd == std::string::npos || pathEnd > lineEnd) {
+        lwsl_notice("Unsupported HTTP request\n");
+        return -1;
+    }
+    std::string path = request.substr(4, pathEnd - 4);
+    bool http10 = !request.compare(pathEnd + 1, lineEnd - pathEnd - 1, "HTTP/1.0");
+
+    // HTTP/1.1 keeps the connection by default, HTTP/1.0 only if asked
+    if (httpHeader(request, "Connection", value)) {
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        client.httpKeepAlive = http10 ? value == "keep-alive" : value != "close";
+    } else {
+        client.httpKeepAlive = !http10;
+    }
+
+    std::string ifNoneMatch;
+    httpHeader(request, "If-None-Match", ifNoneMatch);
+
+    return httpBegin(context, wsi, client, path.c_str(), ifNoneMatch);
+}
+
+bool TcpNetServer::httpHeader(const std::string &request, const char *name, std::string &value)
+{
+    // Find a header by case-insensitive name, and return its value without surrounding whitespace
+
+    size_t nameLen = strlen(name);
+    size_t line = request.find("\r\n");
+
+    while (line != std::string::npos && line + 2 < request.size()) {
+        line += 2;
+        size_t next = request.find("\r\n", line);
+        if (next == std::string::npos) {
+            break;
+        }
+
+        if (next - line > nameLen && request[line + nameLen] == ':') {
+            size_t i = 0;
+            while (i < nameLen && tolower(request[line + i]) == tolower(name[i])) {
+                i++;
+            }
+            if (i == nameLen) {
+                size_t first = request.find_first_not_of(" \t", line + nameLen + 1);
+                size_t last = request.find_last_not_of(" \t", next - 1);
+                value = first < next && last >= first ? request.substr(first, last - first + 1) : std::string();
+                return true;
+            }
+        }
+
+        line = next;
+    }
+
+    return false;
+}
+
 bool TcpNetServer::httpPathEqual(const char *a, const char *b)
 {
     // HTTP path comparison. Stop at '?' or '#', to ignore query/fragment portions.
@@ -394,7 +728,7 @@ bool TcpNetServer::httpPathEqual(const char *a, const char *b)
 }
 
 int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
-    Client &client, const char *path)
+    Client &client, const char *path, const std::string &ifNoneMatch)
 {
     /*
      * We have a new plain HTTP request. Match it against our document list, and send
@@ -403,8 +737,16 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
      * Note: To keep the size of fcserver down, we compress our HTTP documents.
      *       We don't bother supporting decompressing them. Instead, we always send
      *       them back with deflate content-encoding.
+     *
+     * Each document has an ETag computed when it was compiled in, so a browser that
+     * already has the current version gets an empty 304 response instead.
      */
 
+    // Generated documents come ahead of the static list
+    if (httpPathEqual(path, "/metrics")) {
+        return httpMetrics(context, wsi, client);
+    }
+
     HTTPDocument *doc = httpDocumentList;
 
     // Look for this path in the document list. If it isn't found, we'll serve the 404 doc.
@@ -413,48 +755,193 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
 
     if (!doc->path) {
         lwsl_notice("HTTP document not found, \"%s\"\n", path);
+        return httpRespond(context, wsi, client, 404, doc->contentType, "deflate",
+            0, "no-cache", doc->body, doc->contentLength);
+    }
+
+    char cacheControl[32];
+    if (doc->maxAge) {
+        snprintf(cacheControl, sizeof cacheControl, "max-age=%d", doc->maxAge);
+    } else {
+        strcpy(cacheControl, "no-cache");
+    }
+
+    if (ifNoneMatch == "*" || ifNoneMatch.find(doc->etag) != std::string::npos) {
+        return httpRespond(context, wsi, client, 304, 0, 0, doc->etag, cacheControl, "", 0);
     }
 
+    return httpRespond(context, wsi, client, 200, doc->contentType, "deflate",
+        doc->etag, cacheControl, doc->body, doc->contentLength);
+}
+
+int TcpNetServer::httpRespond(libwebsocket_context *context, libwebsocket *wsi, Client &client,
+    int status, const char *contentType, const char *contentEncoding, const char *etag,
+    const char *cacheControl, const char *body, int length)
+{
+    /*
+     * Send the headers for a response, and queue its body. Optional headers are
+     * left out if they're null. A 304 response has headers only.
+     */
+
+    const char *reason = status == 200 ? "OK" : status == 304 ? "Not Modified" : "Not Found";
     char buffer[1024];
     int size = snprintf(buffer, sizeof buffer,
         "HTTP/1.1 %d %s\r\n"
-        "Server: %s\r\n"
-        "Content-Type: %s\r\n"
+        "Server: %s\r\n",
+        status, reason, kFCServerVersion);
+
+    if (contentType) {
+        size += snprintf(buffer + size, sizeof buffer - size, "Content-Type: %s\r\n", contentType);
+    }
+    if (contentEncoding) {
+        size += snprintf(buffer + size, sizeof buffer - size, "Content-Encoding: %s\r\n", contentEncoding);
+    }
+    if (etag) {
+        size += snprintf(buffer + size, sizeof buffer - size, "ETag: %s\r\n", etag);
+    }
+    if (cacheControl) {
+        size += snprintf(buffer + size, sizeof buffer - size, "Cache-Control: %s\r\n", cacheControl);
+    }
+
+    size += snprintf(buffer + size, sizeof buffer - size,
         "Content-Length: %u\r\n"
-        "Content-Encoding: deflate\r\n"
-        "Connection: close\r\n"
+        "Connection: %s\r\n"
         "\r\n",
-        doc->path ? 200 : 404,
-        doc->path ? "OK" : "Not Found",
-        kFCServerVersion,
-        doc->contentType,
-        doc->contentLength
-    );
+        status == 304 ? 0 : length,
+        client.httpKeepAlive ? "keep-alive" : "close");
 
     if (libwebsocket_write(wsi, (unsigned char*) buffer, size, LWS_WRITE_HTTP) < 0) {
         return -1;
     }
 
-    // Write the body asynchronously
-    client.httpBody = doc->body;
-    client.httpLength = doc->contentLength;
+    // Write the body asynchronously, straight from where it's stored
+    client.httpBody = body;
+    client.httpLength = length;
     libwebsocket_callback_on_writable(context, wsi);
 
     return 0;
 }
 
+int TcpNetServer::httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    /*
+     * Live counters in Prometheus text format. Every counter has a single writer
+     * thread and is read here without locks; only walking the lists of devices
+     * and relay clients takes the lock that already protects each list.
+     */
+
+    MetricsWriter metrics;
+    writeMetrics(metrics);
+    mMetricsCallback(metrics, mUserContext);
+
+    std::string text = metrics.text();
+    client.httpBuffer = (char*) malloc(text.size() + 1);
+    if (!client.httpBuffer) {
+        lwsl_err("ERROR: Out of memory allocating metrics response.\n");
+        return -1;
+    }
+    memcpy(client.httpBuffer, text.c_str(), text.size() + 1);
+
+    return httpRespond(context, wsi, client, 200, "text/plain; version=0.0.4",
+        0, 0, "no-cache", client.httpBuffer, text.size());
+}
+
+void TcpNetServer::writeMetrics(MetricsWriter &metrics)
+{
+    static const char *kTransportNames[NUM_TRANSPORTS] = { "opc", "websocket" };
+
+    for (unsigned t = 0; t < NUM_TRANSPORTS; t++) {
+        for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+            uint64_t messages = mReceivedMessages[t][channel].value();
+            if (!messages) {
+                continue;
+            }
+
+            MetricsWriter::Labels labels;
+            labels.add("transport", kTransportNames[t]).add("channel", channel);
+            metrics.counter("fcserver_opc_messages_total",
+                "OPC messages received, by transport and channel", labels, messages);
+            metrics.counter("fcserver_opc_bytes_total",
+                "OPC bytes received including headers, by transport and channel",
+                labels, mReceivedBytes[t][channel].value());
+        }
+    }
+
+    double intervalBounds[NUM_INTERVAL_BUCKETS];
+    for (unsigned i = 0; i < NUM_INTERVAL_BUCKETS; i++) {
+        intervalBounds[i] = kIntervalBoundsMs[i] * 1e-3;
+    }
+
+    uint64_t now = Monotonic::micros();
+    for (std::set<Client*>::iterator cli = mIngestClients.begin(); cli != mIngestClients.end(); ++cli) {
+        Client &client = **cli;
+        const IngestStats &stats = client.ingest;
+
+        if (client.state != CLIENT_STATE_OPEN_PIXEL_CONTROL && client.state != CLIENT_STATE_WEBSOCKETS) {
+            continue;
+        }
+
+        MetricsWriter::Labels labels;
+        labels.add("id", stats.id).add("address", stats.address)
+            .add("transport", kTransportNames[client.state == CLIENT_STATE_WEBSOCKETS ? TRANSPORT_WEBSOCKET : TRANSPORT_OPC]);
+
+        metrics.counter("fcserver_client_messages_total",
+            "OPC messages received from each client", labels, stats.messages);
+        metrics.counter("fcserver_client_bytes_total",
+            "OPC bytes received from each client", labels, stats.bytes);
+        metrics.counter("fcserver_client_parse_errors_total",
+            "Malformed messages received from each client", labels, stats.parseErrors);
+        metrics.counter("fcserver_client_reassembly_copies_total",
+            "Reads from each client that were copied through the reassembly buffer", labels, stats.reassemblyCopies);
+        metrics.gauge("fcserver_client_idle_seconds",
+            "Time since each client's last frame", labels, (now - (stats.lastFrame ? stats.lastFrame : stats.connected)) * 1e-6);
+        metrics.histogram("fcserver_client_frame_interval_seconds",
+            "Time between frames from each client", labels,
+            intervalBounds, stats.intervals, NUM_INTERVAL_BUCKETS, stats.intervalSum * 1e-6);
+    }
+
+    metrics.loop("server", mLoop);
+
+    if (!mRelayThread) {
+        return;
+    }
+    metrics.loop("relay", mRelayLoop);
+
+    mRelayMutex.lock();
+
+    for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+        RelayClient &client = **cli;
+        MetricsWriter::Labels labels;
+        labels.add("id", client.id).add("address", client.address);
+
+        metrics.gauge("fcserver_relay_queued_messages",
+            "Messages waiting to be sent to each relay client", labels, client.queueCount);
+        metrics.counter("fcserver_relay_sent_total",
+            "Messages sent to each relay client", labels, client.sent);
+        metrics.counter("fcserver_relay_dropped_total",
+            "Messages each relay client missed because it fell behind", labels, client.dropped);
+    }
+
+    metrics.gauge("fcserver_relay_clients", "Connected relay clients",
+        MetricsWriter::Labels(), mRelayClients.size());
+    metrics.counter("fcserver_relay_outbox_dropped_total",
+        "Messages dropped before reaching any relay client queue",
+        MetricsWriter::Labels(), mRelayOutboxDropped);
+
+    mRelayMutex.unlock();
+}
+
 int TcpNetServer::httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client)
 {
     if (!client.httpBody) {
         return -1;
     }
 
-    do {
-        if (client.httpLength <= 0) {
-            // End of document
-            return -1;
+    while (client.httpLength > 0) {
+        int blockSize = client.httpLength;
+        if (blockSize > HTTP_WRITE_BLOCK) {
+            blockSize = HTTP_WRITE_BLOCK;
         }
-        int blockSize = std::min<int>(client.httpLength, 4096);
         int m = libwebsocket_write(wsi, (unsigned char *) client.httpBody, blockSize, LWS_WRITE_HTTP);
         if (m < 0) {
             // Write error, close connection
@@ -462,10 +949,26 @@ int TcpNetServer::httpWrite(libwebsocket_context *context, libwebsocket *wsi, Cl
         }
         client.httpBody += m;
         client.httpLength -= m;
-    } while (!lws_send_pipe_choked(wsi));
 
-    libwebsocket_callback_on_writable(context, wsi);
-    return 0;
+        if (client.httpLength > 0 && lws_send_pipe_choked(wsi)) {
+            libwebsocket_callback_on_writable(context, wsi);
+            return 0;
+        }
+    }
+
+    // End of document
+    client.httpBody = 0;
+    if (client.httpBuffer) {
+        free(client.httpBuffer);
+        client.httpBuffer = 0;
+    }
+
+    if (!client.httpKeepAlive || client.state != CLIENT_STATE_HTTP) {
+        return -1;
+    }
+
+    // Answer the next request, if one arrived while we were busy
+    return httpRequest(context, wsi, client);
 }
 
 int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len)
@@ -476,36 +979,62 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
 
         if (len < OPC::HEADER_BYTES) {
             lwsl_notice("NOTICE: Received binary WebSockets packet, but it's too small for an OPC header.\n");
+            client.ingest.parseErrors++;
             return 0;
         }
 
         if (msg->lenLow != 0 || msg->lenHigh != 0) {
             lwsl_notice("NOTICE: Received OPC packet over WebSockets with nonzero reserved (length) fields.\n");
+            client.ingest.parseErrors++;
         }
 
         if (len > sizeof *msg) {
             lwsl_notice("NOTICE: Received oversized OPC packet over WebSockets. Truncating.\n");
+            client.ingest.parseErrors++;
             len = sizeof *msg;
         }
 
         msg->setLength(len - OPC::HEADER_BYTES);
-        mOpcCallback(*msg, mUserContext);
+        opcDispatch(client, TRANSPORT_WEBSOCKET, *msg);
 
         return 0;
     }
 
     // Text frames are JSON encoded. Does that parse?
     rapidjson::Document message;
-    message.ParseInsitu<0>((char*) in);
+    const char *error;
+    size_t errorOffset;
 
-    if (message.HasParseError()) {
+    if (!JsonMessageReader::parseInsitu(message, (char*) in, error, errorOffset)) {
         lwsl_notice("NOTICE: Parse error in received JSON, character %d: %s\n",
-            int(message.GetErrorOffset()), message.GetParseError());
+            int(errorOffset), error);
+        client.ingest.parseErrors++;
         return 0;
     }
 
     if (!message.IsObject()) {
         lwsl_notice("NOTICE: Received JSON is not an object {}\n");
+        client.ingest.parseErrors++;
+        return 0;
+    }
+
+    // Subscriptions belong to this connection, so we handle them here rather than in mJsonCallback
+    const rapidjson::Value &type = message["type"];
+    if (type.IsString() && !strcmp(type.GetString(), "subscribe")) {
+        jsonSubscribe(client, message, true);
+        jsonReply(wsi, message);
+        return 0;
+    }
+    if (type.IsString() && !strcmp(type.GetString(), "unsubscribe")) {
+        jsonSubscribe(client, message, false);
+        jsonReply(wsi, message);
+        return 0;
+    }
+
+    // So do the per-connection statistics
+    if (type.IsString() && !strcmp(type.GetString(), "list_clients")) {
+        jsonListClients(message);
+        jsonReply(wsi, message);
         return 0;
     }
 
@@ -513,6 +1042,64 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
     return 0;
 }
 
+void TcpNetServer::jsonListClients(rapidjson::Document &message)
+{
+    /*
+     * Describe each OPC or WebSockets connection, and the data it has sent us.
+     * "frame_intervals" counts the time between frames in buckets, bounded above
+     * by each entry of "frame_interval_bounds_ms", plus one bucket for longer gaps.
+     */
+
+    rapidjson::MemoryPoolAllocator<> &alloc = message.GetAllocator();
+    rapidjson::Value list(rapidjson::kArrayType);
+    rapidjson::Value bounds(rapidjson::kArrayType);
+    uint64_t now = Monotonic::micros();
+
+    for (std::set<Client*>::iterator cli = mIngestClients.begin(); cli != mIngestClients.end(); ++cli) {
+        Client &client = **cli;
+        const IngestStats &stats = client.ingest;
+
+        if (client.state != CLIENT_STATE_OPEN_PIXEL_CONTROL && client.state != CLIENT_STATE_WEBSOCKETS) {
+            continue;
+        }
+
+        rapidjson::Value item(rapidjson::kObjectType);
+        rapidjson::Value address(stats.address, strlen(stats.address), alloc);
+        rapidjson::Value intervals(rapidjson::kArrayType);
+
+        item.AddMember("id", stats.id, alloc);
+        item.AddMember("address", address, alloc);
+        item.AddMember("protocol", client.state == CLIENT_STATE_WEBSOCKETS ? "websocket" : "opc", alloc);
+        item.AddMember("connected_ms", (now - stats.connected) / 1000, alloc);
+
+        if (stats.lastFrame) {
+            item.AddMember("idle_ms", (now - stats.lastFrame) / 1000, alloc);
+        } else {
+            item.AddMember("idle_ms", rapidjson::kNullType, alloc);
+        }
+
+        item.AddMember("messages", stats.messages, alloc);
+        item.AddMember("bytes", stats.bytes, alloc);
+
+        for (unsigned i = 0; i <= NUM_INTERVAL_BUCKETS; i++) {
+            intervals.PushBack(stats.intervals[i], alloc);
+        }
+        item.AddMember("frame_intervals", intervals, alloc);
+        item.AddMember("max_interval_ms", stats.intervalMax / 1000, alloc);
+
+        item.AddMember("parse_errors", stats.parseErrors, alloc);
+        item.AddMember("reassembly_copies", stats.reassemblyCopies, alloc);
+        list.PushBack(item, alloc);
+    }
+
+    for (unsigned i = 0; i < NUM_INTERVAL_BUCKETS; i++) {
+        bounds.PushBack(kIntervalBoundsMs[i], alloc);
+    }
+
+    message.AddMember("clients", list, alloc);
+    message.AddMember("frame_interval_bounds_ms", bounds, alloc);
+}
+
 int TcpNetServer::jsonReply(libwebsocket *wsi, rapidjson::Document &message)
 {
     jsonBuffer_t buffer;
@@ -540,47 +1127,788 @@ int TcpNetServer::jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi)
     return libwebsocket_write(wsi, (unsigned char *) string, len, LWS_WRITE_TEXT);
 }
 
-void TcpNetServer::flushBroadcastList()
+int TcpNetServer::flushBroadcastList(libwebsocket_context *context)
 {
-    // Send any pending broadcast packets. These are enqueued by other threads on a list
-    // protected by mBroadcastMutex.
+    /*
+     * Pending broadcasts are enqueued by other threads on a list protected by
+     * mBroadcastMutex. Each one was serialized once; here every subscriber to
+     * its topic takes a reference on its queue, and the queues drain as sockets
+     * become writable. Subscribers with a rate limit may have the broadcast
+     * held back until their interval has passed.
+     *
+     * Returns how long the server thread may sleep before a held broadcast is due, in milliseconds.
+     */
 
+    std::vector<Broadcast> list;
     mBroadcastMutex.lock();
-    for (std::vector<jsonBuffer_t*>::iterator buf = mBroadcastList.begin(); buf != mBroadcastList.end(); ++buf) {
-        for (std::set<libwebsocket*>::iterator cli = mClients.begin(); cli != mClients.end(); ++cli) {
-            jsonBufferSend(**buf, *cli);
-        }
-        delete *buf;
-    }
-    mBroadcastList.clear();
+    list.swap(mBroadcastList);
     mBroadcastMutex.unlock();
-}
 
-void TcpNetServer::jsonBroadcast(rapidjson::Document &message)
-{
-    jsonBuffer_t *buffer = new jsonBuffer_t();
-    jsonBufferPrepare(*buffer, message);
+    uint64_t now = Monotonic::micros();
+    bool sentAny = false;
+    int timeoutMs = SERVICE_TIMEOUT_MS;
 
-    mBroadcastMutex.lock();
-    mBroadcastList.push_back(buffer);
+    for (std::vector<Broadcast>::iterator buf = list.begin(); buf != list.end(); ++buf) {
+        unsigned id = broadcastTopicId(buf->topic);
+        subscriberMap_t &subscribers = mSubscribers[id];
+
+        for (subscriberMap_t::iterator sub = subscribers.begin(); sub != subscribers.end(); ++sub) {
+            Subscription &subscription = sub->second;
+
+            if (subscription.maxRate && now - subscription.lastSent < 1000000 / subscription.maxRate) {
+                buf->buffer->ref();
+                if (subscription.held) {
+                    subscription.held->unref();
+                }
+                subscription.held = buf->buffer;
+                continue;
+            }
+
+            // This broadcast supersedes anything still held back
+            if (subscription.held) {
+                subscription.held->unref();
+                subscription.held = 0;
+            }
+
+            subscription.lastSent = now;
+            broadcastEnqueue(*sub->first, buf->buffer, id);
+            sentAny = true;
+        }
+        buf->buffer->unref();
+    }
+
+    for (unsigned id = 0; id < mSubscribers.size(); id++) {
+        subscriberMap_t &subscribers = mSubscribers[id];
+
+        for (subscriberMap_t::iterator sub = subscribers.begin(); sub != subscribers.end(); ++sub) {
+            Subscription &subscription = sub->second;
+            if (!subscription.held) {
+                continue;
+            }
+
+            uint64_t interval = 1000000 / subscription.maxRate;
+            if (now - subscription.lastSent >= interval) {
+                subscription.lastSent = now;
+                broadcastEnqueue(*sub->first, subscription.held, id);
+                subscription.held->unref();
+                subscription.held = 0;
+                sentAny = true;
+            } else {
+                int due = int((subscription.lastSent + interval - now + 999) / 1000);
+                timeoutMs = std::min(timeoutMs, due);
+            }
+        }
+    }
+
+    if (sentAny) {
+        for (std::set<Client*>::iterator cli = mClients.begin(); cli != mClients.end(); ++cli) {
+            if ((*cli)->queueCount) {
+                libwebsocket_callback_on_writable(context, (*cli)->wsi);
+            }
+        }
+    }
+
+    return timeoutMs;
+}
+
+unsigned TcpNetServer::broadcastTopicId(const std::string &topic)
+{
+    // Server thread only. Topics get small integer IDs the first time we see them.
+
+    std::map<std::string, unsigned>::iterator i = mBroadcastTopics.find(topic);
+    if (i != mBroadcastTopics.end()) {
+        return i->second;
+    }
+
+    unsigned id = mSubscribers.size();
+    mBroadcastTopics[topic] = id;
+    mSubscribers.resize(id + 1);
+    return id;
+}
+
+void TcpNetServer::subscribe(Client &client, const std::string &topic, unsigned maxRate)
+{
+    // Server thread only. Subscribing again just updates the rate limit.
+
+    subscriberMap_t &subscribers = mSubscribers[broadcastTopicId(topic)];
+    subscriberMap_t::iterator sub = subscribers.find(&client);
+
+    if (sub != subscribers.end()) {
+        sub->second.maxRate = maxRate;
+        return;
+    }
+
+    Subscription &subscription = subscribers[&client];
+    subscription.maxRate = maxRate;
+    subscription.lastSent = 0;
+    subscription.held = 0;
+
+    mBroadcastMutex.lock();
+    mSubscriberCounts[topic]++;
     mBroadcastMutex.unlock();
 }
 
+void TcpNetServer::unsubscribe(Client &client, const std::string &topic)
+{
+    // Server thread only
+
+    subscriberMap_t &subscribers = mSubscribers[broadcastTopicId(topic)];
+    subscriberMap_t::iterator sub = subscribers.find(&client);
+    if (sub == subscribers.end()) {
+        return;
+    }
+
+    if (sub->second.held) {
+        sub->second.held->unref();
+    }
+    subscribers.erase(sub);
+
+    mBroadcastMutex.lock();
+    if (--mSubscriberCounts[topic] == 0) {
+        mSubscriberCounts.erase(topic);
+    }
+    mBroadcastMutex.unlock();
+}
+
+void TcpNetServer::jsonSubscribe(Client &client, rapidjson::Document &message, bool subscribing)
+{
+    /*
+     * Handle a "subscribe" or "unsubscribe" message. The topic names are in a
+     * "topics" array or a single "topic" string. Subscriptions can have an
+     * optional "maxRate", in broadcasts per second.
+     */
+
+    const rapidjson::Value &topic = message["topic"];
+    const rapidjson::Value &topics = message["topics"];
+    const rapidjson::Value &maxRate = message["maxRate"];
+
+    if (!maxRate.IsNull() && !(maxRate.IsUint() && maxRate.GetUint() > 0)) {
+        message.AddMember("error", "maxRate must be a positive integer", message.GetAllocator());
+        return;
+    }
+    unsigned rate = maxRate.IsUint() ? maxRate.GetUint() : 0;
+
+    std::vector<std::string> names;
+    if (topic.IsString()) {
+        names.push_back(topic.GetString());
+    } else if (topics.IsArray()) {
+        for (unsigned i = 0; i < topics.Size(); i++) {
+            if (!topics[i].IsString()) {
+                message.AddMember("error", "Topic names must be strings", message.GetAllocator());
+                return;
+            }
+            names.push_back(topics[i].GetString());
+        }
+    } else {
+        message.AddMember("error", "Missing \"topic\" or \"topics\"", message.GetAllocator());
+        return;
+    }
+
+    for (std::vector<std::string>::iterator name = names.begin(); name != names.end(); ++name) {
+        if (subscribing) {
+            subscribe(client, *name, rate);
+        } else {
+            unsubscribe(client, *name);
+        }
+    }
+}
+
+void TcpNetServer::broadcastEnqueue(Client &client, SharedBuffer *buffer, unsigned topic)
+{
+    // Replace an unsent broadcast on the same topic, so only the latest state goes out
+    for (unsigned i = 0; i < client.queueCount; i++) {
+        QueuedBroadcast &entry = client.queue[(client.queueHead + i) % BROADCAST_QUEUE_DEPTH];
+        if (entry.topic == topic) {
+            buffer->ref();
+            entry.buffer->unref();
+            entry.buffer = buffer;
+            return;
+        }
+    }
+
+    if (client.queueCount == BROADCAST_QUEUE_DEPTH) {
+        // Client has fallen far behind; drop its oldest broadcast
+        client.queue[client.queueHead].buffer->unref();
+        client.queueHead = (client.queueHead + 1) % BROADCAST_QUEUE_DEPTH;
+        client.queueCount--;
+    }
+
+    buffer->ref();
+    QueuedBroadcast &entry = client.queue[(client.queueHead + client.queueCount) % BROADCAST_QUEUE_DEPTH];
+    entry.buffer = buffer;
+    entry.topic = topic;
+    client.queueCount++;
+}
+
+void TcpNetServer::broadcastClientClosed(Client &client)
+{
+    // May be called more than once per client, and for clients that never became WebSockets
+    for (std::map<std::string, unsigned>::iterator topic = mBroadcastTopics.begin();
+        topic != mBroadcastTopics.end(); ++topic) {
+        if (mSubscribers[topic->second].count(&client)) {
+            unsubscribe(client, topic->first);
+        }
+    }
+
+    while (client.queueCount) {
+        client.queue[client.queueHead].buffer->unref();
+        client.queueHead = (client.queueHead + 1) % BROADCAST_QUEUE_DEPTH;
+        client.queueCount--;
+    }
+    mClients.erase(&client);
+}
+
+int TcpNetServer::broadcastWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    // Send queued broadcasts until the socket would block
+
+    while (client.queueCount) {
+        if (lws_send_pipe_choked(wsi)) {
+            libwebsocket_callback_on_writable(context, wsi);
+            return 0;
+        }
+
+        SharedBuffer *buffer = client.queue[client.queueHead].buffer;
+        client.queueHead = (client.queueHead + 1) % BROADCAST_QUEUE_DEPTH;
+        client.queueCount--;
+
+        int r = libwebsocket_write(wsi, buffer->data(), buffer->length(), LWS_WRITE_TEXT);
+        buffer->unref();
+        if (r < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+bool TcpNetServer::hasSubscribers(const char *topic)
+{
+    mBroadcastMutex.lock();
+    bool result = mSubscriberCounts.count(topic) != 0;
+    mBroadcastMutex.unlock();
+    return result;
+}
+
+void TcpNetServer::jsonBroadcast(rapidjson::Document &message, const char *topic)
+{
+    if (!topic) {
+        const rapidjson::Value &type = message["type"];
+        topic = type.IsString() ? type.GetString() : "";
+    }
+
+    // Publishing to a topic nobody wants costs one lookup
+    if (!hasSubscribers(topic)) {
+        return;
+    }
+
+    // Serialize once, on the calling thread. Every subscriber shares the result.
+    jsonBuffer_t json;
+    rapidjson::Writer<jsonBuffer_t> writer(json);
+    message.Accept(writer);
+
+    SharedBuffer *buffer = SharedBuffer::create(json.Size());
+    if (!buffer) {
+        return;
+    }
+    memcpy(buffer->data(), json.GetString(), json.Size());
+
+    mBroadcastMutex.lock();
+
+    bool replaced = false;
+    for (std::vector<Broadcast>::iterator buf = mBroadcastList.begin(); buf != mBroadcastList.end(); ++buf) {
+        if (buf->topic == topic) {
+            buf->buffer->unref();
+            buf->buffer = buffer;
+            replaced = true;
+            break;
+        }
+    }
+
+    if (!replaced) {
+        Broadcast b;
+        b.buffer = buffer;
+        b.topic = topic;
+        mBroadcastList.push_back(b);
+    }
+
+    mBroadcastMutex.unlock();
+
+    mWake.signal();
+}
+
 void TcpNetServer::relayMessage(OPC::Message &msg)
 {
-    if (mRelayClients.size()) {
-        int headerLen = 4;
-        int bufferLen = headerLen + msg.length();
-        unsigned char buffer[bufferLen];
-        buffer[0] = (unsigned char)msg.channel;
-        buffer[1] = (unsigned char)msg.command;
-        buffer[2] = (unsigned char)msg.lenHigh;
-        buffer[3] = (unsigned char)msg.lenLow;
-        for (int i=0; i < msg.length(); i++) {
-            buffer[headerLen+i] = (unsigned char)msg.data[i];
+    /*
+     * Called on whichever thread received the message. We serialize it once
+     * into a shared buffer and leave it for the relay thread; nothing here
+     * waits on a relay client.
+     */
+
+    if (!mRelayClientCount) {
+        return;
+    }
+
+    unsigned length = OPC::HEADER_BYTES + msg.length();
+    SharedBuffer *buffer = SharedBuffer::create(length);
+    if (!buffer) {
+        return;
+    }
+    memcpy(buffer->data(), &msg, length);
+
+    mRelayMutex.lock();
+    if (mRelayOutbox.size() >= RELAY_QUEUE_DEPTH) {
+        // The relay thread itself is behind. Newest frames win here too.
+        mRelayOutbox.front()->unref();
+        mRelayOutbox.erase(mRelayOutbox.begin());
+        mRelayOutboxDropped++;
+    }
+    mRelayOutbox.push_back(buffer);
+    mRelayMutex.unlock();
+
+    mRelayWake.signal();
+}
+
+int TcpNetServer::flushRelayOutbox(libwebsocket_context *context)
+{
+    /*
+     * Relay thread only. Filter each new frame once per group of clients that
+     * share a filter, then queue the result for every client in that group.
+     * Frames held back by a frame rate limit go out here once their time comes.
+     *
+     * Returns how long the relay thread may sleep before a held frame is due, in milliseconds.
+     */
+
+    mRelayMutex.lock();
+
+    uint64_t now = Monotonic::micros();
+    bool sentAny = !mRelayOutbox.empty();
+
+    for (std::vector<SharedBuffer*>::iterator buf = mRelayOutbox.begin(); buf != mRelayOutbox.end(); ++buf) {
+        for (std::vector<RelayGroup*>::iterator g = mRelayGroups.begin(); g != mRelayGroups.end(); ++g) {
+            RelayGroup *group = *g;
+
+            SharedBuffer *frame = relayFilterFrame(group->filter, *buf);
+            if (!frame) {
+                continue;
+            }
+
+            const OPC::Message *msg = (const OPC::Message*) frame->data();
+            bool limited = group->filter.maxFps &&
+                (OPC::pixelBytes(msg->command) || OPC::isMultiChannelFrame(*msg));
+            if (limited && now - group->lastSent < 1000000 / group->filter.maxFps) {
+                if (group->held) {
+                    group->held->unref();
+                }
+                group->held = frame;
+                continue;
+            }
+
+            if (limited) {
+                group->lastSent = now;
+            }
+            relayGroupSend(group, frame);
+            frame->unref();
+        }
+        (*buf)->unref();
+    }
+    mRelayOutbox.clear();
+
+    int timeoutMs = SERVICE_TIMEOUT_MS;
+
+    for (std::vector<RelayGroup*>::iterator g = mRelayGroups.begin(); g != mRelayGroups.end(); ++g) {
+        RelayGroup *group = *g;
+        if (!group->held) {
+            continue;
+        }
+
+        uint64_t interval = 1000000 / group->filter.maxFps;
+        if (now - group->lastSent >= interval) {
+            group->lastSent = now;
+            relayGroupSend(group, group->held);
+            group->held->unref();
+            group->held = 0;
+            sentAny = true;
+        } else {
+            int due = int((group->lastSent + interval - now + 999) / 1000);
+            timeoutMs = std::min(timeoutMs, due);
+        }
+    }
+
+    if (sentAny) {
+        for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+            if ((*cli)->queueCount) {
+                libwebsocket_callback_on_writable(context, (*cli)->wsi);
+            }
+        }
+    }
+
+    mRelayMutex.unlock();
+    return timeoutMs;
+}
+
+void TcpNetServer::relayGroupSend(RelayGroup *group, SharedBuffer *frame)
+{
+    // Queue a frame for every client in a group. Caller holds mRelayMutex.
+
+    for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+        RelayClient &client = **cli;
+        if (client.group != group) {
+            continue;
         }
-        for (std::set<libwebsocket*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
-            libwebsocket_write(*cli, buffer, bufferLen, LWS_WRITE_BINARY);
+
+        if (client.queueCount == RELAY_QUEUE_DEPTH) {
+            // Lagging client; drop its oldest frame
+            client.queue[client.queueHead]->unref();
+            client.queueHead = (client.queueHead + 1) % RELAY_QUEUE_DEPTH;
+            client.queueCount--;
+            client.dropped++;
         }
+
+        frame->ref();
+        client.queue[(client.queueHead + client.queueCount) % RELAY_QUEUE_DEPTH] = frame;
+        client.queueCount++;
+        client.maxQueueCount = std::max(client.maxQueueCount, client.queueCount);
+    }
+}
+
+void TcpNetServer::relayParseFilter(RelayFilter &filter, const char *uri)
+{
+    /*
+     * Relay clients choose what they receive with URL query parameters, for example
+     * "ws://host:port/?channel=1&first=0&count=64&fps=10". Anything missing or
+     * unrecognized leaves that part of the filter wide open.
+     */
+
+    filter.channel = -1;
+    filter.firstPixel = 0;
+    filter.pixelCount = 0;
+    filter.maxFps = 0;
+
+    const char *query = strchr(uri, '?');
+    if (!query) {
+        return;
+    }
+
+    for (const char *param = query + 1; *param; ) {
+        const char *value = strchr(param, '=');
+        const char *next = strchr(param, '&');
+        if (!next) {
+            next = param + strlen(param);
+        }
+
+        if (value && value < next) {
+            unsigned long v = strtoul(value + 1, 0, 10);
+            size_t keyLen = value - param;
+
+            if (keyLen == 7 && !strncmp(param, "channel", 7) && v <= 255) {
+                filter.channel = v;
+            } else if (keyLen == 5 && !strncmp(param, "first", 5)) {
+                filter.firstPixel = std::min<unsigned long>(v, 0xFFFF);
+            } else if (keyLen == 5 && !strncmp(param, "count", 5)) {
+                filter.pixelCount = std::min<unsigned long>(v, 0xFFFF);
+            } else if (keyLen == 3 && !strncmp(param, "fps", 3)) {
+                filter.maxFps = std::min<unsigned long>(v, 1000000);
+            }
+        }
+
+        param = *next ? next + 1 : next;
+    }
+}
+
+bool TcpNetServer::relayFilterRange(const RelayFilter &filter, const OPC::Message &msg,
+    unsigned &start, unsigned &end)
+{
+    /*
+     * Which bytes of one message's payload pass 'filter', as [start, end).
+     * Returns false if none of them do.
+     */
+
+    unsigned length = msg.length();
+
+    if (filter.channel >= 0 && msg.channel != unsigned(filter.channel) && msg.channel != 0) {
+        return false;
+    }
+
+    unsigned pixelBytes = OPC::pixelBytes(msg.command);
+
+    if (!pixelBytes || (filter.firstPixel == 0 && filter.pixelCount == 0)) {
+        start = 0;
+        end = length;
+        return true;
     }
+
+    start = filter.firstPixel * pixelBytes;
+    if (start >= length) {
+        return false;
+    }
+    end = filter.pixelCount ? std::min(length, start + filter.pixelCount * pixelBytes) : length;
+    return true;
+}
+
+SharedBuffer *TcpNetServer::relayFilterFrame(const RelayFilter &filter, SharedBuffer *frame)
+{
+    /*
+     * Returns a new reference to the part of 'frame' that passes 'filter', or NULL if
+     * none of it does. Unfiltered frames are shared, not copied. A pixel subrange is
+     * renumbered so that its first pixel becomes pixel 0.
+     */
+
+    const OPC::Message *msg = (const OPC::Message*) frame->data();
+
+    if (OPC::isMultiChannelFrame(*msg)) {
+        return relayFilterMultiChannel(filter, frame);
+    }
+
+    unsigned start, end;
+    if (!relayFilterRange(filter, *msg, start, end)) {
+        return 0;
+    }
+    if (start == 0 && end == msg->length()) {
+        frame->ref();
+        return frame;
+    }
+
+    SharedBuffer *out = SharedBuffer::create(OPC::HEADER_BYTES + end - start);
+    if (!out) {
+        return 0;
+    }
+
+    OPC::Message *outMsg = (OPC::Message*) out->data();
+    outMsg->channel = msg->channel;
+    outMsg->command = msg->command;
+    outMsg->setLength(end - start);
+    memcpy(outMsg->data, msg->data + start, end - start);
+    return out;
+}
+
+SharedBuffer *TcpNetServer::relayFilterMultiChannel(const RelayFilter &filter, SharedBuffer *frame)
+{
+    /*
+     * Filter each part of a Multi-Channel Pixel Colors frame on its own. The first
+     * pass sizes the result and the second fills it in. If only one part is left,
+     * it's relayed as a plain message, which is what a client watching one channel
+     * expects.
+     */
+
+    const OPC::Message *msg = (const OPC::Message*) frame->data();
+    unsigned length = msg->length();
+    SharedBuffer *out = 0;
+    uint8_t *dest = 0;
+    unsigned outLength = 4;
+    unsigned count = 0;
+    const OPC::Message *single = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned offset = 4;
+
+        while (offset + OPC::HEADER_BYTES <= length) {
+            const OPC::Message *part = (const OPC::Message*) &msg->data[offset];
+            unsigned size = OPC::HEADER_BYTES + part->length();
+            if (offset + size > length) {
+                break;
+            }
+            offset += size;
+
+            unsigned start, end;
+            if (!relayFilterRange(filter, *part, start, end)) {
+                continue;
+            }
+
+            if (dest) {
+                OPC::Message *outPart = (OPC::Message*) dest;
+                outPart->channel = part->channel;
+                outPart->command = part->command;
+                outPart->setLength(end - start);
+                memcpy(outPart->data, part->data + start, end - start);
+                dest += OPC::HEADER_BYTES + end - start;
+            } else {
+                outLength += OPC::HEADER_BYTES + end - start;
+                count++;
+                single = part;
+            }
+        }
+
+        if (dest) {
+            return out;
+        }
+        if (!count || outLength > 0xFFFF) {
+            return 0;
+        }
+        if (outLength == length) {
+            frame->ref();
+            return frame;
+        }
+
+        if (count == 1) {
+            // Drop the wrapper; the range check can't fail the second time
+            unsigned start, end;
+            relayFilterRange(filter, *single, start, end);
+            out = SharedBuffer::create(OPC::HEADER_BYTES + end - start);
+            if (!out) {
+                return 0;
+            }
+            OPC::Message *outMsg = (OPC::Message*) out->data();
+            outMsg->channel = single->channel;
+            outMsg->command = single->command;
+            outMsg->setLength(end - start);
+            memcpy(outMsg->data, single->data + start, end - start);
+            return out;
+        }
+
+        out = SharedBuffer::create(OPC::HEADER_BYTES + outLength);
+        if (!out) {
+            return 0;
+        }
+        OPC::Message *outMsg = (OPC::Message*) out->data();
+        outMsg->channel = msg->channel;
+        outMsg->command = msg->command;
+        outMsg->setLength(outLength);
+        memcpy(outMsg->data, msg->data, 4);
+        dest = outMsg->data + 4;
+    }
+
+    return out;
+}
+
+int TcpNetServer::relayWrite(libwebsocket_context *context, libwebsocket *wsi, RelayClient &client)
+{
+    // Send queued frames until the socket would block
+
+    while (!lws_send_pipe_choked(wsi)) {
+        mRelayMutex.lock();
+        if (!client.queueCount) {
+            mRelayMutex.unlock();
+            return 0;
+        }
+        SharedBuffer *buffer = client.queue[client.queueHead];
+        client.queueHead = (client.queueHead + 1) % RELAY_QUEUE_DEPTH;
+        client.queueCount--;
+        client.sent++;
+        mRelayMutex.unlock();
+
+        int r = libwebsocket_write(wsi, buffer->data(), buffer->length(), LWS_WRITE_BINARY);
+        buffer->unref();
+        if (r < 0) {
+            return -1;
+        }
+    }
+
+    libwebsocket_callback_on_writable(context, wsi);
+    return 0;
+}
+
+void TcpNetServer::relayClientOpened(libwebsocket_context *context, libwebsocket *wsi, RelayClient &client)
+{
+    // The filter was already parsed from the request; everything else starts out empty.
+    client.wsi = wsi;
+    client.queueHead = 0;
+    client.queueCount = 0;
+    client.maxQueueCount = 0;
+    client.sent = 0;
+    client.dropped = 0;
+
+    char name[64];
+    libwebsockets_get_peer_addresses(context, wsi, libwebsocket_get_socket_fd(wsi),
+        name, sizeof name, client.address, sizeof client.address);
+
+    mRelayMutex.lock();
+
+    client.group = 0;
+    for (std::vector<RelayGroup*>::iterator g = mRelayGroups.begin(); g != mRelayGroups.end(); ++g) {
+        if ((*g)->filter == client.filter) {
+            client.group = *g;
+            break;
+        }
+    }
+    if (!client.group) {
+        client.group = new RelayGroup();
+        client.group->filter = client.filter;
+        client.group->numClients = 0;
+        client.group->lastSent = 0;
+        client.group->held = 0;
+        mRelayGroups.push_back(client.group);
+    }
+    client.group->numClients++;
+
+    client.id = mNextRelayClientId++;
+    mRelayClients.insert(&client);
+    mRelayClientCount = mRelayClients.size();
+
+    mRelayMutex.unlock();
+
+    lwsl_notice("Relay client connected!\n");
+}
+
+void TcpNetServer::relayClientClosed(RelayClient &client)
+{
+    mRelayMutex.lock();
+
+    // We may hear about the same client closing more than once
+    if (mRelayClients.erase(&client) > 0) {
+        while (client.queueCount) {
+            client.queue[client.queueHead]->unref();
+            client.queueHead = (client.queueHead + 1) % RELAY_QUEUE_DEPTH;
+            client.queueCount--;
+        }
+
+        if (--client.group->numClients == 0) {
+            if (client.group->held) {
+                client.group->held->unref();
+            }
+            mRelayGroups.erase(std::find(mRelayGroups.begin(), mRelayGroups.end(), client.group));
+            delete client.group;
+        }
+        client.group = 0;
+
+        mRelayClientCount = mRelayClients.size();
+        lwsl_notice("Relay client disconnected!\n");
+    }
+
+    mRelayMutex.unlock();
+}
+
+void TcpNetServer::describeRelayClients(rapidjson::Value &object, rapidjson::MemoryPoolAllocator<> &alloc)
+{
+    /*
+     * "queued" is how many frames a client is behind right now, and "dropped"
+     * counts frames it never received because it fell too far behind.
+     */
+
+    rapidjson::Value list(rapidjson::kArrayType);
+
+    mRelayMutex.lock();
+
+    for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+        RelayClient &client = **cli;
+        rapidjson::Value item(rapidjson::kObjectType);
+        rapidjson::Value address(client.address, strlen(client.address), alloc);
+
+        item.AddMember("id", client.id, alloc);
+        item.AddMember("address", address, alloc);
+
+        if (client.filter.channel >= 0) {
+            item.AddMember("channel", client.filter.channel, alloc);
+        }
+        if (client.filter.firstPixel || client.filter.pixelCount) {
+            item.AddMember("first", client.filter.firstPixel, alloc);
+            item.AddMember("count", client.filter.pixelCount, alloc);
+        }
+        if (client.filter.maxFps) {
+            item.AddMember("fps", client.filter.maxFps, alloc);
+        }
+
+        item.AddMember("queued", client.queueCount, alloc);
+        item.AddMember("max_queued", client.maxQueueCount, alloc);
+        item.AddMember("sent", client.sent, alloc);
+        item.AddMember("dropped", client.dropped, alloc);
+        list.PushBack(item, alloc);
+    }
+
+    uint64_t outboxDropped = mRelayOutboxDropped;
+
+    mRelayMutex.unlock();
+
+    object.AddMember("clients", list, alloc);
+    object.AddMember("dropped", outboxDropped, alloc);
 }
@@ -25,19 +25,25 @@
 #include <stdint.h>
 #include <vector>
 #include <set>
+#include <map>
+#include <string>
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "tinythread.h"
 #include "libwebsockets.h"
 #include "opc.h"
+#include "sharedbuffer.h"
+#include "wakeevent.h"
+#include "metrics.h"
 
 
 class TcpNetServer {
 public:
     typedef void (*jsonCallback_t)(libwebsocket *wsi, rapidjson::Document &message, void *context);
+    typedef void (*metricsCallback_t)(MetricsWriter &metrics, void *context);
 
     TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
-        void *context, bool verbose = false);
+        metricsCallback_t metricsCallback, void *context, bool verbose = false);
 
     // Start the event loop on a separate thread
     bool start(const char *host, int port);
@@ -48,27 +54,49 @@ public:
     // Reply callback, for use only on the TcpNetServer thread. Call this inside jsonCallback.
     int jsonReply(libwebsocket *wsi, rapidjson::Document &message);
 
-    // Broadcast JSON to all clients, from any thread.
-    void jsonBroadcast(rapidjson::Document &message);
+    // Broadcast JSON to all clients subscribed to a topic, from any thread. A newer broadcast
+    // on the same topic replaces one that hasn't been sent yet. By default the topic is the message type.
+    void jsonBroadcast(rapidjson::Document &message, const char *topic = 0);
 
-    // Sends an OPC message to clients connected to the relay socket
+    // Does a topic have any subscribers? Publishers can skip building messages nobody wants. Any thread.
+    bool hasSubscribers(const char *topic);
+
+    // Sends an OPC message to clients connected to the relay socket, from any thread. Never blocks.
     void relayMessage(OPC::Message &msg);
 
+    // Add relay client details and queue statistics to a JSON object, from any thread.
+    void describeRelayClients(rapidjson::Value &object, rapidjson::MemoryPoolAllocator<> &alloc);
+
 private:
     enum ClientState {
         CLIENT_STATE_PROTOCOL_DETECT = 0,
         CLIENT_STATE_OPEN_PIXEL_CONTROL,
-        CLIENT_STATE_HTTP
+        CLIENT_STATE_HTTP,              // Plain HTTP requests, which we parse ourselves
+        CLIENT_STATE_WEBSOCKETS         // Handed over to libwebsockets
+    };
+
+    // How OPC messages reached us, for the metrics endpoint
+    enum Transport {
+        TRANSPORT_OPC = 0,
+        TRANSPORT_WEBSOCKET,
+        NUM_TRANSPORTS
     };
 
+    static const unsigned NUM_CHANNELS = 256;
+
     // In-memory database of static files to serve over HTTP
     struct HTTPDocument {
         const char *path;
         const char *body;
         const char *contentType;
         int contentLength;
+        const char *etag;       // Quoted hash of the document, computed by manifest.py
+        int maxAge;             // Seconds a browser may use its copy without asking again
     };
 
+    // HTTP bodies are written in blocks this large, until the socket is full
+    static const int HTTP_WRITE_BLOCK = 64 * 1024;
+
     // Buffer used for protocol-detection and Open Pixel Control. Big enough for two OPC packets.
     // This buffer is jettisonned 
     struct OPCBuffer {
@@ -76,52 +104,202 @@ private:
         uint8_t buffer[2 * sizeof(OPC::Message)];
     };
 
+    // Each relay client holds at most this many frames. A client that falls behind loses its oldest frames.
+    static const unsigned RELAY_QUEUE_DEPTH = 4;
+
+    // Longest wait in poll(). Other threads wake us for new work; this only paces libwebsockets' timeout checks.
+    static const int SERVICE_TIMEOUT_MS = 1000;
+
+    // Each WebSockets client holds at most this many broadcasts, one per topic. Beyond that, the oldest is dropped.
+    static const unsigned BROADCAST_QUEUE_DEPTH = 16;
+
+    struct QueuedBroadcast {
+        SharedBuffer *buffer;
+        unsigned topic;
+    };
+
+    // Histogram of the time between frames from one client. One more bucket counts anything longer.
+    static const unsigned NUM_INTERVAL_BUCKETS = 10;
+    static const unsigned kIntervalBoundsMs[NUM_INTERVAL_BUCKETS];
+
+    // OPC data received on one connection. Only the server thread touches these.
+    struct IngestStats {
+        unsigned id;                // Zero until the connection first sends us something
+        char address[64];
+        uint64_t connected;         // Monotonic::micros() when we first heard from the client
+        uint64_t messages;
+        uint64_t bytes;
+        int frameChannel;           // Frames are timed on the first channel the client sends to
+        uint64_t lastFrame;         // Monotonic::micros(), zero before the first frame
+        uint64_t intervalSum;       // Microseconds between frames, in total and at most
+        uint64_t intervalMax;
+        uint64_t intervals[NUM_INTERVAL_BUCKETS + 1];
+        uint64_t parseErrors;       // Malformed OPC packets and JSON messages
+        uint64_t reassemblyCopies;  // Reads that had to go through the reassembly buffer
+    };
+
     struct Client {
         ClientState state;
 
         // HTTP response state
         const char *httpBody;
         int httpLength;
+        char *httpBuffer;       // Generated response body, if we own one
+        bool httpKeepAlive;     // Wait for another request after this response
 
         // OPC and protocol-detection receive buffer.
         OPCBuffer *opcBuffer;
+
+        IngestStats ingest;
+
+        // WebSockets broadcasts waiting for the socket to become writable
+        libwebsocket *wsi;
+        QueuedBroadcast queue[BROADCAST_QUEUE_DEPTH];
+        unsigned queueHead;
+        unsigned queueCount;
+    };
+
+    // A serialized broadcast, waiting for the server thread
+    struct Broadcast {
+        SharedBuffer *buffer;
+        std::string topic;
+    };
+
+    // One client's interest in one topic
+    struct Subscription {
+        unsigned maxRate;       // Broadcasts per second, or 0 for no limit
+        uint64_t lastSent;
+        SharedBuffer *held;     // Newest broadcast waiting on the rate limit
+    };
+    typedef std::map<Client*, Subscription> subscriberMap_t;
+
+    // What a relay client asked to receive, from its URL query string
+    struct RelayFilter {
+        int channel;            // Only this OPC channel (plus channel 0 broadcasts), or -1 for all
+        unsigned firstPixel;    // Pixel subrange of SetPixelColors messages; count 0 means to the end
+        unsigned pixelCount;
+        unsigned maxFps;        // Limit on pixel frames per second, or 0 for no limit
+
+        bool operator==(const RelayFilter &o) const {
+            return channel == o.channel && firstPixel == o.firstPixel &&
+                pixelCount == o.pixelCount && maxFps == o.maxFps;
+        }
+    };
+
+    // Clients with identical filters share a group, so each filtered frame is built only once
+    struct RelayGroup {
+        RelayFilter filter;
+        unsigned numClients;
+        uint64_t lastSent;
+        SharedBuffer *held;     // Newest frame waiting on the frame rate limit
+    };
+
+    // Relay clients, owned by the relay thread. Queues and counters are protected by mRelayMutex.
+    struct RelayClient {
+        libwebsocket *wsi;
+        RelayFilter filter;
+        RelayGroup *group;
+        unsigned id;
+        SharedBuffer *queue[RELAY_QUEUE_DEPTH];
+        unsigned queueHead;
+        unsigned queueCount;
+        unsigned maxQueueCount;
+        uint64_t sent;
+        uint64_t dropped;
+        char address[64];
     };
 
     OPC::callback_t mOpcCallback;
     jsonCallback_t mJsonCallback;
+    metricsCallback_t mMetricsCallback;
     void *mUserContext;
     tthread::thread *mThread;
     bool mVerbose;
-    std::set<libwebsocket*> mClients;
+    std::set<Client*> mClients;
+    std::set<Client*> mIngestClients;
+    unsigned mNextClientId;
+    std::vector<pollfd> mPollFds;
+    WakeEvent mWake;
+    MetricLoop mLoop;
+
+    // OPC messages and bytes received, by transport and channel. Written only by the server thread.
+    MetricCounter mReceivedMessages[NUM_TRANSPORTS][NUM_CHANNELS];
+    MetricCounter mReceivedBytes[NUM_TRANSPORTS][NUM_CHANNELS];
 
-    void *mRelayContext;
     tthread::thread *mRelayThread;
-    std::set<libwebsocket*> mRelayClients;
+    std::set<RelayClient*> mRelayClients;
+    std::vector<pollfd> mRelayPollFds;
+    WakeEvent mRelayWake;
+    MetricLoop mRelayLoop;
+    std::vector<RelayGroup*> mRelayGroups;
+    std::vector<SharedBuffer*> mRelayOutbox;
+    uint64_t mRelayOutboxDropped;
+    unsigned mNextRelayClientId;
+    volatile unsigned mRelayClientCount;
+    tthread::mutex mRelayMutex;
 
     typedef rapidjson::GenericStringBuffer<rapidjson::UTF8<> > jsonBuffer_t;
-    std::vector<jsonBuffer_t*> mBroadcastList;
+    std::vector<Broadcast> mBroadcastList;
     tthread::mutex mBroadcastMutex;
+    std::map<std::string, unsigned> mBroadcastTopics;   // Topic IDs, for the server thread only
+    std::vector<subscriberMap_t> mSubscribers;          // Indexed by topic ID, server thread only
+    std::map<std::string, unsigned> mSubscriberCounts;  // By topic name, protected by mBroadcastMutex
 
     static HTTPDocument httpDocumentList[];
 
     // libwebsockets server
     static void threadFunc(void *arg);
+    static void relayThreadFunc(void *arg);
     static int lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
         enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len);
     static int lwsRelayCallback(libwebsocket_context *context, libwebsocket *wsi,
         enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len);
+    static void pollSetUpdate(std::vector<pollfd> &fds, enum libwebsocket_callback_reasons reason,
+        void *in, size_t len);
+    static bool servicePoll(libwebsocket_context *context, std::vector<pollfd> &fds, WakeEvent &wake,
+        MetricLoop &loop, int timeoutMs);
 
     // HTTP Server
-    int httpBegin(libwebsocket_context *context, libwebsocket *wsi, Client &client, const char *path);
+    int httpRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
+    int httpRequest(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+    int httpBegin(libwebsocket_context *context, libwebsocket *wsi, Client &client,
+        const char *path, const std::string &ifNoneMatch = std::string());
     int httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+    int httpRespond(libwebsocket_context *context, libwebsocket *wsi, Client &client, int status,
+        const char *contentType, const char *contentEncoding, const char *etag, const char *cacheControl,
+        const char *body, int length);
+    static bool httpHeader(const std::string &request, const char *name, std::string &value);
+    int httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+    void writeMetrics(MetricsWriter &metrics);
     static bool httpPathEqual(const char *a, const char *b);
 
     // Open Pixel Control server
     int opcRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
+    void opcDispatch(Client &client, Transport transport, OPC::Message &msg);
+    void ingestClientOpened(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+    void jsonListClients(rapidjson::Document &message);
 
     // WebSockets server
     int wsRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
     void jsonBufferPrepare(jsonBuffer_t &buffer, rapidjson::Value &value);
     int jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi);
-    void flushBroadcastList();
+    int flushBroadcastList(libwebsocket_context *context);
+    unsigned broadcastTopicId(const std::string &topic);
+    void subscribe(Client &client, const std::string &topic, unsigned maxRate);
+    void unsubscribe(Client &client, const std::string &topic);
+    void jsonSubscribe(Client &client, rapidjson::Document &message, bool subscribing);
+    void broadcastEnqueue(Client &client, SharedBuffer *buffer, unsigned topic);
+    void broadcastClientClosed(Client &client);
+    int broadcastWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+
+    // Relay server
+    static void relayParseFilter(RelayFilter &filter, const char *uri);
+    static SharedBuffer *relayFilterFrame(const RelayFilter &filter, SharedBuffer *frame);
+    static SharedBuffer *relayFilterMultiChannel(const RelayFilter &filter, SharedBuffer *frame);
+    static bool relayFilterRange(const RelayFilter &filter, const OPC::Message &msg, unsigned &start, unsigned &end);
+    void relayGroupSend(RelayGroup *group, SharedBuffer *frame);
+    void relayClientOpened(libwebsocket_context *context, libwebsocket *wsi, RelayClient &client);
+    void relayClientClosed(RelayClient &client);
+    int flushRelayOutbox(libwebsocket_context *context);
+    int relayWrite(libwebsocket_context *context, libwebsocket *wsi, RelayClient &client);
 };
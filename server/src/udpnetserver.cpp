@@ -0,0 +1,515 @@
+/*
+ * Art-Net and sACN (E1.31) input, as an alternative to Open Pixel Control
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "udpnetserver.h"
+#include "monotonic.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+  #include <ws2tcpip.h>
+  static const SOCKET kInvalidSocket = INVALID_SOCKET;
+#else
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/select.h>
+  #include <netinet/in.h>
+  #include <netdb.h>
+  #include <unistd.h>
+  static const int kInvalidSocket = -1;
+  #define closesocket close
+#endif
+
+static const char *kProtocolNames[] = { "artnet", "e131" };
+static const unsigned kDefaultPorts[] = { 6454, 5568 };
+
+// Largest OPC message payload
+static const unsigned kMaxOPCData = 0xFFFF;
+
+namespace {
+    // A compiled segment, tagged with its universe while the map is being sorted
+    struct TaggedSegment {
+        uint16_t universe;
+        unsigned order;
+    };
+
+    bool taggedSegmentLess(const TaggedSegment &a, const TaggedSegment &b)
+    {
+        return a.universe < b.universe || (a.universe == b.universe && a.order < b.order);
+    }
+}
+
+
+UdpNetServer::UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose), mThread(0),
+      mNumReceived(0), mLastSync(0)
+{
+    for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+        mHost[p] = 0;
+        mPort[p] = 0;
+        mSocket[p] = kInvalidSocket;
+    }
+    memset(mMessages, 0, sizeof mMessages);
+    memset(mDirty, 0, sizeof mDirty);
+}
+
+bool UdpNetServer::loadConfiguration(const Value &config, std::ostream &error)
+{
+    if (!config.IsObject()) {
+        error << "The optional 'dmxInput' configuration key must be an object.\n";
+        return false;
+    }
+
+    /*
+     * Each protocol is enabled by giving it a [host, port] list, in the same
+     * format as 'listen'. The port may be null to use the protocol's standard port.
+     */
+
+    bool anyProtocol = false;
+    for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+        const Value &vlisten = config[kProtocolNames[p]];
+        if (vlisten.IsNull()) {
+            continue;
+        }
+
+        if (!vlisten.IsArray() || vlisten.Size() != 2 ||
+            !(vlisten[0u].IsNull() || vlisten[0u].IsString()) ||
+            !(vlisten[1].IsNull() || vlisten[1].IsUint())) {
+            error << "The 'dmxInput' key '" << kProtocolNames[p] << "' must be a [host, port] list.\n";
+            return false;
+        }
+
+        mHost[p] = vlisten[0u].IsString() ? vlisten[0u].GetString() : 0;
+        mPort[p] = vlisten[1].IsUint() ? vlisten[1].GetUint() : kDefaultPorts[p];
+        anyProtocol = true;
+    }
+
+    if (!anyProtocol) {
+        error << "The 'dmxInput' configuration must enable 'artnet', 'e131', or both.\n";
+        return false;
+    }
+
+    const Value &vmap = config["map"];
+    if (!vmap.IsArray()) {
+        error << "The 'dmxInput' configuration requires a 'map' array.\n";
+        return false;
+    }
+
+    /*
+     * Compile the map into a list of segments, grouped by universe. Segments
+     * within a universe keep their configuration order, so overlapping entries
+     * behave the same way they do in output device maps.
+     */
+
+    std::vector<Segment> segments;
+    std::vector<uint16_t> universes;
+
+    for (unsigned i = 0, e = vmap.Size(); i != e; i++) {
+        if (!compileInstruction(segments, universes, vmap[i], error)) {
+            return false;
+        }
+    }
+
+    std::vector<TaggedSegment> order(segments.size());
+    for (unsigned i = 0; i < segments.size(); i++) {
+        order[i].universe = universes[i];
+        order[i].order = i;
+    }
+    std::sort(order.begin(), order.end(), taggedSegmentLess);
+
+    mSegments.clear();
+    mUniverses.clear();
+    mUniverseIndex.assign(0x10000, 0);
+
+    for (unsigned i = 0; i < order.size(); i++) {
+        if (mUniverses.empty() || mUniverses.back().number != order[i].universe) {
+            Universe u;
+            u.number = order[i].universe;
+            u.received = false;
+            u.firstSegment = mSegments.size();
+            u.numSegments = 0;
+            mUniverses.push_back(u);
+            mUniverseIndex[u.number] = mUniverses.size();
+        }
+        mSegments.push_back(segments[order[i].order]);
+        mUniverses.back().numSegments++;
+    }
+
+    return true;
+}
+
+bool UdpNetServer::compileInstruction(std::vector<Segment> &segments, std::vector<uint16_t> &universes,
+    const Value &inst, std::ostream &error)
+{
+    /*
+     * Supported mapping instructions:
+     *
+     *   [ Universe, OPC Channel, First OPC Pixel ]
+     *   [ Universe, First DMX Channel, OPC Channel, First OPC Pixel, Pixel count ]
+     *
+     * The short form maps a whole universe, 170 RGB pixels starting at DMX channel 1.
+     */
+
+    unsigned universe, dmxFirst, channel, firstPixel, count;
+
+    if (inst.IsArray() && inst.Size() == 3 &&
+        inst[0u].IsUint() && inst[1].IsUint() && inst[2].IsUint()) {
+        universe = inst[0u].GetUint();
+        dmxFirst = 1;
+        channel = inst[1].GetUint();
+        firstPixel = inst[2].GetUint();
+        count = PIXELS_PER_UNIVERSE;
+
+    } else if (inst.IsArray() && inst.Size() == 5 &&
+        inst[0u].IsUint() && inst[1].IsUint() && inst[2].IsUint() &&
+        inst[3].IsUint() && inst[4].IsUint()) {
+        universe = inst[0u].GetUint();
+        dmxFirst = inst[1].GetUint();
+        channel = inst[2].GetUint();
+        firstPixel = inst[3].GetUint();
+        count = inst[4].GetUint();
+
+    } else {
+        error << "Unsupported 'dmxInput' mapping instruction.\n";
+        return false;
+    }
+
+    if (universe > 0xFFFF || channel >= NUM_CHANNELS ||
+        dmxFirst < 1 || dmxFirst > CHANNELS_PER_UNIVERSE ||
+        count > (CHANNELS_PER_UNIVERSE - (dmxFirst - 1)) / 3 ||
+        firstPixel > kMaxOPCData / 3 || count > kMaxOPCData / 3 - firstPixel) {
+        error << "Out of range 'dmxInput' mapping instruction for universe " << universe << ".\n";
+        return false;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    OPC::Message *msg = mMessages[channel];
+    if (!msg) {
+        msg = mMessages[channel] = new OPC::Message;
+        msg->channel = channel;
+        msg->command = OPC::SetPixelColors;
+        msg->setLength(0);
+        memset(msg->data, 0, sizeof msg->data);
+    }
+
+    // Messages are as long as the furthest pixel mapped on their channel
+    msg->setLength(std::max(msg->length(), (firstPixel + count) * 3));
+
+    Segment s;
+    s.dmxOffset = dmxFirst - 1;
+    s.length = count * 3;
+    s.channel = channel;
+    s.dest = msg->data + firstPixel * 3;
+    segments.push_back(s);
+    universes.push_back(universe);
+
+    return true;
+}
+
+bool UdpNetServer::start()
+{
+    for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+        if (mPort[p] && !openSocket(Protocol(p))) {
+            return false;
+        }
+    }
+
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+bool UdpNetServer::openSocket(Protocol protocol)
+{
+    char portStr[16];
+    snprintf(portStr, sizeof portStr, "%u", mPort[protocol]);
+
+    struct addrinfo hints;
+    struct addrinfo *result = 0;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(mHost[protocol], portStr, &hints, &result) || !result) {
+        std::clog << "Can't resolve " << kProtocolNames[protocol] << " input address\n";
+        return false;
+    }
+
+    socket_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == kInvalidSocket) {
+        freeaddrinfo(result);
+        std::clog << "Can't create " << kProtocolNames[protocol] << " input socket\n";
+        return false;
+    }
+
+    // Share the port with any other receivers on this host
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*) &enable, sizeof enable);
+
+    int err = bind(sock, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (err) {
+        closesocket(sock);
+        std::clog << "Can't listen for " << kProtocolNames[protocol] << " on port " << mPort[protocol] << "\n";
+        return false;
+    }
+
+    if (protocol == PROTOCOL_E131) {
+        // Consoles usually multicast sACN, to 239.255.<universe hi>.<universe lo>
+        for (unsigned i = 0; i < mUniverses.size(); i++) {
+            struct ip_mreq mreq;
+            memset(&mreq, 0, sizeof mreq);
+            mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | mUniverses[i].number);
+            mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+            if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*) &mreq, sizeof mreq) && mVerbose) {
+                std::clog << "Can't join sACN multicast group for universe " << mUniverses[i].number << "\n";
+            }
+        }
+    }
+
+    if (mVerbose) {
+        std::clog << "Listening for " << kProtocolNames[protocol] << " on "
+            << (mHost[protocol] ? mHost[protocol] : "*") << ":" << mPort[protocol] << "\n";
+    }
+
+    mSocket[protocol] = sock;
+    return true;
+}
+
+void UdpNetServer::threadFunc(void *arg)
+{
+    UdpNetServer *self = (UdpNetServer*) arg;
+
+#ifdef __linux__
+    // Drain a burst of universes with each system call
+    static const unsigned kBatch = 32;
+    static uint8_t buffers[kBatch][MAX_PACKET];
+    struct iovec iov[kBatch];
+    struct mmsghdr msgs[kBatch];
+
+    memset(msgs, 0, sizeof msgs);
+    for (unsigned i = 0; i < kBatch; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = MAX_PACKET;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#else
+    static uint8_t buffer[MAX_PACKET];
+#endif
+
+    for (;;) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        socket_t maxfd = 0;
+
+        for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+            if (self->mSocket[p] != kInvalidSocket) {
+                FD_SET(self->mSocket[p], &fds);
+                maxfd = std::max(maxfd, self->mSocket[p]);
+            }
+        }
+
+        self->mLoop.wait();
+        int ready = select(int(maxfd) + 1, &fds, 0, 0, 0);
+        self->mLoop.resume();
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+            if (self->mSocket[p] == kInvalidSocket || !FD_ISSET(self->mSocket[p], &fds)) {
+                continue;
+            }
+
+#ifdef __linux__
+            int n = recvmmsg(self->mSocket[p], msgs, kBatch, MSG_DONTWAIT, 0);
+            for (int i = 0; i < n; i++) {
+                self->receive(Protocol(p), buffers[i], msgs[i].msg_len);
+            }
+#else
+            int n = recv(self->mSocket[p], (char*) buffer, sizeof buffer, 0);
+            if (n > 0) {
+                self->receive(Protocol(p), buffer, n);
+            }
+#endif
+        }
+    }
+}
+
+void UdpNetServer::receive(Protocol protocol, const uint8_t *packet, unsigned length)
+{
+    mPackets[protocol].add();
+
+    switch (protocol) {
+        case PROTOCOL_ARTNET:   receiveArtNet(packet, length); break;
+        case PROTOCOL_E131:     receiveE131(packet, length); break;
+        default:                break;
+    }
+}
+
+void UdpNetServer::receiveArtNet(const uint8_t *packet, unsigned length)
+{
+    if (length < 14 || memcmp(packet, "Art-Net", 8)) {
+        return;
+    }
+
+    unsigned opcode = packet[8] | (packet[9] << 8);
+
+    if (opcode == 0x5000 && length >= 18) {
+        // ArtDmx
+        unsigned universe = packet[14] | ((packet[15] & 0x7F) << 8);
+        unsigned dataLength = std::min<unsigned>((packet[16] << 8) | packet[17], length - 18);
+        universeData(universe, packet + 18, dataLength);
+
+    } else if (opcode == 0x5200) {
+        // ArtSync
+        sync();
+    }
+}
+
+void UdpNetServer::receiveE131(const uint8_t *packet, unsigned length)
+{
+    if (length < 49 || memcmp(packet + 4, "ASC-E1.17\0\0\0", 12)) {
+        return;
+    }
+
+    uint32_t rootVector = (packet[18] << 24) | (packet[19] << 16) | (packet[20] << 8) | packet[21];
+    uint32_t framingVector = (packet[40] << 24) | (packet[41] << 16) | (packet[42] << 8) | packet[43];
+
+    if (rootVector == 0x00000004 && framingVector == 0x00000002 && length >= 126) {
+        // Data packet. Skip preview data, stream termination notices, and alternate start codes.
+        uint8_t options = packet[112];
+        if ((options & 0xC0) || packet[125] != 0) {
+            return;
+        }
+
+        unsigned universe = (packet[113] << 8) | packet[114];
+        unsigned propertyCount = (packet[123] << 8) | packet[124];
+        unsigned dataLength = std::min<unsigned>(propertyCount ? propertyCount - 1 : 0, length - 126);
+        universeData(universe, packet + 126, dataLength);
+
+    } else if (rootVector == 0x00000008 && framingVector == 0x00000001) {
+        // Universe synchronization
+        sync();
+    }
+}
+
+void UdpNetServer::universeData(unsigned number, const uint8_t *data, unsigned length)
+{
+    /*
+     * Copy one universe's DMX data directly into the OPC messages it maps to.
+     *
+     * Without sync packets, a frame is complete once every mapped universe has
+     * arrived. If a universe arrives twice first, some universe is missing, and
+     * we send what we have rather than stalling. Once a sender starts using sync
+     * packets, frames are only sent when it asks.
+     */
+
+    unsigned index = mUniverseIndex.empty() ? 0 : mUniverseIndex[number];
+    if (!index) {
+        return;
+    }
+
+    Universe &u = mUniverses[index - 1];
+    bool synchronized = mLastSync && Monotonic::micros() - mLastSync < SYNC_TIMEOUT_US;
+
+    if (u.received && !synchronized) {
+        dispatch();
+    }
+
+    const Segment *s = &mSegments[u.firstSegment];
+    for (unsigned i = 0; i < u.numSegments; i++, s++) {
+        if (s->dmxOffset < length) {
+            memcpy(s->dest, data + s->dmxOffset, std::min<unsigned>(s->length, length - s->dmxOffset));
+            mDirty[s->channel] = true;
+        }
+    }
+
+    if (!u.received) {
+        u.received = true;
+        mNumReceived++;
+    }
+
+    if (mNumReceived == mUniverses.size() && !synchronized) {
+        dispatch();
+    }
+}
+
+void UdpNetServer::sync()
+{
+    mLastSync = Monotonic::micros();
+    dispatch();
+}
+
+void UdpNetServer::dispatch()
+{
+    for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+        if (mDirty[channel]) {
+            mDirty[channel] = false;
+            mDispatched[channel].add();
+            mOpcCallback(*mMessages[channel], mUserContext);
+        }
+    }
+
+    for (unsigned i = 0; i < mUniverses.size(); i++) {
+        mUniverses[i].received = false;
+    }
+    mNumReceived = 0;
+}
+
+void UdpNetServer::writeMetrics(MetricsWriter &metrics)
+{
+    if (!mThread) {
+        return;
+    }
+
+    for (unsigned p = 0; p < NUM_PROTOCOLS; p++) {
+        if (mSocket[p] != kInvalidSocket) {
+            MetricsWriter::Labels labels;
+            labels.add("protocol", kProtocolNames[p]);
+            metrics.counter("fcserver_dmx_packets_total",
+                "Art-Net and sACN packets received", labels, mPackets[p].value());
+        }
+    }
+
+    for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+        uint64_t messages = mDispatched[channel].value();
+        if (messages) {
+            MetricsWriter::Labels labels;
+            labels.add("transport", "dmx").add("channel", channel);
+            metrics.counter("fcserver_opc_messages_total",
+                "OPC messages received, by transport and channel", labels, messages);
+            metrics.counter("fcserver_opc_bytes_total",
+                "OPC bytes received including headers, by transport and channel",
+                labels, messages * (OPC::HEADER_BYTES + mMessages[channel]->length()));
+        }
+    }
+
+    metrics.loop("dmx", mLoop);
+}
@@ -0,0 +1,129 @@
+/*
+ * Art-Net and sACN (E1.31) input, as an alternative to Open Pixel Control
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "opc.h"
+#include "metrics.h"
+
+#ifdef _WIN32
+  #include <winsock2.h>
+#endif
+
+
+class UdpNetServer {
+public:
+    typedef rapidjson::Value Value;
+
+    UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Validate and compile the 'dmxInput' configuration object. Problems are written to 'error'.
+    bool loadConfiguration(const Value &config, std::ostream &error);
+
+    // Open sockets and start receiving on a separate thread
+    bool start();
+
+    // Add our counters to a metrics scrape, from any thread
+    void writeMetrics(MetricsWriter &metrics);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+    static const unsigned CHANNELS_PER_UNIVERSE = 512;
+    static const unsigned PIXELS_PER_UNIVERSE = 170;
+    static const unsigned MAX_PACKET = 1024;
+
+    // Receivers leave synchronized mode after this long without a sync packet
+    static const uint64_t SYNC_TIMEOUT_US = 4000000;
+
+    enum Protocol {
+        PROTOCOL_ARTNET = 0,
+        PROTOCOL_E131,
+        NUM_PROTOCOLS
+    };
+
+#ifdef _WIN32
+    typedef SOCKET socket_t;
+#else
+    typedef int socket_t;
+#endif
+
+    /*
+     * A compiled map entry: one run of DMX channels in one universe, copied
+     * straight into the data of the OPC message that will be dispatched.
+     */
+    struct Segment {
+        uint16_t dmxOffset;
+        uint16_t length;
+        uint8_t channel;
+        uint8_t *dest;
+    };
+
+    struct Universe {
+        uint16_t number;
+        bool received;
+        unsigned firstSegment;
+        unsigned numSegments;
+    };
+
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    tthread::thread *mThread;
+
+    const char *mHost[NUM_PROTOCOLS];
+    unsigned mPort[NUM_PROTOCOLS];
+    socket_t mSocket[NUM_PROTOCOLS];
+
+    // One OPC message per mapped channel, reused for every frame
+    OPC::Message *mMessages[NUM_CHANNELS];
+    bool mDirty[NUM_CHANNELS];
+
+    // Universes in configuration order, with their segments, and a lookup table by universe number
+    std::vector<Universe> mUniverses;
+    std::vector<Segment> mSegments;
+    std::vector<uint16_t> mUniverseIndex;
+    unsigned mNumReceived;
+
+    uint64_t mLastSync;
+
+    // Counters, written only by the receive thread
+    MetricLoop mLoop;
+    MetricCounter mPackets[NUM_PROTOCOLS];
+    MetricCounter mDispatched[NUM_CHANNELS];
+
+    static void threadFunc(void *arg);
+    bool openSocket(Protocol protocol);
+    bool compileInstruction(std::vector<Segment> &segments, std::vector<uint16_t> &universes,
+        const Value &inst, std::ostream &error);
+
+    void receive(Protocol protocol, const uint8_t *packet, unsigned length);
+    void receiveArtNet(const uint8_t *packet, unsigned length);
+    void receiveE131(const uint8_t *packet, unsigned length);
+    void universeData(unsigned number, const uint8_t *data, unsigned length);
+    void sync();
+    void dispatch();
+};
@@ -26,12 +26,13 @@
 
 
 USBDevice::USBDevice(libusb_device *device, const char *type, bool verbose)
-    : mDevice(libusb_ref_device(device)),
+    : mDevice(device ? libusb_ref_device(device) : 0),
       mHandle(0),
       mTypeString(type),
       mSerialString(0),
       mVerbose(verbose)
 {
+    memset(&mTransferStats, 0, sizeof mTransferStats);
     gettimeofday(&mTimestamp, NULL);
 }
 
@@ -56,6 +57,25 @@ void USBDevice::writeColorCorrection(const Value &color)
     // Optional. By default, ignore color correction messages.
 }
 
+void USBDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    // Optional. By default, each part is handled as a separate message.
+    for (unsigned i = 0; i < count; i++) {
+        writeMessage(*parts[i]);
+    }
+}
+
+void USBDevice::prepareConfiguration(const Value &config)
+{
+    // Optional. By default, loadConfiguration() does all the work.
+}
+
+uint64_t USBDevice::flushDeadline()
+{
+    // Optional. By default, we only flush in response to USB events.
+    return 0;
+}
+
 bool USBDevice::matchConfiguration(const Value &config)
 {
     if (!config.IsObject()) {
@@ -124,3 +144,23 @@ void USBDevice::describe(rapidjson::Value &object, Allocator &alloc)
     uint64_t timestamp = (uint64_t)mTimestamp.tv_sec*1000 + mTimestamp.tv_usec/1000;
     object.AddMember("timestamp", timestamp, alloc);
 }
+
+void USBDevice::writeMetrics(MetricsWriter &metrics)
+{
+    MetricsWriter::Labels labels;
+    labels.add("type", mTypeString);
+    if (mSerialString) {
+        labels.add("serial", mSerialString);
+    }
+
+    metrics.counter("fcserver_device_transfers_total",
+        "USB transfers submitted to each device", labels, mTransferStats.submitted);
+    metrics.counter("fcserver_device_completions_total",
+        "USB transfers completed by each device", labels, mTransferStats.completed);
+    metrics.counter("fcserver_device_frames_total",
+        "Frames sent to each device", labels, mTransferStats.frames);
+    metrics.counter("fcserver_device_dropped_frames_total",
+        "Frames replaced by a newer frame before they could be sent", labels, mTransferStats.droppedFrames);
+    metrics.counter("fcserver_device_errors_total",
+        "Transfers or packets that failed, by device", labels, mTransferStats.errors);
+}
@@ -25,6 +25,7 @@
 
 #include "rapidjson/document.h"
 #include "opc.h"
+#include "metrics.h"
 #include <string>
 #include <libusb.h> // Also brings in gettimeofday() in a portable way
 
@@ -74,9 +75,19 @@ public:
     // Load a matching configuration
     virtual void loadConfiguration(const Value &config) = 0;
 
+    /*
+     * Optionally do the slow part of loading a configuration ahead of time,
+     * without the event lock, such as compiling its map. Nothing a frame could
+     * see changes until loadConfiguration() is called with the same entry.
+     */
+    virtual void prepareConfiguration(const Value &config);
+
     // Handle an incoming OPC message
     virtual void writeMessage(const OPC::Message &msg) = 0;
 
+    // Handle the Set Pixel Colors messages that make up one multi-channel frame
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
+
     // Handle a device-specific JSON message
     virtual void writeMessage(Document &msg);
 
@@ -86,22 +97,40 @@ public:
     // Deal with any I/O that results from completed transfers, outside the context of a completion callback
     virtual void flush() = 0;
 
+    // If flush() must run by a particular time even without USB activity, returns that
+    // time in Monotonic::micros() units. Zero if there's no deadline.
+    virtual uint64_t flushDeadline();
+
     // Describe this device by adding keys to a JSON object
     virtual void describe(Value &object, Allocator &alloc);
 
+    // Add this device's counters to a metrics scrape
+    virtual void writeMetrics(MetricsWriter &metrics);
+
     virtual std::string getName() = 0;
 
+    // NULL for devices that aren't backed by real USB hardware
     libusb_device *getDevice() { return mDevice; };
     const char *getSerial() { return mSerialString; }
     const char *getTypeString() { return mTypeString; }
 
 protected:
+    // Transfer counters, updated with the server's event mutex held
+    struct TransferStats {
+        uint64_t submitted;         // Transfers handed to libusb
+        uint64_t completed;         // Transfers that finished, successfully or not
+        uint64_t errors;            // Transfers that couldn't be submitted or didn't succeed
+        uint64_t frames;            // Frames of pixel data submitted
+        uint64_t droppedFrames;     // Frames replaced by a newer one before they could be submitted
+    };
+
     libusb_device *mDevice;
     libusb_device_handle *mHandle;
     struct timeval mTimestamp;
     const char *mTypeString;
     const char *mSerialString;
     bool mVerbose;
+    TransferStats mTransferStats;
 
     // Utilities
     const Value *findConfigMap(const Value &config);
@@ -0,0 +1,289 @@
+/*
+ * Simulated Fadecandy device, for testing and benchmarking without hardware.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "virtualfcdevice.h"
+#include "monotonic.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+
+const char* VirtualFCDevice::DEVICE_TYPE = "virtual";
+
+// Defaults approximate a real Fadecandy on a USB full-speed bus
+static const double kDefaultLatency = 0.001;
+static const double kDefaultBandwidth = 1000000;
+
+// Timestamps further in the past than this are pixel data, not a benchmark's clock
+static const uint64_t kMaxTimestampAge = 10000000;
+
+const unsigned VirtualFCDevice::kLatencyBoundsUs[] = {
+    50, 100, 200, 300, 500, 750, 1000, 1500, 2000, 3000,
+    5000, 7500, 10000, 15000, 20000, 30000, 50000, 100000, 200000, 500000
+};
+
+
+VirtualFCDevice::VirtualFCDevice(const char *serial, bool verbose)
+    : FCDevice(0, verbose, DEVICE_TYPE),
+      mLatency(0), mBandwidth(0), mBusyUntil(0),
+      mCapture(0), mTimestamps(false), mPendingTimestamp(0)
+{
+    strncpy(mSerialBuffer, serial, sizeof mSerialBuffer - 1);
+    mSerialBuffer[sizeof mSerialBuffer - 1] = '\0';
+    memset(&mStats, 0, sizeof mStats);
+}
+
+VirtualFCDevice::~VirtualFCDevice()
+{
+    /*
+     * Nothing was ever handed to libusb, so rather than letting FCDevice cancel
+     * our pending transfers, free them here.
+     */
+
+    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
+        delete *i;
+    }
+    mPending.clear();
+
+    if (mCapture) {
+        fclose(mCapture);
+    }
+}
+
+int VirtualFCDevice::open()
+{
+    // Pretend to be the current firmware
+    memset(&mDD, 0, sizeof mDD);
+    mDD.idVendor = 0x1d50;
+    mDD.idProduct = 0x607a;
+    mDD.bcdDevice = 0x0109;
+    snprintf(mVersionString, sizeof mVersionString, "%x.%02x", mDD.bcdDevice >> 8, mDD.bcdDevice & 0xFF);
+    return 0;
+}
+
+void VirtualFCDevice::loadConfiguration(const Value &config)
+{
+    /*
+     * In addition to the usual Fadecandy settings, virtual devices have:
+     *
+     *   "latency":    Seconds from the end of a transfer until it completes
+     *   "bandwidth":  Simulated bus throughput in bytes per second, or 0 for unlimited
+     *   "capture":    Optional file name. Every packet sent to the device is appended.
+     *   "timestamps": If true, pixel messages start with a sender timestamp, and
+     *                 the device measures how long each frame took to submit.
+     */
+
+    const Value &vlatency = config["latency"];
+    const Value &vbandwidth = config["bandwidth"];
+    const Value &vcapture = config["capture"];
+    const Value &vtimestamps = config["timestamps"];
+
+    double latency = kDefaultLatency;
+    if (vlatency.IsNumber() && vlatency.GetDouble() >= 0) {
+        latency = vlatency.GetDouble();
+    } else if (!vlatency.IsNull() && mVerbose) {
+        std::clog << "Virtual device 'latency' must be a non-negative number of seconds.\n";
+    }
+    mLatency = uint64_t(latency * 1e6);
+
+    mBandwidth = kDefaultBandwidth;
+    if (vbandwidth.IsNumber() && vbandwidth.GetDouble() >= 0) {
+        mBandwidth = vbandwidth.GetDouble();
+    } else if (!vbandwidth.IsNull() && mVerbose) {
+        std::clog << "Virtual device 'bandwidth' must be a non-negative number of bytes per second.\n";
+    }
+
+    if (mCapture) {
+        fclose(mCapture);
+        mCapture = 0;
+    }
+    if (vcapture.IsString()) {
+        mCapture = fopen(vcapture.GetString(), "wb");
+        if (!mCapture) {
+            perror("Error opening virtual device capture file");
+        }
+    } else if (!vcapture.IsNull() && mVerbose) {
+        std::clog << "Virtual device 'capture' must be a file name.\n";
+    }
+
+    mTimestamps = vtimestamps.IsTrue();
+    if (!vtimestamps.IsBool() && !vtimestamps.IsNull() && mVerbose) {
+        std::clog << "Virtual device 'timestamps' must be true or false.\n";
+    }
+
+    FCDevice::loadConfiguration(config);
+}
+
+void VirtualFCDevice::writeMessage(const OPC::Message &msg)
+{
+    readTimestamp(msg);
+    FCDevice::writeMessage(msg);
+}
+
+void VirtualFCDevice::writeFrame(const OPC::Message *const *parts, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        readTimestamp(*parts[i]);
+    }
+    FCDevice::writeFrame(parts, count);
+}
+
+void VirtualFCDevice::readTimestamp(const OPC::Message &msg)
+{
+    /*
+     * A benchmark client puts the time it sent each frame, in Monotonic
+     * microseconds on this machine, in the first 8 bytes of pixel data. The
+     * newest one we've mapped is what the next submitted frame shows.
+     */
+
+    if (mTimestamps && (msg.command == OPC::SetPixelColors || msg.command == OPC::SetPixelColors16) &&
+        msg.length() >= sizeof(uint64_t) && mMap.hasChannel(msg.channel)) {
+
+        uint64_t timestamp;
+        memcpy(&timestamp, msg.data, sizeof timestamp);
+        uint64_t now = Monotonic::micros();
+
+        if (timestamp <= now && now - timestamp < kMaxTimestampAge) {
+            mPendingTimestamp = timestamp;
+        }
+    }
+}
+
+bool VirtualFCDevice::submitTransfer(Transfer *fct)
+{
+    /*
+     * Instead of going to libusb, schedule a simulated completion. Transfers
+     * share the bus, so each one starts when the previous one is done.
+     */
+
+    uint64_t now = Monotonic::micros();
+    unsigned length = fct->transfer->length;
+
+    uint64_t start = std::max(now, mBusyUntil);
+    uint64_t duration = mBandwidth > 0 ? uint64_t(length * 1e6 / mBandwidth) : 0;
+    mBusyUntil = start + duration;
+
+    Completion c;
+    c.transfer = fct;
+    c.time = mBusyUntil + mLatency;
+    mQueue.push_back(c);
+    mPending.insert(fct);
+
+    if (mCapture) {
+        // The packet format is exactly what the firmware would receive
+        fwrite(fct->transfer->buffer, 1, length, mCapture);
+    }
+
+    mStats.transfers++;
+    mStats.bytes += length;
+    mTransferStats.submitted++;
+    if (fct->type == FRAME) {
+        mStats.frames++;
+        mTransferStats.frames++;
+
+        if (mPendingTimestamp) {
+            uint64_t latency = now - mPendingTimestamp;
+            unsigned bucket = 0;
+            while (bucket < NUM_LATENCY_BUCKETS && latency > kLatencyBoundsUs[bucket]) {
+                bucket++;
+            }
+            mStats.latencies[bucket]++;
+            mStats.latencySum += latency;
+            mStats.latencyMax = std::max(mStats.latencyMax, latency);
+            mPendingTimestamp = 0;
+        }
+    }
+
+    return true;
+}
+
+void VirtualFCDevice::flush()
+{
+    uint64_t now = Monotonic::micros();
+
+    while (!mQueue.empty() && mQueue.front().time <= now) {
+        mQueue.front().transfer->finished = true;
+        mQueue.pop_front();
+    }
+
+    FCDevice::flush();
+}
+
+uint64_t VirtualFCDevice::flushDeadline()
+{
+    return mQueue.empty() ? 0 : mQueue.front().time;
+}
+
+std::string VirtualFCDevice::getName()
+{
+    std::ostringstream s;
+    s << "Virtual Fadecandy (Serial# " << mSerialString << ")";
+    return s.str();
+}
+
+void VirtualFCDevice::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    FCDevice::describe(object, alloc);
+
+    Value stats(rapidjson::kObjectType);
+    stats.AddMember("transfers", mStats.transfers, alloc);
+    stats.AddMember("frames", mStats.frames, alloc);
+    stats.AddMember("bytes", mStats.bytes, alloc);
+
+    if (mTimestamps) {
+        Value latencies(rapidjson::kArrayType);
+        Value bounds(rapidjson::kArrayType);
+        for (unsigned i = 0; i <= NUM_LATENCY_BUCKETS; i++) {
+            latencies.PushBack(mStats.latencies[i], alloc);
+        }
+        for (unsigned i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+            bounds.PushBack(kLatencyBoundsUs[i], alloc);
+        }
+        stats.AddMember("latencies", latencies, alloc);
+        stats.AddMember("latency_bounds_us", bounds, alloc);
+        stats.AddMember("latency_sum_us", mStats.latencySum, alloc);
+        stats.AddMember("max_latency_us", mStats.latencyMax, alloc);
+    }
+
+    object.AddMember("stats", stats, alloc);
+}
+
+void VirtualFCDevice::writeMetrics(MetricsWriter &metrics)
+{
+    FCDevice::writeMetrics(metrics);
+
+    if (!mTimestamps) {
+        return;
+    }
+
+    double bounds[NUM_LATENCY_BUCKETS];
+    for (unsigned i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        bounds[i] = kLatencyBoundsUs[i] * 1e-6;
+    }
+
+    MetricsWriter::Labels labels;
+    labels.add("type", mTypeString).add("serial", mSerialString);
+    metrics.histogram("fcserver_device_submit_latency_seconds",
+        "Time from a benchmark client's timestamp until the frame was submitted, by virtual device",
+        labels, bounds, mStats.latencies, NUM_LATENCY_BUCKETS, mStats.latencySum * 1e-6);
+}
@@ -0,0 +1,88 @@
+/*
+ * Simulated Fadecandy device, for testing and benchmarking without hardware.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "fcdevice.h"
+#include <deque>
+#include <stdio.h>
+
+
+class VirtualFCDevice : public FCDevice
+{
+public:
+    VirtualFCDevice(const char *serial, bool verbose);
+    virtual ~VirtualFCDevice();
+
+    static const char* DEVICE_TYPE;
+
+    virtual int open();
+    virtual void loadConfiguration(const Value &config);
+    virtual void writeMessage(const OPC::Message &msg);
+    using FCDevice::writeMessage;
+    virtual void writeFrame(const OPC::Message *const *parts, unsigned count);
+    virtual void flush();
+    virtual uint64_t flushDeadline();
+    virtual std::string getName();
+    virtual void describe(rapidjson::Value &object, Allocator &alloc);
+    virtual void writeMetrics(MetricsWriter &metrics);
+
+protected:
+    virtual bool submitTransfer(Transfer *fct);
+
+private:
+    struct Completion {
+        Transfer *transfer;
+        uint64_t time;
+    };
+
+    static const unsigned NUM_LATENCY_BUCKETS = 20;
+    static const unsigned kLatencyBoundsUs[NUM_LATENCY_BUCKETS];
+
+    struct Stats {
+        uint64_t transfers;
+        uint64_t frames;
+        uint64_t bytes;
+
+        // Sender timestamp to frame submission. One more bucket counts anything longer.
+        uint64_t latencies[NUM_LATENCY_BUCKETS + 1];
+        uint64_t latencySum;
+        uint64_t latencyMax;
+    };
+
+    // Transfers complete in the order they were submitted
+    std::deque<Completion> mQueue;
+
+    // Simulated bus: a fixed latency per transfer, and a shared bandwidth limit
+    uint64_t mLatency;
+    double mBandwidth;
+    uint64_t mBusyUntil;
+
+    FILE *mCapture;
+    Stats mStats;
+
+    // With "timestamps", the sender's time from the newest message that the next frame will show
+    bool mTimestamps;
+    uint64_t mPendingTimestamp;
+
+    void readTimestamp(const OPC::Message &msg);
+};
@@ -0,0 +1,145 @@
+/*
+ * Wakes a poll() loop from other threads: an eventfd, self-pipe, or loopback socket.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "wakeevent.h"
+
+#if defined(_WIN32)
+  #include <ws2tcpip.h>
+  #include <string.h>
+#elif defined(__linux__)
+  #include <sys/eventfd.h>
+  #include <unistd.h>
+  #include <stdint.h>
+#else
+  #include <unistd.h>
+  #include <fcntl.h>
+#endif
+
+
+WakeEvent::WakeEvent()
+    : mPending(0),
+#ifdef _WIN32
+      mSocket(INVALID_SOCKET)
+#else
+      mReadFd(-1), mWriteFd(-1)
+#endif
+{}
+
+WakeEvent::~WakeEvent()
+{
+#if defined(_WIN32)
+    if (mSocket != INVALID_SOCKET) {
+        closesocket(mSocket);
+    }
+#else
+    if (mWriteFd >= 0 && mWriteFd != mReadFd) {
+        close(mWriteFd);
+    }
+    if (mReadFd >= 0) {
+        close(mReadFd);
+    }
+#endif
+}
+
+bool WakeEvent::init()
+{
+#if defined(_WIN32)
+    /*
+     * WSAPoll() only works with sockets, so Windows gets a UDP socket that's
+     * bound to the loopback interface and connected to itself.
+     */
+
+    mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (mSocket == INVALID_SOCKET) {
+        return false;
+    }
+
+    sockaddr_in addr;
+    int addrLen = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    u_long nonBlocking = 1;
+    return bind(mSocket, (sockaddr*) &addr, sizeof addr) == 0 &&
+        getsockname(mSocket, (sockaddr*) &addr, &addrLen) == 0 &&
+        connect(mSocket, (sockaddr*) &addr, sizeof addr) == 0 &&
+        ioctlsocket(mSocket, FIONBIO, &nonBlocking) == 0;
+
+#elif defined(__linux__)
+    mReadFd = mWriteFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mReadFd >= 0;
+
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return false;
+    }
+    mReadFd = fds[0];
+    mWriteFd = fds[1];
+    return fcntl(mReadFd, F_SETFL, O_NONBLOCK) == 0 &&
+        fcntl(mWriteFd, F_SETFL, O_NONBLOCK) == 0;
+#endif
+}
+
+void WakeEvent::signal()
+{
+    // Only the first wakeup since the last clear() needs a system call
+    if (!__sync_bool_compare_and_swap(&mPending, 0, 1)) {
+        return;
+    }
+
+#if defined(_WIN32)
+    char byte = 0;
+    send(mSocket, &byte, 1, 0);
+#elif defined(__linux__)
+    uint64_t count = 1;
+    if (write(mWriteFd, &count, sizeof count) < 0) {
+        // Already readable; nothing more to do
+    }
+#else
+    char byte = 0;
+    if (write(mWriteFd, &byte, 1) < 0) {
+        // Pipe full; the reader will wake regardless
+    }
+#endif
+}
+
+void WakeEvent::clear()
+{
+    // Drain first, so a signal() racing with us either sees mPending set or writes again
+#if defined(_WIN32)
+    char buffer[64];
+    while (recv(mSocket, buffer, sizeof buffer, 0) > 0);
+#elif defined(__linux__)
+    uint64_t count;
+    if (read(mReadFd, &count, sizeof count) < 0) {
+        // Nothing pending
+    }
+#else
+    char buffer[64];
+    while (read(mReadFd, buffer, sizeof buffer) > 0);
+#endif
+
+    __sync_lock_release(&mPending);
+}
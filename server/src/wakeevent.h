@@ -0,0 +1,62 @@
+/*
+ * Wakes a poll() loop from other threads: an eventfd, self-pipe, or loopback socket.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef _WIN32
+  #include <winsock2.h>
+#endif
+
+
+class WakeEvent
+{
+public:
+    WakeEvent();
+    ~WakeEvent();
+
+    // Create the underlying descriptors. Returns false on error.
+    bool init();
+
+    // Descriptor to include in the poll set, readable while a wakeup is pending
+#ifdef _WIN32
+    SOCKET fd() const { return mSocket; }
+#else
+    int fd() const { return mReadFd; }
+#endif
+
+    // Wake the polling thread, from any thread. Wakeups coalesce until clear() is called.
+    void signal();
+
+    // Polling thread only. Call after poll() reports the descriptor readable, before looking for new work.
+    void clear();
+
+private:
+    volatile int mPending;
+
+#ifdef _WIN32
+    SOCKET mSocket;
+#else
+    int mReadFd;
+    int mWriteFd;
+#endif
+};